@@ -41,6 +41,7 @@
 
 #include "auth.h"
 #include "common.h"
+#include "lockprof.h"
 #include "rpc.h"
 
 #define	REALLOC_STEP	(16 << 10)	/* 16 KiB */
@@ -40,6 +40,7 @@
 
 #include "common.h"
 #include "blocklist.h"
+#include "lockprof.h"
 
 #define	BLOCK_ADDR_LEN	MAX(sizeof (struct in6_addr), sizeof (struct in_addr))
 
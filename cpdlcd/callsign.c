@@ -0,0 +1,296 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/safe_alloc.h>
+
+#include "callsign.h"
+
+#define	CSTBL_MIN_CAP	16
+
+CTASSERT(CALLSIGN_LEN > sizeof (callsign_key_t));
+
+/*
+ * Packs a callsign string into a callsign_key_t. The string must be at
+ * most sizeof (callsign_key_t) characters long (not counting the NUL
+ * terminator).
+ */
+callsign_key_t
+callsign_key(const char *callsign)
+{
+	callsign_key_t key = 0;
+	size_t len;
+
+	ASSERT(callsign != NULL);
+	len = strlen(callsign);
+	ASSERT3U(len, <=, sizeof (key));
+	memcpy(&key, callsign, MIN(len, sizeof (key)));
+
+	return (key);
+}
+
+/*
+ * Unpacks a callsign_key_t back into its NUL-terminated string form.
+ */
+void
+callsign_key2str(callsign_key_t key, char str[CALLSIGN_LEN])
+{
+	ASSERT(str != NULL);
+	memset(str, 0, CALLSIGN_LEN);
+	memcpy(str, &key, sizeof (key));
+}
+
+/*
+ * 64-bit finalizer from MurmurHash3. Callsigns are mostly uppercase
+ * ASCII, so the raw key bits are far from uniformly distributed and
+ * need to be mixed before we can use the low bits as a slot index.
+ */
+static inline size_t
+cstbl_hash(const cstbl_t *tbl, callsign_key_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdull;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ull;
+	key ^= key >> 33;
+	return (key & (tbl->cap - 1));
+}
+
+static void
+cstbl_resize(cstbl_t *tbl, size_t new_cap)
+{
+	cstbl_slot_t *old_slots = tbl->slots;
+	size_t old_cap = tbl->cap;
+
+	ASSERT(new_cap != 0);
+	ASSERT0(new_cap & (new_cap - 1));
+	ASSERT3U(new_cap, >, tbl->count);
+
+	tbl->slots = safe_calloc(new_cap, sizeof (*tbl->slots));
+	tbl->cap = new_cap;
+	for (size_t i = 0; i < old_cap; i++) {
+		size_t j;
+
+		if (old_slots[i].key == CALLSIGN_KEY_NONE)
+			continue;
+		for (j = cstbl_hash(tbl, old_slots[i].key);
+		    tbl->slots[j].key != CALLSIGN_KEY_NONE;
+		    j = (j + 1) & (tbl->cap - 1))
+			;
+		tbl->slots[j] = old_slots[i];
+	}
+	free(old_slots);
+}
+
+/*
+ * Initializes an empty table. `min_cap' is the number of slots the
+ * table starts out with and below which it never shrinks. It is
+ * rounded up to the next power of two. Pass 0 for a sensible default.
+ */
+void
+cstbl_create(cstbl_t *tbl, size_t min_cap)
+{
+	size_t cap = CSTBL_MIN_CAP;
+
+	ASSERT(tbl != NULL);
+	while (cap < min_cap)
+		cap <<= 1;
+	tbl->slots = safe_calloc(cap, sizeof (*tbl->slots));
+	tbl->cap = cap;
+	tbl->min_cap = cap;
+	tbl->count = 0;
+	tbl->none_value = NULL;
+}
+
+/*
+ * Frees the table's slot array. The table must have been emptied
+ * by the caller beforehand, since values are opaque to the table.
+ */
+void
+cstbl_destroy(cstbl_t *tbl)
+{
+	ASSERT(tbl != NULL);
+	ASSERT0(tbl->count);
+	free(tbl->slots);
+	memset(tbl, 0, sizeof (*tbl));
+}
+
+/*
+ * Removes all entries from the table, calling `func' (if not NULL) on
+ * each one beforehand, so the caller can free the values. The table
+ * is shrunk back to its initial size.
+ */
+void
+cstbl_empty(cstbl_t *tbl,
+    void (*func)(callsign_key_t key, void *value, void *userinfo),
+    void *userinfo)
+{
+	ASSERT(tbl != NULL);
+	if (func != NULL)
+		cstbl_foreach(tbl, func, userinfo);
+	free(tbl->slots);
+	tbl->slots = safe_calloc(tbl->min_cap, sizeof (*tbl->slots));
+	tbl->cap = tbl->min_cap;
+	tbl->count = 0;
+	tbl->none_value = NULL;
+}
+
+size_t
+cstbl_count(const cstbl_t *tbl)
+{
+	ASSERT(tbl != NULL);
+	return (tbl->count);
+}
+
+static cstbl_slot_t *
+cstbl_find(const cstbl_t *tbl, callsign_key_t key)
+{
+	ASSERT(tbl != NULL);
+	ASSERT(key != CALLSIGN_KEY_NONE);
+
+	for (size_t i = cstbl_hash(tbl, key);
+	    tbl->slots[i].key != CALLSIGN_KEY_NONE;
+	    i = (i + 1) & (tbl->cap - 1)) {
+		if (tbl->slots[i].key == key)
+			return (&tbl->slots[i]);
+	}
+	return (NULL);
+}
+
+/*
+ * Returns the value associated with `key', or NULL if not present.
+ */
+void *
+cstbl_lookup(const cstbl_t *tbl, callsign_key_t key)
+{
+	cstbl_slot_t *slot;
+
+	if (key == CALLSIGN_KEY_NONE)
+		return (tbl->none_value);
+	slot = cstbl_find(tbl, key);
+	return (slot != NULL ? slot->value : NULL);
+}
+
+/*
+ * Associates `value' with `key', replacing any previous value.
+ */
+void
+cstbl_set(cstbl_t *tbl, callsign_key_t key, void *value)
+{
+	cstbl_slot_t *slot;
+	size_t i;
+
+	ASSERT(value != NULL);
+
+	if (key == CALLSIGN_KEY_NONE) {
+		if (tbl->none_value == NULL)
+			tbl->count++;
+		tbl->none_value = value;
+		return;
+	}
+	slot = cstbl_find(tbl, key);
+	if (slot != NULL) {
+		slot->value = value;
+		return;
+	}
+	if ((tbl->count + 1) * 4 > tbl->cap * 3)
+		cstbl_resize(tbl, tbl->cap << 1);
+	for (i = cstbl_hash(tbl, key); tbl->slots[i].key != CALLSIGN_KEY_NONE;
+	    i = (i + 1) & (tbl->cap - 1))
+		;
+	tbl->slots[i].key = key;
+	tbl->slots[i].value = value;
+	tbl->count++;
+}
+
+/*
+ * Removes `key' from the table and returns its former value, or NULL
+ * if the key wasn't present. Uses backward-shift deletion, so lookups
+ * never have to step over tombstones.
+ */
+void *
+cstbl_remove(cstbl_t *tbl, callsign_key_t key)
+{
+	cstbl_slot_t *slot;
+	size_t hole, mask = tbl->cap - 1;
+	void *value;
+
+	if (key == CALLSIGN_KEY_NONE) {
+		value = tbl->none_value;
+		if (value != NULL) {
+			tbl->none_value = NULL;
+			tbl->count--;
+		}
+		return (value);
+	}
+	slot = cstbl_find(tbl, key);
+	if (slot == NULL)
+		return (NULL);
+	value = slot->value;
+	hole = slot - tbl->slots;
+	for (size_t i = (hole + 1) & mask;
+	    tbl->slots[i].key != CALLSIGN_KEY_NONE; i = (i + 1) & mask) {
+		size_t home = cstbl_hash(tbl, tbl->slots[i].key);
+		/*
+		 * The entry at `i' may only move into the hole if its
+		 * home slot doesn't lie cyclically within (hole, i].
+		 */
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			tbl->slots[hole] = tbl->slots[i];
+			hole = i;
+		}
+	}
+	tbl->slots[hole].key = CALLSIGN_KEY_NONE;
+	tbl->slots[hole].value = NULL;
+	ASSERT(tbl->count != 0);
+	tbl->count--;
+
+	if (tbl->cap > tbl->min_cap && tbl->count * 8 < tbl->cap)
+		cstbl_resize(tbl, tbl->cap >> 1);
+
+	return (value);
+}
+
+/*
+ * Calls `cb' for every key-value pair in the table. The callback must
+ * not modify the table.
+ */
+void
+cstbl_foreach(const cstbl_t *tbl,
+    void (*cb)(callsign_key_t key, void *value, void *userinfo),
+    void *userinfo)
+{
+	ASSERT(tbl != NULL);
+	ASSERT(cb != NULL);
+	if (tbl->none_value != NULL)
+		cb(CALLSIGN_KEY_NONE, tbl->none_value, userinfo);
+	for (size_t i = 0; i < tbl->cap; i++) {
+		if (tbl->slots[i].key != CALLSIGN_KEY_NONE)
+			cb(tbl->slots[i].key, tbl->slots[i].value, userinfo);
+	}
+}
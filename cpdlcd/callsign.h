@@ -0,0 +1,90 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_CPDLCD_CALLSIGN_H_
+#define	_CPDLCD_CALLSIGN_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * A callsign packed into a single 64-bit integer. CPDLC station
+ * identifiers are at most 8 characters long, so they fit into a
+ * uint64_t losslessly. Comparing two keys for equality is identical
+ * to comparing the two original strings. A zero key corresponds to
+ * the empty callsign.
+ */
+typedef uint64_t callsign_key_t;
+
+#define	CALLSIGN_KEY_NONE	((callsign_key_t)0)
+
+callsign_key_t callsign_key(const char *callsign);
+void callsign_key2str(callsign_key_t key, char str[CALLSIGN_LEN]);
+
+/*
+ * Open-addressing hash table mapping callsign keys to opaque pointers.
+ * The table grows and shrinks automatically to keep its load factor
+ * between 1/8 and 3/4. Since a zero key marks an empty slot, the
+ * entry for CALLSIGN_KEY_NONE (if any) is kept aside in `none_value'.
+ * The table performs no locking of its own.
+ */
+typedef struct {
+	callsign_key_t	key;
+	void		*value;
+} cstbl_slot_t;
+
+typedef struct {
+	cstbl_slot_t	*slots;
+	size_t		cap;
+	size_t		min_cap;
+	size_t		count;
+	void		*none_value;
+} cstbl_t;
+
+void cstbl_create(cstbl_t *tbl, size_t min_cap);
+void cstbl_destroy(cstbl_t *tbl);
+void cstbl_empty(cstbl_t *tbl,
+    void (*func)(callsign_key_t key, void *value, void *userinfo),
+    void *userinfo);
+size_t cstbl_count(const cstbl_t *tbl);
+void *cstbl_lookup(const cstbl_t *tbl, callsign_key_t key);
+void cstbl_set(cstbl_t *tbl, callsign_key_t key, void *value);
+void *cstbl_remove(cstbl_t *tbl, callsign_key_t key);
+void cstbl_foreach(const cstbl_t *tbl,
+    void (*cb)(callsign_key_t key, void *value, void *userinfo),
+    void *userinfo);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _CPDLCD_CALLSIGN_H_ */
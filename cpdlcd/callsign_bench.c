@@ -0,0 +1,236 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * callsign_bench: compares callsign lookups in a cstbl_t keyed by packed
+ * callsign_key_t integers (see callsign.h) against the string-keyed
+ * structures they replaced: a fixed-size htbl_t keyed by CALLSIGN_LEN
+ * byte strings (as formerly used for `conns_by_from') and an AVL tree
+ * compared with strcmp (as formerly used by msgquota.c).
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/avl.h>
+#include <acfutils/htbl.h>
+#include <acfutils/safe_alloc.h>
+#include <acfutils/time.h>
+
+#include "callsign.h"
+
+#define	DFL_NUM_CALLSIGNS	10000
+#define	DFL_NUM_LOOKUPS		10000000
+/*
+ * The extra callsigns are numbered "%08u", which must stay within the
+ * 8 characters a callsign_key_t can hold.
+ */
+#define	MAX_NUM_CALLSIGNS	10000000
+#define	HTBL_SHIFT		12	/* same as the old CONNS_BY_FROM_SHIFT */
+
+typedef struct {
+	char		callsign[CALLSIGN_LEN];
+	avl_node_t	node;
+} avl_ent_t;
+
+static int
+avl_ent_compar(const void *a, const void *b)
+{
+	const avl_ent_t *ea = a, *eb = b;
+	int res = strcmp(ea->callsign, eb->callsign);
+
+	if (res < 0)
+		return (-1);
+	if (res > 0)
+		return (1);
+	return (0);
+}
+
+static void
+print_usage(const char *progname, FILE *fp)
+{
+	fprintf(fp, "Usage: %s [-h] [-n <callsigns>] [-l <lookups>]\n"
+	    "  -h : show this help screen\n"
+	    "  -n <callsigns> : number of distinct callsigns in the tables "
+	    "(default: %d, max: %d)\n"
+	    "  -l <lookups> : number of lookups per table (default: %d)\n",
+	    progname, DFL_NUM_CALLSIGNS, MAX_NUM_CALLSIGNS, DFL_NUM_LOOKUPS);
+}
+
+/*
+ * Generates a callsign which looks like an ICAO flight ID, e.g.
+ * "BAW123A", between 3 and 8 characters long.
+ */
+static void
+gen_callsign(char callsign[CALLSIGN_LEN])
+{
+	unsigned len = 3 + rand() % 6;
+
+	memset(callsign, 0, CALLSIGN_LEN);
+	for (unsigned i = 0; i < len; i++) {
+		if (i < 3)
+			callsign[i] = 'A' + rand() % 26;
+		else
+			callsign[i] = '0' + rand() % 10;
+	}
+}
+
+static void
+report(const char *what, uint64_t start, uint64_t end, unsigned num_lookups,
+    unsigned hits)
+{
+	printf("%-36s %8.2f ns/lookup (%u hits)\n", what,
+	    (end - start) * 1000.0 / num_lookups, hits);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int opt;
+	unsigned num_callsigns = DFL_NUM_CALLSIGNS;
+	unsigned num_lookups = DFL_NUM_LOOKUPS;
+	char (*callsigns)[CALLSIGN_LEN];
+	callsign_key_t *keys;
+	unsigned *order;
+	avl_ent_t *avl_ents;
+	cstbl_t cstbl;
+	htbl_t htbl;
+	avl_tree_t tree;
+	uint64_t start;
+	unsigned hits, num_total;
+	void *cookie = NULL;
+
+	while ((opt = getopt(argc, argv, "hn:l:")) != -1) {
+		switch (opt) {
+		case 'h':
+			print_usage(argv[0], stdout);
+			return (0);
+		case 'n':
+			num_callsigns = atoi(optarg);
+			break;
+		case 'l':
+			num_lookups = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0], stderr);
+			return (1);
+		}
+	}
+	if (num_callsigns == 0 || num_callsigns > MAX_NUM_CALLSIGNS ||
+	    num_lookups == 0) {
+		print_usage(argv[0], stderr);
+		return (1);
+	}
+
+	/*
+	 * Every 9th lookup is for one of `num_callsigns / 8' extra
+	 * callsigns, which aren't in the tables.
+	 */
+	num_total = num_callsigns + num_callsigns / 8;
+	srand(1);
+	callsigns = safe_calloc(num_total, sizeof (*callsigns));
+	keys = safe_calloc(num_total, sizeof (*keys));
+	avl_ents = safe_calloc(num_callsigns, sizeof (*avl_ents));
+	cstbl_create(&cstbl, 0);
+	htbl_create(&htbl, 1 << HTBL_SHIFT, CALLSIGN_LEN, B_FALSE);
+	avl_create(&tree, avl_ent_compar, sizeof (avl_ent_t),
+	    offsetof(avl_ent_t, node));
+	for (unsigned i = 0; i < num_callsigns; i++) {
+		avl_index_t where;
+
+		do {
+			gen_callsign(callsigns[i]);
+			memcpy(avl_ents[i].callsign, callsigns[i],
+			    CALLSIGN_LEN);
+		} while (avl_find(&tree, &avl_ents[i], &where) != NULL);
+		avl_insert(&tree, &avl_ents[i], where);
+		keys[i] = callsign_key(callsigns[i]);
+		cstbl_set(&cstbl, keys[i], &avl_ents[i]);
+		htbl_set(&htbl, callsigns[i], &avl_ents[i]);
+	}
+	for (unsigned i = num_callsigns; i < num_total; i++) {
+		/* gen_callsign never generates all-digit callsigns */
+		snprintf(callsigns[i], CALLSIGN_LEN, "%08u", i);
+		keys[i] = callsign_key(callsigns[i]);
+	}
+	/*
+	 * Pick the callsigns to look up in advance, so generating them
+	 * doesn't count against any of the tables.
+	 */
+	order = safe_calloc(num_lookups, sizeof (*order));
+	for (unsigned i = 0; i < num_lookups; i++)
+		order[i] = rand() % num_total;
+
+	printf("%u callsigns, %u lookups\n", num_callsigns, num_lookups);
+
+	hits = 0;
+	start = microclock();
+	for (unsigned i = 0; i < num_lookups; i++)
+		hits += (cstbl_lookup(&cstbl, keys[order[i]]) != NULL);
+	report("cstbl_t, packed key", start, microclock(), num_lookups, hits);
+
+	hits = 0;
+	start = microclock();
+	for (unsigned i = 0; i < num_lookups; i++) {
+		hits += (cstbl_lookup(&cstbl,
+		    callsign_key(callsigns[order[i]])) != NULL);
+	}
+	report("cstbl_t, packing key from string", start, microclock(),
+	    num_lookups, hits);
+
+	hits = 0;
+	start = microclock();
+	for (unsigned i = 0; i < num_lookups; i++)
+		hits += (htbl_lookup(&htbl, callsigns[order[i]]) != NULL);
+	report("htbl_t, string key", start, microclock(), num_lookups, hits);
+
+	hits = 0;
+	start = microclock();
+	for (unsigned i = 0; i < num_lookups; i++) {
+		avl_ent_t srch;
+
+		memcpy(srch.callsign, callsigns[order[i]], CALLSIGN_LEN);
+		hits += (avl_find(&tree, &srch, NULL) != NULL);
+	}
+	report("avl_tree_t, strcmp", start, microclock(), num_lookups, hits);
+
+	cstbl_empty(&cstbl, NULL, NULL);
+	cstbl_destroy(&cstbl);
+	htbl_empty(&htbl, NULL, NULL);
+	htbl_destroy(&htbl);
+	while (avl_destroy_nodes(&tree, &cookie) != NULL)
+		;
+	avl_destroy(&tree);
+	free(order);
+	free(avl_ents);
+	free(keys);
+	free(callsigns);
+
+	return (0);
+}
@@ -0,0 +1,1277 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <gnutls/gnutls.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+#include <acfutils/list.h>
+#include <acfutils/log.h>
+#include <acfutils/safe_alloc.h>
+#include <acfutils/thread.h>
+
+#include "../common/cpdlc_config_common.h"
+
+#include "cluster.h"
+#include "lockprof.h"
+
+#define	NODE_ID_LEN		32
+#define	SECRET_LEN		128
+#define	MIN_SECRET_LEN		16
+#define	DFL_CLUSTER_PORT	17624
+#define	MAX_LINE_LEN		16384		/* bytes */
+#define	MAX_OUTBUF		(16 << 20)	/* bytes */
+#define	RECONNECT_INTVAL	2		/* seconds */
+#define	HANDSHAKE_TIMEOUT	10		/* seconds */
+#define	WORKER_POLL_INTVAL	1000		/* ms */
+#define	READ_BUF_SZ		4096		/* bytes */
+/*
+ * Links use TLS 1.3 with the cluster secret as a pre-shared key. The
+ * (EC)DHE key exchange gives them forward secrecy.
+ */
+#define	TLS_PRIO	"NORMAL:-VERS-ALL:+VERS-TLS1.3:-KX-ALL:+ECDHE-PSK"
+
+/*
+ * A configured peer node. The outgoing link is used by any thread
+ * wanting to send something to the peer, so it is protected by `lock'.
+ * The incoming link is only ever touched by the worker thread.
+ */
+typedef struct {
+	char		name[NODE_ID_LEN];
+	uint64_t	name_hash;
+	char		hostname[CPDLC_HOSTNAME_MAX_LEN];
+	int		port;
+
+	/* protected by `lock' */
+	unsigned	addr_idx;	/* which address to try connecting to */
+	int		out_fd;
+	gnutls_session_t out_session;
+	bool		out_conn;	/* connected, TLS handshake started */
+	bool		out_up;		/* TLS handshake done, link usable */
+	bool		out_failed;	/* worker must close the link */
+	bool		out_resend;	/* resume an interrupted TLS send */
+	char		*outbuf;
+	size_t		outbuf_sz;
+	time_t		next_connect;
+
+	/* only accessed from the worker thread */
+	int		in_fd;
+	gnutls_session_t in_session;
+	char		*inbuf;
+	size_t		inbuf_sz;
+} peer_t;
+
+/*
+ * An incoming link which hasn't completed its TLS handshake yet.
+ */
+typedef struct {
+	int		fd;
+	gnutls_session_t session;
+	time_t		since;
+	list_node_t	node;
+} pending_t;
+
+static bool		inited = false;
+static cluster_ops_t	ops;
+static char		node_id[NODE_ID_LEN] = {};
+static uint64_t		node_hash = 0;
+static char		secret[SECRET_LEN] = {};
+static gnutls_psk_client_credentials_t	psk_client_creds = NULL;
+static gnutls_psk_server_credentials_t	psk_server_creds = NULL;
+static gnutls_priority_t		tls_prio = NULL;
+static int		listen_fd = -1;
+static int		wake_pipe[2] = { -1, -1 };
+static thread_t		worker;
+static bool		worker_shutdown = false;
+static list_t		pending;		/* worker thread only */
+
+static mutex_t		lock;
+static bool		enabled = false;
+static peer_t		peers[CLUSTER_MAX_PEERS];
+static unsigned		num_peers = 0;
+/* callsigns logged on locally, value unused */
+static cstbl_t		local_tbl;
+/* callsigns logged on elsewhere, value is a cluster_nodes_t */
+static cstbl_t		remote_tbl;
+
+static void worker_func(void *unused);
+
+static uint64_t
+mix64(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ull;
+	x ^= x >> 33;
+	return (x);
+}
+
+static uint64_t
+str_hash(const char *str)
+{
+	uint64_t h = 0xcbf29ce484222325ull;	/* FNV-1a */
+
+	for (; *str != '\0'; str++) {
+		h ^= (uint8_t)*str;
+		h *= 0x100000001b3ull;
+	}
+	return (mix64(h));
+}
+
+static bool
+node_id_valid(const char *str)
+{
+	size_t l = strlen(str);
+
+	if (l == 0 || l >= NODE_ID_LEN)
+		return (false);
+	for (size_t i = 0; i < l; i++) {
+		if (str[i] <= ' ' || str[i] > '~')
+			return (false);
+	}
+	return (true);
+}
+
+static bool
+secret_valid(const char *str)
+{
+	size_t l = strlen(str);
+
+	if (l < MIN_SECRET_LEN || l >= SECRET_LEN)
+		return (false);
+	for (size_t i = 0; i < l; i++) {
+		if (str[i] <= ' ' || str[i] > '~')
+			return (false);
+	}
+	return (true);
+}
+
+static bool
+callsign_valid(const char *str)
+{
+	size_t l = strlen(str);
+	/* callsign_key can only hold 8 characters */
+	return (l != 0 && l <= sizeof (callsign_key_t));
+}
+
+static void
+set_nonblock(int fd)
+{
+	(void) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	(void) fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+}
+
+static void
+wake_worker(void)
+{
+	uint8_t b = 0;
+	(void) write(wake_pipe[1], &b, sizeof (b));
+}
+
+static int
+open_listen_sock(const char *name_port)
+{
+	char hostname[CPDLC_HOSTNAME_MAX_LEN];
+	char portbuf[8];
+	int port, error, fd = -1;
+	struct addrinfo *ai_full = NULL;
+	struct addrinfo hints = {
+	    .ai_family = AF_UNSPEC,
+	    .ai_socktype = SOCK_STREAM,
+	    .ai_protocol = IPPROTO_TCP,
+	    .ai_flags = AI_PASSIVE
+	};
+
+	if (!cpdlc_config_str2hostname_port(name_port, hostname, &port,
+	    false)) {
+		logMsg("Invalid cluster/listen directive \"%s\"", name_port);
+		return (-1);
+	}
+	if (strchr(name_port, ':') == NULL)
+		port = DFL_CLUSTER_PORT;
+	snprintf(portbuf, sizeof (portbuf), "%d", port);
+	error = getaddrinfo(strcmp(hostname, "*") == 0 ? NULL : hostname,
+	    portbuf, &hints, &ai_full);
+	if (error != 0) {
+		logMsg("Invalid cluster/listen directive \"%s\": %s",
+		    name_port, gai_strerror(error));
+		return (-1);
+	}
+	for (const struct addrinfo *ai = ai_full; ai != NULL;
+	    ai = ai->ai_next) {
+		int one = 1;
+
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    listen(fd, CLUSTER_MAX_PEERS) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai_full);
+	if (fd == -1) {
+		logMsg("Can't listen on cluster/listen address \"%s\": %s",
+		    name_port, strerror(errno));
+		return (-1);
+	}
+	set_nonblock(fd);
+
+	return (fd);
+}
+
+static peer_t *
+peer_find(const char *name)
+{
+	for (unsigned i = 0; i < num_peers; i++) {
+		if (strcmp(peers[i].name, name) == 0)
+			return (&peers[i]);
+	}
+	return (NULL);
+}
+
+/*
+ * Hands the pre-shared key to a peer opening a link to us. Peers identify
+ * themselves with their node_id as the PSK username, and all of them
+ * share the same key, the cluster secret. GnuTLS then checks that the
+ * peer knows it, without the secret ever going over the wire.
+ */
+static int
+psk_server_cb(gnutls_session_t session, const char *username,
+    gnutls_datum_t *key)
+{
+	UNUSED(session);
+
+	if (peer_find(username) == NULL) {
+		logMsg("Rejecting cluster link from unknown node %s",
+		    username);
+		return (-1);
+	}
+	key->size = strlen(secret);
+	key->data = gnutls_malloc(key->size);
+	if (key->data == NULL)
+		return (-1);
+	memcpy(key->data, secret, key->size);
+
+	return (0);
+}
+
+static void
+psk_fini(void)
+{
+	if (psk_client_creds != NULL) {
+		gnutls_psk_free_client_credentials(psk_client_creds);
+		psk_client_creds = NULL;
+	}
+	if (psk_server_creds != NULL) {
+		gnutls_psk_free_server_credentials(psk_server_creds);
+		psk_server_creds = NULL;
+	}
+	if (tls_prio != NULL) {
+		gnutls_priority_deinit(tls_prio);
+		tls_prio = NULL;
+	}
+}
+
+static bool
+psk_init(void)
+{
+	const gnutls_datum_t key = {
+	    .data = (unsigned char *)secret, .size = strlen(secret)
+	};
+	int error;
+
+	if ((error = gnutls_psk_allocate_client_credentials(
+	    &psk_client_creds)) != GNUTLS_E_SUCCESS ||
+	    (error = gnutls_psk_set_client_credentials(psk_client_creds,
+	    node_id, &key, GNUTLS_PSK_KEY_RAW)) != GNUTLS_E_SUCCESS ||
+	    (error = gnutls_psk_allocate_server_credentials(
+	    &psk_server_creds)) != GNUTLS_E_SUCCESS ||
+	    (error = gnutls_priority_init(&tls_prio, TLS_PRIO, NULL)) !=
+	    GNUTLS_E_SUCCESS) {
+		logMsg("Can't set up cluster TLS: %s",
+		    gnutls_strerror(error));
+		psk_fini();
+		return (false);
+	}
+	gnutls_psk_set_server_credentials_function(psk_server_creds,
+	    psk_server_cb);
+
+	return (true);
+}
+
+static gnutls_session_t
+tls_session_new(int fd, bool server)
+{
+	gnutls_session_t session;
+
+	VERIFY0(gnutls_init(&session, (server ? GNUTLS_SERVER :
+	    GNUTLS_CLIENT) | GNUTLS_NONBLOCK | GNUTLS_NO_TICKETS));
+	VERIFY0(gnutls_priority_set(session, tls_prio));
+	VERIFY0(gnutls_credentials_set(session, GNUTLS_CRD_PSK,
+	    server ? (void *)psk_server_creds : (void *)psk_client_creds));
+	gnutls_transport_set_int(session, fd);
+
+	return (session);
+}
+
+/*
+ * Advances the TLS handshake on a link. Sets `done' once the handshake
+ * has completed. Returns false if it has failed.
+ */
+static bool
+tls_handshake(gnutls_session_t session, const char *who, bool *done)
+{
+	int error = gnutls_handshake(session);
+
+	*done = (error == GNUTLS_E_SUCCESS);
+	if (error == GNUTLS_E_SUCCESS || !gnutls_error_is_fatal(error))
+		return (true);
+	logMsg("Cluster TLS handshake with %s failed: %s", who,
+	    gnutls_strerror(error));
+
+	return (false);
+}
+
+/*
+ * Returns the poll events a link with a TLS handshake in progress is
+ * waiting for.
+ */
+static short
+tls_handshake_events(gnutls_session_t session)
+{
+	return (gnutls_record_get_direction(session) != 0 ? POLLOUT : POLLIN);
+}
+
+/*
+ * Sets up cluster mode from the "cluster/..." config keys. If no
+ * "cluster/node_id" is set, cluster mode stays disabled and all other
+ * cluster_* functions turn into no-ops.
+ */
+bool
+cluster_init(const conf_t *conf, const cluster_ops_t *ops_in)
+{
+	const char *key, *value;
+	void *cookie = NULL;
+
+	ASSERT(conf != NULL);
+	ASSERT(ops_in != NULL);
+	ASSERT(ops_in->deliver != NULL);
+	ASSERT(ops_in->enqueue != NULL);
+	ASSERT(!inited);
+
+	if (!conf_get_str(conf, "cluster/node_id", &value))
+		return (true);
+	if (!node_id_valid(value)) {
+		logMsg("Invalid cluster/node_id \"%s\": must be 1-%d "
+		    "printable characters without spaces", value,
+		    NODE_ID_LEN - 1);
+		return (false);
+	}
+	lacf_strlcpy(node_id, value, sizeof (node_id));
+	node_hash = str_hash(node_id);
+	/* "-" was the default before a secret became mandatory */
+	if (!conf_get_str(conf, "cluster/secret", &value) ||
+	    strcmp(value, "-") == 0) {
+		logMsg("Cluster mode requires cluster/secret to be set");
+		return (false);
+	}
+	if (!secret_valid(value)) {
+		logMsg("Invalid cluster/secret: must be %d-%d printable "
+		    "characters without spaces", MIN_SECRET_LEN,
+		    SECRET_LEN - 1);
+		return (false);
+	}
+	lacf_strlcpy(secret, value, sizeof (secret));
+	ops = *ops_in;
+
+	num_peers = 0;
+	while (conf_walk(conf, &key, &value, &cookie)) {
+		peer_t *p;
+		const char *name;
+
+		if (strncmp(key, "cluster/peer/", 13) != 0)
+			continue;
+		name = &key[13];
+		if (num_peers == CLUSTER_MAX_PEERS) {
+			logMsg("Too many cluster peers, at most %d supported",
+			    CLUSTER_MAX_PEERS);
+			return (false);
+		}
+		if (!node_id_valid(name) || strcmp(name, node_id) == 0) {
+			logMsg("Invalid cluster peer name \"%s\"", name);
+			return (false);
+		}
+		p = &peers[num_peers];
+		memset(p, 0, sizeof (*p));
+		lacf_strlcpy(p->name, name, sizeof (p->name));
+		p->name_hash = str_hash(name);
+		if (!cpdlc_config_str2hostname_port(value, p->hostname,
+		    &p->port, false)) {
+			logMsg("Invalid address \"%s\" for cluster peer %s",
+			    value, name);
+			return (false);
+		}
+		if (strchr(value, ':') == NULL)
+			p->port = DFL_CLUSTER_PORT;
+		p->out_fd = -1;
+		p->in_fd = -1;
+		num_peers++;
+	}
+	if (!conf_get_str(conf, "cluster/listen", &value)) {
+		logMsg("Cluster mode requires cluster/listen to be set");
+		return (false);
+	}
+	if (!psk_init())
+		return (false);
+	listen_fd = open_listen_sock(value);
+	if (listen_fd == -1) {
+		psk_fini();
+		return (false);
+	}
+	if (pipe(wake_pipe) != 0) {
+		logMsg("Can't create cluster wakeup pipe: %s",
+		    strerror(errno));
+		close(listen_fd);
+		listen_fd = -1;
+		psk_fini();
+		return (false);
+	}
+	set_nonblock(wake_pipe[0]);
+	set_nonblock(wake_pipe[1]);
+
+	mutex_init(&lock);
+	cstbl_create(&local_tbl, 0);
+	cstbl_create(&remote_tbl, 0);
+	list_create(&pending, sizeof (pending_t), offsetof(pending_t, node));
+	inited = true;
+	enabled = true;
+	worker_shutdown = false;
+	VERIFY(thread_create(&worker, worker_func, NULL));
+	logMsg("Cluster node %s up with %d peers", node_id, num_peers);
+
+	return (true);
+}
+
+static void
+pending_close(pending_t *pd)
+{
+	list_remove(&pending, pd);
+	gnutls_deinit(pd->session);
+	close(pd->fd);
+	free(pd);
+}
+
+static void
+peer_out_close(peer_t *p)
+{
+	ASSERT_MUTEX_HELD(&lock);
+	if (p->out_session != NULL) {
+		gnutls_deinit(p->out_session);
+		p->out_session = NULL;
+	}
+	if (p->out_fd != -1) {
+		close(p->out_fd);
+		p->out_fd = -1;
+		p->next_connect = time(NULL) + RECONNECT_INTVAL;
+		/* If the hostname has several addresses, try the next one */
+		if (!p->out_up)
+			p->addr_idx++;
+	}
+	p->out_conn = false;
+	p->out_up = false;
+	p->out_failed = false;
+	p->out_resend = false;
+	free(p->outbuf);
+	p->outbuf = NULL;
+	p->outbuf_sz = 0;
+}
+
+typedef struct {
+	callsign_key_t	*keys;
+	size_t		num_keys;
+	cluster_nodes_t	bit;
+} clear_info_t;
+
+static void
+collect_keys_cb(callsign_key_t key, void *value, void *userinfo)
+{
+	clear_info_t *ci = userinfo;
+
+	if (((uintptr_t)value & ci->bit) != 0)
+		ci->keys[ci->num_keys++] = key;
+}
+
+static void
+peer_in_close(peer_t *p)
+{
+	clear_info_t ci = { .bit = 1u << (p - peers) };
+
+	if (p->in_fd == -1)
+		return;
+	gnutls_deinit(p->in_session);
+	p->in_session = NULL;
+	close(p->in_fd);
+	p->in_fd = -1;
+	free(p->inbuf);
+	p->inbuf = NULL;
+	p->inbuf_sz = 0;
+
+	/* Everything the peer told us about is now stale */
+	mutex_enter(&lock);
+	ci.keys = safe_malloc((cstbl_count(&remote_tbl) + 1) *
+	    sizeof (*ci.keys));
+	cstbl_foreach(&remote_tbl, collect_keys_cb, &ci);
+	for (size_t i = 0; i < ci.num_keys; i++) {
+		uintptr_t nodes = (uintptr_t)cstbl_lookup(&remote_tbl,
+		    ci.keys[i]) & ~ci.bit;
+
+		if (nodes == 0)
+			cstbl_remove(&remote_tbl, ci.keys[i]);
+		else
+			cstbl_set(&remote_tbl, ci.keys[i], (void *)nodes);
+	}
+	mutex_exit(&lock);
+	free(ci.keys);
+	logMsg("Cluster peer %s disconnected", p->name);
+}
+
+static void
+peer_append(peer_t *p, const char *fmt, ...) PRINTF_ATTR(2);
+
+/*
+ * Queues a line up for sending on a peer's outgoing link.
+ */
+static void
+peer_append(peer_t *p, const char *fmt, ...)
+{
+	va_list ap;
+	int l;
+
+	ASSERT_MUTEX_HELD(&lock);
+	ASSERT(p->out_fd != -1);
+
+	va_start(ap, fmt);
+	l = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (p->outbuf_sz + l > MAX_OUTBUF) {
+		if (!p->out_failed) {
+			logMsg("Cluster peer %s isn't keeping up, dropping "
+			    "link", p->name);
+		}
+		p->out_up = false;
+		p->out_failed = true;
+		return;
+	}
+	p->outbuf = safe_realloc(p->outbuf, p->outbuf_sz + l + 1);
+	va_start(ap, fmt);
+	vsnprintf(&p->outbuf[p->outbuf_sz], l + 1, fmt, ap);
+	va_end(ap);
+	p->outbuf_sz += l;
+}
+
+static void
+sync_logon_cb(callsign_key_t key, void *value, void *userinfo)
+{
+	char cs[CALLSIGN_LEN];
+
+	UNUSED(value);
+	callsign_key2str(key, cs);
+	peer_append(userinfo, "LOGON %s\n", cs);
+}
+
+/*
+ * Advances the TLS handshake on a peer's outgoing link. Once it's done,
+ * the link is up and we tell the peer about our local callsigns.
+ * Returns false if the handshake has failed.
+ */
+static bool
+peer_out_handshake(peer_t *p)
+{
+	bool done;
+
+	ASSERT_MUTEX_HELD(&lock);
+	ASSERT(p->out_conn);
+
+	if (!tls_handshake(p->out_session, p->name, &done))
+		return (false);
+	if (done) {
+		p->out_up = true;
+		cstbl_foreach(&local_tbl, sync_logon_cb, p);
+		logMsg("Connected to cluster peer %s", p->name);
+	}
+	return (true);
+}
+
+/*
+ * Starts the TLS handshake once a peer's outgoing connection has been
+ * established. Our node_id is the PSK username, which tells the peer
+ * who we are.
+ */
+static bool
+peer_out_connected(peer_t *p)
+{
+	ASSERT_MUTEX_HELD(&lock);
+	p->out_conn = true;
+	p->out_session = tls_session_new(p->out_fd, false);
+	return (peer_out_handshake(p));
+}
+
+static void
+peer_connect(peer_t *p)
+{
+	char portbuf[8];
+	struct addrinfo *ai_full = NULL, *ai;
+	struct addrinfo hints = {
+	    .ai_family = AF_UNSPEC,
+	    .ai_socktype = SOCK_STREAM,
+	    .ai_protocol = IPPROTO_TCP
+	};
+	unsigned num_ai = 0;
+	int fd;
+
+	ASSERT_MUTEX_HELD(&lock);
+	ASSERT3S(p->out_fd, ==, -1);
+
+	p->next_connect = time(NULL) + RECONNECT_INTVAL;
+	snprintf(portbuf, sizeof (portbuf), "%d", p->port);
+	if (getaddrinfo(p->hostname, portbuf, &hints, &ai_full) != 0)
+		return;
+	for (ai = ai_full; ai != NULL; ai = ai->ai_next)
+		num_ai++;
+	ai = ai_full;
+	for (unsigned i = 0; i < p->addr_idx % num_ai; i++)
+		ai = ai->ai_next;
+	fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (fd == -1) {
+		p->addr_idx++;
+		freeaddrinfo(ai_full);
+		return;
+	}
+	set_nonblock(fd);
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+		p->out_fd = fd;
+		if (!peer_out_connected(p))
+			peer_out_close(p);
+	} else if (errno == EINPROGRESS) {
+		p->out_fd = fd;
+	} else {
+		close(fd);
+		p->addr_idx++;
+	}
+	freeaddrinfo(ai_full);
+}
+
+/*
+ * Reads more data on a link. Returns false on EOF or error.
+ */
+static bool
+link_read(gnutls_session_t session, char **inbuf, size_t *inbuf_sz)
+{
+	for (;;) {
+		char buf[READ_BUF_SZ];
+		ssize_t bytes = gnutls_record_recv(session, buf, sizeof (buf));
+
+		if (bytes == 0)
+			return (false);
+		if (bytes < 0) {
+			if (bytes == GNUTLS_E_AGAIN)
+				return (true);
+			if (gnutls_error_is_fatal(bytes))
+				return (false);
+			continue;
+		}
+		if (*inbuf_sz + bytes > MAX_LINE_LEN &&
+		    memchr(*inbuf, '\n', *inbuf_sz) == NULL) {
+			return (false);
+		}
+		*inbuf = safe_realloc(*inbuf, *inbuf_sz + bytes + 1);
+		memcpy(&(*inbuf)[*inbuf_sz], buf, bytes);
+		*inbuf_sz += bytes;
+		(*inbuf)[*inbuf_sz] = '\0';
+	}
+}
+
+/*
+ * Returns the poll events a peer's outgoing link is waiting for.
+ */
+static short
+peer_out_events(const peer_t *p)
+{
+	ASSERT_MUTEX_HELD(&lock);
+	if (!p->out_conn)
+		return (POLLIN | POLLOUT);
+	if (!p->out_up)
+		return (tls_handshake_events(p->out_session));
+	return (POLLIN | (p->outbuf_sz != 0 ? POLLOUT : 0));
+}
+
+/*
+ * Completes a non-blocking connect, advances the TLS handshake or
+ * flushes queued output on a peer's outgoing link.
+ */
+static void
+peer_out_io(peer_t *p, short revents)
+{
+	mutex_enter(&lock);
+	if (p->out_fd == -1)
+		goto out;
+	if (!p->out_conn && !p->out_failed && (revents & POLLOUT)) {
+		int error = 0;
+		socklen_t len = sizeof (error);
+
+		if (getsockopt(p->out_fd, SOL_SOCKET, SO_ERROR, &error,
+		    &len) != 0 || error != 0 || !peer_out_connected(p)) {
+			peer_out_close(p);
+			goto out;
+		}
+	} else if (p->out_conn && !p->out_up && !p->out_failed) {
+		if (!peer_out_handshake(p)) {
+			peer_out_close(p);
+			goto out;
+		}
+	}
+	if (revents & (POLLERR | POLLHUP)) {
+		peer_out_close(p);
+		goto out;
+	}
+	/*
+	 * The peer never sends any data on this link, so it becoming
+	 * readable means either TLS housekeeping, or that it has been
+	 * closed.
+	 */
+	if (p->out_up && (revents & POLLIN)) {
+		char *buf = NULL;
+		size_t buf_sz = 0;
+
+		if (!link_read(p->out_session, &buf, &buf_sz) ||
+		    buf_sz != 0) {
+			free(buf);
+			peer_out_close(p);
+			goto out;
+		}
+	}
+	while (p->out_up && p->outbuf_sz != 0 && !p->out_failed) {
+		ssize_t bytes;
+
+		/* An interrupted send must be resumed with the same data */
+		if (p->out_resend) {
+			bytes = gnutls_record_send(p->out_session, NULL, 0);
+		} else {
+			bytes = gnutls_record_send(p->out_session,
+			    p->outbuf, p->outbuf_sz);
+		}
+		if (bytes < 0) {
+			p->out_resend = (bytes == GNUTLS_E_AGAIN ||
+			    bytes == GNUTLS_E_INTERRUPTED);
+			if (!p->out_resend)
+				p->out_failed = true;
+			break;
+		}
+		p->out_resend = false;
+		p->outbuf_sz -= bytes;
+		memmove(p->outbuf, &p->outbuf[bytes], p->outbuf_sz);
+	}
+	if (p->out_failed) {
+		logMsg("Lost link to cluster peer %s", p->name);
+		peer_out_close(p);
+	}
+out:
+	mutex_exit(&lock);
+}
+
+static void
+presence_update(peer_t *p, const char *cs, bool present)
+{
+	callsign_key_t key = callsign_key(cs);
+	uintptr_t bit = 1u << (p - peers);
+	uintptr_t nodes;
+
+	mutex_enter(&lock);
+	nodes = (uintptr_t)cstbl_lookup(&remote_tbl, key);
+	nodes = (present ? (nodes | bit) : (nodes & ~bit));
+	if (nodes != 0)
+		cstbl_set(&remote_tbl, key, (void *)nodes);
+	else if (cstbl_lookup(&remote_tbl, key) != NULL)
+		cstbl_remove(&remote_tbl, key);
+	mutex_exit(&lock);
+}
+
+/*
+ * Processes a single protocol line (including its terminating newline)
+ * received from a peer. Returns false on a protocol error.
+ */
+static bool
+process_line(peer_t *p, const char *line)
+{
+	char cs1[CALLSIGN_LEN], cs2[CALLSIGN_LEN];
+	char dir;
+	long long created;
+	int off;
+
+	if (sscanf(line, "LOGON %15s", cs1) == 1) {
+		if (!callsign_valid(cs1))
+			return (false);
+		presence_update(p, cs1, true);
+	} else if (sscanf(line, "LOGOFF %15s", cs1) == 1) {
+		if (!callsign_valid(cs1))
+			return (false);
+		presence_update(p, cs1, false);
+	} else if (sscanf(line, "MSG %15s %c %n", cs1, &dir, &off) == 2) {
+		if (!callsign_valid(cs1) || (dir != 'D' && dir != 'U'))
+			return (false);
+		ops.deliver(cs1, dir == 'D', &line[off]);
+	} else if (sscanf(line, "QMSG %15s %15s %lld %c %n", cs1, cs2,
+	    &created, &dir, &off) == 4) {
+		if (!callsign_valid(cs1) || !callsign_valid(cs2) ||
+		    (dir != 'D' && dir != 'U')) {
+			return (false);
+		}
+		ops.enqueue(callsign_key(cs2), callsign_key(cs1),
+		    dir == 'D', (time_t)created, &line[off]);
+	} else {
+		return (false);
+	}
+	return (true);
+}
+
+/*
+ * Splits input received on a peer's incoming link into lines and
+ * processes them.
+ */
+static bool
+peer_in_process(peer_t *p)
+{
+	size_t consumed = 0;
+
+	if (p->inbuf_sz == 0)
+		return (true);
+	for (;;) {
+		char *start = &p->inbuf[consumed];
+		char *nl = memchr(start, '\n', p->inbuf_sz - consumed);
+		char save;
+
+		if (nl == NULL)
+			break;
+		/* Keep the newline, the message decoder needs it */
+		save = nl[1];
+		nl[1] = '\0';
+		if (!process_line(p, start)) {
+			logMsg("Protocol error from cluster peer %s",
+			    p->name);
+			return (false);
+		}
+		nl[1] = save;
+		consumed += (nl - start) + 1;
+	}
+	p->inbuf_sz -= consumed;
+	memmove(p->inbuf, &p->inbuf[consumed], p->inbuf_sz + 1);
+
+	return (true);
+}
+
+/*
+ * Advances the TLS handshake on a new incoming link. Once the peer has
+ * proven that it knows the cluster secret, the link becomes its incoming
+ * link.
+ */
+static void
+pending_process(pending_t *pd)
+{
+	const char *name;
+	peer_t *p;
+	bool done;
+
+	if (!tls_handshake(pd->session, "incoming link", &done)) {
+		pending_close(pd);
+		return;
+	}
+	if (!done)
+		return;
+	/* psk_server_cb has already rejected unknown nodes */
+	name = gnutls_psk_server_get_username(pd->session);
+	p = (name != NULL ? peer_find(name) : NULL);
+	if (p == NULL) {
+		pending_close(pd);
+		return;
+	}
+	/* A reconnect, the previous link is dead */
+	peer_in_close(p);
+	p->in_fd = pd->fd;
+	p->in_session = pd->session;
+	list_remove(&pending, pd);
+	free(pd);
+	logMsg("Cluster peer %s connected", p->name);
+	if (!link_read(p->in_session, &p->inbuf, &p->inbuf_sz) ||
+	    !peer_in_process(p)) {
+		peer_in_close(p);
+	}
+}
+
+static void
+handle_accepts(void)
+{
+	for (;;) {
+		int fd = accept(listen_fd, NULL, NULL);
+		pending_t *pd;
+
+		if (fd == -1)
+			break;
+		set_nonblock(fd);
+		pd = safe_calloc(1, sizeof (*pd));
+		pd->fd = fd;
+		pd->session = tls_session_new(fd, true);
+		pd->since = time(NULL);
+		list_insert_tail(&pending, pd);
+	}
+}
+
+typedef enum {
+	FD_WAKE,
+	FD_LISTEN,
+	FD_PENDING,
+	FD_PEER_IN,
+	FD_PEER_OUT
+} fd_kind_t;
+
+typedef struct {
+	fd_kind_t	kind;
+	void		*obj;
+} fd_owner_t;
+
+static void
+worker_func(void *unused)
+{
+	UNUSED(unused);
+	thread_set_name("cluster");
+
+	while (!worker_shutdown) {
+		unsigned n = 0, max_fds = 2 + list_count(&pending) +
+		    2 * num_peers;
+		struct pollfd *pfds = safe_calloc(max_fds, sizeof (*pfds));
+		fd_owner_t *owners = safe_calloc(max_fds, sizeof (*owners));
+		time_t now = time(NULL);
+
+#define	ADD_FD(_fd, _events, _kind, _obj) \
+	do { \
+		pfds[n].fd = (_fd); \
+		pfds[n].events = (_events); \
+		owners[n].kind = (_kind); \
+		owners[n].obj = (_obj); \
+		n++; \
+	} while (0)
+		ADD_FD(wake_pipe[0], POLLIN, FD_WAKE, NULL);
+		ADD_FD(listen_fd, POLLIN, FD_LISTEN, NULL);
+		for (pending_t *pd = list_head(&pending), *pd_next = NULL;
+		    pd != NULL; pd = pd_next) {
+			pd_next = list_next(&pending, pd);
+			if (now - pd->since > HANDSHAKE_TIMEOUT) {
+				pending_close(pd);
+				continue;
+			}
+			ADD_FD(pd->fd, tls_handshake_events(pd->session),
+			    FD_PENDING, pd);
+		}
+		mutex_enter(&lock);
+		for (unsigned i = 0; i < num_peers; i++) {
+			peer_t *p = &peers[i];
+
+			if (p->in_fd != -1)
+				ADD_FD(p->in_fd, POLLIN, FD_PEER_IN, p);
+			if (p->out_failed)
+				peer_out_close(p);
+			if (p->out_fd == -1 && now >= p->next_connect)
+				peer_connect(p);
+			if (p->out_fd != -1) {
+				ADD_FD(p->out_fd, peer_out_events(p),
+				    FD_PEER_OUT, p);
+			}
+		}
+		mutex_exit(&lock);
+#undef	ADD_FD
+
+		if (poll(pfds, n, WORKER_POLL_INTVAL) > 0) {
+			for (unsigned i = 0; i < n; i++) {
+				if (pfds[i].revents == 0)
+					continue;
+				switch (owners[i].kind) {
+				case FD_WAKE: {
+					uint8_t buf[64];
+					while (read(wake_pipe[0], buf,
+					    sizeof (buf)) > 0)
+						;
+					break;
+				}
+				case FD_LISTEN:
+					handle_accepts();
+					break;
+				case FD_PENDING:
+					pending_process(owners[i].obj);
+					break;
+				case FD_PEER_IN: {
+					peer_t *p = owners[i].obj;
+					/* Could have been replaced by now */
+					if (p->in_fd != pfds[i].fd)
+						break;
+					if (!link_read(p->in_session,
+					    &p->inbuf, &p->inbuf_sz) ||
+					    !peer_in_process(p)) {
+						peer_in_close(p);
+					}
+					break;
+				}
+				case FD_PEER_OUT:
+					peer_out_io(owners[i].obj,
+					    pfds[i].revents);
+					break;
+				}
+			}
+		}
+		free(pfds);
+		free(owners);
+	}
+}
+
+/*
+ * Stops all cluster activity and drops all links, as if the node had
+ * gone down. This can be called while other threads might still be
+ * calling into the cluster_* functions, which then simply turn into
+ * no-ops.
+ */
+void
+cluster_leave(void)
+{
+	pending_t *pd;
+
+	if (!inited || !enabled)
+		return;
+
+	worker_shutdown = true;
+	wake_worker();
+	thread_join(&worker);
+
+	while ((pd = list_head(&pending)) != NULL)
+		pending_close(pd);
+	for (unsigned i = 0; i < num_peers; i++)
+		peer_in_close(&peers[i]);
+	mutex_enter(&lock);
+	for (unsigned i = 0; i < num_peers; i++)
+		peer_out_close(&peers[i]);
+	enabled = false;
+	cstbl_empty(&local_tbl, NULL, NULL);
+	cstbl_empty(&remote_tbl, NULL, NULL);
+	mutex_exit(&lock);
+	close(listen_fd);
+	listen_fd = -1;
+	logMsg("Cluster node %s left the cluster", node_id);
+}
+
+/*
+ * Tears down cluster mode. Must only be called once no other threads
+ * can call into the cluster_* functions anymore.
+ */
+void
+cluster_fini(void)
+{
+	if (!inited)
+		return;
+	cluster_leave();
+	list_destroy(&pending);
+	psk_fini();
+	cstbl_destroy(&local_tbl);
+	cstbl_destroy(&remote_tbl);
+	mutex_destroy(&lock);
+	close(wake_pipe[0]);
+	close(wake_pipe[1]);
+	wake_pipe[0] = wake_pipe[1] = -1;
+	inited = false;
+}
+
+/*
+ * Announces to all peers that a callsign has logged on locally (when the
+ * first local connection with that identity appears), or logged off (when
+ * the last one is gone).
+ */
+void
+cluster_presence(callsign_key_t key, bool present)
+{
+	char cs[CALLSIGN_LEN];
+
+	if (!inited || key == CALLSIGN_KEY_NONE)
+		return;
+	callsign_key2str(key, cs);
+
+	mutex_enter(&lock);
+	if (!enabled) {
+		mutex_exit(&lock);
+		return;
+	}
+	if (present)
+		cstbl_set(&local_tbl, key, (void *)(uintptr_t)1);
+	else if (cstbl_lookup(&local_tbl, key) != NULL)
+		cstbl_remove(&local_tbl, key);
+	for (unsigned i = 0; i < num_peers; i++) {
+		if (peers[i].out_up) {
+			peer_append(&peers[i], "%s %s\n",
+			    present ? "LOGON" : "LOGOFF", cs);
+		}
+	}
+	mutex_exit(&lock);
+	wake_worker();
+}
+
+/*
+ * Returns the set of peer nodes on which a callsign is logged on.
+ */
+cluster_nodes_t
+cluster_lookup(callsign_key_t key)
+{
+	cluster_nodes_t nodes;
+
+	if (!inited)
+		return (0);
+	mutex_enter(&lock);
+	nodes = (uintptr_t)cstbl_lookup(&remote_tbl, key);
+	mutex_exit(&lock);
+
+	return (nodes);
+}
+
+/*
+ * Returns the home node of a callsign, which holds queued messages for
+ * it while it isn't logged on anywhere. Returns CLUSTER_NO_NODE if the
+ * home node is us (or if cluster mode is disabled). Nodes we can't
+ * currently reach aren't considered, so the result changes as nodes come
+ * and go. That's fine, queued messages which are already stored on a
+ * node stay there and get forwarded once their recipient logs on.
+ */
+int
+cluster_home(callsign_key_t key)
+{
+	int home = CLUSTER_NO_NODE;
+	uint64_t best;
+
+	if (!inited)
+		return (CLUSTER_NO_NODE);
+	best = mix64(key ^ node_hash);
+	mutex_enter(&lock);
+	for (unsigned i = 0; enabled && i < num_peers; i++) {
+		uint64_t score = mix64(key ^ peers[i].name_hash);
+
+		if (peers[i].out_up && score > best) {
+			best = score;
+			home = i;
+		}
+	}
+	mutex_exit(&lock);
+
+	return (home);
+}
+
+/*
+ * Sends a message to the peer nodes in `nodes' for delivery to their
+ * local recipients. `msg' is the encoded message, including its
+ * terminating newline. Returns the set of nodes the message was actually
+ * sent to (nodes with a down link are skipped).
+ */
+cluster_nodes_t
+cluster_send_msg(cluster_nodes_t nodes, const char *to, bool is_dl,
+    const char *msg)
+{
+	cluster_nodes_t sent = 0;
+
+	ASSERT(to != NULL);
+	ASSERT(msg != NULL);
+	ASSERT(strchr(msg, '\n') == &msg[strlen(msg) - 1]);
+
+	if (!inited || nodes == 0)
+		return (0);
+	mutex_enter(&lock);
+	for (unsigned i = 0; enabled && i < num_peers; i++) {
+		if ((nodes & (1u << i)) != 0 && peers[i].out_up) {
+			peer_append(&peers[i], "MSG %s %c %s", to,
+			    is_dl ? 'D' : 'U', msg);
+			sent |= (1u << i);
+		}
+	}
+	mutex_exit(&lock);
+	if (sent != 0)
+		wake_worker();
+
+	return (sent);
+}
+
+/*
+ * Hands an encoded message over to another node, which either delivers
+ * it right away, or holds it in its delayed-delivery queue. `is_dl'
+ * tells whether the sender is an aircraft station, so that the other
+ * node can charge the message to its quota.
+ */
+bool
+cluster_send_qmsg(int node, callsign_key_t from, callsign_key_t to,
+    bool is_dl, time_t created, const char *msg)
+{
+	char from_str[CALLSIGN_LEN], to_str[CALLSIGN_LEN];
+	bool sent = false;
+
+	ASSERT3S(node, >=, 0);
+	ASSERT(msg != NULL);
+	ASSERT(strchr(msg, '\n') == &msg[strlen(msg) - 1]);
+
+	if (!inited || from == CALLSIGN_KEY_NONE || to == CALLSIGN_KEY_NONE)
+		return (false);
+	callsign_key2str(from, from_str);
+	callsign_key2str(to, to_str);
+	mutex_enter(&lock);
+	if (enabled && (unsigned)node < num_peers && peers[node].out_up) {
+		peer_append(&peers[node], "QMSG %s %s %lld %c %s", to_str,
+		    from_str, (long long)created, is_dl ? 'D' : 'U', msg);
+		sent = true;
+	}
+	mutex_exit(&lock);
+	if (sent)
+		wake_worker();
+
+	return (sent);
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_CPDLCD_CLUSTER_H_
+#define	_CPDLCD_CLUSTER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <acfutils/conf.h>
+
+#include "callsign.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Cluster mode. Several cpdlcd nodes announce to each other which
+ * callsigns are logged on locally, so that a message can be forwarded
+ * directly to the node(s) where its recipient is logged on. Messages
+ * for recipients which aren't logged on anywhere are queued on the
+ * recipient's "home" node, which is picked by rendezvous hashing of the
+ * callsign over all reachable nodes.
+ *
+ * Each node keeps an outgoing link to every one of its configured peers.
+ * A node only ever sends on its outgoing links and receives on the links
+ * that its peers have established to it. Links run over TLS, using the
+ * shared cluster secret as a pre-shared key, so both ends authenticate
+ * each other. All link handling runs on a background thread, from which
+ * the callbacks in cluster_ops_t are called.
+ */
+#define	CLUSTER_MAX_PEERS	32
+#define	CLUSTER_NO_NODE		(-1)
+
+typedef uint32_t cluster_nodes_t;	/* bitmask of peer node indices */
+
+typedef struct {
+	/*
+	 * A message forwarded to us for delivery to local recipients.
+	 * `is_dl' tells whether the sender is an aircraft station, which
+	 * is needed to decode the message.
+	 */
+	void	(*deliver)(const char *to, bool is_dl, const char *msg);
+	/*
+	 * An encoded message to either deliver to local recipients right
+	 * away, or to hold in our delayed-delivery queue. `is_dl' tells
+	 * whether the sender is an aircraft station.
+	 */
+	void	(*enqueue)(callsign_key_t from, callsign_key_t to, bool is_dl,
+	    time_t created, const char *msg);
+} cluster_ops_t;
+
+bool cluster_init(const conf_t *conf, const cluster_ops_t *ops);
+void cluster_leave(void);
+void cluster_fini(void);
+
+void cluster_presence(callsign_key_t key, bool present);
+cluster_nodes_t cluster_lookup(callsign_key_t key);
+int cluster_home(callsign_key_t key);
+
+cluster_nodes_t cluster_send_msg(cluster_nodes_t nodes, const char *to,
+    bool is_dl, const char *msg);
+bool cluster_send_qmsg(int node, callsign_key_t from, callsign_key_t to,
+    bool is_dl, time_t created, const char *msg);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _CPDLCD_CLUSTER_H_ */
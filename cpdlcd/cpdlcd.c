@@ -44,6 +44,7 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 
 #include <curl/curl.h>
 
@@ -55,11 +56,11 @@
 #include <acfutils/avl.h>
 #include <acfutils/conf.h>
 #include <acfutils/crc64.h>
-#include <acfutils/htbl.h>
 #include <acfutils/log.h>
 #include <acfutils/list.h>
 #include <acfutils/safe_alloc.h>
 #include <acfutils/thread.h>
+#include <acfutils/time.h>
 
 #include "../common/cpdlc_config_common.h"
 #include "../src/cpdlc_client.h"
@@ -68,9 +69,19 @@
 
 #include "auth.h"
 #include "blocklist.h"
+#include "callsign.h"
+#include "cluster.h"
+#include "flightrec.h"
+#include "handoff.h"
+#include "hooks.h"
+#include "logondir.h"
 #include "common.h"
 #include "msgquota.h"
+#include "latency.h"
+#include "lockprof.h"
 #include "msg_router.h"
+#include "peercred.h"
+#include "ratelimit.h"
 
 #define	CONN_BACKLOG		UINT16_MAX
 #define	READ_BUF_SZ		4096	/* bytes */
@@ -82,6 +93,24 @@
 #define	MAX_BUF_SZ		8192	/* bytes */
 #define	MAX_BUF_SZ_NO_LOGON	128	/* bytes */
 #define	POLL_TIMEOUT		500	/* ms */
+/*
+ * Upper limit on the `lws/coalesce_ms' setting. Also, once this many bytes
+ * have been queued up on an LWS connection, we send them out immediately,
+ * even if the coalescing delay hasn't expired yet.
+ */
+#define	LWS_COALESCE_MAX_MS	100	/* ms */
+#define	LWS_COALESCE_MAX_BYTES	16384	/* bytes */
+#define	STATS_INTVAL		10	/* seconds */
+/*
+ * Maximum amount of output handed to GnuTLS at once (the maximum TLS
+ * record size). If a send would block, GnuTLS needs the same data again,
+ * so this also limits how far a priority message can be held back.
+ */
+#define	TLS_SEND_MAX		16384	/* bytes */
+/*
+ * Default output watermarks, see `out_high_water' and `out_low_water'.
+ */
+#define	DFL_OUT_HIGH_WATER	(1 << 20)	/* bytes */
 /*
  * This value is tuned to be greater + a sufficient margin above the longest
  * possible message validity timeout (LONG_TIMEOUT in cpdlc_infos.c). This is
@@ -94,6 +123,12 @@
  * having been established, the connection is terminated.
  */
 #define	LOGON_GRACE_TIME	30	/* seconds */
+/*
+ * After handing off to a new instance, this is the default time period
+ * over which we gradually close our remaining connections, so their
+ * reconnects to the new instance don't all arrive at once.
+ */
+#define	DFL_DRAIN_TIME		120	/* seconds */
 
 #define	AF2ADDRLEN(sa_family) \
 	((sa_family) == AF_INET ? sizeof (struct sockaddr_in) : \
@@ -133,10 +168,16 @@ typedef enum {
 	LOGON_COMPLETE
 } logon_status_t;
 
+/*
+ * Marks the end of a message in a connection's `outbuf'. Used to insert
+ * priority messages on message boundaries and for latency accounting.
+ */
 typedef struct {
-	char	ident[CALLSIGN_LEN];
-	list_t	node;
-} ident_list_t;
+	size_t		end;	/* offset in `outbuf' past the message */
+	uint64_t	queued;	/* latency_now() when queued */
+	uint64_t	rx;	/* latency_now() when received, 0 if unknown */
+	cpdlc_prio_t	prio;
+} out_mark_t;
 
 /*
  * Master connection tracking structure. This structure holds all the state
@@ -147,10 +188,18 @@ typedef struct {
 typedef struct {
 	/* immutable once set */
 	bool			is_lws;
+	/* plain connection over a Unix-domain socket, no TLS session */
+	bool			is_unix;
 	uint64_t		outbuf_pre_pad;
+	uint64_t		addr_key;	/* see ratelimit_addr_key */
 
 	struct lws		*wsi;
 	bool			kill_wsi;
+	/* in `conns_lws_ready', only accessed from the main thread */
+	list_node_t		lws_ready_node;
+	/* in `conns_lws_wr', protected by `conns_lws_wr_lock' */
+	list_node_t		lws_wr_node;
+	uint64_t		lws_wr_deadline;	/* microclock() */
 
 	/* only set & read from main thread */
 	struct sockaddr_storage	sockaddr;
@@ -163,6 +212,8 @@ typedef struct {
 
 	bool			fmt_plain;
 	bool			fmt_arinc622;
+	/* stamp forwarded messages with SRVTS= (LATENCY logon option) */
+	bool			srv_ts;
 
 	mutex_t			lock;
 
@@ -182,25 +233,92 @@ typedef struct {
 	/* Data received over the TLS/WS connection */
 	uint8_t			*inbuf;
 	size_t			inbuf_sz;
+	/* leading bytes of `inbuf' known not to hold a full message */
+	size_t			inbuf_scanned;
+	/*
+	 * Messages decoded from `inbuf' are allocated from here. Reset
+	 * after each message, so it doesn't outlive conn_process_msg.
+	 */
+	cpdlc_arena_t		*arena;
 	/* Data about to be sent to the client over the TLS/WS connection */
 	uint8_t			*outbuf;
 	size_t			outbuf_sz;
+	/* number of messages contained in `outbuf' */
+	unsigned		outbuf_msgs;
+	/* one mark for each message in `outbuf', in order */
+	out_mark_t		*out_marks;
+	unsigned		num_out_marks;
+	/*
+	 * Number of bytes at the start of `outbuf' which must be sent as
+	 * they are: the rest of a partially sent message, or a TLS record
+	 * which needs to be retried. Priority messages go after these.
+	 */
+	size_t			outbuf_fixed;
+	/* set by OUT_ACTION_DROP, the main thread then closes the conn */
+	bool			out_dropped;
+	/* protected by `out_lock' */
+	bool			out_congested;
+
+	/* in `paused_conns', only accessed from the main thread */
+	bool			in_paused;
+	/* the congested recipient we are waiting for */
+	callsign_key_t		paused_on;
+	/* rate limited until this time (microclock) */
+	uint64_t		paused_until;
+	list_node_t		paused_node;
+	/* set when the source address has been penalized by a rate limit */
+	bool			penalized;
+	/* set by conn_failed, the flight recorder gets dumped on close */
+	const char		*fail_reason;
+	/*
+	 * Set once the connection has been handed over to a new instance.
+	 * Closing it then isn't a logoff, the client remains logged on.
+	 */
+	bool			handed_off;
+	/* NULL if the flight recorder is disabled */
+	flightrec_t		*fr;
 
 	list_node_t		conns_node;
 } conn_t;
 
+/*
+ * A single logon identity of a connection. Each of these is held both
+ * in its connection's `from_list', as well as in the list of all
+ * connections of that identity in the `conns_by_from' table.
+ */
+typedef struct {
+	callsign_key_t	key;
+	char		ident[CALLSIGN_LEN];
+	conn_t		*conn;
+	/* slot in the logon directory, or -1 if not listed */
+	int		logondir_slot;
+	list_node_t	node;
+	list_node_t	by_from_node;
+} ident_list_t;
+
 /*
  * An encoded message waiting in the delivery queue.
  */
 typedef struct {
-	char		from[CALLSIGN_LEN];
-	char		to[CALLSIGN_LEN];
+	callsign_key_t	from;
+	callsign_key_t	to;
 	bool		is_atc;
 	time_t		created;	/* when the msg entered the queue */
+	cpdlc_prio_t	prio;
 	char		*msg;		/* message contents */
 	list_node_t	queued_msgs_node;
 } queued_msg_t;
 
+/*
+ * Logon state of a TLS connection of the instance we have taken over
+ * from, waiting for its client to reconnect to us (see handoff_resume_t).
+ */
+typedef struct {
+	handoff_resume_t	*hr;
+	time_t			expire;
+	list_node_t		resume_logons_node;
+} resume_logon_t;
+
 /*
  * Structure holding all information about a socket on which we listen
  * for new incoming connections. This structure is held in the
@@ -215,11 +333,39 @@ typedef struct {
 typedef struct {
 	bool			is_lws;
 	struct lws_context	*ctx;
-	bool			shutdown;
-	thread_t		worker;
 	list_node_t		listen_lws_node;
 } listen_lws_t;
 
+/*
+ * A socket which libwebsockets wants us to poll on its behalf. LWS doesn't
+ * run its own event loop, instead it is serviced from poll_sockets. LWS
+ * tells us which sockets to poll through the ADD_POLL_FD, DEL_POLL_FD and
+ * CHANGE_MODE_POLL_FD callbacks. Only accessed from the main thread.
+ */
+typedef struct {
+	int			fd;
+	short			events;
+	struct lws_context	*ctx;
+} lws_pollfd_t;
+
+/*
+ * Encoding shared by all the recipients of a message with a multi-
+ * recipient TO= header. Each recipient gets its own copy of the message
+ * (so it can be routed individually), but instead of encoding every one
+ * of them from scratch, the message is encoded only once without the
+ * TO= header and the recipient's TO= header is then spliced in. This is
+ * only possible for the plain text format, since ARINC 622 uplinks
+ * embed the recipient's callsign in the binary message body. Every copy
+ * of the message holds a reference until it has been dealt with.
+ */
+typedef struct {
+	mutex_t			lock;
+	unsigned		refcnt;
+	char			*buf;	/* lazily encoded on first use */
+	unsigned		len;
+	unsigned		to_off;	/* where the TO= header goes */
+} mcast_enc_t;
+
 /*
  * Master connections lists. All conn_t's are gathered and primarily
  * held in one of two lists. `conns_tcp' collects connections over raw
@@ -231,6 +377,64 @@ static list_t		conns_tcp;
 
 static mutex_t		conns_lws_lock;
 static list_t		conns_lws;
+/*
+ * LWS connections which have received data that hasn't been processed
+ * yet. This is filled by the LWS receive callback and drained by
+ * handle_lws_input, so we don't need to scan all of `conns_lws'. Since
+ * LWS is only ever serviced from the main thread, this list doesn't
+ * need a lock.
+ */
+static list_t		conns_lws_ready;
+/*
+ * LWS connections which have had output queued from a thread other than
+ * the main thread. LWS may only be called from the main thread, so the
+ * main thread picks these up and requests writable callbacks for them.
+ */
+static mutex_t		conns_lws_wr_lock;
+static list_t		conns_lws_wr;
+/*
+ * Connections whose input processing has been paused, either by
+ * OUT_ACTION_PAUSE because they have sent a message to a congested
+ * recipient, or because they have exceeded a per-address rate limit.
+ * Only accessed from the main thread.
+ */
+static list_t		paused_conns;
+/*
+ * Sockets to be polled on behalf of LWS. `lws_fd2idx' maps a socket fd
+ * number to its index in `lws_pfds' (or -1), to make the frequent
+ * CHANGE_MODE_POLL_FD callback cheap.
+ */
+static lws_pollfd_t	*lws_pfds = NULL;
+static unsigned		num_lws_pfds = 0;
+static unsigned		cap_lws_pfds = 0;
+static int		*lws_fd2idx = NULL;
+static unsigned		cap_lws_fd2idx = 0;
+/*
+ * LWS output tuning. `lws_deflate' enables negotiation of the
+ * permessage-deflate extension (RFC 7692) with clients. If
+ * `lws_coalesce_us' is non-zero, output on LWS connections is held back
+ * for up to that long, so that messages queued in short succession go
+ * out in a single WebSocket frame.
+ */
+static bool		lws_deflate = true;
+static uint64_t		lws_coalesce_us = 0;
+/*
+ * LWS output statistics, periodically written to `stats_file'. Only
+ * accessed from the main thread.
+ */
+static struct {
+	uint64_t	frames;		/* WebSocket frames sent */
+	uint64_t	msgs;		/* CPDLC messages sent in those frames */
+	uint64_t	bytes;		/* payload bytes sent */
+	uint64_t	write_cpu_ns;	/* CPU time spent in lws_write */
+	/* payload bytes in and out of the permessage-deflate compressor */
+	uint64_t	deflate_in;
+	uint64_t	deflate_out;
+} lws_stats = {};
+static char		stats_file[PATH_MAX] = {};
+static time_t		stats_written = 0;
+/* set by SIGUSR1 to write out the stats file right away */
+static volatile sig_atomic_t	stats_requested = 0;
 /*
  * If modifications to `conns_tcp' are done, we need to raise this flag.
  * This is because TCP input handling requires constructing a pollfd list
@@ -242,16 +446,17 @@ static list_t		conns_lws;
 static bool		conns_tcp_dirty = false;
 /*
  * Hash table mapping station "FROM" identities to one or more connections.
- * This mapping is established after a successful LOGON.
+ * This mapping is established after a successful LOGON. The table is keyed
+ * by the packed callsign and each value is a list_t of ident_list_t's.
  */
 static mutex_t		conns_by_from_lock;
-static htbl_t		conns_by_from;
+static cstbl_t		conns_by_from;
 static bool		conns_by_from_changed = true;
 /*
- * Bitshift defining the size of the `conns_by_from' hash table.
- * The default value of `12' defines a hash table with 4096 entries in it.
+ * Initial number of slots in the `conns_by_from' table. The table grows
+ * on demand, this merely avoids rehashing during the initial logon burst.
  */
-#define	CONNS_BY_FROM_SHIFT	12
+#define	CONNS_BY_FROM_INIT_CAP	4096
 /*
  * Master lists of listening ends. `listen_socks' is for TCP sockets,
  * `listen_lws' is for WebSockets.
@@ -286,6 +491,11 @@ static gnutls_pkcs_encrypt_flags_t tls_keyfile_enctype = GNUTLS_PKCS_PLAIN;
  */
 static gnutls_certificate_credentials_t	x509_creds;
 static gnutls_priority_t		prio_cache;
+/*
+ * Session ticket encryption key. This is passed on during a hot restart,
+ * so clients reconnecting to the new instance can resume their sessions.
+ */
+static gnutls_datum_t			tls_ticket_key = {};
 
 /*
  * List of messages queued for later delivery (recipient currently not
@@ -293,10 +503,53 @@ static gnutls_priority_t		prio_cache;
  * intervals to expunge timed out messages.
  */
 static list_t		queued_msgs;
+/*
+ * Priority messages are kept at the head of `queued_msgs', so they get
+ * delivered first. This is the last of them (NULL if there are none).
+ */
+static queued_msg_t	*queued_msgs_prio_last = NULL;
 /* Current amount of bytes consumed by messages in `queued_msgs' */
 static uint64_t		queued_msg_bytes = 0;
 /* Maximum size that `queued_msgs' can grow to. */
 static uint64_t		queued_msg_max_bytes = 128 << 20;	/* 128 MiB */
+/*
+ * Output backpressure. Once more than `out_high_water' bytes of output
+ * are pending on a connection (or the output pending on all connections
+ * would exceed `out_max_total'), the connection becomes congested and
+ * `out_action' determines what happens to further output to it:
+ *	OUT_ACTION_QUEUE: messages go to the delayed-delivery queue.
+ *	OUT_ACTION_PAUSE: we stop processing input from connections which
+ *	    send messages to the congested connection.
+ *	OUT_ACTION_DROP: the connection is closed.
+ * A congested connection stops being congested once its pending output
+ * has drained down to `out_low_water'. Zero values mean no limit.
+ */
+typedef enum {
+	OUT_ACTION_QUEUE,
+	OUT_ACTION_PAUSE,
+	OUT_ACTION_DROP
+} out_action_t;
+static uint64_t		out_high_water = DFL_OUT_HIGH_WATER;
+static uint64_t		out_low_water = DFL_OUT_HIGH_WATER / 2;
+static uint64_t		out_max_total = 0;
+static out_action_t	out_action = OUT_ACTION_QUEUE;
+static mutex_t		out_lock;
+/* Output accounting statistics, protected by `out_lock' */
+static struct {
+	uint64_t	pending;	/* bytes in all `outbuf's */
+	uint64_t	peak;		/* max value `pending' ever had */
+	unsigned	congested;	/* number of congested conns */
+	uint64_t	congest_events;	/* conns becoming congested */
+	uint64_t	deferred;	/* msgs not sent due to congestion */
+	uint64_t	paused;		/* conns getting input paused */
+	uint64_t	dropped;	/* conns closed due to congestion */
+	/* per priority class, time from queueing to being sent out */
+	struct {
+		uint64_t	msgs;
+		uint64_t	lat_sum;	/* microseconds */
+		uint64_t	lat_max;	/* microseconds */
+	} prio[CPDLC_NUM_PRIOS];
+} out_stats = {};
 /*
  * Global server config parameters. Can be overridden from config file.
  */
@@ -307,15 +560,52 @@ static mutex_t		msg_log_lock;
 static char		msg_log_filename[PATH_MAX] = {};
 static FILE		*msg_log_file = NULL;
 static char		logon_list_file[PATH_MAX] = {};
-static char		*logon_cmd = NULL;
-static char		*logoff_cmd = NULL;
-
-static void lws_worker(void *userinfo);
+static _Thread_local bool is_main_thread = false;
+/*
+ * Hot restart state (see handoff.h). `handoff_listen_fd' accepts new
+ * instances wanting to take over from us. `handoff_peer_fd' connects us
+ * to the other instance during a handoff. In the old instance, once
+ * `draining' is set, messages which would otherwise be queued are
+ * forwarded to the new instance through it, so they aren't lost when we
+ * exit. In the new instance, that's where those messages arrive from.
+ * In the old instance, `handoff_peer_fd' is protected by
+ * `conns_by_from_lock', otherwise it's only accessed from the main thread.
+ */
+static char		handoff_path[PATH_MAX] = {};
+static int		handoff_listen_fd = -1;
+static int		handoff_peer_fd = -1;
+static bool		takeover = false;
+static bool		draining = false;
+static time_t		drain_start = 0;
+static unsigned		drain_conns_total = 0;
+static int		drain_time = DFL_DRAIN_TIME;
+/* resume_logon_t's, only accessed from the main thread */
+static list_t		resume_logons;
+
+static bool takeover_from_running(void);
+static void resume_logon(conn_t *conn);
+static void cluster_deliver_cb(const char *to, bool is_dl, const char *buf);
+static void cluster_enqueue_cb(callsign_key_t from, callsign_key_t to,
+    bool is_dl, time_t created, const char *buf);
 static int http_lws_cb(struct lws *wsi, enum lws_callback_reasons reason,
     void *user, void *in, size_t len);
 static int cpdlc_lws_cb(struct lws *wsi, enum lws_callback_reasons reason,
     void *user, void *in, size_t len);
 
+static int lws_deflate_ext_cb(struct lws_context *ctx,
+    const struct lws_extension *ext, struct lws *wsi,
+    enum lws_extension_callback_reasons reason, void *user, void *in,
+    size_t len);
+
+static const struct lws_extension lws_exts[] = {
+    {
+	.name = "permessage-deflate",
+	.callback = lws_deflate_ext_cb,
+	.client_offer = "permessage-deflate; client_max_window_bits"
+    },
+    { .name = NULL }	/* list terminator */
+};
+
 static struct lws_protocols proto_list_lws[] =
 {
     /* The first protocol must always be the HTTP handler */
@@ -340,73 +630,16 @@ static void send_error_msg_to(const char *to, const cpdlc_msg_t *orig_msg,
     cpdlc_errinfo_t errinfo);
 static void send_svc_unavail_msg(conn_t *conn, unsigned orig_min);
 static void close_conn(conn_t *conn);
-static void conn_send_msg(conn_t *conn, const cpdlc_msg_t *msg);
-
-static char *
-str_subst(char *str, const char *pattern, const char *replace)
-{
-	char *result = NULL;
-	size_t sz = 0;
-	char *srch, *hit;
-
-	ASSERT(str != NULL);
-	ASSERT(pattern != NULL);
-	ASSERT(replace != NULL);
-
-	for (srch = str, hit = strstr(srch, pattern);
-	    srch < str + strlen(str) && hit != NULL;
-	    srch = hit + strlen(pattern), hit = strstr(srch, pattern)) {
-		unsigned l = hit - srch + 1;
-		char *buf = safe_malloc(l);
-
-		strlcpy(buf, srch, l);
-		append_format(&result, &sz, "%s%s", buf, replace);
-		free(buf);
-	}
-	append_format(&result, &sz, "%s", srch);
-	free(str);
-
-	return (result);
-}
-
-static void
-exec_cmd_common(const char *cmd_in, const char *from, const conn_t *conn)
-{
-	const char *to;
-	char *cmd;
-
-	ASSERT(cmd_in != NULL);
-	ASSERT(from != NULL);
-	ASSERT(conn != NULL);
-	cmd = strdup(cmd_in);
-	to = (conn->to[0] != '\0' ? conn->to : "-");
-
-	cmd = str_subst(cmd, "${FROM}", from);
-	cmd = str_subst(cmd, "${TO}", to);
-	cmd = str_subst(cmd, "${ADDR}", conn->addr_str);
-	cmd = str_subst(cmd, "${STATYPE}", conn->is_atc ? "ATC" : "ACFT");
-	cmd = str_subst(cmd, "${CONNTYPE}", conn->is_lws ? "WS" : "TLS");
-	switch (fork()) {
-	case -1:
-		logMsg("fork() failed: %s", strerror(errno));
-		break;
-	case 0:
-		execl("/bin/sh", "sh", "-c", cmd, NULL);
-		logMsg("execl(\"/bin/sh\") failed: %s", strerror(errno));
-		exit(EXIT_FAILURE);
-	default:
-		break;
-	}
-	free(cmd);
-}
+static bool conn_send_msg(conn_t *conn, const cpdlc_msg_t *msg);
+static void conn_outbuf_drained(conn_t *conn, size_t bytes);
 
 static void
 logon_hook(const char *from, const conn_t *conn)
 {
 	auth_notify_logon(true, from, !conn->is_atc ? conn->to : NULL,
 	    conn->addr_str, conn->is_atc, conn->is_lws);
-	if (logon_cmd != NULL)
-		exec_cmd_common(logon_cmd, from, conn);
+	hooks_post(true, from, conn->to, conn->addr_str, conn->is_atc,
+	    conn->is_lws);
 }
 
 static void
@@ -414,8 +647,8 @@ logoff_hook(const char *from, const conn_t *conn)
 {
 	auth_notify_logon(false, from, !conn->is_atc ? conn->to : NULL,
 	    conn->addr_str, conn->is_atc, conn->is_lws);
-	if (logoff_cmd != NULL)
-		exec_cmd_common(logoff_cmd, from, conn);
+	hooks_post(false, from, conn->to, conn->addr_str, conn->is_atc,
+	    conn->is_lws);
 }
 
 /*
@@ -482,21 +715,29 @@ sockaddr2str(const struct sockaddr_storage *ss, char str[SOCKADDR_STRLEN])
 static void
 init_structs(void)
 {
-	ASSERT(CONNS_BY_FROM_SHIFT > 0);
 	mutex_init(&conns_tcp_lock);
 	mutex_init(&msg_log_lock);
 	list_create(&conns_tcp, sizeof (conn_t), offsetof(conn_t, conns_node));
 	mutex_init(&conns_lws_lock);
 	list_create(&conns_lws, sizeof (conn_t), offsetof(conn_t, conns_node));
+	list_create(&conns_lws_ready, sizeof (conn_t),
+	    offsetof(conn_t, lws_ready_node));
+	mutex_init(&conns_lws_wr_lock);
+	list_create(&conns_lws_wr, sizeof (conn_t),
+	    offsetof(conn_t, lws_wr_node));
+	list_create(&paused_conns, sizeof (conn_t),
+	    offsetof(conn_t, paused_node));
+	mutex_init(&out_lock);
 	mutex_init(&conns_by_from_lock);
-	htbl_create(&conns_by_from, 1 << CONNS_BY_FROM_SHIFT, CALLSIGN_LEN,
-	    true);
+	cstbl_create(&conns_by_from, CONNS_BY_FROM_INIT_CAP);
 	list_create(&queued_msgs, sizeof (queued_msg_t),
 	    offsetof(queued_msg_t, queued_msgs_node));
 	list_create(&listen_socks, sizeof (listen_sock_t),
 	    offsetof(listen_sock_t, listen_socks_node));
 	list_create(&listen_lws, sizeof (listen_lws_t),
 	    offsetof(listen_lws_t, listen_lws_node));
+	list_create(&resume_logons, sizeof (resume_logon_t),
+	    offsetof(resume_logon_t, resume_logons_node));
 	blocklist_init();
 	VERIFY_MSG(pipe(poll_wakeup_pipe) != -1, "pipe() failed: %s",
 	    strerror(errno));
@@ -504,6 +745,20 @@ init_structs(void)
 	set_fd_nonblock(poll_wakeup_pipe[1]);
 }
 
+/*
+ * Destroys all LWS listeners, which also closes all LWS connections.
+ */
+static void
+close_listen_lws(void)
+{
+	listen_lws_t *lws;
+
+	while ((lws = list_remove_head(&listen_lws)) != NULL) {
+		lws_context_destroy(lws->ctx);
+		free(lws);
+	}
+}
+
 /*
  * Destroys and cleans up our global data structures.
  */
@@ -513,11 +768,7 @@ fini_structs(void)
 	conn_t *conn;
 	queued_msg_t *msg;
 	listen_sock_t *ls;
-	listen_lws_t *lws;
-
-	htbl_empty(&conns_by_from, NULL, NULL);
-	htbl_destroy(&conns_by_from);
-	mutex_destroy(&conns_by_from_lock);
+	resume_logon_t *rl;
 
 	mutex_enter(&conns_tcp_lock);
 	/* calling `close_conn' removes the connection from `conns_tcp' */
@@ -529,8 +780,26 @@ fini_structs(void)
 	list_destroy(&conns_tcp);
 	mutex_destroy(&conns_tcp_lock);
 
-	/* Destroying the LWS contexts should have drained this list */
+	/*
+	 * Destroying the LWS contexts closes all of their connections and
+	 * sockets, which drains `conns_lws' and the LWS pollfd table.
+	 */
+	close_listen_lws();
+	list_destroy(&listen_lws);
+	ASSERT0(num_lws_pfds);
+	free(lws_pfds);
+	free(lws_fd2idx);
+
 	ASSERT0(list_count(&conns_lws));
+	ASSERT0(list_count(&conns_lws_ready));
+	ASSERT0(list_count(&conns_lws_wr));
+	list_destroy(&conns_lws_ready);
+	list_destroy(&conns_lws_wr);
+	mutex_destroy(&conns_lws_wr_lock);
+	ASSERT0(list_count(&paused_conns));
+	list_destroy(&paused_conns);
+	ASSERT0(out_stats.pending);
+	mutex_destroy(&out_lock);
 	list_destroy(&conns_lws);
 	mutex_destroy(&conns_lws_lock);
 
@@ -539,28 +808,30 @@ fini_structs(void)
 		free(msg);
 	}
 	list_destroy(&queued_msgs);
+	queued_msgs_prio_last = NULL;
 	queued_msg_bytes = 0;
 
 	while ((ls = list_remove_head(&listen_socks)) != NULL) {
 		if (ls->fd != -1)
 			close(ls->fd);
+		if (ls->sockaddr.ss_family == AF_UNIX) {
+			unlink(((struct sockaddr_un *)&ls->sockaddr)->
+			    sun_path);
+		}
 		free(ls);
 	}
 	list_destroy(&listen_socks);
 
-	/*
-	 * First mark all LWS contexts for destruction, then join all the
-	 * worker threads.
-	 */
-	for (lws = list_head(&listen_lws); lws != NULL;
-	    lws = list_next(&listen_lws, lws)) {
-		lws->shutdown = true;
+	while ((rl = list_remove_head(&resume_logons)) != NULL) {
+		free(rl->hr);
+		free(rl);
 	}
-	while ((lws = list_remove_head(&listen_lws)) != NULL) {
-		thread_join(&lws->worker);
-		free(lws);
-	}
-	list_destroy(&listen_lws);
+	list_destroy(&resume_logons);
+
+	/* Closing all connections should have drained this table */
+	ASSERT0(cstbl_count(&conns_by_from));
+	cstbl_destroy(&conns_by_from);
+	mutex_destroy(&conns_by_from_lock);
 
 	blocklist_fini();
 
@@ -571,7 +842,7 @@ fini_structs(void)
 static void
 print_usage(const char *progname, FILE *fp)
 {
-	fprintf(fp, "Usage: %s [-hd] [-c <conffile>]\n", progname);
+	fprintf(fp, "Usage: %s [-hdt] [-c <conffile>]\n", progname);
 }
 
 static bool
@@ -588,6 +859,8 @@ add_listen_sock_lws(const char *iface, int port, const char *name_port)
 
 	info.port = port;
 	info.protocols = proto_list_lws;
+	if (lws_deflate)
+		info.extensions = lws_exts;
 	info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
 	if (strcmp(iface, "loopback") == 0) {
 #if	APL || SUN
@@ -611,13 +884,14 @@ add_listen_sock_lws(const char *iface, int port, const char *name_port)
 	if (strlen(tls_cafile) != 0)
 		info.ssl_ca_filepath = tls_cafile;
 
+	lws->is_lws = true;
 	lws->ctx = lws_create_context(&info);
 	if (lws->ctx == NULL) {
 		logMsg("Error creating LWS context for %s", name_port);
 		free(lws);
 		return (false);
 	}
-	VERIFY(thread_create(&lws->worker, lws_worker, lws));
+	list_insert_tail(&listen_lws, lws);
 
 	return (true);
 }
@@ -727,6 +1001,88 @@ add_listen_sock(const char *name_port, bool lws)
 		return (add_listen_sock_tcp(hostname, port, name_port));
 }
 
+/*
+ * Checks if anybody is listening on a Unix-domain socket path. Used to
+ * tell a stale socket left behind by a crashed instance (which we can
+ * safely remove) from one which is still in use.
+ */
+static bool
+unix_sock_in_use(const struct sockaddr_un *sun)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	bool in_use;
+
+	if (fd == -1)
+		return (true);
+	in_use = (connect(fd, (const struct sockaddr *)sun,
+	    sizeof (*sun)) == 0 || errno != ECONNREFUSED);
+	close(fd);
+	return (in_use);
+}
+
+/*
+ * Adds a Unix-domain listen socket. This is meant for clients running on
+ * the same machine as the server, which saves them the overhead of going
+ * through TCP & TLS. Since there is no client certificate to check,
+ * access is controlled using the peer's credentials (see peercred.c).
+ * The socket node itself is thus made world-accessible.
+ */
+static bool
+add_listen_sock_unix(const char *path)
+{
+	listen_sock_t *ls;
+	struct sockaddr_un *sun;
+
+	ASSERT(path != NULL);
+
+	ls = safe_calloc(1, sizeof (*ls));
+	sun = (struct sockaddr_un *)&ls->sockaddr;
+	if (path[0] == '\0' || strlen(path) >= sizeof (sun->sun_path)) {
+		logMsg("Invalid listen directive \"%s\": Unix socket path "
+		    "must be between 1 and %d characters long", path,
+		    (int)sizeof (sun->sun_path) - 1);
+		free(ls);
+		return (false);
+	}
+	sun->sun_family = AF_UNIX;
+	cpdlc_strlcpy(sun->sun_path, path, sizeof (sun->sun_path));
+
+	list_insert_tail(&listen_socks, ls);
+
+	ls->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (ls->fd == -1) {
+		logMsg("Invalid listen directive \"%s\": cannot create "
+		    "socket: %s", path, strerror(errno));
+		return (false);
+	}
+	if (bind(ls->fd, (struct sockaddr *)sun, sizeof (*sun)) == -1 &&
+	    (errno != EADDRINUSE || unix_sock_in_use(sun) ||
+	    unlink(path) == -1 ||
+	    bind(ls->fd, (struct sockaddr *)sun, sizeof (*sun)) == -1)) {
+		logMsg("Invalid listen directive \"%s\": cannot bind "
+		    "socket: %s", path, strerror(errno));
+		/* Don't remove somebody else's socket in fini_structs */
+		ls->sockaddr.ss_family = AF_UNSPEC;
+		return (false);
+	}
+	if (chmod(path, 0666) == -1) {
+		logMsg("Invalid listen directive \"%s\": cannot set socket "
+		    "permissions: %s", path, strerror(errno));
+		return (false);
+	}
+	if (listen(ls->fd, CONN_BACKLOG) == -1) {
+		logMsg("Invalid listen directive \"%s\": cannot listen on "
+		    "socket: %s", path, strerror(errno));
+		return (false);
+	}
+	if (!set_fd_nonblock(ls->fd)) {
+		logMsg("Invalid listen directive \"%s\": cannot set socket "
+		    "as non-blocking: %s", path, strerror(errno));
+		return (false);
+	}
+	return (true);
+}
+
 /*
  * Parses a numerical byte-count specification with an optional multiplier
  * suffix and returns the raw number of bytes. For example, '128k' returns
@@ -793,7 +1149,7 @@ msglog_reopen(void)
 static bool
 parse_config(const char *conf_path)
 {
-	int errline;
+	int errline, i;
 	uint64_t msgquota_max = 0;
 	conf_t *conf = conf_read_file(conf_path, &errline);
 	const char *key, *value;
@@ -837,6 +1193,15 @@ parse_config(const char *conf_path)
 		msgquota_max = parse_bytes(value);
 	if (conf_get_str(conf, "msgqueue/max", &value))
 		queued_msg_max_bytes = parse_bytes(value);
+	/* Must go before takeover_from_running, which can queue messages */
+	msgquota_init(msgquota_max);
+	/* Must go before we start accepting connections */
+	if (!ratelimit_init(conf))
+		goto errout;
+	if (!flightrec_init(conf))
+		goto errout;
+	if (!peercred_init(conf))
+		goto errout;
 	if (conf_get_str(conf, "msglog", &value)) {
 		cpdlc_strlcpy(msg_log_filename, value,
 		    sizeof (msg_log_filename));
@@ -847,10 +1212,69 @@ parse_config(const char *conf_path)
 	}
 	if (conf_get_str(conf, "logon_list_file", &value))
 		strlcpy(logon_list_file, value, sizeof (logon_list_file));
-	if (conf_get_str(conf, "logon_cmd", &value))
-		logon_cmd = strdup(value);
-	if (conf_get_str(conf, "logoff_cmd", &value))
-		logoff_cmd = strdup(value);
+	conf_get_b(conf, "lws/deflate", (bool_t *)&lws_deflate);
+	if (conf_get_i(conf, "lws/coalesce_ms", &i))
+		lws_coalesce_us = MIN(MAX(i, 0), LWS_COALESCE_MAX_MS) * 1000;
+	/* "lws/stats_file" is the old name of "stats_file" */
+	if (conf_get_str(conf, "stats_file", &value) ||
+	    conf_get_str(conf, "lws/stats_file", &value)) {
+		strlcpy(stats_file, value, sizeof (stats_file));
+	}
+	if (conf_get_str(conf, "output/high_water", &value))
+		out_high_water = parse_bytes(value);
+	out_low_water = out_high_water / 2;
+	if (conf_get_str(conf, "output/low_water", &value))
+		out_low_water = MIN(parse_bytes(value), out_high_water);
+	if (conf_get_str(conf, "output/max_total", &value))
+		out_max_total = parse_bytes(value);
+	if (conf_get_str(conf, "output/action", &value)) {
+		if (strcmp(value, "queue") == 0) {
+			out_action = OUT_ACTION_QUEUE;
+		} else if (strcmp(value, "pause") == 0) {
+			out_action = OUT_ACTION_PAUSE;
+		} else if (strcmp(value, "drop") == 0) {
+			out_action = OUT_ACTION_DROP;
+		} else {
+			logMsg("Invalid output/action \"%s\": must be one "
+			    "of \"queue\", \"pause\" or \"drop\"", value);
+			goto errout;
+		}
+	}
+	if (conf_get_str(conf, "handoff/socket", &value))
+		strlcpy(handoff_path, value, sizeof (handoff_path));
+	if (conf_get_i(conf, "handoff/drain_time", &drain_time))
+		drain_time = MAX(drain_time, 1);
+	/*
+	 * Must go before the logon directory is set up, since the old
+	 * instance keeps writing to it until it has handed off to us.
+	 */
+	if (takeover) {
+		if (handoff_path[0] == '\0') {
+			logMsg("Taking over from a running instance requires "
+			    "handoff/socket to be set");
+			goto errout;
+		}
+		if (!takeover_from_running())
+			goto errout;
+	}
+	if (conf_get_str(conf, "logon_dir/file", &value)) {
+		int max_ents = 0;
+
+		conf_get_i(conf, "logon_dir/max_entries", &max_ents);
+		if (!logondir_init(value, MAX(max_ents, 0)))
+			goto errout;
+	}
+	/* Must go before any threads are started */
+	if (!hooks_init(conf))
+		goto errout;
+	/*
+	 * Must go after takeover_from_running, since the old instance
+	 * only leaves the cluster once it has handed off to us.
+	 */
+	if (!cluster_init(conf, &(cluster_ops_t){
+	    .deliver = cluster_deliver_cb, .enqueue = cluster_enqueue_cb })) {
+		goto errout;
+	}
 
 	/*
 	 * Must go after all TLS parameters have been parsed, because
@@ -859,11 +1283,19 @@ parse_config(const char *conf_path)
 	cookie = NULL;
 	while (conf_walk(conf, &key, &value, &cookie)) {
 		if (strncmp(key, "listen/tcp/", 11) == 0) {
+			/* When taking over, these have been handed to us */
+			if (takeover)
+				continue;
 			if (!add_listen_sock(value, false))
 				goto errout;
 		} else if (strncmp(key, "listen/lws/", 11) == 0) {
 			if (!add_listen_sock(value, true))
 				goto errout;
+		} else if (strncmp(key, "listen/unix/", 12) == 0) {
+			if (takeover)
+				continue;
+			if (!add_listen_sock_unix(value))
+				goto errout;
 		}
 	}
 
@@ -874,9 +1306,18 @@ parse_config(const char *conf_path)
 	}
 	if (!auth_init(conf))
 		goto errout;
-	msgquota_init(msgquota_max);
 	if (!msg_router_init(conf))
 		goto errout;
+	/*
+	 * Only start accepting handoffs once we know we're up and running,
+	 * otherwise we could knock out the handoff socket of an instance
+	 * which is still running.
+	 */
+	if (handoff_path[0] != '\0') {
+		handoff_listen_fd = handoff_listen(handoff_path);
+		if (handoff_listen_fd == -1)
+			goto errout;
+	}
 
 	conf_free(conf);
 	return (true);
@@ -896,6 +1337,7 @@ auto_config(void)
 	auth_init(NULL);
 	VERIFY(msg_router_init(NULL));
 	msgquota_init(0);
+	VERIFY(ratelimit_init(NULL));
 	return (add_listen_sock("localhost", false));
 }
 
@@ -939,6 +1381,28 @@ daemonize(bool do_chdir, bool do_close)
 	return (true);
 }
 
+/*
+ * Checks if a new connection from a source address is within the rate
+ * limits and the address isn't serving a rate limiting penalty. Returns
+ * false if the connection must be refused.
+ */
+static bool
+check_conn_ratelimit(uint64_t addr_key, const char *addr_str)
+{
+	if (ratelimit_penalized(addr_key)) {
+		logMsg("Incoming connection refused: address %s is serving "
+		    "a rate limiting penalty", addr_str);
+		return (false);
+	}
+	if (!ratelimit_allow(RL_ADDR_CONNS, addr_key, 1)) {
+		logMsg("Incoming connection refused: too many connections "
+		    "from address %s", addr_str);
+		ratelimit_penalize(addr_key);
+		return (false);
+	}
+	return (true);
+}
+
 /*
  * Handles an new incoming connections on a listen socket. Connections
  * are accepted until there are no more pending connections. The function
@@ -966,16 +1430,38 @@ handle_accepts(listen_sock_t *ls)
 			    strerror(errno));
 			continue;
 		}
-		ASSERT(conn->sockaddr.ss_family == AF_INET ||
-		    conn->sockaddr.ss_family == AF_INET6);
-		sockaddr2str(&conn->sockaddr, conn->addr_str);
-		/*
-		 * Interrogate the blocklist as early as possible, so we're
-		 * not wasting any resources on blocked hosts.
-		 */
-		if (!blocklist_check(&conn->sockaddr)) {
-			logMsg("Incoming connection blocked: "
-			    "address %s on blocklist.", conn->addr_str);
+		if (ls->sockaddr.ss_family == AF_UNIX) {
+			uid_t uid;
+			/*
+			 * Local clients have no address to block, the
+			 * peer credentials take the place of the blocklist.
+			 */
+			conn->is_unix = true;
+			if (!peercred_check(conn->fd, conn->addr_str, &uid)) {
+				close(conn->fd);
+				free(conn);
+				continue;
+			}
+			conn->addr_key = ratelimit_uid_key(uid);
+		} else {
+			ASSERT(conn->sockaddr.ss_family == AF_INET ||
+			    conn->sockaddr.ss_family == AF_INET6);
+			sockaddr2str(&conn->sockaddr, conn->addr_str);
+			/*
+			 * Interrogate the blocklist as early as possible,
+			 * so we're not wasting any resources on blocked
+			 * hosts.
+			 */
+			if (!blocklist_check(&conn->sockaddr)) {
+				logMsg("Incoming connection blocked: "
+				    "address %s on blocklist.", conn->addr_str);
+				close(conn->fd);
+				free(conn);
+				continue;
+			}
+			conn->addr_key = ratelimit_addr_key(&conn->sockaddr);
+		}
+		if (!check_conn_ratelimit(conn->addr_key, conn->addr_str)) {
 			close(conn->fd);
 			free(conn);
 			continue;
@@ -987,19 +1473,28 @@ handle_accepts(listen_sock_t *ls)
 		set_fd_nonblock(conn->fd);
 		conn->logoff_time = time(NULL);
 		/*
-		 * Start the TLS handshake process.
+		 * Start the TLS handshake process. Unix-domain connections
+		 * are plain text, so there's no handshake to do.
 		 */
-		VERIFY0(gnutls_init(&conn->session,
-		    GNUTLS_SERVER | GNUTLS_NONBLOCK | GNUTLS_NO_SIGNAL));
-		VERIFY0(gnutls_priority_set(conn->session, prio_cache));
-		VERIFY0(gnutls_credentials_set(conn->session,
-		    GNUTLS_CRD_CERTIFICATE, x509_creds));
-		/* If client certs are required, request one. */
-		gnutls_certificate_server_set_request(conn->session,
-		    req_client_cert ? GNUTLS_CERT_REQUIRE : GNUTLS_CERT_IGNORE);
-		gnutls_handshake_set_timeout(conn->session,
-		    GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
-		gnutls_transport_set_int(conn->session, conn->fd);
+		if (!conn->is_unix) {
+			VERIFY0(gnutls_init(&conn->session, GNUTLS_SERVER |
+			    GNUTLS_NONBLOCK | GNUTLS_NO_SIGNAL));
+			VERIFY0(gnutls_priority_set(conn->session, prio_cache));
+			VERIFY0(gnutls_credentials_set(conn->session,
+			    GNUTLS_CRD_CERTIFICATE, x509_creds));
+			/* If client certs are required, request one. */
+			gnutls_certificate_server_set_request(conn->session,
+			    req_client_cert ? GNUTLS_CERT_REQUIRE :
+			    GNUTLS_CERT_IGNORE);
+			gnutls_handshake_set_timeout(conn->session,
+			    GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
+			VERIFY0(gnutls_session_ticket_enable_server(
+			    conn->session, &tls_ticket_key));
+			gnutls_transport_set_int(conn->session, conn->fd);
+		} else {
+			conn->tls_handshake_complete = true;
+		}
+		conn->fr = flightrec_alloc();
 
 		mutex_init(&conn->lock);
 		list_create(&conn->from_list, sizeof (ident_list_t),
@@ -1012,25 +1507,64 @@ handle_accepts(listen_sock_t *ls)
 	}
 }
 
+/*
+ * Looks up the list of ident_list_t's of all connections which have
+ * logged on with a particular identity. Returns NULL if there are none.
+ * Caller must hold `conns_by_from_lock'.
+ */
+static const list_t *
+conns_by_from_lookup(callsign_key_t key)
+{
+	ASSERT_MUTEX_HELD(&conns_by_from_lock);
+	return (cstbl_lookup(&conns_by_from, key));
+}
+
 static void
-conns_by_from_remove(conn_t *conn, const char ident[CALLSIGN_LEN])
+conns_by_from_add(ident_list_t *idl)
 {
-	const list_t *l;
+	list_t *l;
+
+	ASSERT(idl != NULL);
+	ASSERT(idl->conn != NULL);
+	ASSERT_MUTEX_HELD(&conns_by_from_lock);
+
+	l = cstbl_lookup(&conns_by_from, idl->key);
+	if (l == NULL) {
+		l = safe_malloc(sizeof (*l));
+		list_create(l, sizeof (ident_list_t),
+		    offsetof(ident_list_t, by_from_node));
+		cstbl_set(&conns_by_from, idl->key, l);
+		cluster_presence(idl->key, true);
+	}
+	list_insert_tail(l, idl);
+	conns_by_from_changed = true;
+	idl->logondir_slot = logondir_add(idl->ident, idl->conn->to,
+	    idl->conn->addr_str, idl->conn->is_atc, idl->conn->is_lws);
+}
+
+static void
+conns_by_from_remove(ident_list_t *idl)
+{
+	list_t *l;
+
+	ASSERT(idl != NULL);
 
 	mutex_enter(&conns_by_from_lock);
 
-	l = htbl_lookup_multi(&conns_by_from, ident);
+	l = cstbl_lookup(&conns_by_from, idl->key);
 	ASSERT(l != NULL);
-	for (void *mv = list_head(l); mv != NULL; mv = list_next(l, mv)) {
-		conn_t *c = HTBL_VALUE_MULTI(mv);
-
-		if (conn == c) {
-			logoff_hook(ident, c);
-			htbl_remove_multi(&conns_by_from, ident, mv);
-			conns_by_from_changed = true;
-			break;
-		}
+	if (!idl->conn->handed_off)
+		logoff_hook(idl->ident, idl->conn);
+	logondir_remove(idl->logondir_slot);
+	idl->logondir_slot = -1;
+	list_remove(l, idl);
+	if (list_count(l) == 0) {
+		VERIFY3P(cstbl_remove(&conns_by_from, idl->key), ==, l);
+		list_destroy(l);
+		free(l);
+		cluster_presence(idl->key, false);
 	}
+	conns_by_from_changed = true;
 
 	mutex_exit(&conns_by_from_lock);
 }
@@ -1053,7 +1587,7 @@ conn_reset_logon(conn_t *conn)
 	 * inserted in the conns_by_from hashtable.
 	 */
 	while ((idl = list_remove_head(&conn->from_list)) != NULL) {
-		conns_by_from_remove(conn, idl->ident);
+		conns_by_from_remove(idl);
 		free(idl);
 	}
 	/*
@@ -1076,6 +1610,21 @@ out:
 	mutex_exit(&conn->lock);
 }
 
+/*
+ * Marks a connection as having failed, so that close_conn dumps its
+ * flight recorder. `reason' must be a string constant.
+ */
+static void
+conn_failed(conn_t *conn, const char *reason)
+{
+	ASSERT(conn != NULL);
+	ASSERT(reason != NULL);
+
+	flightrec_event(conn->fr, FR_EV_ERROR, 0, 0);
+	if (conn->fail_reason == NULL)
+		conn->fail_reason = reason;
+}
+
 /*
  * Closes a network connection and kills all associated state with it.
  */
@@ -1085,6 +1634,23 @@ close_conn(conn_t *conn)
 	ASSERT(conn != NULL);
 	ASSERT_CONNS_MUTEX_HELD(conn);
 
+	/*
+	 * Failed connections which had logged on get their recent history
+	 * dumped. Connections which never got that far are most likely
+	 * just port scanners and the like, so they aren't worth the disk
+	 * space.
+	 */
+	if (conn->fail_reason != NULL && conn->fr != NULL) {
+		const ident_list_t *idl;
+
+		mutex_enter(&conn->lock);
+		idl = list_head(&conn->from_list);
+		if (idl != NULL) {
+			flightrec_dump(conn->fr, idl->ident, conn->addr_str,
+			    conn->fail_reason);
+		}
+		mutex_exit(&conn->lock);
+	}
 	/*
 	 * Must be done before unlinking the connection from any list,
 	 * because we can be called in the background to complete a logon.
@@ -1093,22 +1659,42 @@ close_conn(conn_t *conn)
 
 	if (conn->is_lws) {
 		list_remove(&conns_lws, conn);
+		if (list_link_active(&conn->lws_ready_node))
+			list_remove(&conns_lws_ready, conn);
+		mutex_enter(&conns_lws_wr_lock);
+		if (list_link_active(&conn->lws_wr_node))
+			list_remove(&conns_lws_wr, conn);
+		mutex_exit(&conns_lws_wr_lock);
 	} else {
 		list_remove(&conns_tcp, conn);
 		conns_tcp_dirty = true;
 	}
+	if (conn->in_paused)
+		list_remove(&paused_conns, conn);
+	if (conn->outbuf_sz != 0) {
+		size_t bytes = conn->outbuf_sz;
+
+		conn->outbuf_sz = 0;
+		/* discarded output doesn't count towards latency stats */
+		conn->num_out_marks = 0;
+		conn_outbuf_drained(conn, bytes);
+	}
+	free(conn->out_marks);
+	flightrec_free(conn->fr);
 
 	mutex_destroy(&conn->lock);
 	list_destroy(&conn->from_list);
 	free(conn->inbuf);
+	cpdlc_arena_free(conn->arena);
 	free(conn->outbuf);
 
 	if (!conn->is_lws) {
-		if (conn->tls_handshake_complete)
+		if (!conn->is_unix && conn->tls_handshake_complete)
 			gnutls_bye(conn->session, GNUTLS_SHUT_WR);
 		ASSERT(conn->fd != -1);
 		close(conn->fd);
-		gnutls_deinit(conn->session);
+		if (!conn->is_unix)
+			gnutls_deinit(conn->session);
 
 		memset(conn, 0, sizeof (*conn));
 		free(conn);
@@ -1175,12 +1761,13 @@ complete_logon(conn_t *conn)
 
 		lacf_strlcpy(conn->to, conn->logon_to, sizeof (conn->to));
 		lacf_strlcpy(idl->ident, conn->logon_from, sizeof (idl->ident));
+		idl->key = callsign_key(idl->ident);
+		idl->conn = conn;
 		list_insert_tail(&conn->from_list, idl);
 
 		mutex_enter(&conns_by_from_lock);
-		htbl_set(&conns_by_from, idl->ident, conn);
+		conns_by_from_add(idl);
 		logon_hook(idl->ident, conn);
-		conns_by_from_changed = true;
 		mutex_exit(&conns_by_from_lock);
 
 		cpdlc_msg_set_logon_data(msg, "SUCCESS");
@@ -1204,6 +1791,8 @@ complete_logon(conn_t *conn)
 	memset(conn->logon_to, 0, sizeof (conn->logon_to));
 	memset(conn->logon_from, 0, sizeof (conn->logon_from));
 
+	flightrec_event(conn->fr, FR_EV_LOGON,
+	    conn->logon_status == LOGON_COMPLETE, 0);
 	conn_send_msg(conn, msg);
 	cpdlc_msg_free(msg);
 
@@ -1235,12 +1824,15 @@ complete_logons(void)
 static void
 conn_remove_ident(conn_t *conn, const char *ident, bool missing_ok)
 {
+	callsign_key_t key;
+
 	ASSERT(conn != NULL);
 	ASSERT(ident != NULL);
+	key = callsign_key(ident);
 	for (ident_list_t *idl = list_head(&conn->from_list);
 	    idl != NULL; idl = list_next(&conn->from_list, idl)) {
-		if (strcmp(idl->ident, ident) == 0) {
-			conns_by_from_remove(conn, idl->ident);
+		if (idl->key == key) {
+			conns_by_from_remove(idl);
 			list_remove(&conn->from_list, idl);
 			free(idl);
 			return;
@@ -1304,9 +1896,10 @@ process_logon_msg(conn_t *conn, const cpdlc_msg_t *msg)
 	conn->logon_status = LOGON_STARTED;
 	conn->logon_min = cpdlc_msg_get_min(msg);
 
-	conn->fmt_plain = (cpdlc_msg_option_is_set(msg, "PLAIN") ||
-	    cpdlc_msg_options_count(msg) == 0);
 	conn->fmt_arinc622 = cpdlc_msg_option_is_set(msg, "ARINC622");
+	conn->fmt_plain = (cpdlc_msg_option_is_set(msg, "PLAIN") ||
+	    !conn->fmt_arinc622);
+	conn->srv_ts = cpdlc_msg_option_is_set(msg, "LATENCY");
 	/* This is async */
 	conn->auth_key = auth_sess_open(msg, conn->addr_str,
 	    logon_done_cb, conn);
@@ -1350,7 +1943,6 @@ static void
 conn_log_msg(const char *addr_str, const cpdlc_msg_t *msg, bool inout)
 {
 	char *buf;
-	int l;
 	cpdlc_msg_t *copymsg = NULL;
 
 	ASSERT(addr_str != NULL);
@@ -1363,11 +1955,13 @@ conn_log_msg(const char *addr_str, const cpdlc_msg_t *msg, bool inout)
 		copymsg = cpdlc_msg_copy(msg);
 		cpdlc_msg_set_logon_data(copymsg, "hidden");
 		msg = copymsg;
+	} else if (cpdlc_msg_is_frozen(msg)) {
+		conn_log_buf(addr_str, cpdlc_msg_encode_cached(msg,
+		    msg->fmt_plain, msg->fmt_arinc622, NULL), inout);
+		return;
 	}
 
-	l = cpdlc_msg_encode(msg, NULL, 0);
-	buf = safe_malloc(l + 1);
-	cpdlc_msg_encode(msg, buf, l + 1);
+	buf = cpdlc_msg_encode_alloc(msg, NULL);
 	conn_log_buf(addr_str, buf, inout);
 	free(buf);
 
@@ -1376,65 +1970,452 @@ conn_log_msg(const char *addr_str, const cpdlc_msg_t *msg, bool inout)
 }
 
 /*
- * Prepares a new buffer for transmission to a particular connection.
- * The buffer is queued on the connections `outbuf'. This is later
- * processed by the master output functions.
+ * Accounts for `bytes' having been removed from a connection's `outbuf'
+ * (`outbuf_sz' must already have been adjusted). Once the connection has
+ * drained down to the low watermark, it stops being congested. Messages
+ * which have been sent out completely are accounted in the per-priority
+ * latency stats. Caller must hold the connection's `lock', or otherwise
+ * be its sole user.
  */
 static void
-conn_send_buf(conn_t *conn, const char *buf, size_t buflen)
+conn_outbuf_drained(conn_t *conn, size_t bytes)
 {
-	ASSERT(conn != NULL);
-	ASSERT(buf != NULL);
-	ASSERT(buflen != 0);
+	uint64_t now = latency_now();
+	unsigned n = 0;
+	size_t start;
 
-	mutex_enter(&conn->lock);
+	ASSERT(conn != NULL);
 
-	conn->outbuf = safe_realloc(conn->outbuf, conn->outbuf_pre_pad +
-	    conn->outbuf_sz + buflen + 1);
-	lacf_strlcpy((char *)&conn->outbuf[conn->outbuf_pre_pad +
-	    conn->outbuf_sz], buf, buflen + 1);
-	/* Exclude training NUL char */
-	conn->outbuf_sz += buflen;
-	if (conn->is_lws) {
-		ASSERT(conn->wsi != NULL);
-		lws_callback_on_writable(conn->wsi);
+	mutex_enter(&out_lock);
+	ASSERT3U(out_stats.pending, >=, bytes);
+	out_stats.pending -= bytes;
+	for (; n < conn->num_out_marks && conn->out_marks[n].end <= bytes;
+	    n++) {
+		const out_mark_t *mark = &conn->out_marks[n];
+		uint64_t lat = (now > mark->queued ? now - mark->queued : 0);
+
+		latency_record(LAT_HOP_OUTPUT, mark->queued, now);
+		flightrec_event(conn->fr, FR_EV_SENT_MSG, mark->prio, lat);
+		if (mark->rx != 0)
+			latency_record(LAT_HOP_SERVER, mark->rx, now);
+		out_stats.prio[mark->prio].msgs++;
+		out_stats.prio[mark->prio].lat_sum += lat;
+		out_stats.prio[mark->prio].lat_max =
+		    MAX(out_stats.prio[mark->prio].lat_max, lat);
+	}
+	/* where the first remaining message used to start */
+	start = (n != 0 ? conn->out_marks[n - 1].end : 0);
+	if (n != 0) {
+		conn->num_out_marks -= n;
+		memmove(conn->out_marks, &conn->out_marks[n],
+		    conn->num_out_marks * sizeof (*conn->out_marks));
+	}
+	for (unsigned i = 0; i < conn->num_out_marks; i++) {
+		ASSERT3U(conn->out_marks[i].end, >, bytes);
+		conn->out_marks[i].end -= bytes;
+	}
+	/*
+	 * If we have stopped in the middle of a message, the rest of it
+	 * must go out before anything else.
+	 */
+	if (conn->num_out_marks != 0 && bytes > start)
+		conn->outbuf_fixed = conn->out_marks[0].end;
+	else
+		conn->outbuf_fixed = 0;
+	if (conn->out_congested && conn->outbuf_sz <= out_low_water) {
+		conn->out_congested = false;
+		ASSERT(out_stats.congested != 0);
+		out_stats.congested--;
+	}
+	mutex_exit(&out_lock);
+}
+
+/*
+ * Checks if `bytes' more output can be queued on a connection, and if
+ * so, accounts for them. Connections crossing the high watermark (or the
+ * global output budget) become congested here. Priority messages are
+ * small and rare, so they are always accepted.
+ *
+ * @return True if the output can be queued, false if it must not be
+ *	and the caller needs to apply `out_action'.
+ */
+static bool
+conn_out_reserve(conn_t *conn, size_t bytes, cpdlc_prio_t prio)
+{
+	bool over_budget, accept;
+
+	ASSERT(conn != NULL);
+	ASSERT_MUTEX_HELD(&conn->lock);
+
+	mutex_enter(&out_lock);
+	over_budget = (out_max_total != 0 &&
+	    out_stats.pending + bytes > out_max_total);
+	if (!conn->out_congested && (over_budget || (out_high_water != 0 &&
+	    conn->outbuf_sz + bytes > out_high_water))) {
+		conn->out_congested = true;
+		out_stats.congested++;
+		out_stats.congest_events++;
+	}
+	/*
+	 * In pause mode, we stop the producers instead of refusing output,
+	 * so a congested connection keeps accepting output that's already
+	 * in flight. The global budget is a hard limit, however.
+	 */
+	accept = (!conn->out_congested || prio != CPDLC_PRIO_NORMAL ||
+	    (out_action == OUT_ACTION_PAUSE && !over_budget));
+	if (accept) {
+		out_stats.pending += bytes;
+		out_stats.peak = MAX(out_stats.peak, out_stats.pending);
+	} else {
+		out_stats.deferred++;
+	}
+	mutex_exit(&out_lock);
+
+	return (accept);
+}
+
+/*
+ * Returns true if any connection logged on as `key' is congested (see
+ * `out_high_water').
+ */
+static bool
+ident_congested(callsign_key_t key)
+{
+	const list_t *l;
+	bool congested = false;
+
+	mutex_enter(&conns_by_from_lock);
+	l = conns_by_from_lookup(key);
+	if (l != NULL) {
+		mutex_enter(&out_lock);
+		for (const ident_list_t *idl = list_head(l);
+		    idl != NULL && !congested; idl = list_next(l, idl)) {
+			congested = idl->conn->out_congested;
+		}
+		mutex_exit(&out_lock);
+	}
+	mutex_exit(&conns_by_from_lock);
+
+	return (congested);
+}
+
+/*
+ * Inserts an encoded message into a connection's `outbuf'. Normal
+ * messages are simply appended. Priority messages are placed ahead of
+ * all queued messages of a lower priority class, except for any data
+ * which must be sent out first (see `outbuf_fixed').
+ */
+static void
+conn_outbuf_insert(conn_t *conn, const char *buf, size_t buflen,
+    cpdlc_prio_t prio, uint64_t rx)
+{
+	size_t off = conn->outbuf_sz, start = 0;
+	unsigned idx = conn->num_out_marks;
+	uint8_t *p;
+
+	ASSERT_MUTEX_HELD(&conn->lock);
+
+	if (prio != CPDLC_PRIO_NORMAL) {
+		for (unsigned i = 0; i < conn->num_out_marks; i++) {
+			if (start >= conn->outbuf_fixed &&
+			    conn->out_marks[i].prio < prio) {
+				idx = i;
+				off = start;
+				break;
+			}
+			start = conn->out_marks[i].end;
+		}
+	}
+	conn->outbuf = safe_realloc(conn->outbuf, conn->outbuf_pre_pad +
+	    conn->outbuf_sz + buflen + 1);
+	p = &conn->outbuf[conn->outbuf_pre_pad];
+	/* Also moves the trailing NUL char */
+	memmove(&p[off + buflen], &p[off], (conn->outbuf_sz - off) + 1);
+	memcpy(&p[off], buf, buflen);
+	conn->outbuf_sz += buflen;
+	conn->outbuf_msgs++;
+
+	conn->out_marks = safe_realloc(conn->out_marks,
+	    (conn->num_out_marks + 1) * sizeof (*conn->out_marks));
+	memmove(&conn->out_marks[idx + 1], &conn->out_marks[idx],
+	    (conn->num_out_marks - idx) * sizeof (*conn->out_marks));
+	conn->num_out_marks++;
+	conn->out_marks[idx].end = off + buflen;
+	conn->out_marks[idx].queued = latency_now();
+	conn->out_marks[idx].rx = rx;
+	conn->out_marks[idx].prio = prio;
+	for (unsigned i = idx + 1; i < conn->num_out_marks; i++)
+		conn->out_marks[i].end += buflen;
+}
+
+/*
+ * Prepares a new buffer for transmission to a particular connection.
+ * The buffer is queued on the connections `outbuf'. This is later
+ * processed by the master output functions. Messages of a priority
+ * class other than CPDLC_PRIO_NORMAL skip ahead of normal traffic.
+ * `rx' is the time the message was received by us (see latency_now),
+ * or 0 if unknown.
+ *
+ * @return True if the buffer has been queued. False if the connection
+ *	is congested and the buffer was refused (see `out_action'). The
+ *	caller can then try to queue the message for later delivery.
+ */
+static bool
+conn_send_buf(conn_t *conn, const char *buf, size_t buflen, cpdlc_prio_t prio,
+    uint64_t rx)
+{
+	ASSERT(conn != NULL);
+	ASSERT(buf != NULL);
+	ASSERT(buflen != 0);
+
+	mutex_enter(&conn->lock);
+
+	if (conn->out_dropped) {
+		mutex_exit(&conn->lock);
+		return (false);
+	}
+	if (!conn_out_reserve(conn, buflen, prio)) {
+		flightrec_event(conn->fr, FR_EV_REFUSED, 0, buflen);
+		if (out_action == OUT_ACTION_DROP) {
+			logMsg("Output on connection from %s is congested "
+			    "(%ld bytes pending), closing connection",
+			    conn->addr_str, (long)conn->outbuf_sz);
+			conn->out_dropped = true;
+			conn_failed(conn, "output congested");
+			mutex_enter(&out_lock);
+			out_stats.dropped++;
+			mutex_exit(&out_lock);
+			/* close_timedout_conns does the actual closing */
+			if (!is_main_thread)
+				wake_up_main_thread();
+		}
+		mutex_exit(&conn->lock);
+		return (false);
+	}
+
+	conn_outbuf_insert(conn, buf, buflen, prio, rx);
+	flightrec_event(conn->fr, FR_EV_ENQUEUE, prio, buflen);
+	if (conn->is_lws) {
+		ASSERT(conn->wsi != NULL);
+		if (is_main_thread && lws_coalesce_us == 0) {
+			lws_callback_on_writable(conn->wsi);
+		} else {
+			bool wakeup = false;
+
+			mutex_enter(&conns_lws_wr_lock);
+			if (!list_link_active(&conn->lws_wr_node)) {
+				/*
+				 * The main thread only needs to be woken up
+				 * if this sets an earlier deadline than what
+				 * it's currently waiting for.
+				 */
+				wakeup = (list_head(&conns_lws_wr) == NULL);
+				conn->lws_wr_deadline = microclock() +
+				    lws_coalesce_us;
+				list_insert_tail(&conns_lws_wr, conn);
+			}
+			/* priority messages aren't held back either */
+			if ((conn->outbuf_sz >= LWS_COALESCE_MAX_BYTES ||
+			    prio != CPDLC_PRIO_NORMAL) &&
+			    conn->lws_wr_deadline != 0) {
+				conn->lws_wr_deadline = 0;
+				wakeup = true;
+			}
+			mutex_exit(&conns_lws_wr_lock);
+			if (wakeup && !is_main_thread)
+				wake_up_main_thread();
+		}
 	}
 
 	mutex_exit(&conn->lock);
+
+	return (true);
+}
+
+static mcast_enc_t *
+mcast_enc_alloc(unsigned refcnt)
+{
+	mcast_enc_t *enc = safe_calloc(1, sizeof (*enc));
+
+	ASSERT(refcnt != 0);
+	mutex_init(&enc->lock);
+	enc->refcnt = refcnt;
+
+	return (enc);
+}
+
+static void
+mcast_enc_rele(mcast_enc_t *enc)
+{
+	unsigned refcnt;
+
+	ASSERT(enc != NULL);
+
+	mutex_enter(&enc->lock);
+	ASSERT(enc->refcnt != 0);
+	refcnt = --enc->refcnt;
+	mutex_exit(&enc->lock);
+	if (refcnt == 0) {
+		mutex_destroy(&enc->lock);
+		free(enc->buf);
+		free(enc);
+	}
+}
+
+/*
+ * Checks if a message going out in the given format can use the shared
+ * encoding of a multicast message (see mcast_enc_t).
+ */
+static inline bool
+mcast_enc_usable(const mcast_enc_t *enc, bool fmt_plain, bool fmt_arinc622,
+    bool srv_ts)
+{
+	return (enc != NULL && fmt_plain && !fmt_arinc622 && !srv_ts);
+}
+
+/*
+ * Produces the plain text encoding of `msg', which must be one of the
+ * recipient copies of a multicast message, from the shared encoding.
+ * The message is encoded on the first call, all subsequent calls only
+ * splice in the recipient's TO= header.
+ *
+ * @return A malloc'd buffer, with its length (sans NUL) in `len_p'.
+ */
+static char *
+mcast_enc_get(mcast_enc_t *enc, const cpdlc_msg_t *msg, unsigned *len_p)
+{
+	char to_hdr[8 + 4 * CALLSIGN_LEN];
+	unsigned to_len = 0;
+	char *buf;
+
+	ASSERT(enc != NULL);
+	ASSERT(msg != NULL);
+	ASSERT(len_p != NULL);
+
+	if (cpdlc_msg_get_to(msg)[0] != '\0') {
+		char textbuf[4 * CALLSIGN_LEN];
+
+		cpdlc_escape_percent(cpdlc_msg_get_to(msg), textbuf,
+		    sizeof (textbuf));
+		to_len = snprintf(to_hdr, sizeof (to_hdr), "/TO=%s", textbuf);
+		ASSERT3U(to_len, <, sizeof (to_hdr));
+	}
+	mutex_enter(&enc->lock);
+	if (enc->buf == NULL) {
+		cpdlc_msg_t *tmpl = cpdlc_msg_copy(msg);
+		const char *min;
+
+		tmpl->fmt_plain = true;
+		tmpl->fmt_arinc622 = false;
+		cpdlc_msg_set_to(tmpl, "");
+		cpdlc_msg_set_srv_ts(tmpl, 0, 0);
+		enc->buf = cpdlc_msg_encode_alloc(tmpl, &enc->len);
+		cpdlc_msg_free(tmpl);
+		/*
+		 * cpdlc_msg_encode emits the TO= header right in front of
+		 * the MIN= header, which is always present.
+		 */
+		min = strstr(enc->buf, "/MIN=");
+		VERIFY(min != NULL);
+		enc->to_off = min - enc->buf;
+	}
+	buf = safe_malloc(enc->len + to_len + 1);
+	memcpy(buf, enc->buf, enc->to_off);
+	memcpy(&buf[enc->to_off], to_hdr, to_len);
+	memcpy(&buf[enc->to_off + to_len], &enc->buf[enc->to_off],
+	    enc->len - enc->to_off + 1);
+	*len_p = enc->len + to_len;
+	mutex_exit(&enc->lock);
+
+	return (buf);
+}
+
+/*
+ * Encodes a message in its own format, using the shared encoding of a
+ * multicast message, or the message's cached encoding if it is frozen.
+ * `enc' can be NULL.
+ *
+ * @return A malloc'd buffer, with its length (sans NUL) in `len_p'.
+ */
+static char *
+msg_encode(const cpdlc_msg_t *msg, mcast_enc_t *enc, unsigned *len_p)
+{
+	ASSERT(msg != NULL);
+	ASSERT(len_p != NULL);
+
+	if (mcast_enc_usable(enc, msg->fmt_plain, msg->fmt_arinc622,
+	    msg->srv_ts.rx != 0 && msg->srv_ts.tx != 0)) {
+		return (mcast_enc_get(enc, msg, len_p));
+	}
+	if (cpdlc_msg_is_frozen(msg)) {
+		const char *cached = cpdlc_msg_encode_cached(msg,
+		    msg->fmt_plain, msg->fmt_arinc622, len_p);
+		char *buf = safe_malloc(*len_p + 1);
+
+		memcpy(buf, cached, *len_p + 1);
+		return (buf);
+	}
+	return (cpdlc_msg_encode_alloc(msg, len_p));
 }
 
 /*
  * Takes a message, encodes it into a sendable format and schedules it for
  * sending to a client. The caller retains ownership of the `msg' object.
+ * If the message is one of the copies of a multicast message, `enc' is
+ * its shared encoding (see mcast_enc_t), otherwise NULL.
+ * Returns false if the connection was congested (see conn_send_buf).
  */
-static void
-conn_send_msg(conn_t *conn, const cpdlc_msg_t *msg_in)
+static bool
+conn_send_msg_enc(conn_t *conn, const cpdlc_msg_t *msg_in, mcast_enc_t *enc)
 {
 	unsigned l;
-	char *buf;
-	cpdlc_msg_t *msg;
-	bool is_end_svc = false;
+	char *buf = NULL;
+	const char *out;
+	bool is_end_svc = false, sent;
 
 	ASSERT(conn != NULL);
 	ASSERT(msg_in != NULL);
-	msg = cpdlc_msg_copy(msg_in);
 
-	for (unsigned i = 0, n = msg->num_segs; i < n; i++) {
-		ASSERT(msg->segs[i].info != NULL);
-		if (!msg->segs[i].info->is_dl &&
-		    msg->segs[i].info->msg_type == CPDLC_UM161_END_SVC) {
+	for (unsigned i = 0, n = msg_in->num_segs; i < n; i++) {
+		ASSERT(msg_in->segs[i].info != NULL);
+		if (!msg_in->segs[i].info->is_dl &&
+		    msg_in->segs[i].info->msg_type == CPDLC_UM161_END_SVC) {
 			is_end_svc = true;
 		}
 	}
 
-	msg->fmt_plain = conn->fmt_plain;
-	msg->fmt_arinc622 = conn->fmt_arinc622;
+	if (mcast_enc_usable(enc, conn->fmt_plain, conn->fmt_arinc622,
+	    conn->srv_ts)) {
+		buf = mcast_enc_get(enc, msg_in, &l);
+		out = buf;
+	} else if (cpdlc_msg_is_frozen(msg_in) && (msg_in->srv_ts.rx == 0 ||
+	    (!conn->srv_ts && msg_in->srv_ts.tx == 0))) {
+		/*
+		 * Without a per-connection SRVTS= header, the message's
+		 * cached encoding in the connection's format is exactly
+		 * what a copy of it would encode to. This saves copying
+		 * and encoding the message for every recipient connection.
+		 */
+		out = cpdlc_msg_encode_cached(msg_in, conn->fmt_plain,
+		    conn->fmt_arinc622, &l);
+	} else {
+		cpdlc_msg_t *msg = cpdlc_msg_copy(msg_in);
 
-	l = cpdlc_msg_encode(msg, NULL, 0);
-	buf = safe_malloc(l + 1);
-	cpdlc_msg_encode(msg, buf, l + 1);
-	conn_log_buf(conn->addr_str, buf, false);
-	conn_send_buf(conn, buf, l);
+		msg->fmt_plain = conn->fmt_plain;
+		msg->fmt_arinc622 = conn->fmt_arinc622;
+		/*
+		 * The SRVTS= header is only sent to clients which have
+		 * asked for it, as others might not understand it.
+		 */
+		cpdlc_msg_set_srv_ts(msg, msg->srv_ts.rx,
+		    conn->srv_ts && msg->srv_ts.rx != 0 ? latency_now() : 0);
+		buf = msg_encode(msg, NULL, &l);
+		cpdlc_msg_free(msg);
+		out = buf;
+	}
+	conn_log_buf(conn->addr_str, out, false);
+	sent = conn_send_buf(conn, out, l, cpdlc_msg_get_prio(msg_in),
+	    msg_in->srv_ts.rx);
 	free(buf);
 	/*
 	 * Check if the message being sent is a service termination.
@@ -1444,7 +2425,14 @@ conn_send_msg(conn_t *conn, const cpdlc_msg_t *msg_in)
 		conn_reset_logon(conn);
 		conn->logoff_time = time(NULL);
 	}
-	cpdlc_msg_free(msg);
+
+	return (sent);
+}
+
+static bool
+conn_send_msg(conn_t *conn, const cpdlc_msg_t *msg)
+{
+	return (conn_send_msg_enc(conn, msg, NULL));
 }
 
 /*
@@ -1511,15 +2499,13 @@ send_error_msg_to(const char *to, const cpdlc_msg_t *orig_msg,
 	ASSERT(orig_msg != NULL);
 
 	mutex_enter(&conns_by_from_lock);
-	l = htbl_lookup_multi(&conns_by_from, to);
-	if (l != NULL && list_count(l) != 0) {
-		for (void *mv = list_head(l), *mv_next = NULL; mv != NULL;
-		    mv = mv_next) {
-			conn_t *conn = HTBL_VALUE_MULTI(mv);
-
-			mv_next = list_next(l, mv);
-			ASSERT(conn != NULL);
-			send_error_msg(conn, orig_msg, errinfo, NULL);
+	l = conns_by_from_lookup(callsign_key(to));
+	if (l != NULL) {
+		for (ident_list_t *idl = list_head(l), *idl_next = NULL;
+		    idl != NULL; idl = idl_next) {
+			idl_next = list_next(l, idl);
+			ASSERT(idl->conn != NULL);
+			send_error_msg(idl->conn, orig_msg, errinfo, NULL);
 		}
 	}
 	mutex_exit(&conns_by_from_lock);
@@ -1542,6 +2528,66 @@ send_svc_unavail_msg(conn_t *conn, unsigned orig_min)
 	cpdlc_msg_free(msg);
 }
 
+/*
+ * Sends a queued message to another instance over a handoff connection.
+ */
+static bool
+handoff_send_qmsg(int sock, callsign_key_t from, callsign_key_t to,
+    bool is_atc, time_t created, const char *msg)
+{
+	size_t len = strlen(msg);
+	handoff_qmsg_t *hq;
+	bool res;
+
+	if (sizeof (*hq) + len > HANDOFF_MAX_REC_LEN) {
+		logMsg("Message too long for handoff (%d bytes)", (int)len);
+		return (false);
+	}
+	hq = safe_malloc(sizeof (*hq) + len);
+	hq->from = from;
+	hq->to = to;
+	hq->created = created;
+	hq->is_atc = is_atc;
+	memcpy(hq->msg, msg, len);
+	res = handoff_send(sock, HANDOFF_QUEUED_MSG, hq, sizeof (*hq) + len,
+	    -1);
+	free(hq);
+
+	return (res);
+}
+
+/*
+ * Adds a message to `queued_msgs'. Priority messages are kept in arrival
+ * order at the head of the queue, ahead of all normal messages.
+ */
+static void
+queue_msg(queued_msg_t *qmsg)
+{
+	ASSERT(qmsg != NULL);
+
+	if (qmsg->prio == CPDLC_PRIO_NORMAL) {
+		list_insert_tail(&queued_msgs, qmsg);
+		return;
+	}
+	if (queued_msgs_prio_last != NULL) {
+		list_insert_after(&queued_msgs, queued_msgs_prio_last, qmsg);
+	} else {
+		list_insert_head(&queued_msgs, qmsg);
+	}
+	queued_msgs_prio_last = qmsg;
+}
+
+/*
+ * Returns true if another `bytes' bytes don't fit into the global message
+ * queue anymore.
+ */
+static bool
+queue_is_full(uint64_t bytes)
+{
+	return (queued_msg_max_bytes != 0 &&
+	    queued_msg_bytes + bytes > queued_msg_max_bytes);
+}
+
 /*
  * Stores a message for later delivery. The message is accounted for
  * in the global memory and individual message quota trackers.
@@ -1553,15 +2599,23 @@ send_svc_unavail_msg(conn_t *conn, unsigned orig_min)
  *	aircraft station. ATC stations do not have individual quota
  *	applied to their stored messages.
  *
+ * @param enc Shared encoding if `msg' is a copy of a multicast message
+ *	(see mcast_enc_t), otherwise NULL.
+ *
+ * While draining after having handed off to a new instance, the message
+ * is forwarded to the new instance instead. Caller must hold
+ * `conns_by_from_lock'.
+ *
  * @return True if the message was stored for later delivery. False
  *	if storing the message couldn't be performed. This can only
  *	happen when either the global message queue has run out of
  *	space, or if the sender's quota has been exhausted.
  */
 static bool
-store_msg(const cpdlc_msg_t *msg, const char *to, bool is_atc)
+store_msg(const cpdlc_msg_t *msg, const char *to, bool is_atc,
+    mcast_enc_t *enc)
 {
-	uint64_t bytes = cpdlc_msg_encode(msg, NULL, 0);
+	unsigned bytes;
 	queued_msg_t *qmsg;
 	char *buf;
 
@@ -1569,28 +2623,43 @@ store_msg(const cpdlc_msg_t *msg, const char *to, bool is_atc)
 	ASSERT(to != NULL);
 	ASSERT(cpdlc_msg_get_from(msg) != NULL);
 
-	if (queued_msg_max_bytes != 0 &&
-	    queued_msg_bytes + bytes > queued_msg_max_bytes) {
+	buf = msg_encode(msg, enc, &bytes);
+	if (draining && handoff_peer_fd != -1) {
+		/*
+		 * We're on our way out, so let the new instance deliver
+		 * the message. If that fails, we fall back to storing it.
+		 */
+		if (handoff_send_qmsg(handoff_peer_fd,
+		    callsign_key(cpdlc_msg_get_from(msg)), callsign_key(to),
+		    is_atc, time(NULL), buf)) {
+			free(buf);
+			return (true);
+		}
+		close(handoff_peer_fd);
+		handoff_peer_fd = -1;
+	}
+	if (queue_is_full(bytes)) {
 		logMsg("Cannot queue message from %s, global message queue "
 		    "is completely out of space (%lld bytes)",
 		    cpdlc_msg_get_from(msg), (long long)queued_msg_max_bytes);
+		free(buf);
 		return (false);
 	}
-	if (!is_atc && !msgquota_incr(cpdlc_msg_get_from(msg), bytes))
+	if (!is_atc &&
+	    !msgquota_incr(callsign_key(cpdlc_msg_get_from(msg)), bytes)) {
+		free(buf);
 		return (false);
+	}
 
 	qmsg = safe_calloc(1, sizeof (*qmsg));
-	buf = safe_malloc(bytes + 1);
-
-	cpdlc_msg_encode(msg, buf, bytes + 1);
-
 	qmsg->msg = buf;
 	qmsg->created = time(NULL);
 	qmsg->is_atc = is_atc;
-	lacf_strlcpy(qmsg->from, cpdlc_msg_get_from(msg), sizeof (qmsg->from));
-	lacf_strlcpy(qmsg->to, to, sizeof (qmsg->to));
+	qmsg->from = callsign_key(cpdlc_msg_get_from(msg));
+	qmsg->to = callsign_key(to);
+	qmsg->prio = cpdlc_msg_get_prio(msg);
 
-	list_insert_tail(&queued_msgs, qmsg);
+	queue_msg(qmsg);
 	queued_msg_bytes += bytes;
 
 	return (true);
@@ -1626,14 +2695,15 @@ msg_auto_assign_from(cpdlc_msg_t *msg)
 
 	mutex_enter(&conns_by_from_lock);
 
-	l = htbl_lookup_multi(&conns_by_from, cpdlc_msg_get_to(msg));
-	if (l != NULL && list_count(l) != 0) {
+	l = conns_by_from_lookup(callsign_key(cpdlc_msg_get_to(msg)));
+	if (l != NULL) {
 		/*
 		 * Pick the last connection, since that's the most likely
 		 * one to be the current one. The earlier ones could be
 		 * stale connections.
 		 */
-		acft_conn = HTBL_VALUE_MULTI(list_tail(l));
+		ident_list_t *idl = list_tail(l);
+		acft_conn = idl->conn;
 		if (acft_conn != NULL) {
 			cpdlc_msg_set_from(msg, acft_conn->to);
 			mutex_exit(&conns_by_from_lock);
@@ -1646,42 +2716,74 @@ msg_auto_assign_from(cpdlc_msg_t *msg)
 	return (false);
 }
 
+/*
+ * Delivers a message once the router has decided who to send it to.
+ * If the message is a copy of a multicast message, `userinfo' is its
+ * shared encoding (see forward_msg_mcast), otherwise NULL.
+ */
 static void
 forward_msg_cb(const cpdlc_msg_t *msg, const char *addr_str, void *userinfo)
 {
 	const char *to;
 	const list_t *l;
+	callsign_key_t key;
+	cluster_nodes_t nodes;
+	bool sent = false;
+	mcast_enc_t *enc = userinfo;
 
 	ASSERT(msg != NULL);
 	to = cpdlc_msg_get_to(msg);
 	ASSERT(addr_str != NULL);
-	UNUSED(userinfo);
 
 	conn_log_msg(addr_str, msg, true);
+	if (msg->srv_ts.rx != 0)
+		latency_record(LAT_HOP_ROUTE, msg->srv_ts.rx, latency_now());
+	key = callsign_key(to);
 	/*
 	 * If there is at least one connection matching the identity of
 	 * the intended recipient, forward the message without storing it.
-	 * Otherwise, we store it for later delivery as soon as the
-	 * recipient becomes available, or until the message expires.
+	 * In cluster mode, the recipient can also be logged on to other
+	 * nodes, which then deliver the message to it. Otherwise, we
+	 * store it for later delivery as soon as the recipient becomes
+	 * available, or until the message expires. In cluster mode, the
+	 * message is stored on the recipient's home node instead. If the
+	 * recipient is connected, but congested, it is stored right here.
 	 */
 	mutex_enter(&conns_by_from_lock);
-	l = htbl_lookup_multi(&conns_by_from, to);
-	if (l != NULL && list_count(l) != 0) {
-		for (void *mv = list_head(l), *mv_next = NULL; mv != NULL;
-		    mv = mv_next) {
-			conn_t *tgt_conn = HTBL_VALUE_MULTI(mv);
-
-			mv_next = list_next(l, mv);
-			ASSERT(tgt_conn != NULL);
-			conn_send_msg(tgt_conn, msg);
+	l = conns_by_from_lookup(key);
+	if (l != NULL) {
+		for (ident_list_t *idl = list_head(l), *idl_next = NULL;
+		    idl != NULL; idl = idl_next) {
+			idl_next = list_next(l, idl);
+			ASSERT(idl->conn != NULL);
+			sent |= conn_send_msg_enc(idl->conn, msg, enc);
 		}
-	} else {
-		if (!store_msg(msg, to, false)) {
-			send_error_msg_to(cpdlc_msg_get_from(msg), msg,
-			    CPDLC_ERRINFO_INSUFF_MSG_STORAGE);
+	}
+	nodes = cluster_lookup(key);
+	if (nodes != 0 || (l == NULL && cluster_home(key) != CLUSTER_NO_NODE)) {
+		unsigned len;
+		char *buf = msg_encode(msg, enc, &len);
+		int home;
+
+		if (nodes != 0) {
+			sent |= (cluster_send_msg(nodes, to,
+			    msg->segs[0].info->is_dl, buf) != 0);
 		}
+		if (!sent && l == NULL &&
+		    (home = cluster_home(key)) != CLUSTER_NO_NODE) {
+			sent = cluster_send_qmsg(home,
+			    callsign_key(cpdlc_msg_get_from(msg)), key,
+			    msg->segs[0].info->is_dl, time(NULL), buf);
+		}
+		free(buf);
+	}
+	if (!sent && !store_msg(msg, to, false, enc)) {
+		send_error_msg_to(cpdlc_msg_get_from(msg), msg,
+		    CPDLC_ERRINFO_INSUFF_MSG_STORAGE);
 	}
 	mutex_exit(&conns_by_from_lock);
+	if (enc != NULL)
+		mcast_enc_rele(enc);
 }
 
 static void
@@ -1689,73 +2791,220 @@ discard_msg_cb(const cpdlc_msg_t *msg, const char *addr_str, void *userinfo)
 {
 	ASSERT(msg != NULL);
 	ASSERT(addr_str != NULL);
-	UNUSED(userinfo);
 	/* Only log the message for tracking purposes */
 	conn_log_msg(addr_str, msg, true);
+	if (userinfo != NULL)
+		mcast_enc_rele(userinfo);
 }
 
+/*
+ * Stamps a message with its sender connection. No matter what FROM=
+ * header the client provided, this overrides it. On ATC connections,
+ * we allow other IDs.
+ */
 static void
-forward_msg(conn_t *conn, cpdlc_msg_t *msg, char to[CALLSIGN_LEN])
+msg_stamp_from(const conn_t *conn, cpdlc_msg_t *msg)
 {
-	ASSERT(conn != NULL);
-	ASSERT(msg != NULL);
-	/*
-	 * Stamp the message with its sender connection. No matter what
-	 * FROM= header the client provided, this overrides it. On ATC
-	 * connections, we allow other IDs.
-	 */
 	ASSERT(list_count(&conn->from_list) != 0);
 	if (cpdlc_msg_get_from(msg)[0] == '\0' || !conn->is_atc) {
-		ident_list_t *idl = list_head(&conn->from_list);
+		const ident_list_t *idl = list_head(&conn->from_list);
 		cpdlc_msg_set_from(msg, idl->ident);
 	}
+}
+
+static void
+forward_msg(conn_t *conn, cpdlc_msg_t *msg, char to[CALLSIGN_LEN])
+{
+	ASSERT(conn != NULL);
+	ASSERT(msg != NULL);
+	msg_stamp_from(conn, msg);
+	flightrec_event(conn->fr, FR_EV_FORWARD, cpdlc_msg_get_min(msg),
+	    callsign_key(to));
 	msg_router(conn->addr_str, conn->is_atc, conn->is_lws, msg, to,
 	    forward_msg_cb, discard_msg_cb, NULL);
 }
 
 /*
- * Handles an incoming message from a connection. This performs all
- * necessary permissions checks, logon hooks and message forwarding.
- *
- * @param conn The connection which received the message.
- * @param msg The message to process. The message is consumed by this
- *	function (either storing it, or freeing it), so the caller
- *	relinquishes control of the object.
+ * Forwards a message with a multi-recipient TO= header. Every recipient
+ * gets its own copy of the message, which is routed & delivered (or
+ * stored for later delivery) just like any other message, but they all
+ * share a single encoding of the message (see mcast_enc_t). The caller
+ * retains ownership of `msg'.
  */
 static void
-conn_process_msg(conn_t *conn, cpdlc_msg_t *msg)
+forward_msg_mcast(conn_t *conn, cpdlc_msg_t *msg)
 {
-	char to[CALLSIGN_LEN] = { 0 };
+	unsigned n;
+	mcast_enc_t *enc;
 
 	ASSERT(conn != NULL);
 	ASSERT(msg != NULL);
-	ASSERT_CONNS_MUTEX_HELD(conn);
+	n = cpdlc_msg_get_to_list_len(msg);
+	ASSERT(n != 0);
+
+	msg_stamp_from(conn, msg);
+	enc = mcast_enc_alloc(n);
+	for (unsigned i = 0; i < n; i++) {
+		const char *to = cpdlc_msg_get_to_list(msg, i);
+		cpdlc_msg_t *copy = cpdlc_msg_copy(msg);
+
+		cpdlc_msg_set_to(copy, to);
+		flightrec_event(conn->fr, FR_EV_FORWARD,
+		    cpdlc_msg_get_min(msg), callsign_key(to));
+		/* consumes `copy' and, eventually, a reference to `enc' */
+		msg_router(conn->addr_str, conn->is_atc, conn->is_lws, copy,
+		    to, forward_msg_cb, discard_msg_cb, enc);
+	}
+}
 
-	/*
-	 * If the user isn't logged on, don't allow anything other than
-	 * LOGON through.
-	 */
-	mutex_enter(&conn->lock);
-	if (conn->logon_status != LOGON_COMPLETE && !msg->is_logon) {
-		mutex_exit(&conn->lock);
-		if (!msg->is_logoff) {
-			send_error_msg(conn, msg, CPDLC_ERRINFO_APP_ERROR,
-			    NULL);
-		}
-		cpdlc_msg_free(msg);
+/*
+ * Stops processing input from a connection until resume_paused_conns
+ * decides that it can go on. TCP connections are left to fill up their
+ * TCP window, for LWS connections we ask LWS to stop receiving.
+ */
+static void
+conn_pause(conn_t *conn)
+{
+	ASSERT(conn != NULL);
+	ASSERT(is_main_thread);
+
+	if (conn->in_paused)
 		return;
-	}
-	mutex_exit(&conn->lock);
+	conn->in_paused = true;
+	list_insert_tail(&paused_conns, conn);
+	flightrec_event(conn->fr, FR_EV_PAUSE, 0, 0);
+	if (conn->is_lws)
+		lws_rx_flow_control(conn->wsi, 0);
+}
 
-	if (msg->is_logon || msg->is_logoff) {
-		/* Logon messages do not get forwarded. */
-		conn_log_msg(conn->addr_str, msg, true);
-		process_logon_msg(conn, msg);
-		cpdlc_msg_free(msg);
+/*
+ * Implements OUT_ACTION_PAUSE. If the recipient of a message that a
+ * connection has just sent is congested, we stop processing further
+ * input from the connection until the recipient has drained its output
+ * (see resume_paused_conns). This way, a producer can't keep piling up
+ * output on a slow consumer.
+ */
+static void
+conn_pause_if_congested(conn_t *conn, const char *to)
+{
+	callsign_key_t key;
+
+	ASSERT(conn != NULL);
+	ASSERT(to != NULL);
+
+	if (conn->paused_on != CALLSIGN_KEY_NONE)
 		return;
-	}
-	if (msg->pkt_type == CPDLC_PKT_PING) {
-		/* Generate a local PONG message with no further processing */
+	key = callsign_key(to);
+	if (!ident_congested(key))
+		return;
+	conn->paused_on = key;
+	conn_pause(conn);
+	mutex_enter(&out_lock);
+	out_stats.paused++;
+	mutex_exit(&out_lock);
+}
+
+/*
+ * Pauses input processing on a connection for `delay_us' microseconds,
+ * to bring it back within the per-address rate limits.
+ */
+static void
+conn_throttle(conn_t *conn, uint64_t delay_us)
+{
+	ASSERT(conn != NULL);
+
+	if (delay_us == 0)
+		return;
+	conn->paused_until = MAX(conn->paused_until, microclock() + delay_us);
+	conn_pause(conn);
+}
+
+/*
+ * Responds to a message which exceeded a rate limit with an error. If a
+ * rate limiting penalty is configured, the connection's source address
+ * serves the penalty and the connection gets closed.
+ */
+static void
+conn_penalize(conn_t *conn, const cpdlc_msg_t *msg, const char *reason)
+{
+	ASSERT(conn != NULL);
+	ASSERT(msg != NULL);
+
+	conn_log_msg(conn->addr_str, msg, true);
+	send_error_msg(conn, msg, CPDLC_ERRINFO_APP_ERROR, reason);
+	ratelimit_penalize(conn->addr_key);
+	if (ratelimit_penalized(conn->addr_key)) {
+		/* close_timedout_conns does the actual closing */
+		conn->penalized = true;
+		conn_failed(conn, "rate limit penalty");
+		/* Don't process any input left in the buffer */
+		conn_pause(conn);
+	}
+}
+
+/*
+ * Handles an incoming message from a connection. This performs all
+ * necessary permissions checks, logon hooks and message forwarding.
+ *
+ * @param conn The connection which received the message.
+ * @param msg The message to process. The message is consumed by this
+ *	function (either storing it, or freeing it), so the caller
+ *	relinquishes control of the object.
+ * @param len Number of input bytes the message was decoded from.
+ */
+static void
+conn_process_msg(conn_t *conn, cpdlc_msg_t *msg, size_t len)
+{
+	char to[CALLSIGN_LEN] = { 0 };
+	const ident_list_t *idl;
+
+	ASSERT(conn != NULL);
+	ASSERT(msg != NULL);
+	ASSERT_CONNS_MUTEX_HELD(conn);
+
+	/*
+	 * If the user isn't logged on, don't allow anything other than
+	 * LOGON through.
+	 */
+	mutex_enter(&conn->lock);
+	if (conn->logon_status != LOGON_COMPLETE && !msg->is_logon) {
+		mutex_exit(&conn->lock);
+		if (!msg->is_logoff) {
+			send_error_msg(conn, msg, CPDLC_ERRINFO_APP_ERROR,
+			    NULL);
+		}
+		cpdlc_msg_free(msg);
+		return;
+	}
+	mutex_exit(&conn->lock);
+
+	if (msg->is_logon && !ratelimit_allow(RL_LOGONS, conn->addr_key, 1)) {
+		logMsg("Too many LOGON attempts from %s", conn->addr_str);
+		conn_penalize(conn, msg, "TOO MANY LOGON ATTEMPTS");
+		cpdlc_msg_free(msg);
+		return;
+	}
+	idl = list_head(&conn->from_list);
+	/* Multicast messages count once for every recipient */
+	if (!msg->is_logon && !msg->is_logoff && idl != NULL &&
+	    (!ratelimit_allow(RL_CALLSIGN_MSGS, idl->key,
+	    MAX(cpdlc_msg_get_to_list_len(msg), 1)) ||
+	    !ratelimit_allow(RL_CALLSIGN_BYTES, idl->key, len))) {
+		logMsg("Message rate limit exceeded by %s on connection "
+		    "from %s", idl->ident, conn->addr_str);
+		conn_penalize(conn, msg, "MESSAGE RATE LIMIT EXCEEDED");
+		cpdlc_msg_free(msg);
+		return;
+	}
+	if (msg->is_logon || msg->is_logoff) {
+		/* Logon messages do not get forwarded. */
+		conn_log_msg(conn->addr_str, msg, true);
+		process_logon_msg(conn, msg);
+		cpdlc_msg_free(msg);
+		return;
+	}
+	if (msg->pkt_type == CPDLC_PKT_PING) {
+		/* Generate a local PONG message with no further processing */
 		cpdlc_msg_t *pong = cpdlc_msg_alloc(CPDLC_PKT_PONG);
 		cpdlc_msg_set_mrn(pong, cpdlc_msg_get_min(msg));
 		conn_send_msg(conn, pong);
@@ -1771,7 +3020,20 @@ conn_process_msg(conn_t *conn, cpdlc_msg_t *msg)
 		cpdlc_msg_free(msg);
 		return;
 	}
-	if (msg->to[0] != '\0') {
+	if (cpdlc_msg_get_to_list_len(msg) != 0) {
+		/*
+		 * Only ATC stations get to send the same message to
+		 * multiple recipients.
+		 */
+		if (!conn->is_atc ||
+		    strcmp(cpdlc_msg_get_from(msg), "AUTO") == 0) {
+			conn_log_msg(conn->addr_str, msg, true);
+			send_error_msg(conn, msg, CPDLC_ERRINFO_UNEXPCT_DATA,
+			    NULL);
+			cpdlc_msg_free(msg);
+			return;
+		}
+	} else if (msg->to[0] != '\0') {
 		/*
 		 * Aircraft stations can only communicate with their
 		 * LOGON target.
@@ -1833,7 +3095,19 @@ conn_process_msg(conn_t *conn, cpdlc_msg_t *msg)
 		return;
 	}
 	/* Forwarded messages are only logged after the routing decision */
+	if (cpdlc_msg_get_to_list_len(msg) != 0) {
+		forward_msg_mcast(conn, msg);
+		for (unsigned i = 0; out_action == OUT_ACTION_PAUSE &&
+		    i < cpdlc_msg_get_to_list_len(msg); i++) {
+			conn_pause_if_congested(conn,
+			    cpdlc_msg_get_to_list(msg, i));
+		}
+		cpdlc_msg_free(msg);
+		return;
+	}
 	forward_msg(conn, msg, to);
+	if (out_action == OUT_ACTION_PAUSE)
+		conn_pause_if_congested(conn, to);
 }
 
 /*
@@ -1848,40 +3122,60 @@ conn_process_msg(conn_t *conn, cpdlc_msg_t *msg)
 static bool
 conn_process_input(conn_t *conn)
 {
-	int consumed_total = 0;
+	size_t consumed_total = 0;
 
 	ASSERT(conn != NULL);
 	ASSERT(conn->inbuf_sz != 0);
 	ASSERT_CONNS_MUTEX_HELD(conn);
 	ASSERT_MUTEX_HELD(&conn->lock);
 
-	while (consumed_total < (int)conn->inbuf_sz) {
-		int consumed;
+	if (conn->arena == NULL)
+		conn->arena = cpdlc_arena_alloc();
+	while (consumed_total < conn->inbuf_sz && !conn->in_paused) {
+		size_t consumed;
 		cpdlc_msg_t *msg;
 		char error[128] = { 0 };
+		uint64_t delay_us;
 
-		if (!cpdlc_msg_decode(
-		    (const char *)&conn->inbuf[consumed_total], !conn->is_atc,
-		    &msg, &consumed, error, sizeof (error))) {
+		/*
+		 * Messages are forwarded with their segments exactly as
+		 * the client sent them, so we needn't re-encode those.
+		 * The arguments are still fully decoded, so a malformed
+		 * message never makes it past this point.
+		 */
+		if (!cpdlc_msg_decode_arena(
+		    (const char *)&conn->inbuf[consumed_total],
+		    conn->inbuf_sz - consumed_total, !conn->is_atc,
+		    conn->arena, CPDLC_DECODE_KEEP_RAW, &msg, &consumed,
+		    &conn->inbuf_scanned, error, sizeof (error))) {
+			cpdlc_arena_reset(conn->arena);
 			logMsg("Error decoding message from client %s: %s",
 			    conn->addr_str, error);
+			conn_failed(conn, "message decoding error");
 			return (false);
 		}
 		/* No more complete messages pending? */
 		if (msg == NULL)
 			break;
 		ASSERT(consumed != 0);
+		flightrec_event(conn->fr, FR_EV_DECODE, cpdlc_msg_get_min(msg),
+		    consumed);
+		/* Overrides any SRVTS= header the client might have sent */
+		cpdlc_msg_set_srv_ts(msg, latency_now(), 0);
+		delay_us = ratelimit_charge(RL_ADDR_MSGS, conn->addr_key, 1);
 		/* This consumes the msg, so no need to free it */
-		conn_process_msg(conn, msg);
+		conn_process_msg(conn, msg, consumed);
+		cpdlc_arena_reset(conn->arena);
 		consumed_total += consumed;
-		ASSERT3S(consumed_total, <=, conn->inbuf_sz);
+		conn_throttle(conn, delay_us);
+		ASSERT3U(consumed_total, <=, conn->inbuf_sz);
 	}
 	if (consumed_total != 0) {
 		/* Adjust `inbuf' to get rid of the consumed message data */
-		ASSERT3S(consumed_total, <=, conn->inbuf_sz);
+		ASSERT3U(consumed_total, <=, conn->inbuf_sz);
 		conn->inbuf_sz -= consumed_total;
 		memmove(conn->inbuf, &conn->inbuf[consumed_total],
-		    conn->inbuf_sz + 1);
+		    conn->inbuf_sz);
 		conn->inbuf = realloc(conn->inbuf, conn->inbuf_sz);
 	}
 
@@ -1937,6 +3231,45 @@ sanitize_input(const uint8_t *buf, size_t len)
 	return (true);
 }
 
+/*
+ * Unix-domain connections carry the data in the clear, so the socket is
+ * accessed directly. To keep the callers simple, socket errors are mapped
+ * onto the equivalent GnuTLS error codes.
+ */
+static int
+conn_recv(conn_t *conn, void *buf, size_t len)
+{
+	ssize_t bytes;
+
+	if (!conn->is_unix)
+		return (gnutls_record_recv(conn->session, buf, len));
+	bytes = recv(conn->fd, buf, len, 0);
+	if (bytes >= 0)
+		return (bytes);
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return (GNUTLS_E_AGAIN);
+	if (errno == EINTR)
+		return (GNUTLS_E_INTERRUPTED);
+	return (GNUTLS_E_PULL_ERROR);
+}
+
+static int
+conn_send(conn_t *conn, const void *buf, size_t len)
+{
+	ssize_t bytes;
+
+	if (!conn->is_unix)
+		return (gnutls_record_send(conn->session, buf, len));
+	bytes = send(conn->fd, buf, len, MSG_NOSIGNAL);
+	if (bytes >= 0)
+		return (bytes);
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return (GNUTLS_E_AGAIN);
+	if (errno == EINTR)
+		return (GNUTLS_E_INTERRUPTED);
+	return (GNUTLS_E_PUSH_ERROR);
+}
+
 /*
  * Drains a connection of any pending input bytes and stores them in the
  * `inbuf' cache. This function then calls conn_process_input to turn any
@@ -1975,9 +3308,11 @@ conn_read_input(conn_t *conn)
 				return (false);
 			/* TLS handshake succeeded */
 			conn->tls_handshake_complete = true;
+			if (gnutls_session_is_resumed(conn->session))
+				resume_logon(conn);
 		}
 
-		bytes = gnutls_record_recv(conn->session, buf, sizeof (buf));
+		bytes = conn_recv(conn, buf, sizeof (buf));
 		if (bytes < 0) {
 			/* Read error, or no more data pending */
 			if (bytes == GNUTLS_E_AGAIN)
@@ -1990,15 +3325,18 @@ conn_read_input(conn_t *conn)
 			}
 			logMsg("Fatal read error on connection from %s: %s",
 			    conn->addr_str, gnutls_strerror(bytes));
+			conn_failed(conn, "read error");
 			return (false);
 		}
 		if (bytes == 0) {
 			/* Connection closed */
 			return (false);
 		}
+		flightrec_event(conn->fr, FR_EV_READ, 0, bytes);
 		if (!sanitize_input(buf, bytes)) {
 			logMsg("Invalid input character on connection from "
 			    "%s: data MUST be plain text", conn->addr_str);
+			conn_failed(conn, "invalid input");
 			return (false);
 		}
 		if (conn->inbuf_sz + bytes > max_inbuf_sz) {
@@ -2006,6 +3344,7 @@ conn_read_input(conn_t *conn)
 			    "received %d bytes, maximum allowable is %d bytes",
 			    conn->addr_str, (int)(conn->inbuf_sz + bytes),
 			    (int)max_inbuf_sz);
+			conn_failed(conn, "input buffer overflow");
 			return (false);
 		}
 		/*
@@ -2015,16 +3354,20 @@ conn_read_input(conn_t *conn)
 		mutex_enter(&conn->lock);
 
 		conn->inbuf = safe_realloc(conn->inbuf,
-		    conn->inbuf_sz + bytes + 1);
+		    conn->inbuf_sz + bytes);
 		memcpy(&conn->inbuf[conn->inbuf_sz], buf, bytes);
 		conn->inbuf_sz += bytes;
-		conn->inbuf[conn->inbuf_sz] = '\0';
 
 		if (!conn_process_input(conn)) {
 			mutex_exit(&conn->lock);
 			return (false);
 		}
 		mutex_exit(&conn->lock);
+		conn_throttle(conn, ratelimit_charge(RL_ADDR_BYTES,
+		    conn->addr_key, bytes));
+		/* Leave the rest of the input until we're unpaused */
+		if (conn->in_paused)
+			return (true);
 	}
 }
 
@@ -2041,6 +3384,7 @@ static bool
 conn_write_output(conn_t *conn)
 {
 	int bytes;
+	size_t len;
 
 	ASSERT(conn != NULL);
 	ASSERT(conn->outbuf_sz != 0);
@@ -2051,14 +3395,23 @@ conn_write_output(conn_t *conn)
 	 * We are in non-blocking mode, so we can hold `lock' here safely
 	 * during the record send operation.
 	 */
-	bytes = gnutls_record_send(conn->session,
-	    &conn->outbuf[conn->outbuf_pre_pad], conn->outbuf_sz);
+	len = MIN(conn->outbuf_sz, TLS_SEND_MAX);
+	bytes = conn_send(conn, &conn->outbuf[conn->outbuf_pre_pad], len);
 	if (bytes < 0) {
+		/*
+		 * The same data must be passed to the retry, so it can't be
+		 * preempted by priority messages anymore.
+		 */
+		if (bytes == GNUTLS_E_AGAIN || bytes == GNUTLS_E_INTERRUPTED)
+			conn->outbuf_fixed = MAX(conn->outbuf_fixed, len);
+		if (bytes == GNUTLS_E_AGAIN)
+			flightrec_event(conn->fr, FR_EV_EAGAIN, 0, len);
 		if (bytes != GNUTLS_E_AGAIN) {
 			if (gnutls_error_is_fatal(bytes)) {
 				logMsg("Fatal send error on connection from "
 				    "%s: %s", conn->addr_str,
 				    gnutls_strerror(bytes));
+				conn_failed(conn, "send error");
 				mutex_exit(&conn->lock);
 				return (false);
 			}
@@ -2066,6 +3419,8 @@ conn_write_output(conn_t *conn)
 			    conn->addr_str, gnutls_strerror(bytes));
 		}
 	} else if (bytes > 0) {
+		flightrec_event(conn->fr, (ssize_t)conn->outbuf_sz > bytes ?
+		    FR_EV_SEND_PARTIAL : FR_EV_SEND, 0, bytes);
 		if ((ssize_t)conn->outbuf_sz > bytes) {
 			memmove(&conn->outbuf[conn->outbuf_pre_pad],
 			    &conn->outbuf[conn->outbuf_pre_pad + bytes],
@@ -2077,7 +3432,9 @@ conn_write_output(conn_t *conn)
 			free(conn->outbuf);
 			conn->outbuf = NULL;
 			conn->outbuf_sz = 0;
+			conn->outbuf_msgs = 0;
 		}
+		conn_outbuf_drained(conn, bytes);
 	}
 
 	mutex_exit(&conn->lock);
@@ -2085,6 +3442,118 @@ conn_write_output(conn_t *conn)
 	return (true);
 }
 
+/*
+ * Resumes input processing on paused connections (see conn_pause), once
+ * their recipient is no longer congested and their rate limiting delay
+ * has passed.
+ */
+static void
+resume_paused_conns(void)
+{
+	uint64_t now = microclock();
+
+	ASSERT(is_main_thread);
+
+	for (conn_t *conn = list_head(&paused_conns), *conn_next = NULL;
+	    conn != NULL; conn = conn_next) {
+		conn_next = list_next(&paused_conns, conn);
+		ASSERT(conn->in_paused);
+		/* About to be closed by close_timedout_conns */
+		if (conn->penalized)
+			continue;
+		if (conn->paused_on != CALLSIGN_KEY_NONE) {
+			if (ident_congested(conn->paused_on))
+				continue;
+			conn->paused_on = CALLSIGN_KEY_NONE;
+		}
+		if (now < conn->paused_until)
+			continue;
+		conn->paused_until = 0;
+		list_remove(&paused_conns, conn);
+		conn->in_paused = false;
+		flightrec_event(conn->fr, FR_EV_RESUME, 0, 0);
+		if (conn->is_lws) {
+			mutex_enter(&conns_lws_lock);
+			lws_rx_flow_control(conn->wsi, 1);
+			/* Let handle_lws_input pick up the leftover input */
+			if (conn->inbuf_sz != 0 &&
+			    !list_link_active(&conn->lws_ready_node))
+				list_insert_tail(&conns_lws_ready, conn);
+			mutex_exit(&conns_lws_lock);
+		} else {
+			bool ok = true;
+
+			mutex_enter(&conns_tcp_lock);
+			mutex_enter(&conn->lock);
+			if (conn->inbuf_sz != 0)
+				ok = conn_process_input(conn);
+			mutex_exit(&conn->lock);
+			/*
+			 * TLS can have buffered more records than poll()
+			 * will tell us about, so drain those right away.
+			 */
+			if (!ok || (!conn->in_paused &&
+			    !conn_read_input(conn))) {
+				close_conn(conn);
+			}
+			mutex_exit(&conns_tcp_lock);
+		}
+	}
+}
+
+/*
+ * Returns the number of milliseconds until the earliest rate limited
+ * connection can be resumed, or `timeout' if that's sooner.
+ */
+static int
+paused_conns_timeout(int timeout)
+{
+	uint64_t now = microclock();
+
+	ASSERT(is_main_thread);
+	for (const conn_t *conn = list_head(&paused_conns); conn != NULL;
+	    conn = list_next(&paused_conns, conn)) {
+		if (conn->paused_until == 0)
+			continue;
+		if (conn->paused_until <= now)
+			return (0);
+		timeout = MIN(timeout,
+		    (int)((conn->paused_until - now + 999) / 1000));
+	}
+	return (timeout);
+}
+
+/*
+ * Requests writable callbacks for LWS connections which have had output
+ * queued from other threads, or whose output coalescing delay has expired
+ * (see conn_send_buf). Returns the number of milliseconds until the next
+ * pending connection becomes due, or POLL_TIMEOUT if none are pending.
+ */
+static int
+flush_lws_writable(void)
+{
+	uint64_t now = microclock();
+	uint64_t next = now + POLL_TIMEOUT * 1000;
+
+	ASSERT(is_main_thread);
+	mutex_enter(&conns_lws_wr_lock);
+	for (conn_t *conn = list_head(&conns_lws_wr), *conn_next = NULL;
+	    conn != NULL; conn = conn_next) {
+		conn_next = list_next(&conns_lws_wr, conn);
+		ASSERT(conn->is_lws);
+		if (conn->lws_wr_deadline <= now) {
+			list_remove(&conns_lws_wr, conn);
+			lws_callback_on_writable(conn->wsi);
+		} else {
+			next = MIN(next, conn->lws_wr_deadline);
+		}
+	}
+	mutex_exit(&conns_lws_wr_lock);
+
+	/* Round up, so we don't spin on a sub-millisecond remainder */
+	return ((next - now + 999) / 1000);
+}
+
 /*
  * Polls all sockets for incoming data and if we have any pending data
  * to be written, also polls on client connection sockets for ready-to-send
@@ -2094,15 +3563,21 @@ static void
 poll_sockets(void)
 {
 	unsigned sock_nr = 0;
-	unsigned num_pfds;
+	unsigned num_pfds, lws_pfd_start, num_lws;
 	struct pollfd *pfds;
-	int poll_res, polls_seen;
+	struct lws_context **lws_ctxs;
+	int poll_res, polls_seen, timeout;
+
+	timeout = paused_conns_timeout(flush_lws_writable());
 
 	mutex_enter(&conns_tcp_lock);
 retry_poll:
 	conns_tcp_dirty = false;
-	num_pfds = 1 + list_count(&listen_socks) + list_count(&conns_tcp);
+	num_lws = num_lws_pfds;
+	num_pfds = 3 + list_count(&listen_socks) + list_count(&conns_tcp) +
+	    num_lws;
 	pfds = safe_calloc(num_pfds, sizeof (*pfds));
+	lws_ctxs = safe_calloc(MAX(num_lws, 1), sizeof (*lws_ctxs));
 
 	/*
 	 * The first fd in the poll list is always our poll wakeup pipe.
@@ -2110,6 +3585,17 @@ retry_poll:
 	pfds[sock_nr].fd = poll_wakeup_pipe[0];
 	pfds[sock_nr].events = POLLIN;
 	sock_nr++;
+	/*
+	 * Next come the handoff sockets. These are only here to wake us
+	 * up, they're actually serviced by handle_handoff. Negative fds
+	 * are ignored by poll().
+	 */
+	pfds[sock_nr].fd = handoff_listen_fd;
+	pfds[sock_nr].events = POLLIN;
+	sock_nr++;
+	pfds[sock_nr].fd = (draining ? -1 : handoff_peer_fd);
+	pfds[sock_nr].events = POLLIN;
+	sock_nr++;
 
 	for (listen_sock_t *ls = list_head(&listen_socks); ls != NULL;
 	    ls = list_next(&listen_socks, ls), sock_nr++) {
@@ -2119,28 +3605,38 @@ retry_poll:
 	for (conn_t *conn = list_head(&conns_tcp); conn != NULL;
 	    conn = list_next(&conns_tcp, conn), sock_nr++) {
 		pfds[sock_nr].fd = conn->fd;
-		pfds[sock_nr].events = POLLIN;
+		/* Paused connections are left to fill their TCP window */
+		pfds[sock_nr].events = (conn->in_paused ? 0 : POLLIN);
 		/* If a socket has data to send, poll for output as well */
 		if (conn->outbuf_sz != 0)
 			pfds[sock_nr].events |= POLLOUT;
 	}
+	/*
+	 * LWS sockets go last. The LWS pollfd table can only change from
+	 * within LWS callbacks, which only run on this thread, so it can't
+	 * change under us while we're polling.
+	 */
+	lws_pfd_start = sock_nr;
+	for (unsigned i = 0; i < num_lws; i++, sock_nr++) {
+		pfds[sock_nr].fd = lws_pfds[i].fd;
+		pfds[sock_nr].events = lws_pfds[i].events;
+		lws_ctxs[i] = lws_pfds[i].ctx;
+	}
 	ASSERT3U(sock_nr, ==, num_pfds);
 	mutex_exit(&conns_tcp_lock);
 
-	poll_res = poll(pfds, num_pfds, POLL_TIMEOUT);
+	poll_res = poll(pfds, num_pfds, timeout);
 	if (poll_res == -1) {
 		/*
 		 * In case conns_tcp was changed and a socket closed before
 		 * we attempted to poll, we might end up getting spurious
 		 * poll errors.
 		 */
-		free(pfds);
-		return;
+		goto out_unlocked;
 	}
 	if (poll_res == 0) {
 		/* Poll timeout, respin another loop */
-		free(pfds);
-		return;
+		goto out_unlocked;
 	}
 
 	mutex_enter(&conns_tcp_lock);
@@ -2150,6 +3646,8 @@ retry_poll:
 	 */
 	if (conns_tcp_dirty) {
 		free(pfds);
+		free(lws_ctxs);
+		sock_nr = 0;
 		goto retry_poll;
 	}
 
@@ -2170,6 +3668,13 @@ retry_poll:
 			goto out;
 	}
 	sock_nr++;
+	for (int i = 0; i < 2; i++, sock_nr++) {
+		if (pfds[sock_nr].revents != 0) {
+			polls_seen++;
+			if (polls_seen == poll_res)
+				goto out;
+		}
+	}
 	/*
 	 * Handling of newly accepted connections.
 	 */
@@ -2214,97 +3719,940 @@ retry_poll:
 		}
 	}
 out:
-	free(pfds);
 	mutex_exit(&conns_tcp_lock);
+out_unlocked:
+	/*
+	 * LWS callbacks can take `conns_lws_lock', so LWS must be serviced
+	 * without holding `conns_tcp_lock'. Sockets which LWS has closed in
+	 * the meantime are simply ignored by lws_service_fd.
+	 */
+	for (unsigned i = 0; poll_res > 0 && i < num_lws; i++) {
+		if (pfds[lws_pfd_start + i].revents != 0)
+			lws_service_fd(lws_ctxs[i], &pfds[lws_pfd_start + i]);
+	}
+	for (listen_lws_t *lws = list_head(&listen_lws); lws != NULL;
+	    lws = list_next(&listen_lws, lws)) {
+		/* Timeout processing, LWS rate-limits this internally */
+		lws_service_fd(lws->ctx, NULL);
+		/*
+		 * Some connections might have input left buffered inside
+		 * of LWS (e.g. decrypted TLS records) that poll() can't
+		 * tell us about, so service those explicitly.
+		 */
+		while (lws_service_adjust_timeout(lws->ctx, 1, 0) == 0)
+			lws_service_tsi(lws->ctx, -1, 0);
+	}
+	free(pfds);
+	free(lws_ctxs);
+}
+
+/*
+ * Processes input on all LWS connections which have received data
+ * during the last call to poll_sockets.
+ */
+static void
+handle_lws_input(void)
+{
+	conn_t *conn;
+
+	ASSERT(is_main_thread);
+	mutex_enter(&conns_lws_lock);
+
+	while ((conn = list_remove_head(&conns_lws_ready)) != NULL) {
+		ASSERT(conn->is_lws);
+		ASSERT(conn->wsi != NULL);
+
+		mutex_enter(&conn->lock);
+		if (conn->inbuf_sz > 0 && !conn_process_input(conn)) {
+			logMsg("Error LWS connection from %s: input "
+			    "processing error", conn->addr_str);
+			conn->kill_wsi = true;
+			lws_callback_on_writable(conn->wsi);
+		}
+		mutex_exit(&conn->lock);
+	}
+
+	mutex_exit(&conns_lws_lock);
+}
+
+/*
+ * Removes a queued message it from the delayed-delivery queue (queued_msgs)
+ * and adjusts the quota and queue size accounting.
+ */
+static void
+dequeue_msg(queued_msg_t *qmsg)
+{
+	uint64_t bytes;
+
+	ASSERT(qmsg != NULL);
+	bytes = strlen(qmsg->msg);
+	ASSERT3U(queued_msg_bytes, >=, bytes);
+	queued_msg_bytes -= bytes;
+	if (!qmsg->is_atc)
+		msgquota_decr(qmsg->from, bytes);
+	if (qmsg == queued_msgs_prio_last)
+		queued_msgs_prio_last = list_prev(&queued_msgs, qmsg);
+	list_remove(&queued_msgs, qmsg);
+	free(qmsg->msg);
+	free(qmsg);
+	if (list_count(&queued_msgs) == 0)
+		ASSERT0(queued_msg_bytes);
+}
+
+/*
+ * Hands a queued message over to one of the cluster nodes on which its
+ * recipient is currently logged on. Returns true if the message was sent.
+ */
+static bool
+cluster_send_qmsg_any(const queued_msg_t *qmsg)
+{
+	cluster_nodes_t nodes = cluster_lookup(qmsg->to);
+
+	for (int i = 0; nodes != 0; i++, nodes >>= 1) {
+		if ((nodes & 1) != 0 && cluster_send_qmsg(i, qmsg->from,
+		    qmsg->to, !qmsg->is_atc, qmsg->created, qmsg->msg)) {
+			return (true);
+		}
+	}
+	return (false);
+}
+
+/*
+ * Runs over `queued_msgs' and processes all of the queued messages. Any
+ * messages which can be delivered are sent to their respective connections.
+ * Alternatively, any messages which have expired are dropped from the queue.
+ */
+static void
+handle_queued_msgs(void)
+{
+	time_t now = time(NULL);
+
+	for (queued_msg_t *qmsg = list_head(&queued_msgs), *next_qmsg = NULL;
+	    qmsg != NULL; qmsg = next_qmsg) {
+		const list_t *l;
+		bool sent = false;
+		/*
+		 * Messages might be removed from the list below, so we need
+		 * to grab the next message pointer ahead of time.
+		 */
+		next_qmsg = list_next(&queued_msgs, qmsg);
+
+		mutex_enter(&conns_by_from_lock);
+		l = conns_by_from_lookup(qmsg->to);
+		/*
+		 * If one or more connections with the identity of the
+		 * message's intended recipient have been found, deliver
+		 * the message to them and remove it from the queue. If
+		 * they're all congested, the message stays queued.
+		 */
+		for (ident_list_t *idl = (l != NULL ? list_head(l) : NULL);
+		    idl != NULL; idl = list_next(l, idl)) {
+			size_t len = strlen(qmsg->msg);
+
+			if (conn_send_buf(idl->conn, qmsg->msg, len,
+			    qmsg->prio, 0)) {
+				flightrec_event(idl->conn->fr, FR_EV_DEQUEUE,
+				    0, len);
+				sent = true;
+			}
+		}
+		if (sent) {
+			dequeue_msg(qmsg);
+		} else if (l == NULL && cluster_send_qmsg_any(qmsg)) {
+			/*
+			 * The recipient has logged on to another node of
+			 * the cluster, which now delivers the message.
+			 */
+			dequeue_msg(qmsg);
+		} else if (now - qmsg->created > QUEUED_MSG_TIMEOUT) {
+			/*
+			 * Message has timed out, remove it from the queue.
+			 */
+			dequeue_msg(qmsg);
+		}
+		mutex_exit(&conns_by_from_lock);
+	}
+}
+
+/*
+ * Adds an already encoded message to our delayed-delivery queue. The
+ * global queue limit isn't applied here, callers which need it must
+ * check queue_is_full() first. Caller must hold `conns_by_from_lock'.
+ * @return True if the message was queued, false if the sender's quota
+ *	has been exhausted.
+ */
+static bool
+enqueue_encoded_msg(callsign_key_t from, callsign_key_t to, bool is_atc,
+    time_t created, const char *buf, size_t len)
+{
+	queued_msg_t *qmsg;
+
+	ASSERT(buf != NULL);
+	ASSERT_MUTEX_HELD(&conns_by_from_lock);
+
+	if (!is_atc && !msgquota_incr(from, len))
+		return (false);
+	qmsg = safe_calloc(1, sizeof (*qmsg));
+	qmsg->msg = safe_malloc(len + 1);
+	memcpy(qmsg->msg, buf, len);
+	qmsg->msg[len] = '\0';
+	qmsg->from = from;
+	qmsg->to = to;
+	qmsg->is_atc = is_atc;
+	qmsg->created = created;
+	queue_msg(qmsg);
+	queued_msg_bytes += len;
+
+	return (true);
+}
+
+/*
+ * Adds a message received from another instance during a handoff to
+ * our delayed-delivery queue. From there, handle_queued_msgs delivers
+ * it to its recipient as usual.
+ */
+static void
+import_qmsg(const handoff_qmsg_t *hq, size_t len)
+{
+	size_t msglen;
+
+	ASSERT(hq != NULL);
+	if (len < sizeof (*hq)) {
+		logMsg("Handoff error: malformed queued message");
+		return;
+	}
+	msglen = len - sizeof (*hq);
+	if (msglen == 0 || memchr(hq->msg, '\0', msglen) != NULL) {
+		logMsg("Handoff error: malformed queued message");
+		return;
+	}
+	mutex_enter(&conns_by_from_lock);
+	if (!enqueue_encoded_msg(hq->from, hq->to, hq->is_atc, hq->created,
+	    hq->msg, msglen)) {
+		char from[CALLSIGN_LEN];
+
+		callsign_key2str(hq->from, from);
+		logMsg("Handoff: dropping queued message from %s, quota "
+		    "exceeded", from);
+	}
+	mutex_exit(&conns_by_from_lock);
+}
+
+/*
+ * Fills in `hl' with the logon state of a connection, followed by its
+ * logon identities in `idents', which must have space for all of them.
+ * Caller must hold the connection's lock.
+ */
+static void
+export_logon(const conn_t *conn, handoff_logon_t *hl,
+    char (*idents)[CALLSIGN_LEN])
+{
+	ASSERT(conn != NULL);
+	ASSERT(hl != NULL);
+	ASSERT(idents != NULL);
+
+	lacf_strlcpy(hl->to, conn->to, sizeof (hl->to));
+	hl->is_atc = conn->is_atc;
+	hl->fmt_plain = conn->fmt_plain;
+	hl->fmt_arinc622 = conn->fmt_arinc622;
+	hl->srv_ts = conn->srv_ts;
+	hl->num_idents = 0;
+	if (conn->logon_status != LOGON_COMPLETE)
+		return;
+	for (const ident_list_t *idl = list_head(&conn->from_list);
+	    idl != NULL; idl = list_next(&conn->from_list, idl)) {
+		lacf_strlcpy(idents[hl->num_idents], idl->ident, CALLSIGN_LEN);
+		hl->num_idents++;
+	}
+}
+
+/*
+ * Checks that logon state received from another instance only contains
+ * well-formed callsigns.
+ */
+static bool
+logon_valid(const handoff_logon_t *hl, const char (*idents)[CALLSIGN_LEN])
+{
+	ASSERT(hl != NULL);
+
+	if (memchr(hl->to, '\0', sizeof (hl->to)) == NULL)
+		return (false);
+	for (uint32_t i = 0; i < hl->num_idents; i++) {
+		if (idents[i][0] == '\0' ||
+		    memchr(idents[i], '\0', CALLSIGN_LEN) == NULL)
+			return (false);
+	}
+	return (true);
+}
+
+/*
+ * Restores the logon state exported from a connection of another
+ * instance (see export_logon). If `notify' is set, the logon hooks run
+ * just like for a new logon.
+ */
+static void
+restore_logon(conn_t *conn, const handoff_logon_t *hl,
+    const char (*idents)[CALLSIGN_LEN], bool notify)
+{
+	ASSERT(conn != NULL);
+	ASSERT(hl != NULL);
+	ASSERT(is_main_thread);
+
+	conn->fmt_plain = hl->fmt_plain;
+	conn->fmt_arinc622 = hl->fmt_arinc622;
+	conn->srv_ts = hl->srv_ts;
+	if (hl->num_idents == 0)
+		return;
+
+	mutex_enter(&conn->lock);
+	ASSERT3U(conn->logon_status, ==, LOGON_NONE);
+	conn->logon_status = LOGON_COMPLETE;
+	conn->logon_success = true;
+	conn->is_atc = hl->is_atc;
+	lacf_strlcpy(conn->to, hl->to, sizeof (conn->to));
+	mutex_enter(&conns_by_from_lock);
+	for (uint32_t i = 0; i < hl->num_idents; i++) {
+		ident_list_t *idl = safe_calloc(1, sizeof (*idl));
+
+		lacf_strlcpy(idl->ident, idents[i], sizeof (idl->ident));
+		idl->key = callsign_key(idl->ident);
+		idl->conn = conn;
+		list_insert_tail(&conn->from_list, idl);
+		conns_by_from_add(idl);
+		if (notify)
+			logon_hook(idl->ident, conn);
+	}
+	mutex_exit(&conns_by_from_lock);
+	flightrec_event(conn->fr, FR_EV_LOGON, true, 0);
+	mutex_exit(&conn->lock);
+}
+
+/*
+ * Takes over a plain-text connection from the instance we have taken
+ * over from (see handoff_conn_t). The connection carries on just as if
+ * its client had connected to us, but keeps its logon. We take ownership
+ * of `fd'.
+ */
+static void
+import_conn(const handoff_conn_t *hc, size_t len, int fd)
+{
+	const char (*idents)[CALLSIGN_LEN];
+	conn_t *conn;
+
+	ASSERT(hc != NULL);
+	ASSERT(is_main_thread);
+
+	if (fd == -1 || len < sizeof (*hc) ||
+	    hc->logon.num_idents > HANDOFF_MAX_REC_LEN / CALLSIGN_LEN ||
+	    hc->inbuf_sz > MAX_BUF_SZ ||
+	    len != sizeof (*hc) + hc->logon.num_idents * CALLSIGN_LEN +
+	    hc->inbuf_sz ||
+	    memchr(hc->addr_str, '\0', sizeof (hc->addr_str)) == NULL) {
+		goto malformed;
+	}
+	idents = (const char (*)[CALLSIGN_LEN])hc->data;
+	if (!logon_valid(&hc->logon, idents))
+		goto malformed;
+
+	conn = safe_calloc(1, sizeof (*conn));
+	conn->fd = fd;
+	conn->is_unix = true;
+	conn->tls_handshake_complete = true;
+	lacf_strlcpy(conn->addr_str, hc->addr_str, sizeof (conn->addr_str));
+	conn->addr_key = hc->addr_key;
+	set_fd_nonblock(conn->fd);
+	conn->logoff_time = time(NULL);
+	conn->fr = flightrec_alloc();
+	mutex_init(&conn->lock);
+	list_create(&conn->from_list, sizeof (ident_list_t),
+	    offsetof(ident_list_t, node));
+	if (hc->inbuf_sz != 0) {
+		conn->inbuf = safe_malloc(hc->inbuf_sz);
+		memcpy(conn->inbuf, &idents[hc->logon.num_idents],
+		    hc->inbuf_sz);
+		conn->inbuf_sz = hc->inbuf_sz;
+	}
+
+	mutex_enter(&conns_tcp_lock);
+	/*
+	 * The previous instance has already announced this logon, so
+	 * there's nothing to notify anybody of.
+	 */
+	restore_logon(conn, &hc->logon, idents, false);
+	list_insert_tail(&conns_tcp, conn);
+	conns_tcp_dirty = true;
+	mutex_exit(&conns_tcp_lock);
+	return;
+malformed:
+	logMsg("Handoff error: malformed connection record");
+	if (fd != -1)
+		close(fd);
+}
+
+/*
+ * Stores the logon state of a TLS connection of the instance we have
+ * taken over from, until its client reconnects to us (see resume_logon).
+ * We take ownership of `hr'.
+ */
+static void
+import_resume(handoff_resume_t *hr, size_t len)
+{
+	resume_logon_t *rl;
+
+	ASSERT(hr != NULL);
+	ASSERT(is_main_thread);
+
+	if (len < sizeof (*hr) || hr->session_id_len == 0 ||
+	    hr->session_id_len > sizeof (hr->session_id) ||
+	    hr->logon.num_idents == 0 ||
+	    hr->logon.num_idents > HANDOFF_MAX_REC_LEN / CALLSIGN_LEN ||
+	    len != sizeof (*hr) + hr->logon.num_idents * CALLSIGN_LEN ||
+	    !logon_valid(&hr->logon, hr->idents)) {
+		logMsg("Handoff error: malformed logon record");
+		free(hr);
+		return;
+	}
+	rl = safe_calloc(1, sizeof (*rl));
+	rl->hr = hr;
+	/* the previous instance drains its connections over `drain_time' */
+	rl->expire = time(NULL) + drain_time + LOGON_GRACE_TIME;
+	list_insert_tail(&resume_logons, rl);
+}
+
+/*
+ * Restores the logon of a client which has reconnected to us after the
+ * instance we have taken over from drained its connection. In TLS 1.3,
+ * the client picks the session ID, so it must also reconnect from the
+ * same address and each logon can only be restored once.
+ */
+static void
+resume_logon(conn_t *conn)
+{
+	uint8_t id[sizeof (((handoff_resume_t *)NULL)->session_id)];
+	size_t id_len = sizeof (id);
+
+	ASSERT(conn != NULL);
+	ASSERT(is_main_thread);
+
+	if (list_head(&resume_logons) == NULL ||
+	    gnutls_session_get_id(conn->session, id, &id_len) !=
+	    GNUTLS_E_SUCCESS) {
+		return;
+	}
+	for (resume_logon_t *rl = list_head(&resume_logons); rl != NULL;
+	    rl = list_next(&resume_logons, rl)) {
+		const handoff_resume_t *hr = rl->hr;
+
+		if (hr->addr_key != conn->addr_key ||
+		    hr->session_id_len != id_len ||
+		    memcmp(hr->session_id, id, id_len) != 0) {
+			continue;
+		}
+		/* the previous instance ran the logoff hooks on draining */
+		restore_logon(conn, &hr->logon, hr->idents, true);
+		logMsg("Restored logon of %s from previous instance",
+		    conn->addr_str);
+		list_remove(&resume_logons, rl);
+		free(rl->hr);
+		free(rl);
+		return;
+	}
+}
+
+/*
+ * Forgets the logon state of clients which haven't reconnected to us
+ * in time (see import_resume).
+ */
+static void
+expire_resume_logons(void)
+{
+	time_t now = time(NULL);
+
+	ASSERT(is_main_thread);
+
+	for (resume_logon_t *rl = list_head(&resume_logons), *rl_next = NULL;
+	    rl != NULL; rl = rl_next) {
+		rl_next = list_next(&resume_logons, rl);
+		if (now >= rl->expire) {
+			list_remove(&resume_logons, rl);
+			free(rl->hr);
+			free(rl);
+		}
+	}
+}
+
+/*
+ * Delivers a message forwarded to us by another cluster node to our
+ * local connections. If the recipient has logged off in the meantime,
+ * the message is queued up for later delivery, subject to the same queue
+ * limit and quota as a message from a local sender.
+ */
+static void
+cluster_deliver_cb(const char *to, bool is_dl, const char *buf)
+{
+	cpdlc_msg_t *msg;
+	int consumed;
+	const list_t *l;
+	char reason[64] = "incomplete message";
+	bool sent = false;
+
+	if (!cpdlc_msg_decode(buf, is_dl, &msg, &consumed, reason,
+	    sizeof (reason)) || msg == NULL) {
+		logMsg("Cluster: dropping undecodable message for %s: %s",
+		    to, reason);
+		return;
+	}
+	mutex_enter(&conns_by_from_lock);
+	l = conns_by_from_lookup(callsign_key(to));
+	for (ident_list_t *idl = (l != NULL ? list_head(l) : NULL);
+	    idl != NULL; idl = list_next(l, idl)) {
+		sent |= conn_send_msg(idl->conn, msg);
+	}
+	if (!sent && !store_msg(msg, to, !is_dl, NULL)) {
+		logMsg("Cluster: dropping message for %s, out of queue "
+		    "space or quota", to);
+	}
+	mutex_exit(&conns_by_from_lock);
+	cpdlc_msg_free(msg);
+}
+
+/*
+ * Takes over a queued message from another cluster node. We either
+ * deliver it right away, or keep it in our delayed-delivery queue,
+ * subject to the queue limit and quota.
+ */
+static void
+cluster_enqueue_cb(callsign_key_t from, callsign_key_t to, bool is_dl,
+    time_t created, const char *buf)
+{
+	const list_t *l;
+	size_t len = strlen(buf);
+	bool sent = false;
+
+	mutex_enter(&conns_by_from_lock);
+	l = conns_by_from_lookup(to);
+	for (ident_list_t *idl = (l != NULL ? list_head(l) : NULL);
+	    idl != NULL; idl = list_next(l, idl)) {
+		sent |= conn_send_buf(idl->conn, buf, len,
+		    CPDLC_PRIO_NORMAL, 0);
+	}
+	if (!sent && (queue_is_full(len) ||
+	    !enqueue_encoded_msg(from, to, !is_dl, created, buf, len))) {
+		char from_str[CALLSIGN_LEN];
+
+		callsign_key2str(from, from_str);
+		logMsg("Cluster: dropping queued message from %s, out of "
+		    "queue space or quota", from_str);
+	}
+	mutex_exit(&conns_by_from_lock);
+}
+
+/*
+ * Takes over from a running instance (`-t' command line option). The
+ * running instance hands us its TCP listen sockets, TLS session ticket
+ * key and queued messages, which we acknowledge. Once it has released
+ * its LWS listeners, it tells us it's done and hands over its
+ * connections (see handoff_conns), then starts draining the rest. We
+ * keep the connection open to receive those, as well as any messages it
+ * still needs to queue while draining.
+ */
+static bool
+takeover_from_running(void)
+{
+	int sock = handoff_connect(handoff_path);
+	unsigned num_socks = 0, num_msgs = 0;
+
+	if (sock == -1)
+		return (false);
+	for (;;) {
+		handoff_rec_type_t type;
+		void *buf;
+		size_t len;
+		int fd;
+		listen_sock_t *ls;
+
+		if (!handoff_recv(sock, &type, &buf, &len, &fd)) {
+			logMsg("Handoff failed: connection to running "
+			    "instance lost");
+			close(sock);
+			return (false);
+		}
+		switch (type) {
+		case HANDOFF_TICKET_KEY:
+			if (len == 0)
+				break;
+			gnutls_free(tls_ticket_key.data);
+			tls_ticket_key.data = gnutls_malloc(len);
+			memcpy(tls_ticket_key.data, buf, len);
+			tls_ticket_key.size = len;
+			break;
+		case HANDOFF_LISTEN_SOCK:
+			if (fd == -1 || len != sizeof (ls->sockaddr)) {
+				logMsg("Handoff error: malformed listen "
+				    "socket record");
+				if (fd != -1)
+					close(fd);
+				break;
+			}
+			ls = safe_calloc(1, sizeof (*ls));
+			memcpy(&ls->sockaddr, buf, len);
+			ls->fd = fd;
+			set_fd_nonblock(fd);
+			list_insert_tail(&listen_socks, ls);
+			num_socks++;
+			break;
+		case HANDOFF_QUEUED_MSG:
+			import_qmsg(buf, len);
+			num_msgs++;
+			break;
+		case HANDOFF_QUEUE_END:
+			if (!handoff_send(sock, HANDOFF_ACK, NULL, 0, -1)) {
+				logMsg("Handoff failed: connection to running "
+				    "instance lost");
+				free(buf);
+				close(sock);
+				return (false);
+			}
+			break;
+		case HANDOFF_DONE:
+			free(buf);
+			logMsg("Took over %d listen sockets and %d queued "
+			    "messages from running instance", num_socks,
+			    num_msgs);
+			handoff_peer_fd = sock;
+			return (true);
+		default:
+			logMsg("Handoff error: unknown record type %d", type);
+			if (fd != -1)
+				close(fd);
+			break;
+		}
+		free(buf);
+	}
+}
+
+/*
+ * Hands a plain-text connection over to the new instance, socket and all.
+ * Connections in the middle of a logon, or with input or output waiting
+ * on flow control, are left to be drained instead.
+ *
+ * @return True if the new instance has taken over the connection, in
+ *	which case it must be closed without logging it off.
+ */
+static bool
+handoff_send_conn(int peer, conn_t *conn)
+{
+	handoff_conn_t *hc;
+	size_t len;
+	bool res = false;
+
+	ASSERT(conn != NULL);
+	ASSERT(conn->is_unix);
+	ASSERT_MUTEX_HELD(&conns_tcp_lock);
+
+	if (conn->in_paused || conn->penalized)
+		return (false);
+	mutex_enter(&conn->lock);
+	if ((conn->logon_status != LOGON_NONE &&
+	    conn->logon_status != LOGON_COMPLETE) || conn->outbuf_sz != 0 ||
+	    conn->out_dropped) {
+		goto out;
+	}
+	len = sizeof (*hc) + list_count(&conn->from_list) * CALLSIGN_LEN +
+	    conn->inbuf_sz;
+	if (len > HANDOFF_MAX_REC_LEN)
+		goto out;
+	hc = safe_calloc(1, len);
+	lacf_strlcpy(hc->addr_str, conn->addr_str, sizeof (hc->addr_str));
+	hc->addr_key = conn->addr_key;
+	export_logon(conn, &hc->logon, (char (*)[CALLSIGN_LEN])hc->data);
+	hc->inbuf_sz = conn->inbuf_sz;
+	if (conn->inbuf_sz != 0) {
+		memcpy(&hc->data[hc->logon.num_idents * CALLSIGN_LEN],
+		    conn->inbuf, conn->inbuf_sz);
+	}
+	res = handoff_send(peer, HANDOFF_CONN, hc, len, conn->fd);
+	conn->handed_off = res;
+	free(hc);
+out:
+	mutex_exit(&conn->lock);
+	return (res);
+}
+
+/*
+ * Passes on the logon state of a TLS connection, so the new instance can
+ * restore it when the client reconnects (see resume_logon).
+ */
+static bool
+handoff_send_resume(int peer, conn_t *conn)
+{
+	handoff_resume_t *hr;
+	size_t len, id_len;
+	bool res = false;
+
+	ASSERT(conn != NULL);
+	ASSERT(!conn->is_unix);
+	ASSERT_MUTEX_HELD(&conns_tcp_lock);
+
+	if (!conn->tls_handshake_complete)
+		return (false);
+	mutex_enter(&conn->lock);
+	if (conn->logon_status != LOGON_COMPLETE)
+		goto out;
+	len = sizeof (*hr) + list_count(&conn->from_list) * CALLSIGN_LEN;
+	if (len > HANDOFF_MAX_REC_LEN)
+		goto out;
+	hr = safe_calloc(1, len);
+	id_len = sizeof (hr->session_id);
+	if (gnutls_session_get_id(conn->session, hr->session_id,
+	    &id_len) == GNUTLS_E_SUCCESS && id_len != 0) {
+		hr->session_id_len = id_len;
+		hr->addr_key = conn->addr_key;
+		export_logon(conn, &hr->logon, hr->idents);
+		res = handoff_send(peer, HANDOFF_RESUME, hr, len, -1);
+	}
+	free(hr);
+out:
+	mutex_exit(&conn->lock);
+	return (res);
+}
+
+/*
+ * Hands our connections over to the new instance. Plain-text connections
+ * are passed on as they are. TLS connections still need to be drained,
+ * but their logon state is passed on, so the new instance can restore it
+ * once their clients reconnect.
+ */
+static void
+handoff_conns(int peer)
+{
+	unsigned num_conns = 0, num_logons = 0;
+
+	mutex_enter(&conns_tcp_lock);
+	for (conn_t *conn = list_head(&conns_tcp), *conn_next = NULL;
+	    conn != NULL; conn = conn_next) {
+		conn_next = list_next(&conns_tcp, conn);
+		if (!conn->is_unix) {
+			if (handoff_send_resume(peer, conn))
+				num_logons++;
+		} else if (handoff_send_conn(peer, conn)) {
+			close_conn(conn);
+			num_conns++;
+		}
+	}
+	mutex_exit(&conns_tcp_lock);
+	logMsg("Handed over %d connections and the logon state of %d "
+	    "others", num_conns, num_logons);
 }
 
+/*
+ * Hands off to a new instance which has connected to our handoff socket
+ * (see takeover_from_running). Our queued messages are handed over in a
+ * single transaction: we only drop them once the new instance has
+ * acknowledged receiving all of them. If the handoff fails before that,
+ * we simply carry on as before.
+ */
 static void
-handle_lws_input(void)
+handoff_start(int peer)
 {
-	mutex_enter(&conns_lws_lock);
+	listen_sock_t *ls;
+	queued_msg_t *qmsg;
+	bool ok;
 
-	for (conn_t *conn = list_head(&conns_lws); conn != NULL;
-	    conn = list_next(&conns_lws, conn)) {
-		ASSERT(conn->is_lws);
-		ASSERT(conn->wsi != NULL);
+	ASSERT3S(peer, >=, 0);
+	ASSERT(!draining);
 
-		mutex_enter(&conn->lock);
-		if (conn->inbuf_sz > 0 && !conn_process_input(conn)) {
-			logMsg("Error LWS connection from %s: input "
-			    "processing error", conn->addr_str);
-			conn->kill_wsi = true;
+	logMsg("New instance is taking over, handing off");
+	if (!handoff_send(peer, HANDOFF_TICKET_KEY, tls_ticket_key.data,
+	    tls_ticket_key.size, -1)) {
+		goto errout;
+	}
+	mutex_enter(&conns_tcp_lock);
+	for (ls = list_head(&listen_socks); ls != NULL;
+	    ls = list_next(&listen_socks, ls)) {
+		if (!handoff_send(peer, HANDOFF_LISTEN_SOCK, &ls->sockaddr,
+		    sizeof (ls->sockaddr), ls->fd)) {
+			mutex_exit(&conns_tcp_lock);
+			goto errout;
 		}
-		mutex_exit(&conn->lock);
 	}
+	mutex_exit(&conns_tcp_lock);
 
-	mutex_exit(&conns_lws_lock);
+	/* Holding the lock keeps anything from being queued meanwhile */
+	mutex_enter(&conns_by_from_lock);
+	for (qmsg = list_head(&queued_msgs); qmsg != NULL;
+	    qmsg = list_next(&queued_msgs, qmsg)) {
+		if (!handoff_send_qmsg(peer, qmsg->from, qmsg->to,
+		    qmsg->is_atc, qmsg->created, qmsg->msg)) {
+			mutex_exit(&conns_by_from_lock);
+			goto errout;
+		}
+	}
+	if (!handoff_send(peer, HANDOFF_QUEUE_END, NULL, 0, -1) ||
+	    !handoff_wait_ack(peer)) {
+		mutex_exit(&conns_by_from_lock);
+		goto errout;
+	}
+	/* The new instance now has everything. */
+	while ((qmsg = list_head(&queued_msgs)) != NULL)
+		dequeue_msg(qmsg);
+	mutex_exit(&conns_by_from_lock);
+
+	/*
+	 * Stop accepting new connections. The listen sockets themselves
+	 * stay open in the new instance, so no pending connections are lost.
+	 * LWS doesn't let us pass on its listen sockets, so those get
+	 * closed and the new instance opens them again.
+	 */
+	mutex_enter(&conns_tcp_lock);
+	while ((ls = list_remove_head(&listen_socks)) != NULL) {
+		close(ls->fd);
+		free(ls);
+	}
+	conns_tcp_dirty = true;
+	mutex_exit(&conns_tcp_lock);
+	close_listen_lws();
+	/* The new instance takes over publishing these */
+	logondir_fini();
+	cluster_leave();
+	logon_list_file[0] = '\0';
+	close(handoff_listen_fd);
+	handoff_listen_fd = -1;
+
+	ok = handoff_send(peer, HANDOFF_DONE, NULL, 0, -1);
+	if (ok)
+		handoff_conns(peer);
+
+	/*
+	 * From here on, any messages we would have queued go to the new
+	 * instance instead. Pass on those which got queued since it has
+	 * taken over our queue.
+	 */
+	mutex_enter(&conns_by_from_lock);
+	while (ok && (qmsg = list_head(&queued_msgs)) != NULL) {
+		ok = handoff_send_qmsg(peer, qmsg->from, qmsg->to,
+		    qmsg->is_atc, qmsg->created, qmsg->msg);
+		if (ok)
+			dequeue_msg(qmsg);
+	}
+	if (ok) {
+		handoff_peer_fd = peer;
+	} else {
+		logMsg("Handoff error: lost connection to new instance, "
+		    "draining anyway");
+		close(peer);
+	}
+	draining = true;
+	mutex_exit(&conns_by_from_lock);
+
+	drain_start = time(NULL);
+	mutex_enter(&conns_tcp_lock);
+	drain_conns_total = list_count(&conns_tcp);
+	mutex_exit(&conns_tcp_lock);
+	logMsg("Handoff complete, draining %d connections over %d seconds",
+	    drain_conns_total, drain_time);
+
+	return;
+errout:
+	logMsg("Handoff to new instance failed, continuing normal operation");
+	close(peer);
 }
 
 /*
- * Removes a queued message it from the delayed-delivery queue (queued_msgs)
- * and adjusts the quota and queue size accounting.
+ * Services the handoff sockets: accepts new instances wanting to take
+ * over from us and receives connections and messages forwarded to us by
+ * the old instance we have taken over from.
  */
 static void
-dequeue_msg(queued_msg_t *qmsg)
+handle_handoff(void)
 {
-	uint64_t bytes;
+	struct pollfd pfd = { .events = POLLIN };
 
-	ASSERT(qmsg != NULL);
-	bytes = strlen(qmsg->msg);
-	ASSERT3U(queued_msg_bytes, >=, bytes);
-	queued_msg_bytes -= bytes;
-	if (!qmsg->is_atc)
-		msgquota_decr(qmsg->from, bytes);
-	list_remove(&queued_msgs, qmsg);
-	free(qmsg->msg);
-	free(qmsg);
-	if (list_count(&queued_msgs) == 0)
-		ASSERT0(queued_msg_bytes);
+	ASSERT(is_main_thread);
+
+	expire_resume_logons();
+	pfd.fd = handoff_listen_fd;
+	if (handoff_listen_fd != -1 && poll(&pfd, 1, 0) == 1) {
+		int peer = handoff_accept(handoff_listen_fd);
+
+		if (peer != -1 && handoff_peer_fd != -1) {
+			logMsg("Refusing handoff, previous handoff is still "
+			    "in progress");
+			close(peer);
+		} else if (peer != -1) {
+			handoff_start(peer);
+		}
+	}
+	if (draining)
+		return;
+	pfd.fd = handoff_peer_fd;
+	while (handoff_peer_fd != -1 && poll(&pfd, 1, 0) == 1) {
+		handoff_rec_type_t type;
+		void *buf;
+		size_t len;
+		int fd;
+
+		if (!handoff_recv(handoff_peer_fd, &type, &buf, &len, &fd)) {
+			/* old instance has finished draining and exited */
+			logMsg("Handoff from previous instance complete");
+			close(handoff_peer_fd);
+			handoff_peer_fd = -1;
+			break;
+		}
+		switch (type) {
+		case HANDOFF_QUEUED_MSG:
+			import_qmsg(buf, len);
+			break;
+		case HANDOFF_CONN:
+			import_conn(buf, len, fd);
+			fd = -1;
+			break;
+		case HANDOFF_RESUME:
+			import_resume(buf, len);
+			buf = NULL;
+			break;
+		default:
+			logMsg("Handoff error: unexpected record type %d",
+			    type);
+			break;
+		}
+		if (fd != -1)
+			close(fd);
+		free(buf);
+	}
 }
 
 /*
- * Runs over `queued_msgs' and processes all of the queued messages. Any
- * messages which can be delivered are sent to their respective connections.
- * Alternatively, any messages which have expired are dropped from the queue.
+ * After handing off to a new instance, gradually closes our remaining
+ * connections, so their clients reconnect to the new instance. Once all
+ * connections are gone (or the drain time is up), we shut down.
  */
 static void
-handle_queued_msgs(void)
+drain_conns(void)
 {
-	time_t now = time(NULL);
+	time_t elapsed;
+	unsigned left, want_left;
 
-	for (queued_msg_t *qmsg = list_head(&queued_msgs), *next_qmsg = NULL;
-	    qmsg != NULL; qmsg = next_qmsg) {
-		const list_t *l;
-		/*
-		 * Messages might be removed from the list below, so we need
-		 * to grab the next message pointer ahead of time.
-		 */
-		next_qmsg = list_next(&queued_msgs, qmsg);
+	if (!draining)
+		return;
 
-		mutex_enter(&conns_by_from_lock);
-		l = htbl_lookup_multi(&conns_by_from, qmsg->to);
-		if (l != NULL && list_count(l) != 0) {
-			/*
-			 * One or more connections with the identity of the
-			 * message's intended recipient have been found, so
-			 * deliver the message to them and remove it from
-			 * the queue.
-			 */
-			for (void *mv = list_head(l); mv != NULL;
-			    mv = list_next(l, mv)) {
-				conn_t *conn = HTBL_VALUE_MULTI(mv);
-				conn_send_buf(conn, qmsg->msg,
-				strlen(qmsg->msg));
-			}
-			dequeue_msg(qmsg);
-		} else if (now - qmsg->created > QUEUED_MSG_TIMEOUT) {
-			/*
-			 * Message has timed out, remove it from the queue.
-			 */
-			dequeue_msg(qmsg);
-		}
-		mutex_exit(&conns_by_from_lock);
+	elapsed = time(NULL) - drain_start;
+	mutex_enter(&conns_tcp_lock);
+	left = list_count(&conns_tcp);
+	if (left == 0 || elapsed >= drain_time) {
+		mutex_exit(&conns_tcp_lock);
+		logMsg("Drain complete, shutting down");
+		do_shutdown = true;
+		return;
+	}
+	/* Spread the disconnects out evenly over the drain period */
+	want_left = drain_conns_total -
+	    ((uint64_t)drain_conns_total * elapsed) / drain_time;
+	while (left > want_left) {
+		close_conn(list_head(&conns_tcp));
+		left--;
 	}
+	mutex_exit(&conns_tcp_lock);
 }
 
 /*
@@ -2319,7 +4667,7 @@ close_blocked_conns(void)
 	for (conn_t *conn = list_head(&conns_tcp), *conn_next = NULL;
 	    conn != NULL; conn = conn_next) {
 		conn_next = list_next(&conns_tcp, conn);
-		if (!blocklist_check(&conn->sockaddr))
+		if (!conn->is_unix && !blocklist_check(&conn->sockaddr))
 			close_conn(conn);
 	}
 	mutex_exit(&conns_tcp_lock);
@@ -2328,8 +4676,10 @@ close_blocked_conns(void)
 	for (conn_t *conn = list_head(&conns_lws), *conn_next = NULL;
 	    conn != NULL; conn = conn_next) {
 		conn_next = list_next(&conns_lws, conn);
-		if (!blocklist_check(&conn->sockaddr))
+		if (!blocklist_check(&conn->sockaddr)) {
 			conn->kill_wsi = true;
+			lws_callback_on_writable(conn->wsi);
+		}
 	}
 	mutex_exit(&conns_lws_lock);
 }
@@ -2347,8 +4697,9 @@ close_timedout_conns(void)
 	for (conn_t *conn = list_head(&conns_tcp), *conn_next = NULL;
 	    conn != NULL; conn = conn_next) {
 		conn_next = list_next(&conns_tcp, conn);
-		if (!conn->logon_success &&
-		    now - conn->logoff_time > LOGON_GRACE_TIME) {
+		if (conn->out_dropped || conn->penalized ||
+		    (!conn->logon_success &&
+		    now - conn->logoff_time > LOGON_GRACE_TIME)) {
 			close_conn(conn);
 		}
 	}
@@ -2359,32 +4710,38 @@ close_timedout_conns(void)
 	    conn != NULL; conn = conn_next) {
 		conn_next = list_next(&conns_lws, conn);
 		ASSERT(conn->wsi != NULL);
-		if (!conn->logon_success &&
-		    now - conn->logoff_time > LOGON_GRACE_TIME) {
+		if ((conn->out_dropped || conn->penalized ||
+		    (!conn->logon_success &&
+		    now - conn->logoff_time > LOGON_GRACE_TIME)) &&
+		    !conn->kill_wsi) {
 			conn->kill_wsi = true;
+			lws_callback_on_writable(conn->wsi);
 		}
 	}
 	mutex_exit(&conns_lws_lock);
 }
 
 static void
-write_logon_list_cb(const void *key, void *value, void *userinfo)
+write_logon_list_cb(callsign_key_t key, void *value, void *userinfo)
 {
-	const char *from;
-	const conn_t *conn;
+	const list_t *l;
 	FILE *fp;
 
-	ASSERT(key != NULL);
-	from = key;
+	UNUSED(key);
 	ASSERT(value != NULL);
-	conn = value;
+	l = value;
 	ASSERT(userinfo != NULL);
 	fp = userinfo;
 
-	fprintf(fp, "%s\t%s\t%s\t%s\t%s\n", from,
-	    conn->to[0] != '\0' ? conn->to : "-",
-	    conn->is_atc ? "ATC" : "ACFT",
-	    conn->addr_str, conn->is_lws ? "WS" : "TLS");
+	for (const ident_list_t *idl = list_head(l); idl != NULL;
+	    idl = list_next(l, idl)) {
+		const conn_t *conn = idl->conn;
+
+		fprintf(fp, "%s\t%s\t%s\t%s\t%s\n", idl->ident,
+		    conn->to[0] != '\0' ? conn->to : "-",
+		    conn->is_atc ? "ATC" : "ACFT",
+		    conn->addr_str, conn->is_lws ? "WS" : "TLS");
+	}
 }
 
 /*
@@ -2408,7 +4765,7 @@ write_logon_list(void)
 		free(tmp_filename);
 		return;
 	}
-	htbl_foreach(&conns_by_from, write_logon_list_cb, fp);
+	cstbl_foreach(&conns_by_from, write_logon_list_cb, fp);
 	fclose(fp);
 
 	if (rename(tmp_filename, logon_list_file) != 0) {
@@ -2418,6 +4775,150 @@ write_logon_list(void)
 	free(tmp_filename);
 }
 
+/*
+ * Finds the connection with the most output pending in a connection list.
+ */
+static void
+find_max_outbuf(mutex_t *lock, list_t *conns, size_t *max_sz,
+    char addr_str[SOCKADDR_STRLEN])
+{
+	mutex_enter(lock);
+	for (conn_t *conn = list_head(conns); conn != NULL;
+	    conn = list_next(conns, conn)) {
+		mutex_enter(&conn->lock);
+		if (conn->outbuf_sz > *max_sz) {
+			*max_sz = conn->outbuf_sz;
+			lacf_strlcpy(addr_str, conn->addr_str,
+			    SOCKADDR_STRLEN);
+		}
+		mutex_exit(&conn->lock);
+	}
+	mutex_exit(lock);
+}
+
+/*
+ * Periodically writes out the server statistics file.
+ */
+static void
+write_stats(void)
+{
+	FILE *fp;
+	char *tmp_filename;
+	time_t now = time(NULL);
+	size_t max_outbuf = 0;
+	char max_outbuf_addr[SOCKADDR_STRLEN] = "-";
+
+	if (stats_file[0] == '\0' ||
+	    (!stats_requested && now - stats_written < STATS_INTVAL)) {
+		return;
+	}
+	stats_written = now;
+	stats_requested = 0;
+
+	tmp_filename = sprintf_alloc("%s.tmp", stats_file);
+	fp = fopen(tmp_filename, "wb");
+	if (fp == NULL) {
+		logMsg("Can't write stats file %s: %s", tmp_filename,
+		    strerror(errno));
+		free(tmp_filename);
+		return;
+	}
+	fprintf(fp, "frames_sent = %llu\n",
+	    (unsigned long long)lws_stats.frames);
+	fprintf(fp, "msgs_sent = %llu\n", (unsigned long long)lws_stats.msgs);
+	fprintf(fp, "bytes_sent = %llu\n",
+	    (unsigned long long)lws_stats.bytes);
+	fprintf(fp, "msgs_per_frame = %.2f\n", lws_stats.frames != 0 ?
+	    lws_stats.msgs / (double)lws_stats.frames : 0.0);
+	fprintf(fp, "deflate_bytes_in = %llu\n",
+	    (unsigned long long)lws_stats.deflate_in);
+	fprintf(fp, "deflate_bytes_out = %llu\n",
+	    (unsigned long long)lws_stats.deflate_out);
+	fprintf(fp, "deflate_ratio = %.3f\n", lws_stats.deflate_out != 0 ?
+	    lws_stats.deflate_in / (double)lws_stats.deflate_out : 0.0);
+	fprintf(fp, "write_cpu_ns = %llu\n",
+	    (unsigned long long)lws_stats.write_cpu_ns);
+	fprintf(fp, "write_cpu_ns_per_byte = %.2f\n", lws_stats.bytes != 0 ?
+	    lws_stats.write_cpu_ns / (double)lws_stats.bytes : 0.0);
+
+	find_max_outbuf(&conns_tcp_lock, &conns_tcp, &max_outbuf,
+	    max_outbuf_addr);
+	find_max_outbuf(&conns_lws_lock, &conns_lws, &max_outbuf,
+	    max_outbuf_addr);
+	mutex_enter(&out_lock);
+	fprintf(fp, "output_bytes_pending = %llu\n",
+	    (unsigned long long)out_stats.pending);
+	fprintf(fp, "output_bytes_peak = %llu\n",
+	    (unsigned long long)out_stats.peak);
+	fprintf(fp, "output_conns_congested = %u\n", out_stats.congested);
+	fprintf(fp, "output_congestion_events = %llu\n",
+	    (unsigned long long)out_stats.congest_events);
+	fprintf(fp, "output_msgs_deferred = %llu\n",
+	    (unsigned long long)out_stats.deferred);
+	fprintf(fp, "output_conns_paused = %llu\n",
+	    (unsigned long long)out_stats.paused);
+	fprintf(fp, "output_conns_dropped = %llu\n",
+	    (unsigned long long)out_stats.dropped);
+	for (int i = 0; i < CPDLC_NUM_PRIOS; i++) {
+		static const char *prio_names[CPDLC_NUM_PRIOS] = {
+		    "normal", "urgent", "distress"
+		};
+		uint64_t msgs = out_stats.prio[i].msgs;
+
+		fprintf(fp, "output_%s_msgs = %llu\n", prio_names[i],
+		    (unsigned long long)msgs);
+		fprintf(fp, "output_%s_latency_avg_us = %llu\n",
+		    prio_names[i], (unsigned long long)(msgs != 0 ?
+		    out_stats.prio[i].lat_sum / msgs : 0));
+		fprintf(fp, "output_%s_latency_max_us = %llu\n",
+		    prio_names[i],
+		    (unsigned long long)out_stats.prio[i].lat_max);
+	}
+	mutex_exit(&out_lock);
+	fprintf(fp, "output_max_conn_bytes = %llu\n",
+	    (unsigned long long)max_outbuf);
+	fprintf(fp, "output_max_conn_addr = %s\n", max_outbuf_addr);
+	ratelimit_write_stats(fp);
+	latency_write_stats(fp);
+#ifdef	CPDLC_LOCK_PROFILE
+	cpdlc_lockprof_dump(fp);
+#endif
+	fclose(fp);
+
+	if (rename(tmp_filename, stats_file) != 0) {
+		logMsg("Can't rename stats file %s to %s: %s",
+		    tmp_filename, stats_file, strerror(errno));
+	}
+	free(tmp_filename);
+}
+
+/*
+ * Dumps the flight recorders of all connections logged on as `key', on
+ * request of flightrec_handle_requests.
+ */
+static void
+dump_flightrec_cb(callsign_key_t key, void *userinfo)
+{
+	const list_t *l;
+	char ident[CALLSIGN_LEN];
+
+	UNUSED(userinfo);
+	callsign_key2str(key, ident);
+
+	mutex_enter(&conns_by_from_lock);
+	l = conns_by_from_lookup(key);
+	if (l == NULL) {
+		logMsg("Can't dump flight recorder of %s: not logged on",
+		    ident);
+	}
+	for (const ident_list_t *idl = (l != NULL ? list_head(l) : NULL);
+	    idl != NULL; idl = list_next(l, idl)) {
+		flightrec_dump(idl->conn->fr, ident, idl->conn->addr_str,
+		    "requested");
+	}
+	mutex_exit(&conns_by_from_lock);
+}
+
 /*
  * Initializes our global TLS parameters.
  */
@@ -2467,6 +4968,9 @@ tls_init(void)
 	    GNUTLS_SEC_PARAM_HIGH);
 #endif	/* GNUTLS_VERSION_NUMBER */
 	TLS_CHK(gnutls_priority_init(&prio_cache, NULL, NULL));
+	/* Unless we've inherited one during a takeover */
+	if (tls_ticket_key.data == NULL)
+		TLS_CHK(gnutls_session_ticket_key_generate(&tls_ticket_key));
 
 	return (true);
 #undef	TLS_CHK
@@ -2481,6 +4985,8 @@ tls_fini(void)
 {
 	gnutls_certificate_free_credentials(x509_creds);
 	gnutls_priority_deinit(prio_cache);
+	gnutls_free(tls_ticket_key.data);
+	tls_ticket_key.data = NULL;
 	gnutls_global_deinit();
 }
 
@@ -2497,6 +5003,20 @@ handle_sighup(int signum)
 	msglog_reopen();
 }
 
+static void
+handle_sigusr1(int signum)
+{
+	UNUSED(signum);
+	stats_requested = 1;
+}
+
+static void
+handle_sigusr2(int signum)
+{
+	UNUSED(signum);
+	flightrec_request();
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -2504,7 +5024,11 @@ main(int argc, char *argv[])
 	const char *conf_path = NULL;
 	bool encrypt_silent = false;
 	const struct sigaction sa_hup = { .sa_handler = handle_sighup };
+	const struct sigaction sa_usr1 = { .sa_handler = handle_sigusr1 };
+	const struct sigaction sa_usr2 = { .sa_handler = handle_sigusr2 };
 
+	/* LWS may only ever be called from this thread */
+	is_main_thread = true;
 	/* Initialize libacfutils' logMsg and crc64 functions */
 	log_init(log_dbg_string, "cpdlcd");
 	crc64_init();
@@ -2515,7 +5039,7 @@ main(int argc, char *argv[])
 	lacf_strlcpy(tls_keyfile, "cpdlcd_key.pem", sizeof (tls_keyfile));
 	lacf_strlcpy(tls_certfile, "cpdlcd_cert.pem", sizeof (tls_certfile));
 
-	while ((opt = getopt(argc, argv, "hc:des")) != -1) {
+	while ((opt = getopt(argc, argv, "hc:dest")) != -1) {
 		switch (opt) {
 		case 'h':
 			print_usage(argv[0], stdout);
@@ -2533,6 +5057,9 @@ main(int argc, char *argv[])
 		case 's':
 			encrypt_silent = true;
 			break;
+		case 't':
+			takeover = true;
+			break;
 		default:
 			print_usage(argv[0], stderr);
 			return (1);
@@ -2551,9 +5078,12 @@ main(int argc, char *argv[])
 	(void) blocklist_refresh();
 
 	sigaction(SIGHUP, &sa_hup, NULL);
+	sigaction(SIGUSR1, &sa_usr1, NULL);
+	sigaction(SIGUSR2, &sa_usr2, NULL);
 
 	while (!do_shutdown) {
 		poll_sockets();
+		resume_paused_conns();
 		handle_lws_input();
 		complete_logons();
 		handle_queued_msgs();
@@ -2561,16 +5091,30 @@ main(int argc, char *argv[])
 			close_blocked_conns();
 		close_timedout_conns();
 		write_logon_list();
+		write_stats();
+		flightrec_handle_requests(dump_flightrec_cb, NULL);
+		handle_handoff();
+		drain_conns();
 	}
 
+	/* Must go first, the cluster thread calls back into us */
+	cluster_fini();
 	msgquota_fini();
+	ratelimit_fini();
+	peercred_fini();
 	auth_fini();
 	msg_router_fini();
 	tls_fini();
 	fini_structs();
+	logondir_fini();
 	curl_global_cleanup();
-	free(logon_cmd);
-	free(logoff_cmd);
+	hooks_fini();
+	if (handoff_listen_fd != -1) {
+		close(handoff_listen_fd);
+		unlink(handoff_path);
+	}
+	if (handoff_peer_fd != -1)
+		close(handoff_peer_fd);
 
 	if (msg_log_file != NULL) {
 		fclose(msg_log_file);
@@ -2582,15 +5126,65 @@ main(int argc, char *argv[])
 }
 
 static void
-lws_worker(void *userinfo)
+lws_pfd_add(struct lws_context *ctx, int fd, short events)
 {
-	listen_lws_t *lws = userinfo;
+	lws_pollfd_t *pfd;
 
-	ASSERT(userinfo != NULL);
-	ASSERT(lws->ctx != NULL);
+	ASSERT(ctx != NULL);
+	ASSERT3S(fd, >=, 0);
+
+	if ((unsigned)fd >= cap_lws_fd2idx) {
+		unsigned new_cap = MAX(cap_lws_fd2idx * 2, (unsigned)fd + 1);
+
+		lws_fd2idx = safe_realloc(lws_fd2idx,
+		    new_cap * sizeof (*lws_fd2idx));
+		for (unsigned i = cap_lws_fd2idx; i < new_cap; i++)
+			lws_fd2idx[i] = -1;
+		cap_lws_fd2idx = new_cap;
+	}
+	ASSERT3S(lws_fd2idx[fd], ==, -1);
+	if (num_lws_pfds == cap_lws_pfds) {
+		cap_lws_pfds = MAX(cap_lws_pfds * 2, 16);
+		lws_pfds = safe_realloc(lws_pfds,
+		    cap_lws_pfds * sizeof (*lws_pfds));
+	}
+	pfd = &lws_pfds[num_lws_pfds];
+	pfd->fd = fd;
+	pfd->events = events;
+	pfd->ctx = ctx;
+	lws_fd2idx[fd] = num_lws_pfds;
+	num_lws_pfds++;
+}
+
+static void
+lws_pfd_del(int fd)
+{
+	int idx;
+
+	ASSERT3S(fd, >=, 0);
+	ASSERT3U(fd, <, cap_lws_fd2idx);
+	idx = lws_fd2idx[fd];
+	ASSERT3S(idx, >=, 0);
+	ASSERT3U(idx, <, num_lws_pfds);
+	/* Move the last entry into the vacated slot */
+	num_lws_pfds--;
+	if ((unsigned)idx != num_lws_pfds) {
+		lws_pfds[idx] = lws_pfds[num_lws_pfds];
+		lws_fd2idx[lws_pfds[idx].fd] = idx;
+	}
+	lws_fd2idx[fd] = -1;
+}
+
+static void
+lws_pfd_change(int fd, short events)
+{
+	int idx;
 
-	while (!lws->shutdown)
-		lws_service(lws->ctx, POLL_TIMEOUT);
+	ASSERT3S(fd, >=, 0);
+	ASSERT3U(fd, <, cap_lws_fd2idx);
+	idx = lws_fd2idx[fd];
+	ASSERT3S(idx, >=, 0);
+	lws_pfds[idx].events = events;
 }
 
 static bool
@@ -2598,6 +5192,7 @@ filter_lws_conn(int fd)
 {
 	struct sockaddr_storage sa;
 	socklen_t sa_len = sizeof (sa);
+	char addr[SOCKADDR_STRLEN];
 
 	ASSERT(fd != -1);
 
@@ -2606,14 +5201,13 @@ filter_lws_conn(int fd)
 		logMsg("Error in getpeername: %s", strerror(errno));
 		return (true);
 	}
+	sockaddr2str(&sa, addr);
 	if (!blocklist_check(&sa)) {
-		char addr[SOCKADDR_STRLEN];
-		sockaddr2str(&sa, addr);
 		logMsg("Incoming connection blocked: "
 		    "address %s on blocklist.", addr);
 		return (true);
 	}
-	return (false);
+	return (!check_conn_ratelimit(ratelimit_addr_key(&sa), addr));
 }
 
 static void
@@ -2640,6 +5234,8 @@ conn_established_lws(conn_t *conn, struct lws *wsi)
 	VERIFY0(getpeername(fd, (struct sockaddr *)&conn->sockaddr,
 	    &sa_len));
 	sockaddr2str(&conn->sockaddr, conn->addr_str);
+	conn->addr_key = ratelimit_addr_key(&conn->sockaddr);
+	conn->fr = flightrec_alloc();
 
 	mutex_init(&conn->lock);
 	list_create(&conn->from_list, sizeof (ident_list_t),
@@ -2654,6 +5250,8 @@ static bool
 do_lws_output(conn_t *conn, struct lws *wsi)
 {
 	int bytes;
+	size_t sent;
+	struct timespec ts1, ts2;
 
 	ASSERT(conn != NULL);
 	ASSERT(wsi != NULL);
@@ -2661,36 +5259,97 @@ do_lws_output(conn_t *conn, struct lws *wsi)
 	if (conn->outbuf_sz == 0)
 		return (true);
 
+	/*
+	 * All messages queued up so far go out in a single frame. Any
+	 * compression of the frame happens inside of lws_write.
+	 */
+	VERIFY0(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts1));
 	bytes = lws_write(wsi, &conn->outbuf[conn->outbuf_pre_pad],
 	    conn->outbuf_sz, LWS_WRITE_TEXT);
+	VERIFY0(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts2));
+	lws_stats.write_cpu_ns += (ts2.tv_sec - ts1.tv_sec) * 1000000000ll +
+	    (ts2.tv_nsec - ts1.tv_nsec);
 	if (bytes == -1) {
 		logMsg("Write error on connection from %s", conn->addr_str);
+		conn_failed(conn, "send error");
 		return (false);
 	}
 	if (bytes == 0) {
+		flightrec_event(conn->fr, FR_EV_EAGAIN, 0, conn->outbuf_sz);
 		lws_callback_on_writable(wsi);
 		return (true);
 	}
+	flightrec_event(conn->fr, FR_EV_SEND, 0, conn->outbuf_sz);
+	lws_stats.frames++;
+	lws_stats.msgs += conn->outbuf_msgs;
+	lws_stats.bytes += conn->outbuf_sz;
+
+	sent = conn->outbuf_sz;
 	free(conn->outbuf);
 	conn->outbuf = NULL;
 	conn->outbuf_sz = 0;
+	conn->outbuf_msgs = 0;
+	conn_outbuf_drained(conn, sent);
 
 	return (true);
 }
 
+/*
+ * Wraps the stock LWS permessage-deflate extension to account for how
+ * much it manages to compress our output.
+ */
+static int
+lws_deflate_ext_cb(struct lws_context *ctx, const struct lws_extension *ext,
+    struct lws *wsi, enum lws_extension_callback_reasons reason, void *user,
+    void *in, size_t len)
+{
+	struct lws_tokens *ebuf = in;
+	size_t in_len = 0;
+	int res;
+
+	if (reason == LWS_EXT_CB_PAYLOAD_TX) {
+		ASSERT(ebuf != NULL);
+		in_len = ebuf->len;
+	}
+	res = lws_extension_callback_pm_deflate(ctx, ext, wsi, reason, user,
+	    in, len);
+	if (reason == LWS_EXT_CB_PAYLOAD_TX && res >= 0) {
+		lws_stats.deflate_in += in_len;
+		lws_stats.deflate_out += ebuf->len;
+	}
+
+	return (res);
+}
+
 static int
 http_lws_cb(struct lws *wsi, enum lws_callback_reasons reason, void *user,
     void *in, size_t len)
 {
-	CPDLC_UNUSED(wsi);
 	CPDLC_UNUSED(user);
-	CPDLC_UNUSED(in);
 	CPDLC_UNUSED(len);
 
 	switch (reason) {
 	case LWS_CALLBACK_FILTER_NETWORK_CONNECTION:
 		/* The `in' pointer is actually the new socket fd */
 		return (filter_lws_conn((intptr_t)in));
+	case LWS_CALLBACK_ADD_POLL_FD: {
+		const struct lws_pollargs *pa = in;
+		ASSERT(is_main_thread);
+		lws_pfd_add(lws_get_context(wsi), pa->fd, pa->events);
+		break;
+	}
+	case LWS_CALLBACK_DEL_POLL_FD: {
+		const struct lws_pollargs *pa = in;
+		ASSERT(is_main_thread);
+		lws_pfd_del(pa->fd);
+		break;
+	}
+	case LWS_CALLBACK_CHANGE_MODE_POLL_FD: {
+		const struct lws_pollargs *pa = in;
+		ASSERT(is_main_thread);
+		lws_pfd_change(pa->fd, pa->events);
+		break;
+	}
 	default:
 		break;
 	}
@@ -2725,19 +5384,23 @@ cpdlc_lws_cb(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 		ASSERT(conn != NULL);
 		if (conn->kill_wsi)
 			return (-1);
+		flightrec_event(conn->fr, FR_EV_READ, 0, len);
 		if (!sanitize_input(in, len)) {
 			logMsg("Invalid input character on connection from "
 			    "%s: data MUST be plain text", conn->addr_str);
+			conn_failed(conn, "invalid input");
 			return (-1);
 		}
 		mutex_enter(&conn->lock);
-		conn->inbuf = safe_realloc(conn->inbuf,
-		    conn->inbuf_sz + len + 1);
+		conn->inbuf = safe_realloc(conn->inbuf, conn->inbuf_sz + len);
 		memcpy(&conn->inbuf[conn->inbuf_sz], in, len);
 		conn->inbuf_sz += len;
-		conn->inbuf[conn->inbuf_sz] = '\0';
 		mutex_exit(&conn->lock);
-		wake_up_main_thread();
+		conn_throttle(conn, ratelimit_charge(RL_ADDR_BYTES,
+		    conn->addr_key, len));
+		/* Processed by handle_lws_input once servicing is done */
+		if (!list_link_active(&conn->lws_ready_node))
+			list_insert_tail(&conns_lws_ready, conn);
 		break;
 	case LWS_CALLBACK_SERVER_WRITEABLE:
 		ASSERT(conn != NULL);
@@ -0,0 +1,375 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Per-connection event flight recorder. Every connection gets a fixed
+ * size ring of its most recent events, each stamped with the monotonic
+ * clock. Events can be recorded by any thread without locking: a writer
+ * claims a slot by atomically bumping the ring's head and then fills it
+ * in, marking the slot's sequence number as zero while doing so. Dumps
+ * use the sequence numbers to skip slots which are being overwritten
+ * under their feet.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+#include <acfutils/log.h>
+#include <acfutils/safe_alloc.h>
+
+#include "flightrec.h"
+
+#define	DFL_RING_EVENTS		256
+#define	MAX_RING_EVENTS		65536
+
+typedef struct {
+	/* event number + 1, or 0 if the slot is unused or being written */
+	atomic_uint_fast32_t	seq;
+	uint16_t		type;	/* fr_ev_t */
+	uint16_t		aux;
+	uint64_t		ts;	/* CLOCK_MONOTONIC, nanoseconds */
+	uint64_t		arg;
+} fr_event_t;
+
+struct flightrec_s {
+	atomic_uint_fast32_t	head;	/* number of events recorded */
+	fr_event_t		evs[];
+};
+
+static const char *ev_names[FR_NUM_EVS] = {
+    [FR_EV_READ] = "read",
+    [FR_EV_DECODE] = "decode",
+    [FR_EV_LOGON] = "logon",
+    [FR_EV_FORWARD] = "forward",
+    [FR_EV_ENQUEUE] = "enqueue",
+    [FR_EV_REFUSED] = "refused",
+    [FR_EV_DEQUEUE] = "dequeue",
+    [FR_EV_SEND] = "send",
+    [FR_EV_SEND_PARTIAL] = "send_partial",
+    [FR_EV_EAGAIN] = "eagain",
+    [FR_EV_SENT_MSG] = "sent_msg",
+    [FR_EV_PAUSE] = "pause",
+    [FR_EV_RESUME] = "resume",
+    [FR_EV_ERROR] = "error"
+};
+static const char *prio_names[] = { "normal", "urgent", "distress" };
+
+/* empty if the flight recorder is disabled */
+static char		dump_dir[PATH_MAX] = "";
+/* number of events per connection, always a power of 2 */
+static unsigned		ring_events = DFL_RING_EVENTS;
+static atomic_uint	dump_seq = 0;
+static volatile sig_atomic_t requested = 0;
+
+static uint64_t
+mono_now(void)
+{
+	struct timespec ts;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return (ts.tv_sec * 1000000000llu + ts.tv_nsec);
+}
+
+/*
+ * Reads the flight recorder configuration. Setting "flightrec/dir"
+ * enables the flight recorder.
+ */
+bool
+flightrec_init(const conf_t *conf)
+{
+	const char *value;
+	int events;
+
+	ASSERT(conf != NULL);
+
+	if (conf_get_str(conf, "flightrec/dir", &value))
+		lacf_strlcpy(dump_dir, value, sizeof (dump_dir));
+	if (conf_get_i(conf, "flightrec/events", &events)) {
+		if (events < 1 || events > MAX_RING_EVENTS) {
+			logMsg("Invalid flightrec/events %d: must be between "
+			    "1 and %d", events, MAX_RING_EVENTS);
+			return (false);
+		}
+		/* round up to a power of 2, so we can mask the head */
+		for (ring_events = 1; ring_events < (unsigned)events;
+		    ring_events <<= 1)
+			;
+	}
+	return (true);
+}
+
+/*
+ * Allocates the event ring for a new connection. Returns NULL if the
+ * flight recorder is disabled. All other functions accept a NULL ring
+ * and do nothing.
+ */
+flightrec_t *
+flightrec_alloc(void)
+{
+	if (dump_dir[0] == '\0')
+		return (NULL);
+	return (safe_calloc(1, sizeof (flightrec_t) +
+	    ring_events * sizeof (fr_event_t)));
+}
+
+void
+flightrec_free(flightrec_t *fr)
+{
+	free(fr);
+}
+
+/*
+ * Records an event on a connection. Safe to call from any thread. See
+ * fr_ev_t for the meaning of `aux' and `arg' for each event type.
+ */
+void
+flightrec_event(flightrec_t *fr, fr_ev_t ev, unsigned aux, uint64_t arg)
+{
+	uint32_t idx;
+	fr_event_t *e;
+
+	ASSERT3U(ev, <, FR_NUM_EVS);
+	if (fr == NULL)
+		return;
+
+	idx = atomic_fetch_add_explicit(&fr->head, 1, memory_order_relaxed);
+	e = &fr->evs[idx & (ring_events - 1)];
+	atomic_store_explicit(&e->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	e->type = ev;
+	e->aux = aux;
+	e->ts = mono_now();
+	e->arg = arg;
+	atomic_store_explicit(&e->seq, idx + 1, memory_order_release);
+}
+
+/*
+ * Copies out event number `idx', returning false if its slot has been
+ * reused or is being written in the meantime.
+ */
+static bool
+read_event(const flightrec_t *fr, uint32_t idx, fr_event_t *out)
+{
+	fr_event_t *e = (fr_event_t *)&fr->evs[idx & (ring_events - 1)];
+	uint32_t seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+
+	if (seq != idx + 1)
+		return (false);
+	out->type = e->type;
+	out->aux = e->aux;
+	out->ts = e->ts;
+	out->arg = e->arg;
+	atomic_thread_fence(memory_order_acquire);
+	return (atomic_load_explicit(&e->seq, memory_order_relaxed) == seq);
+}
+
+static void
+print_event(FILE *fp, const fr_event_t *e)
+{
+	const char *prio = prio_names[MIN(e->aux, ARRAY_NUM_ELEM(prio_names) -
+	    1)];
+	char callsign[CALLSIGN_LEN];
+
+	fprintf(fp, "%-12s", ev_names[e->type]);
+	switch (e->type) {
+	case FR_EV_DECODE:
+		fprintf(fp, " bytes=%llu min=%u", (unsigned long long)e->arg,
+		    e->aux);
+		break;
+	case FR_EV_LOGON:
+		fprintf(fp, " %s", e->aux ? "success" : "failure");
+		break;
+	case FR_EV_FORWARD:
+		callsign_key2str(e->arg, callsign);
+		fprintf(fp, " to=%s min=%u", callsign, e->aux);
+		break;
+	case FR_EV_ENQUEUE:
+		fprintf(fp, " bytes=%llu prio=%s", (unsigned long long)e->arg,
+		    prio);
+		break;
+	case FR_EV_SENT_MSG:
+		fprintf(fp, " latency_us=%llu prio=%s",
+		    (unsigned long long)e->arg, prio);
+		break;
+	case FR_EV_PAUSE:
+	case FR_EV_RESUME:
+	case FR_EV_ERROR:
+		break;
+	default:
+		fprintf(fp, " bytes=%llu", (unsigned long long)e->arg);
+		break;
+	}
+	fprintf(fp, "\n");
+}
+
+/*
+ * Writes out a connection's events into a new file in "flightrec/dir",
+ * named after the connection's logon identity `ident' (or its address,
+ * if it has none), oldest event first. Each event is stamped with its
+ * UTC time of day and the time elapsed since the previous event.
+ */
+void
+flightrec_dump(const flightrec_t *fr, const char *ident,
+    const char *addr_str, const char *reason)
+{
+	uint32_t head, n;
+	uint64_t mono, prev_ts = 0;
+	struct timespec wall;
+	struct tm tm;
+	char datebuf[32], namebuf[128];
+	char *path;
+	FILE *fp;
+
+	ASSERT(addr_str != NULL);
+	ASSERT(reason != NULL);
+	if (fr == NULL)
+		return;
+
+	head = atomic_load_explicit(&fr->head, memory_order_acquire);
+	n = MIN(head, ring_events);
+	VERIFY0(clock_gettime(CLOCK_REALTIME, &wall));
+	mono = mono_now();
+	gmtime_r(&wall.tv_sec, &tm);
+	strftime(datebuf, sizeof (datebuf), "%Y%m%d_%H%M%SZ", &tm);
+	snprintf(namebuf, sizeof (namebuf), "%s-%s-%u.log",
+	    ident != NULL && ident[0] != '\0' ? ident : addr_str, datebuf,
+	    atomic_fetch_add(&dump_seq, 1));
+	/* identities come from clients, don't let them escape dump_dir */
+	for (char *c = namebuf; *c != '\0'; c++) {
+		if (!isalnum(*c) && *c != '-' && *c != '_' && *c != '.')
+			*c = '_';
+	}
+	path = mkpathname(dump_dir, namebuf, NULL);
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		logMsg("Can't write flight recorder dump %s: %s", path,
+		    strerror(errno));
+		free(path);
+		return;
+	}
+	fprintf(fp, "ident = %s\n", ident != NULL ? ident : "");
+	fprintf(fp, "addr = %s\n", addr_str);
+	fprintf(fp, "reason = %s\n", reason);
+	fprintf(fp, "time = %s\n", datebuf);
+	fprintf(fp, "events = %u\n", n);
+	fprintf(fp, "events_lost = %u\n", head - n);
+	for (uint32_t idx = head - n; idx != head; idx++) {
+		fr_event_t e;
+		int64_t ago_ns;
+		time_t t;
+		long ns;
+
+		if (!read_event(fr, idx, &e)) {
+			fprintf(fp, "(overwritten)\n");
+			continue;
+		}
+		/* convert the monotonic timestamp to wall clock time */
+		ago_ns = (int64_t)(mono - e.ts);
+		t = wall.tv_sec - ago_ns / 1000000000;
+		ns = wall.tv_nsec - ago_ns % 1000000000;
+		if (ns < 0) {
+			ns += 1000000000;
+			t--;
+		}
+		gmtime_r(&t, &tm);
+		strftime(datebuf, sizeof (datebuf), "%H:%M:%S", &tm);
+		fprintf(fp, "%s.%06ld +%-10llu ", datebuf, ns / 1000,
+		    (unsigned long long)(prev_ts != 0 && e.ts > prev_ts ?
+		    (e.ts - prev_ts) / 1000 : 0));
+		print_event(fp, &e);
+		prev_ts = e.ts;
+	}
+	fclose(fp);
+	logMsg("Flight recorder of %s (%s) dumped to %s",
+	    ident != NULL ? ident : "-", addr_str, path);
+	free(path);
+}
+
+/*
+ * Asks for the connections listed in the "request" file in
+ * "flightrec/dir" to be dumped. Async-signal-safe, the actual work is
+ * done by the next call to flightrec_handle_requests.
+ */
+void
+flightrec_request(void)
+{
+	requested = 1;
+}
+
+/*
+ * If flightrec_request has been called, reads the callsigns listed in
+ * the "request" file (separated by whitespace) and calls `cb' for each
+ * of them to dump the flight recorders of their connections. The file
+ * is removed afterwards.
+ */
+void
+flightrec_handle_requests(void (*cb)(callsign_key_t key, void *userinfo),
+    void *userinfo)
+{
+	char *path;
+	FILE *fp;
+	char callsign[CALLSIGN_LEN];
+
+	ASSERT(cb != NULL);
+
+	if (!requested)
+		return;
+	requested = 0;
+	if (dump_dir[0] == '\0') {
+		logMsg("Flight recorder dump requested, but flightrec/dir "
+		    "isn't set");
+		return;
+	}
+	path = mkpathname(dump_dir, "request", NULL);
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		logMsg("Can't read flight recorder requests from %s: %s",
+		    path, strerror(errno));
+		free(path);
+		return;
+	}
+	while (fscanf(fp, "%15s", callsign) == 1) {
+		if (strlen(callsign) > sizeof (callsign_key_t)) {
+			logMsg("Ignoring flight recorder request for \"%s\": "
+			    "callsign too long", callsign);
+			/* Skip the rest of an overlong word */
+			(void) fscanf(fp, "%*[^ \t\r\n]");
+			continue;
+		}
+		cb(callsign_key(callsign), userinfo);
+	}
+	fclose(fp);
+	unlink(path);
+	free(path);
+}
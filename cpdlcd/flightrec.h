@@ -0,0 +1,83 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_CPDLCD_FLIGHTREC_H_
+#define	_CPDLCD_FLIGHTREC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <acfutils/conf.h>
+
+#include "callsign.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Per-connection flight recorder. Each connection keeps a ring of its
+ * most recent I/O and message handling events, which gets dumped to a
+ * file for post-mortem analysis when the connection fails, or on demand.
+ */
+typedef enum {
+	FR_EV_READ,		/* arg: bytes read from the network */
+	FR_EV_DECODE,		/* arg: bytes consumed, aux: MIN */
+	FR_EV_LOGON,		/* aux: 1 if successful, 0 if not */
+	FR_EV_FORWARD,		/* arg: recipient callsign key, aux: MIN */
+	FR_EV_ENQUEUE,		/* arg: bytes added to outbuf, aux: prio */
+	FR_EV_REFUSED,		/* arg: bytes refused on congestion */
+	FR_EV_DEQUEUE,		/* arg: bytes delivered from the msg queue */
+	FR_EV_SEND,		/* arg: bytes sent to the network */
+	FR_EV_SEND_PARTIAL,	/* arg: bytes sent, some output left over */
+	FR_EV_EAGAIN,		/* arg: bytes which couldn't be sent */
+	FR_EV_SENT_MSG,		/* arg: us between enqueue & send, aux: prio */
+	FR_EV_PAUSE,		/* input processing paused */
+	FR_EV_RESUME,		/* input processing resumed */
+	FR_EV_ERROR,		/* connection failed */
+	FR_NUM_EVS
+} fr_ev_t;
+
+typedef struct flightrec_s flightrec_t;
+
+bool flightrec_init(const conf_t *conf);
+
+flightrec_t *flightrec_alloc(void);
+void flightrec_free(flightrec_t *fr);
+
+void flightrec_event(flightrec_t *fr, fr_ev_t ev, unsigned aux,
+    uint64_t arg);
+void flightrec_dump(const flightrec_t *fr, const char *ident,
+    const char *addr_str, const char *reason);
+
+void flightrec_request(void);
+void flightrec_handle_requests(void (*cb)(callsign_key_t key,
+    void *userinfo), void *userinfo);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _CPDLCD_FLIGHTREC_H_ */
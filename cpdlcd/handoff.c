@@ -0,0 +1,380 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/log.h>
+#include <acfutils/safe_alloc.h>
+
+#include "handoff.h"
+
+#ifndef	MSG_NOSIGNAL
+#define	MSG_NOSIGNAL	0
+#endif
+
+typedef struct {
+	uint32_t	type;
+	uint32_t	len;
+} handoff_hdr_t;
+
+static bool
+make_addr(const char *path, struct sockaddr_un *addr)
+{
+	ASSERT(path != NULL);
+	ASSERT(addr != NULL);
+
+	memset(addr, 0, sizeof (*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof (addr->sun_path)) {
+		logMsg("Handoff socket path %s is too long", path);
+		return (false);
+	}
+	strcpy(addr->sun_path, path);
+
+	return (true);
+}
+
+static void
+set_cloexec(int fd)
+{
+	(void) fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+}
+
+/*
+ * Creates the handoff listen socket at `path', replacing any socket
+ * already present there. The socket is only accessible to our own user,
+ * since whoever connects to it gets to take over the server.
+ * Returns the socket fd, or -1 on error.
+ */
+int
+handoff_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	mode_t old_umask;
+	int fd;
+
+	if (!make_addr(path, &addr))
+		return (-1);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		logMsg("Can't create handoff socket: %s", strerror(errno));
+		return (-1);
+	}
+	set_cloexec(fd);
+	(void) unlink(path);
+	old_umask = umask(077);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof (addr)) != 0) {
+		logMsg("Can't bind handoff socket %s: %s", path,
+		    strerror(errno));
+		umask(old_umask);
+		close(fd);
+		return (-1);
+	}
+	umask(old_umask);
+	if (listen(fd, 1) != 0) {
+		logMsg("Can't listen on handoff socket %s: %s", path,
+		    strerror(errno));
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+/*
+ * Accepts a new instance connecting to our handoff listen socket.
+ * Returns the connected socket, or -1 on error.
+ */
+int
+handoff_accept(int listen_fd)
+{
+	int fd;
+
+	ASSERT3S(listen_fd, >=, 0);
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			logMsg("Error accepting handoff connection: %s",
+			    strerror(errno));
+		}
+		return (-1);
+	}
+	set_cloexec(fd);
+
+	return (fd);
+}
+
+/*
+ * Connects to the handoff socket of a running instance.
+ * Returns the connected socket, or -1 on error.
+ */
+int
+handoff_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (!make_addr(path, &addr))
+		return (-1);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		logMsg("Can't create handoff socket: %s", strerror(errno));
+		return (-1);
+	}
+	set_cloexec(fd);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof (addr)) != 0) {
+		logMsg("Can't connect to running instance on %s: %s", path,
+		    strerror(errno));
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+static bool
+send_all(int sock, const uint8_t *buf, size_t len)
+{
+	while (len != 0) {
+		ssize_t bytes = send(sock, buf, len, MSG_NOSIGNAL);
+
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			logMsg("Handoff send error: %s", strerror(errno));
+			return (false);
+		}
+		buf += bytes;
+		len -= bytes;
+	}
+	return (true);
+}
+
+static bool
+recv_all(int sock, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+
+	while (len != 0) {
+		ssize_t bytes = recv(sock, p, len, MSG_WAITALL);
+
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			logMsg("Handoff receive error: %s", strerror(errno));
+			return (false);
+		}
+		if (bytes == 0) {
+			logMsg("Handoff connection closed mid-record");
+			return (false);
+		}
+		p += bytes;
+		len -= bytes;
+	}
+	return (true);
+}
+
+/*
+ * Sends a single record over a handoff connection. If `fd' is not -1,
+ * the file descriptor is passed along with the record. The receiver gets
+ * its own copy of the descriptor, so the caller is free to close `fd'
+ * once this returns.
+ */
+bool
+handoff_send(int sock, handoff_rec_type_t type, const void *buf, size_t len,
+    int fd)
+{
+	handoff_hdr_t hdr = { .type = type, .len = len };
+	union {
+		struct cmsghdr	align;
+		char		buf[CMSG_SPACE(sizeof (int))];
+	} cmsgbuf;
+	struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof (hdr) };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+	ssize_t bytes;
+
+	ASSERT3S(sock, >=, 0);
+	ASSERT(buf != NULL || len == 0);
+	ASSERT3U(len, <=, HANDOFF_MAX_REC_LEN);
+
+	if (fd != -1) {
+		struct cmsghdr *cmsg;
+
+		memset(&cmsgbuf, 0, sizeof (cmsgbuf));
+		mh.msg_control = cmsgbuf.buf;
+		mh.msg_controllen = sizeof (cmsgbuf.buf);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof (int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof (int));
+	}
+	/*
+	 * The descriptor travels with the first byte of the header, so only
+	 * the header goes out via sendmsg. The rest is plain stream data.
+	 */
+	do {
+		bytes = sendmsg(sock, &mh, MSG_NOSIGNAL);
+	} while (bytes < 0 && errno == EINTR);
+	if (bytes < 0) {
+		logMsg("Handoff send error: %s", strerror(errno));
+		return (false);
+	}
+	if (!send_all(sock, (uint8_t *)&hdr + bytes, sizeof (hdr) - bytes))
+		return (false);
+
+	return (send_all(sock, buf, len));
+}
+
+/*
+ * Receives a single record from a handoff connection. This blocks until
+ * the whole record has been received. On success, `buf' is set to a
+ * newly allocated buffer holding the record's payload (NUL-terminated
+ * for convenience, but `len' excludes the terminator), and `fd' is set
+ * to the passed descriptor, or -1 if the record didn't carry one.
+ *
+ * @return True on success. False on error, or if the remote end closed
+ *	the connection (in which case `type' is set to 0).
+ */
+bool
+handoff_recv(int sock, handoff_rec_type_t *type, void **buf, size_t *len,
+    int *fd)
+{
+	handoff_hdr_t hdr;
+	union {
+		struct cmsghdr	align;
+		char		buf[CMSG_SPACE(sizeof (int))];
+	} cmsgbuf;
+	struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof (hdr) };
+	struct msghdr mh = {
+	    .msg_iov = &iov, .msg_iovlen = 1,
+	    .msg_control = cmsgbuf.buf, .msg_controllen = sizeof (cmsgbuf.buf)
+	};
+	ssize_t bytes;
+	uint8_t *payload;
+
+	ASSERT3S(sock, >=, 0);
+	ASSERT(type != NULL);
+	ASSERT(buf != NULL);
+	ASSERT(len != NULL);
+	ASSERT(fd != NULL);
+
+	*type = 0;
+	*fd = -1;
+	do {
+		bytes = recvmsg(sock, &mh, 0);
+	} while (bytes < 0 && errno == EINTR);
+	if (bytes < 0) {
+		logMsg("Handoff receive error: %s", strerror(errno));
+		return (false);
+	}
+	if (bytes == 0)
+		return (false);
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS &&
+		    cmsg->cmsg_len == CMSG_LEN(sizeof (int))) {
+			memcpy(fd, CMSG_DATA(cmsg), sizeof (int));
+			set_cloexec(*fd);
+		}
+	}
+	if (!recv_all(sock, (uint8_t *)&hdr + bytes, sizeof (hdr) - bytes))
+		goto errout;
+	if (hdr.len > HANDOFF_MAX_REC_LEN) {
+		logMsg("Handoff record too long (%u bytes)", hdr.len);
+		goto errout;
+	}
+	payload = safe_malloc(hdr.len + 1);
+	if (!recv_all(sock, payload, hdr.len)) {
+		free(payload);
+		goto errout;
+	}
+	payload[hdr.len] = '\0';
+
+	*type = hdr.type;
+	*buf = payload;
+	*len = hdr.len;
+
+	return (true);
+errout:
+	if (*fd != -1) {
+		close(*fd);
+		*fd = -1;
+	}
+	return (false);
+}
+
+/*
+ * Waits for the new instance to acknowledge the records sent so far (see
+ * HANDOFF_QUEUE_END). Gives up after HANDOFF_ACK_TIMEOUT seconds.
+ *
+ * @return True if HANDOFF_ACK has been received, false otherwise.
+ */
+bool
+handoff_wait_ack(int sock)
+{
+	struct pollfd pfd = { .fd = sock, .events = POLLIN };
+	handoff_rec_type_t type;
+	void *buf;
+	size_t len;
+	int fd, res;
+
+	ASSERT3S(sock, >=, 0);
+
+	do {
+		res = poll(&pfd, 1, HANDOFF_ACK_TIMEOUT * 1000);
+	} while (res < 0 && errno == EINTR);
+	if (res <= 0) {
+		logMsg("Handoff error: new instance didn't acknowledge our "
+		    "queued messages");
+		return (false);
+	}
+	if (!handoff_recv(sock, &type, &buf, &len, &fd)) {
+		logMsg("Handoff error: connection to new instance lost");
+		return (false);
+	}
+	free(buf);
+	if (fd != -1)
+		close(fd);
+	if (type != HANDOFF_ACK) {
+		logMsg("Handoff error: expected acknowledgement, got record "
+		    "type %d", type);
+		return (false);
+	}
+	return (true);
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_CPDLCD_HANDOFF_H_
+#define	_CPDLCD_HANDOFF_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Hot-restart state handoff between two cpdlcd instances. The running
+ * instance listens on an AF_UNIX socket. A newly started instance
+ * connects to it and receives a sequence of records, with file
+ * descriptors attached using SCM_RIGHTS where needed. This module only
+ * implements the transport. The contents of the records are up to the
+ * caller.
+ *
+ * The running instance first sends its ticket key, listen sockets and
+ * the contents of its delayed-delivery queue, followed by
+ * HANDOFF_QUEUE_END. The new instance acknowledges those with
+ * HANDOFF_ACK. Only then does the running instance drop its queue, so a
+ * failed handoff never leaves the same message queued in both instances.
+ * After HANDOFF_DONE, the running instance hands over its plain-text
+ * connections and the logon state of its TLS connections.
+ */
+typedef enum {
+	HANDOFF_TICKET_KEY = 1,	/* TLS session ticket encryption key */
+	HANDOFF_LISTEN_SOCK,	/* sockaddr of a listen socket + its fd */
+	HANDOFF_QUEUED_MSG,	/* handoff_qmsg_t */
+	HANDOFF_DONE,		/* sender has released its listen sockets */
+	HANDOFF_QUEUE_END,	/* end of the queue, receiver must ACK */
+	HANDOFF_ACK,		/* receiver has taken over the queue */
+	HANDOFF_CONN,		/* handoff_conn_t + the connection's fd */
+	HANDOFF_RESUME		/* handoff_resume_t */
+} handoff_rec_type_t;
+
+#define	HANDOFF_MAX_REC_LEN	65536	/* bytes */
+#define	HANDOFF_ACK_TIMEOUT	10	/* seconds */
+
+/*
+ * A message from the delayed-delivery queue. `msg' is the encoded message
+ * and is NOT NUL-terminated (its length follows from the record length).
+ */
+typedef struct {
+	uint64_t	from;
+	uint64_t	to;
+	int64_t		created;
+	uint8_t		is_atc;
+	char		msg[];
+} handoff_qmsg_t;
+
+/*
+ * Logon state of a connection. If the connection is logged on,
+ * `num_idents' of its logon identities follow the record it is part of,
+ * each a NUL-terminated callsign of CALLSIGN_LEN bytes.
+ */
+typedef struct {
+	char		to[CALLSIGN_LEN];
+	uint8_t		is_atc;
+	uint8_t		fmt_plain;
+	uint8_t		fmt_arinc622;
+	uint8_t		srv_ts;
+	uint32_t	num_idents;
+} handoff_logon_t;
+
+/*
+ * A plain-text (Unix-domain) connection, which the new instance takes
+ * over as it is. The connection's socket is attached to the record.
+ * `data' holds the logon identities, followed by `inbuf_sz' bytes of
+ * input which haven't formed a complete message yet.
+ */
+typedef struct {
+	char		addr_str[SOCKADDR_STRLEN];
+	uint64_t	addr_key;
+	handoff_logon_t	logon;
+	uint32_t	inbuf_sz;
+	char		data[];
+} handoff_conn_t;
+
+/*
+ * Logon state of a TLS connection. A TLS session can't be handed over,
+ * so these connections are drained. When the client reconnects to the
+ * new instance from the same address and resumes its TLS session (both
+ * instances share the session ticket key), the new instance restores
+ * its logon. `idents' holds the logon identities.
+ */
+typedef struct {
+	uint8_t		session_id[32];
+	uint32_t	session_id_len;
+	uint64_t	addr_key;
+	handoff_logon_t	logon;
+	char		idents[][CALLSIGN_LEN];
+} handoff_resume_t;
+
+int handoff_listen(const char *path);
+int handoff_accept(int listen_fd);
+int handoff_connect(const char *path);
+
+bool handoff_send(int sock, handoff_rec_type_t type, const void *buf,
+    size_t len, int fd);
+bool handoff_recv(int sock, handoff_rec_type_t *type, void **buf,
+    size_t *len, int *fd);
+bool handoff_wait_ack(int sock);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _CPDLCD_HANDOFF_H_ */
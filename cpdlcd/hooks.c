@@ -0,0 +1,498 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+#include <acfutils/list.h>
+#include <acfutils/log.h>
+#include <acfutils/safe_alloc.h>
+
+#include "common.h"
+#include "hooks.h"
+
+extern char **environ;
+
+#define	DFL_MAX_RATE	20	/* command invocations per second */
+#define	DFL_QUEUE_MAX	1024	/* events */
+#define	DFL_BATCH_MAX	64	/* events per batch invocation */
+/* keeps a single batch's stdin well within a pipe buffer */
+#define	MAX_BATCH_MAX	256
+#define	HELPER_IDLE_MS	1000	/* child reaping interval when idle */
+
+/*
+ * An event sent from the daemon to the helper. Being smaller than
+ * PIPE_BUF, each write of an event into the pipe is atomic.
+ */
+typedef struct {
+	bool	logon;
+	bool	is_atc;
+	bool	is_lws;
+	char	from[CALLSIGN_LEN];
+	char	to[CALLSIGN_LEN];
+	char	addr[SOCKADDR_STRLEN];
+} hook_evt_t;
+
+CTASSERT(sizeof (hook_evt_t) <= PIPE_BUF);
+
+typedef struct {
+	hook_evt_t	evt;
+	list_node_t	node;
+} hook_qent_t;
+
+typedef struct {
+	list_t		q;
+	unsigned	dropped;
+} hook_queue_t;
+
+/* Daemon-side state */
+static bool	inited = false;
+static int	evt_fd = -1;
+static pid_t	helper_pid = -1;
+
+/* Configuration. This is inherited as-is by the helper process. */
+static char	*logon_cmd = NULL;
+static char	*logoff_cmd = NULL;
+static char	*batch_cmd = NULL;
+static unsigned	max_rate = DFL_MAX_RATE;
+static unsigned	queue_max = DFL_QUEUE_MAX;
+static unsigned	batch_max = DFL_BATCH_MAX;
+
+static char *
+str_subst(char *str, const char *pattern, const char *replace)
+{
+	char *result = NULL;
+	size_t sz = 0;
+	char *srch, *hit;
+
+	ASSERT(str != NULL);
+	ASSERT(pattern != NULL);
+	ASSERT(replace != NULL);
+
+	for (srch = str, hit = strstr(srch, pattern);
+	    srch < str + strlen(str) && hit != NULL;
+	    srch = hit + strlen(pattern), hit = strstr(srch, pattern)) {
+		unsigned l = hit - srch + 1;
+		char *buf = safe_malloc(l);
+
+		strlcpy(buf, srch, l);
+		append_format(&result, &sz, "%s%s", buf, replace);
+		free(buf);
+	}
+	append_format(&result, &sz, "%s", srch);
+	free(str);
+
+	return (result);
+}
+
+static uint64_t
+mono_ms(void)
+{
+	struct timespec ts;
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return (ts.tv_sec * 1000llu + ts.tv_nsec / 1000000);
+}
+
+/*
+ * Runs `cmd' using /bin/sh. If `stdin_fd' is not -1, it is connected
+ * to the command's stdin. `close_fd' (if not -1) is closed in the child.
+ */
+static bool
+spawn_cmd(const char *cmd, int stdin_fd, int close_fd)
+{
+	char *argv[] = { "sh", "-c", (char *)cmd, NULL };
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t sigdef;
+	pid_t pid;
+	int err;
+
+	ASSERT(cmd != NULL);
+
+	posix_spawn_file_actions_init(&fa);
+	if (stdin_fd != -1) {
+		posix_spawn_file_actions_adddup2(&fa, stdin_fd, STDIN_FILENO);
+		posix_spawn_file_actions_addclose(&fa, stdin_fd);
+	}
+	if (close_fd != -1)
+		posix_spawn_file_actions_addclose(&fa, close_fd);
+	/* Don't pass on the signals the helper itself ignores. */
+	posix_spawnattr_init(&attr);
+	sigemptyset(&sigdef);
+	sigaddset(&sigdef, SIGPIPE);
+	sigaddset(&sigdef, SIGHUP);
+	sigaddset(&sigdef, SIGINT);
+	sigaddset(&sigdef, SIGTERM);
+	posix_spawnattr_setsigdefault(&attr, &sigdef);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+	err = posix_spawn(&pid, "/bin/sh", &fa, &attr, argv, environ);
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+	if (err != 0) {
+		logMsg("Can't spawn hook command \"%s\": %s", cmd,
+		    strerror(err));
+		return (false);
+	}
+	return (true);
+}
+
+static void
+run_single(const hook_evt_t *evt)
+{
+	const char *tmpl = (evt->logon ? logon_cmd : logoff_cmd);
+	char *cmd;
+
+	ASSERT(tmpl != NULL);
+	cmd = safe_strdup(tmpl);
+	cmd = str_subst(cmd, "${FROM}", evt->from);
+	cmd = str_subst(cmd, "${TO}", evt->to[0] != '\0' ? evt->to : "-");
+	cmd = str_subst(cmd, "${ADDR}", evt->addr);
+	cmd = str_subst(cmd, "${STATYPE}", evt->is_atc ? "ATC" : "ACFT");
+	cmd = str_subst(cmd, "${CONNTYPE}", evt->is_lws ? "WS" : "TLS");
+	(void) spawn_cmd(cmd, -1, -1);
+	free(cmd);
+}
+
+/*
+ * Pulls up to `batch_max' events off of the queue and passes them to a
+ * single invocation of `batch_cmd' on its stdin, one event per line.
+ */
+static void
+run_batch(hook_queue_t *hq)
+{
+	char *buf = NULL;
+	size_t sz = 0;
+	hook_qent_t *qe;
+	int pfd[2];
+
+	ASSERT(batch_cmd != NULL);
+
+	for (unsigned i = 0; i < batch_max &&
+	    (qe = list_remove_head(&hq->q)) != NULL; i++) {
+		const hook_evt_t *evt = &qe->evt;
+
+		append_format(&buf, &sz, "%s\t%s\t%s\t%s\t%s\t%s\n",
+		    evt->logon ? "LOGON" : "LOGOFF", evt->from,
+		    evt->to[0] != '\0' ? evt->to : "-",
+		    evt->is_atc ? "ATC" : "ACFT", evt->addr,
+		    evt->is_lws ? "WS" : "TLS");
+		free(qe);
+	}
+	if (pipe(pfd) != 0) {
+		logMsg("Can't create hook batch pipe: %s", strerror(errno));
+		free(buf);
+		return;
+	}
+	if (spawn_cmd(batch_cmd, pfd[0], pfd[1])) {
+		close(pfd[0]);
+		for (size_t off = 0; off < sz;) {
+			ssize_t n = write(pfd[1], &buf[off], sz - off);
+
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				/* the command exited without reading */
+				break;
+			}
+			off += n;
+		}
+	} else {
+		close(pfd[0]);
+	}
+	close(pfd[1]);
+	free(buf);
+}
+
+static void
+queue_push(hook_queue_t *hq, const hook_evt_t *evt)
+{
+	hook_qent_t *qe;
+
+	if (list_count(&hq->q) >= queue_max) {
+		free(list_remove_head(&hq->q));
+		hq->dropped++;
+	}
+	qe = safe_calloc(1, sizeof (*qe));
+	qe->evt = *evt;
+	list_insert_tail(&hq->q, qe);
+}
+
+static void
+queue_init(hook_queue_t *hq)
+{
+	list_create(&hq->q, sizeof (hook_qent_t), offsetof(hook_qent_t, node));
+	hq->dropped = 0;
+}
+
+static void
+queue_report_dropped(hook_queue_t *hq, const char *name)
+{
+	if (hq->dropped != 0) {
+		logMsg("%d %s hook events dropped due to queue overflow",
+		    hq->dropped, name);
+		hq->dropped = 0;
+	}
+}
+
+/*
+ * Body of the helper process. Reads events from the daemon, queues them
+ * and runs the hook commands, subject to the rate limit. When the rate
+ * limit holds events back, they accumulate in the queue, so when they
+ * are finally sent to `batch_cmd', they go out in a single invocation.
+ * Once the daemon closes the pipe, any remaining events are flushed
+ * immediately and the helper exits.
+ */
+static void
+helper_main(int fd)
+{
+	hook_queue_t single_q, batch_q;
+	uint8_t buf[64 * sizeof (hook_evt_t)];
+	size_t fill = 0;
+	double tokens = max_rate;
+	uint64_t last_refill = mono_ms();
+	bool eof = false, batch_turn = false;
+
+	/*
+	 * Leave shutdown to the daemon. We exit once it closes the pipe.
+	 */
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGINT, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+	signal(SIGCHLD, SIG_DFL);
+
+	queue_init(&single_q);
+	queue_init(&batch_q);
+
+	for (;;) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		int timeout = HELPER_IDLE_MS;
+		uint64_t now = mono_ms();
+
+		while (waitpid(-1, NULL, WNOHANG) > 0)
+			;
+		if (max_rate != 0) {
+			tokens = MIN(tokens + (now - last_refill) *
+			    max_rate / 1000.0, MAX(max_rate, 1));
+		}
+		last_refill = now;
+
+		while (list_count(&single_q.q) + list_count(&batch_q.q) != 0) {
+			if (max_rate != 0 && !eof) {
+				if (tokens < 1)
+					break;
+				tokens -= 1;
+			}
+			if (list_count(&batch_q.q) != 0 &&
+			    (batch_turn || list_count(&single_q.q) == 0)) {
+				run_batch(&batch_q);
+			} else {
+				hook_qent_t *qe = list_remove_head(&single_q.q);
+				run_single(&qe->evt);
+				free(qe);
+			}
+			batch_turn = !batch_turn;
+		}
+		queue_report_dropped(&single_q, "single");
+		queue_report_dropped(&batch_q, "batch");
+		if (eof)
+			break;
+		if (list_count(&single_q.q) + list_count(&batch_q.q) != 0) {
+			ASSERT(max_rate != 0);
+			timeout = MIN((1 - tokens) * 1000 / max_rate + 1,
+			    HELPER_IDLE_MS);
+		}
+
+		if (poll(&pfd, 1, timeout) <= 0)
+			continue;
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			ssize_t n = read(fd, &buf[fill], sizeof (buf) - fill);
+			size_t off;
+
+			if (n == 0 || (n < 0 && errno != EINTR &&
+			    errno != EAGAIN)) {
+				eof = true;
+				continue;
+			}
+			if (n < 0)
+				continue;
+			fill += n;
+			for (off = 0; fill - off >= sizeof (hook_evt_t);
+			    off += sizeof (hook_evt_t)) {
+				hook_evt_t evt;
+
+				memcpy(&evt, &buf[off], sizeof (evt));
+				/*
+				 * With both kinds of commands configured,
+				 * each event goes to both (see sample.conf).
+				 */
+				if ((evt.logon ? logon_cmd : logoff_cmd) !=
+				    NULL) {
+					queue_push(&single_q, &evt);
+				}
+				if (batch_cmd != NULL)
+					queue_push(&batch_q, &evt);
+			}
+			memmove(buf, &buf[off], fill - off);
+			fill -= off;
+		}
+	}
+
+	_exit(EXIT_SUCCESS);
+}
+
+/*
+ * Parses the hook configuration and, if any hook commands have been
+ * configured, forks off the helper process.
+ */
+bool
+hooks_init(const conf_t *conf)
+{
+	const char *value;
+	int i, pfd[2];
+
+	ASSERT(!inited);
+
+	if (conf_get_str(conf, "logon_cmd", &value))
+		logon_cmd = safe_strdup(value);
+	if (conf_get_str(conf, "logoff_cmd", &value))
+		logoff_cmd = safe_strdup(value);
+	if (conf_get_str(conf, "hooks/batch_cmd", &value))
+		batch_cmd = safe_strdup(value);
+	if (conf_get_i(conf, "hooks/max_rate", &i))
+		max_rate = MAX(i, 0);
+	if (conf_get_i(conf, "hooks/queue_max", &i))
+		queue_max = MAX(i, 1);
+	if (conf_get_i(conf, "hooks/batch_max", &i))
+		batch_max = MIN(MAX(i, 1), MAX_BATCH_MAX);
+
+	if (logon_cmd == NULL && logoff_cmd == NULL && batch_cmd == NULL)
+		return (true);
+
+	if (pipe(pfd) != 0) {
+		logMsg("Can't create hook pipe: %s", strerror(errno));
+		return (false);
+	}
+	/*
+	 * Neither end may leak into any command we start. A command holding
+	 * the write end would keep the helper from seeing EOF at shutdown,
+	 * and one holding the read end could swallow events.
+	 */
+	VERIFY0(fcntl(pfd[0], F_SETFD, FD_CLOEXEC));
+	VERIFY0(fcntl(pfd[1], F_SETFD, FD_CLOEXEC));
+	helper_pid = fork();
+	switch (helper_pid) {
+	case -1:
+		logMsg("Can't start hook helper: fork() failed: %s",
+		    strerror(errno));
+		close(pfd[0]);
+		close(pfd[1]);
+		return (false);
+	case 0:
+		close(pfd[1]);
+		helper_main(pfd[0]);
+		VERIFY_FAIL();
+	default:
+		break;
+	}
+	close(pfd[0]);
+	evt_fd = pfd[1];
+	/*
+	 * Never block the event loop on a backlogged helper. And should the
+	 * helper die, we want EPIPE rather than getting killed by SIGPIPE.
+	 */
+	VERIFY0(fcntl(evt_fd, F_SETFL, fcntl(evt_fd, F_GETFL) | O_NONBLOCK));
+	signal(SIGPIPE, SIG_IGN);
+	inited = true;
+
+	return (true);
+}
+
+/*
+ * Shuts down the helper process. Any events still queued in the helper
+ * are executed before it exits.
+ */
+void
+hooks_fini(void)
+{
+	if (inited) {
+		close(evt_fd);
+		evt_fd = -1;
+		while (waitpid(helper_pid, NULL, 0) < 0 && errno == EINTR)
+			;
+		helper_pid = -1;
+		inited = false;
+	}
+	free(logon_cmd);
+	logon_cmd = NULL;
+	free(logoff_cmd);
+	logoff_cmd = NULL;
+	free(batch_cmd);
+	batch_cmd = NULL;
+}
+
+/*
+ * Submits a LOGON or LOGOFF event to the hook helper. This never blocks.
+ * If the helper can't keep up, the event is dropped.
+ */
+void
+hooks_post(bool logon, const char *from, const char *to, const char *addr,
+    bool is_atc, bool is_lws)
+{
+	hook_evt_t evt = { .logon = logon, .is_atc = is_atc, .is_lws = is_lws };
+
+	ASSERT(from != NULL);
+	ASSERT(to != NULL);
+	ASSERT(addr != NULL);
+
+	if (!inited ||
+	    ((logon ? logon_cmd : logoff_cmd) == NULL && batch_cmd == NULL))
+		return;
+
+	lacf_strlcpy(evt.from, from, sizeof (evt.from));
+	lacf_strlcpy(evt.to, to, sizeof (evt.to));
+	lacf_strlcpy(evt.addr, addr, sizeof (evt.addr));
+	if (write(evt_fd, &evt, sizeof (evt)) != sizeof (evt)) {
+		logMsg("Can't post %s hook event for %s: %s",
+		    logon ? "LOGON" : "LOGOFF", from, errno == EAGAIN ?
+		    "helper is backlogged" : strerror(errno));
+	}
+}
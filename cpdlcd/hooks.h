@@ -0,0 +1,56 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_CPDLCD_HOOKS_H_
+#define	_CPDLCD_HOOKS_H_
+
+#include <stdbool.h>
+
+#include <acfutils/conf.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * LOGON/LOGOFF shell command hooks. Rather than forking the (large)
+ * daemon process on every event, hooks_init forks a small helper process
+ * once. The daemon then simply posts events to the helper over a pipe,
+ * and the helper takes care of rate-limiting, queueing, optional batching
+ * and spawning the actual commands.
+ *
+ * hooks_init MUST be called before any threads are started.
+ */
+bool hooks_init(const conf_t *conf);
+void hooks_fini(void);
+
+void hooks_post(bool logon, const char *from, const char *to,
+    const char *addr, bool is_atc, bool is_lws);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _CPDLCD_HOOKS_H_ */
@@ -0,0 +1,136 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Per-hop latency histograms of messages passing through the server.
+ * Message timestamps are taken from the wall clock (see latency_now),
+ * since they are also sent to clients in the SRVTS= header. Buckets
+ * are decades, starting at 100us. All counters are updated atomically,
+ * so recording is lock-free and can happen from any thread.
+ */
+
+#include <stdatomic.h>
+#include <time.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+
+#include "latency.h"
+
+enum { NUM_BUCKETS = 7 };
+
+typedef struct {
+	const char		*name;
+	atomic_uint_fast64_t	buckets[NUM_BUCKETS];
+	atomic_uint_fast64_t	count;
+	atomic_uint_fast64_t	sum;	/* microseconds */
+	atomic_uint_fast64_t	max;	/* microseconds */
+} lat_hist_t;
+
+/* upper bounds of all but the last bucket, in microseconds */
+static const uint64_t bucket_lim[NUM_BUCKETS - 1] = {
+    100, 1000, 10000, 100000, 1000000, 10000000
+};
+static const char *bucket_names[NUM_BUCKETS] = {
+    "100us", "1ms", "10ms", "100ms", "1s", "10s", "inf"
+};
+
+static lat_hist_t hists[LAT_NUM_HOPS] = {
+    [LAT_HOP_ROUTE] = { .name = "route" },
+    [LAT_HOP_OUTPUT] = { .name = "output" },
+    [LAT_HOP_SERVER] = { .name = "server" }
+};
+
+/*
+ * Returns the current wall clock time in microseconds since the Unix
+ * epoch. This is the time base of the SRVTS= message header.
+ */
+uint64_t
+latency_now(void)
+{
+	struct timespec ts;
+
+	VERIFY0(clock_gettime(CLOCK_REALTIME, &ts));
+	return (ts.tv_sec * 1000000llu + ts.tv_nsec / 1000llu);
+}
+
+/*
+ * Records a message having taken from `start' to `end' (as returned by
+ * latency_now) to pass through a hop. If the wall clock has stepped
+ * backwards in the meantime, the sample is counted as zero.
+ */
+void
+latency_record(lat_hop_t hop, uint64_t start, uint64_t end)
+{
+	lat_hist_t *hist;
+	uint64_t us = (end > start ? end - start : 0);
+	uint64_t max;
+	int b = 0;
+
+	ASSERT3U(hop, <, LAT_NUM_HOPS);
+	hist = &hists[hop];
+
+	while (b < NUM_BUCKETS - 1 && us >= bucket_lim[b])
+		b++;
+	atomic_fetch_add_explicit(&hist->buckets[b], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->sum, us, memory_order_relaxed);
+	max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+	while (us > max && !atomic_compare_exchange_weak_explicit(&hist->max,
+	    &max, us, memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+/*
+ * Writes the histograms as "latency_<hop>_<key> = <value>" lines. The
+ * "lt_<limit>" keys count the messages which took less than <limit>.
+ */
+void
+latency_write_stats(FILE *fp)
+{
+	ASSERT(fp != NULL);
+
+	for (int i = 0; i < LAT_NUM_HOPS; i++) {
+		lat_hist_t *hist = &hists[i];
+		uint64_t count = atomic_load_explicit(&hist->count,
+		    memory_order_relaxed);
+		uint64_t sum = atomic_load_explicit(&hist->sum,
+		    memory_order_relaxed);
+
+		fprintf(fp, "latency_%s_msgs = %llu\n", hist->name,
+		    (unsigned long long)count);
+		fprintf(fp, "latency_%s_avg_us = %llu\n", hist->name,
+		    (unsigned long long)(count != 0 ? sum / count : 0));
+		fprintf(fp, "latency_%s_max_us = %llu\n", hist->name,
+		    (unsigned long long)atomic_load_explicit(&hist->max,
+		    memory_order_relaxed));
+		for (int b = 0; b < NUM_BUCKETS; b++) {
+			fprintf(fp, "latency_%s_lt_%s = %llu\n", hist->name,
+			    bucket_names[b],
+			    (unsigned long long)atomic_load_explicit(
+			    &hist->buckets[b], memory_order_relaxed));
+		}
+	}
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_CPDLCD_LATENCY_H_
+#define	_CPDLCD_LATENCY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	LAT_HOP_ROUTE,	/* received -> routing decision made */
+	LAT_HOP_OUTPUT,	/* queued on recipient conn -> sent out */
+	LAT_HOP_SERVER,	/* received -> sent out to the recipient */
+	LAT_NUM_HOPS
+} lat_hop_t;
+
+uint64_t latency_now(void);
+void latency_record(lat_hop_t hop, uint64_t start, uint64_t end);
+void latency_write_stats(FILE *fp);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _CPDLCD_LATENCY_H_ */
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The plain libacfutils locking calls, for use by the profiling wrappers
+ * in lockprof.h, which we include with LOCKPROF_IMPL defined to keep it
+ * from redirecting them.
+ */
+
+#ifdef	CPDLC_LOCK_PROFILE
+
+#define	LOCKPROF_IMPL
+#include "lockprof.h"
+
+void
+lockprof_mutex_enter(mutex_t *mtx)
+{
+	mutex_enter(mtx);
+}
+
+void
+lockprof_mutex_exit(mutex_t *mtx)
+{
+	cpdlc_lockprof_released(mtx);
+	mutex_exit(mtx);
+}
+
+void
+lockprof_cv_wait(condvar_t *cv, mutex_t *mtx)
+{
+	cpdlc_lockprof_suspend(mtx);
+	cv_wait(cv, mtx);
+	cpdlc_lockprof_resume(mtx);
+}
+
+int
+lockprof_cv_timedwait(condvar_t *cv, mutex_t *mtx, uint64_t limit)
+{
+	int res;
+
+	cpdlc_lockprof_suspend(mtx);
+	res = cv_timedwait(cv, mtx, limit);
+	cpdlc_lockprof_resume(mtx);
+
+	return (res);
+}
+
+#else	/* !CPDLC_LOCK_PROFILE */
+
+/* ISO C forbids empty translation units */
+typedef int lockprof_unused_t;
+
+#endif	/* !CPDLC_LOCK_PROFILE */
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_CPDLCD_LOCKPROF_H_
+#define	_CPDLCD_LOCKPROF_H_
+
+/*
+ * Include this after <acfutils/thread.h>. When built with
+ * CPDLC_LOCK_PROFILE defined, it redirects the libacfutils mutex and
+ * condition variable calls through the lock profiler in
+ * src/cpdlc_lockprof.h, so the daemon's own locks get profiled the same
+ * way the libcpdlc ones are. Otherwise it does nothing.
+ */
+
+#ifdef	CPDLC_LOCK_PROFILE
+
+#include <stdint.h>
+
+#include <acfutils/thread.h>
+
+#include "../src/cpdlc_lockprof.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+void lockprof_mutex_enter(mutex_t *mtx);
+void lockprof_mutex_exit(mutex_t *mtx);
+void lockprof_cv_wait(condvar_t *cv, mutex_t *mtx);
+int lockprof_cv_timedwait(condvar_t *cv, mutex_t *mtx, uint64_t limit);
+
+#ifndef	LOCKPROF_IMPL
+
+#undef	mutex_enter
+#undef	mutex_exit
+#undef	cv_wait
+#undef	cv_timedwait
+
+#define	mutex_enter(mtx) \
+	CPDLC_LOCKPROF_ENTER_UNTRIED(mtx, lockprof_mutex_enter(mtx))
+#define	mutex_exit(mtx)			lockprof_mutex_exit(mtx)
+#define	cv_wait(cv, mtx)		lockprof_cv_wait((cv), (mtx))
+#define	cv_timedwait(cv, mtx, limit)	lockprof_cv_timedwait((cv), (mtx), \
+	(limit))
+
+#endif	/* !LOCKPROF_IMPL */
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* CPDLC_LOCK_PROFILE */
+
+#endif	/* _CPDLCD_LOCKPROF_H_ */
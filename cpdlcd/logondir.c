@@ -0,0 +1,272 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+#include <acfutils/log.h>
+#include <acfutils/safe_alloc.h>
+#include <acfutils/thread.h>
+
+#include "logondir.h"
+#include "lockprof.h"
+
+#define	LOGONDIR_DFL_ENTS	16384
+
+static bool		inited = false;
+static mutex_t		lock;
+static int		fd = -1;
+static void		*map = NULL;
+static size_t		map_sz = 0;
+static logondir_hdr_t	*hdr = NULL;
+static logondir_ent_t	*ents = NULL;
+/* stack of free slot numbers */
+static uint32_t		*free_slots = NULL;
+static uint32_t		num_free = 0;
+static bool		full_warned = false;
+
+static void
+write_begin(void)
+{
+	uint64_t seq = atomic_load_explicit(&hdr->seq, memory_order_relaxed);
+
+	ASSERT0(seq & 1);
+	atomic_store_explicit(&hdr->seq, seq + 1, memory_order_relaxed);
+	/* Readers must see the odd `seq' before any of our table writes. */
+	atomic_thread_fence(memory_order_release);
+}
+
+static void
+write_end(void)
+{
+	uint64_t seq = atomic_load_explicit(&hdr->seq, memory_order_relaxed);
+
+	ASSERT(seq & 1);
+	atomic_store_explicit(&hdr->seq, seq + 1, memory_order_release);
+}
+
+/*
+ * Creates (or takes over) the logon directory file at `path' and sizes
+ * it to hold `max_ents' simultaneous LOGONs (0 selects the default).
+ * An existing file is reused in place, rather than unlinked, so that
+ * monitoring tools which have it mapped can keep reading across a
+ * daemon restart. For the same reason, the file is never shrunk.
+ * A non-empty file which isn't a logon directory of our version is left
+ * untouched, so a misconfigured path can't clobber some other file.
+ */
+bool
+logondir_init(const char *path, unsigned max_ents)
+{
+	struct stat st;
+	uint64_t seq;
+	logondir_hdr_t old_hdr;
+
+	ASSERT(path != NULL);
+	ASSERT(!inited);
+
+	if (max_ents == 0)
+		max_ents = LOGONDIR_DFL_ENTS;
+	map_sz = sizeof (logondir_hdr_t) + max_ents * sizeof (logondir_ent_t);
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd == -1) {
+		logMsg("Can't open logon directory %s: %s", path,
+		    strerror(errno));
+		return (false);
+	}
+	if (fstat(fd, &st) != 0) {
+		logMsg("Can't stat logon directory %s: %s", path,
+		    strerror(errno));
+		goto errout;
+	}
+	if (st.st_size != 0 &&
+	    ((size_t)st.st_size < sizeof (old_hdr) ||
+	    pread(fd, &old_hdr, sizeof (old_hdr), 0) !=
+	    (ssize_t)sizeof (old_hdr) ||
+	    old_hdr.magic != LOGONDIR_MAGIC ||
+	    old_hdr.version != LOGONDIR_VERSION ||
+	    old_hdr.hdr_sz != sizeof (logondir_hdr_t) ||
+	    old_hdr.ent_sz != sizeof (logondir_ent_t))) {
+		logMsg("Can't use logon directory %s: file exists, but "
+		    "isn't a logon directory, or has an incompatible version. "
+		    "Remove it first if you want it replaced.", path);
+		goto errout;
+	}
+	if ((size_t)st.st_size < map_sz && ftruncate(fd, map_sz) != 0) {
+		logMsg("Can't resize logon directory %s: %s", path,
+		    strerror(errno));
+		goto errout;
+	}
+	map = mmap(NULL, map_sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		logMsg("Can't map logon directory %s: %s", path,
+		    strerror(errno));
+		map = NULL;
+		goto errout;
+	}
+	hdr = map;
+	ents = (logondir_ent_t *)(hdr + 1);
+
+	/*
+	 * If the file was left behind by a previous instance, it might
+	 * have been stopped mid-update, leaving `seq' odd. Either way,
+	 * keep `seq' counting forward, so readers can't confuse the
+	 * reinitialized table with an older snapshot.
+	 */
+	seq = atomic_load_explicit(&hdr->seq, memory_order_relaxed);
+	if (seq & 1)
+		atomic_store_explicit(&hdr->seq, seq + 1, memory_order_relaxed);
+	write_begin();
+	memset(ents, 0, max_ents * sizeof (*ents));
+	hdr->magic = LOGONDIR_MAGIC;
+	hdr->version = LOGONDIR_VERSION;
+	hdr->hdr_sz = sizeof (logondir_hdr_t);
+	hdr->ent_sz = sizeof (logondir_ent_t);
+	hdr->num_ents = max_ents;
+	hdr->hi_water = 0;
+	hdr->num_in_use = 0;
+	hdr->writer_pid = getpid();
+	write_end();
+
+	free_slots = safe_malloc(max_ents * sizeof (*free_slots));
+	for (uint32_t i = 0; i < max_ents; i++)
+		free_slots[i] = max_ents - i - 1;
+	num_free = max_ents;
+	full_warned = false;
+
+	mutex_init(&lock);
+	inited = true;
+
+	return (true);
+errout:
+	close(fd);
+	fd = -1;
+	return (false);
+}
+
+void
+logondir_fini(void)
+{
+	if (!inited)
+		return;
+	inited = false;
+
+	write_begin();
+	hdr->writer_pid = 0;
+	write_end();
+
+	munmap(map, map_sz);
+	map = NULL;
+	hdr = NULL;
+	ents = NULL;
+	close(fd);
+	fd = -1;
+	free(free_slots);
+	free_slots = NULL;
+	num_free = 0;
+	mutex_destroy(&lock);
+}
+
+/*
+ * Publishes a new LOGON in the directory.
+ *
+ * @return The slot number of the entry, to be passed to logondir_remove
+ *	once the LOGON ends. Returns -1 if the directory isn't enabled
+ *	or is full. Passing -1 to logondir_remove is a no-op.
+ */
+int
+logondir_add(const char *from, const char *to, const char *addr,
+    bool is_atc, bool is_lws)
+{
+	uint32_t slot;
+	logondir_ent_t *ent;
+
+	ASSERT(from != NULL);
+	ASSERT(to != NULL);
+	ASSERT(addr != NULL);
+
+	if (!inited)
+		return (-1);
+
+	mutex_enter(&lock);
+	if (num_free == 0) {
+		if (!full_warned) {
+			logMsg("Logon directory is full (%d entries), further "
+			    "LOGONs will not be listed", hdr->num_ents);
+			full_warned = true;
+		}
+		mutex_exit(&lock);
+		return (-1);
+	}
+	slot = free_slots[--num_free];
+	ent = &ents[slot];
+
+	write_begin();
+	ASSERT(!ent->in_use);
+	ent->in_use = true;
+	ent->is_atc = is_atc;
+	ent->transport = (is_lws ? LOGONDIR_TRANSPORT_WS :
+	    LOGONDIR_TRANSPORT_TLS);
+	lacf_strlcpy(ent->from, from, sizeof (ent->from));
+	lacf_strlcpy(ent->to, to, sizeof (ent->to));
+	lacf_strlcpy(ent->addr, addr, sizeof (ent->addr));
+	hdr->hi_water = MAX(hdr->hi_water, slot + 1);
+	hdr->num_in_use++;
+	write_end();
+
+	mutex_exit(&lock);
+
+	return (slot);
+}
+
+void
+logondir_remove(int slot)
+{
+	if (!inited || slot < 0)
+		return;
+
+	mutex_enter(&lock);
+	ASSERT3S(slot, <, hdr->num_ents);
+	ASSERT(ents[slot].in_use);
+
+	write_begin();
+	memset(&ents[slot], 0, sizeof (ents[slot]));
+	while (hdr->hi_water > 0 && !ents[hdr->hi_water - 1].in_use)
+		hdr->hi_water--;
+	ASSERT(hdr->num_in_use != 0);
+	hdr->num_in_use--;
+	write_end();
+
+	free_slots[num_free++] = slot;
+
+	mutex_exit(&lock);
+}
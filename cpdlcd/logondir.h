@@ -0,0 +1,118 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_CPDLCD_LOGONDIR_H_
+#define	_CPDLCD_LOGONDIR_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include "common.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * The logon directory is a memory-mapped file containing a table of all
+ * currently active LOGONs to the server. It carries the same information
+ * as the "logon_list_file", but instead of rewriting the whole file on
+ * every LOGON or LOGOFF, cpdlcd only updates the affected table entry
+ * in place. Readers map the file read-only and take consistent snapshots
+ * of the table without any cooperation from the daemon.
+ *
+ * Consistency is provided by a seqlock. Before modifying the table, the
+ * writer increments `seq' to an odd value. Once it is done, it increments
+ * it again to an even value. A reader samples `seq', copies the table
+ * and samples `seq' again. If both samples are equal and even, the copy
+ * is consistent. Otherwise the reader retries, unless `writer_pid' has
+ * exited, in which case `seq' might never become even again.
+ *
+ * The file layout is a logondir_hdr_t, followed by `num_ents' entries of
+ * logondir_ent_t. Only the first `hi_water' entries can ever be in use,
+ * so readers need not copy the remainder of the table.
+ */
+#define	LOGONDIR_MAGIC		0x4c4f474eu	/* "LOGN" */
+#define	LOGONDIR_VERSION	1
+
+typedef enum {
+	LOGONDIR_TRANSPORT_TLS,
+	LOGONDIR_TRANSPORT_WS
+} logondir_transport_t;
+
+typedef struct {
+	uint32_t		magic;
+	uint32_t		version;
+	uint32_t		hdr_sz;
+	uint32_t		ent_sz;
+	uint32_t		num_ents;
+	/* protected by `seq' */
+	uint32_t		hi_water;
+	uint32_t		num_in_use;
+	/* PID of the cpdlcd instance maintaining the directory */
+	int32_t			writer_pid;
+	_Atomic uint64_t	seq;
+} logondir_hdr_t;
+
+typedef struct {
+	bool		in_use;
+	bool		is_atc;
+	uint8_t		transport;	/* logondir_transport_t */
+	char		from[CALLSIGN_LEN];
+	char		to[CALLSIGN_LEN];
+	char		addr[SOCKADDR_STRLEN];
+} logondir_ent_t;
+
+/*
+ * Writer interface, used by cpdlcd.
+ */
+bool logondir_init(const char *path, unsigned max_ents);
+void logondir_fini(void);
+int logondir_add(const char *from, const char *to, const char *addr,
+    bool is_atc, bool is_lws);
+void logondir_remove(int slot);
+
+/*
+ * Reader interface, for monitoring tools. This doesn't depend on any
+ * other part of cpdlcd or libacfutils, so logondir_reader.c can simply
+ * be dropped into any other project.
+ */
+typedef struct logondir_s logondir_t;
+
+logondir_t *logondir_open(const char *path, char *reason, size_t reason_cap);
+void logondir_close(logondir_t *ld);
+bool logondir_writer_alive(const logondir_t *ld);
+ssize_t logondir_snapshot(logondir_t *ld, logondir_ent_t **ents_p,
+    uint64_t *seq_p);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _CPDLCD_LOGONDIR_H_ */
@@ -0,0 +1,229 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Read-only access to the cpdlcd logon directory. See logondir.h for a
+ * description of the file format and the locking protocol. This file
+ * intentionally only depends on libc.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "logondir.h"
+
+/*
+ * How many times logondir_snapshot retries while the writer is in the
+ * middle of an update, before checking whether the writer is still alive.
+ * A writer which died while holding the seqlock leaves `seq' odd forever.
+ */
+#define	SNAPSHOT_ALIVE_CHECK_TRIES	1000
+#define	SNAPSHOT_MAX_TRIES		100000
+
+struct logondir_s {
+	int			fd;
+	const void		*map;
+	size_t			map_sz;
+	const logondir_hdr_t	*hdr;
+	const logondir_ent_t	*ents;
+	uint32_t		num_ents;
+	logondir_ent_t		*buf;
+};
+
+/*
+ * Opens a logon directory file for reading.
+ *
+ * @param path Path to the file, as configured in cpdlcd's "logon_dir/file".
+ * @param reason Optional buffer to receive a description of the error
+ *	in case opening the directory failed.
+ * @param reason_cap Capacity of `reason' in bytes.
+ *
+ * @return A handle which must be freed with logondir_close, or NULL on
+ *	error.
+ */
+logondir_t *
+logondir_open(const char *path, char *reason, size_t reason_cap)
+{
+	logondir_t *ld = calloc(1, sizeof (*ld));
+	struct stat st;
+
+	if (ld == NULL) {
+		snprintf(reason, reason_cap, "out of memory");
+		return (NULL);
+	}
+	ld->fd = open(path, O_RDONLY);
+	if (ld->fd == -1) {
+		snprintf(reason, reason_cap, "%s", strerror(errno));
+		free(ld);
+		return (NULL);
+	}
+	if (fstat(ld->fd, &st) != 0) {
+		snprintf(reason, reason_cap, "%s", strerror(errno));
+		goto errout;
+	}
+	if ((size_t)st.st_size < sizeof (logondir_hdr_t)) {
+		snprintf(reason, reason_cap, "file too short");
+		goto errout;
+	}
+	ld->map_sz = st.st_size;
+	ld->map = mmap(NULL, ld->map_sz, PROT_READ, MAP_SHARED, ld->fd, 0);
+	if (ld->map == MAP_FAILED) {
+		snprintf(reason, reason_cap, "%s", strerror(errno));
+		ld->map = NULL;
+		goto errout;
+	}
+	ld->hdr = ld->map;
+	if (ld->hdr->magic != LOGONDIR_MAGIC ||
+	    ld->hdr->version != LOGONDIR_VERSION ||
+	    ld->hdr->hdr_sz != sizeof (logondir_hdr_t) ||
+	    ld->hdr->ent_sz != sizeof (logondir_ent_t)) {
+		snprintf(reason, reason_cap, "not a logon directory file, "
+		    "or incompatible version");
+		goto errout;
+	}
+	ld->ents = (const logondir_ent_t *)(ld->hdr + 1);
+	/*
+	 * The writer never shrinks the file, but its configured table
+	 * size may be smaller than the file, so limit ourselves to both.
+	 */
+	ld->num_ents = (ld->map_sz - sizeof (logondir_hdr_t)) /
+	    sizeof (logondir_ent_t);
+	if (ld->hdr->num_ents < ld->num_ents)
+		ld->num_ents = ld->hdr->num_ents;
+	ld->buf = calloc(ld->num_ents != 0 ? ld->num_ents : 1,
+	    sizeof (*ld->buf));
+	if (ld->buf == NULL) {
+		snprintf(reason, reason_cap, "out of memory");
+		goto errout;
+	}
+
+	return (ld);
+errout:
+	logondir_close(ld);
+	return (NULL);
+}
+
+void
+logondir_close(logondir_t *ld)
+{
+	if (ld == NULL)
+		return;
+	if (ld->map != NULL)
+		munmap((void *)ld->map, ld->map_sz);
+	if (ld->fd != -1)
+		close(ld->fd);
+	free(ld->buf);
+	free(ld);
+}
+
+/*
+ * Returns true if the cpdlcd instance maintaining the directory is
+ * still running. If it isn't, the directory contents are stale.
+ */
+bool
+logondir_writer_alive(const logondir_t *ld)
+{
+	pid_t pid = ld->hdr->writer_pid;
+	return (pid > 0 && (kill(pid, 0) == 0 || errno == EPERM));
+}
+
+/*
+ * Takes a consistent snapshot of all active LOGONs in the directory.
+ *
+ * @param ents_p Mandatory return argument, which will be filled with
+ *	a pointer to an array of the active entries. The array is owned
+ *	by `ld' and remains valid until the next call to logondir_snapshot
+ *	or logondir_close.
+ * @param seq_p Optional return argument, which will be filled with the
+ *	sequence number of the snapshot. If this is unchanged from a
+ *	previous snapshot, the directory contents are unchanged as well.
+ *
+ * @return The number of entries in the snapshot, or -1 if no consistent
+ *	snapshot could be taken, with errno set to ESRCH if the writer died
+ *	in the middle of an update, or to EAGAIN if the writer kept
+ *	updating the directory and a later call might succeed.
+ */
+ssize_t
+logondir_snapshot(logondir_t *ld, logondir_ent_t **ents_p, uint64_t *seq_p)
+{
+	uint64_t seq1, seq2;
+	uint32_t hi_water;
+	size_t n = 0;
+
+	for (unsigned tries = 1;; tries++) {
+		if (tries > SNAPSHOT_MAX_TRIES) {
+			errno = EAGAIN;
+			return (-1);
+		}
+		seq1 = atomic_load_explicit(&ld->hdr->seq,
+		    memory_order_acquire);
+		if (seq1 & 1) {
+			/* update in progress */
+			if (tries % SNAPSHOT_ALIVE_CHECK_TRIES == 0 &&
+			    !logondir_writer_alive(ld)) {
+				errno = ESRCH;
+				return (-1);
+			}
+			sched_yield();
+			continue;
+		}
+		hi_water = ld->hdr->hi_water;
+		if (hi_water > ld->num_ents)
+			hi_water = ld->num_ents;
+		memcpy(ld->buf, ld->ents, hi_water * sizeof (*ld->buf));
+		atomic_thread_fence(memory_order_acquire);
+		seq2 = atomic_load_explicit(&ld->hdr->seq,
+		    memory_order_relaxed);
+		if (seq1 == seq2)
+			break;
+	}
+	/* Compact the in-use entries at the start of the buffer. */
+	for (uint32_t i = 0; i < hi_water; i++) {
+		if (ld->buf[i].in_use) {
+			logondir_ent_t *ent = &ld->buf[n++];
+
+			if (ent != &ld->buf[i])
+				*ent = ld->buf[i];
+			/* Don't trust the writer to NUL-terminate */
+			ent->from[sizeof (ent->from) - 1] = '\0';
+			ent->to[sizeof (ent->to) - 1] = '\0';
+			ent->addr[sizeof (ent->addr) - 1] = '\0';
+		}
+	}
+	*ents_p = ld->buf;
+	if (seq_p != NULL)
+		*seq_p = seq1;
+
+	return (n);
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * logondump: prints the contents of a cpdlcd logon directory (see the
+ * "logon_dir/file" option in sample.conf). The output format is the same
+ * as that of "logon_list_file".
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logondir.h"
+
+static void
+print_usage(const char *progname, FILE *fp)
+{
+	fprintf(fp, "Usage: %s [-hsw] [-i <interval>] <logon_dir_file>\n"
+	    "  -h : show this help screen\n"
+	    "  -s : print a summary line before the list of LOGONs\n"
+	    "  -w : watch mode, print the list again whenever it changes\n"
+	    "  -i <interval> : polling interval in watch mode in "
+	    "milliseconds (default: 1000)\n", progname);
+}
+
+static void
+print_snapshot(logondir_t *ld, const logondir_ent_t *ents, size_t n,
+    uint64_t seq, bool summary)
+{
+	if (summary) {
+		printf("# seq %llu, %d LOGONs, cpdlcd %s\n",
+		    (unsigned long long)seq, (int)n,
+		    logondir_writer_alive(ld) ? "running" : "NOT RUNNING");
+	}
+	for (size_t i = 0; i < n; i++) {
+		printf("%s\t%s\t%s\t%s\t%s\n", ents[i].from,
+		    ents[i].to[0] != '\0' ? ents[i].to : "-",
+		    ents[i].is_atc ? "ATC" : "ACFT", ents[i].addr,
+		    ents[i].transport == LOGONDIR_TRANSPORT_WS ? "WS" : "TLS");
+	}
+	fflush(stdout);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int opt;
+	bool summary = false, watch = false;
+	long interval = 1000;
+	logondir_t *ld;
+	char reason[128];
+	uint64_t last_seq = UINT64_MAX;
+
+	while ((opt = getopt(argc, argv, "hswi:")) != -1) {
+		switch (opt) {
+		case 'h':
+			print_usage(argv[0], stdout);
+			return (0);
+		case 's':
+			summary = true;
+			break;
+		case 'w':
+			watch = true;
+			break;
+		case 'i':
+			interval = atol(optarg);
+			if (interval <= 0) {
+				fprintf(stderr, "Invalid interval %s\n",
+				    optarg);
+				return (1);
+			}
+			break;
+		default:
+			print_usage(argv[0], stderr);
+			return (1);
+		}
+	}
+	if (optind + 1 != argc) {
+		print_usage(argv[0], stderr);
+		return (1);
+	}
+	ld = logondir_open(argv[optind], reason, sizeof (reason));
+	if (ld == NULL) {
+		fprintf(stderr, "Can't open %s: %s\n", argv[optind], reason);
+		return (1);
+	}
+	do {
+		logondir_ent_t *ents;
+		uint64_t seq;
+		ssize_t n = logondir_snapshot(ld, &ents, &seq);
+
+		if (n < 0 && (errno != EAGAIN || !watch)) {
+			fprintf(stderr, "Can't read %s: %s\n", argv[optind],
+			    errno == ESRCH ? "cpdlcd died while updating "
+			    "the logon directory" : strerror(errno));
+			logondir_close(ld);
+			return (1);
+		}
+		if (n >= 0 && seq != last_seq) {
+			print_snapshot(ld, ents, n, seq, summary || watch);
+			last_seq = seq;
+		}
+		if (watch)
+			usleep(interval * 1000);
+	} while (watch);
+	logondir_close(ld);
+
+	return (0);
+}
@@ -37,6 +37,7 @@
 
 #define	DFL_NUM_THREADS_MAX	8
 #define	DFL_NUM_THREADS_MIN	0
+#define	PRIO_NUM_THREADS_MAX	2
 #define	DFL_THR_STOP_DELAY	SEC2USEC(2)
 #define	ROUTER_TIMEOUT		10L		/* secs */
 
@@ -66,6 +67,7 @@ enum { MAX_PARAMS = 8 };
 
 static struct {
 	taskq_t		*tq;
+	taskq_t		*prio_tq;	/* priority messages (MAYDAY, PAN, etc.) */
 	rpc_spec_t	spec;
 } rpc = {};
 
@@ -129,6 +131,7 @@ router_proc(void *userinfo, void *thr_info, void *task)
 	    "MRN", mrn,
 	    NULL)) {
 		cpdlc_msg_set_to(mri->msg, result.values[0]);
+		cpdlc_msg_freeze(mri->msg);
 		mri->fwd_cb(mri->msg, mri->addr, mri->userinfo);
 	} else {
 		mri->discard_cb(mri->msg, mri->addr, mri->userinfo);
@@ -178,6 +181,13 @@ rpc_router_init(const conf_t *conf)
 	}
 	rpc.tq = taskq_alloc(min_threads, max_threads, stop_delay,
 	    router_init, router_fini, router_proc, router_discard, NULL);
+	/*
+	 * Priority messages get their own queue, so they don't have to
+	 * wait behind a backlog of normal messages in `tq'.
+	 */
+	rpc.prio_tq = taskq_alloc(0, MIN(max_threads, PRIO_NUM_THREADS_MAX),
+	    stop_delay, router_init, router_fini, router_proc, router_discard,
+	    NULL);
 
 	return (true);
 }
@@ -195,9 +205,18 @@ msg_router_fini(void)
 {
 	if (rpc.tq != NULL)
 		taskq_free(rpc.tq);
+	if (rpc.prio_tq != NULL)
+		taskq_free(rpc.prio_tq);
 	memset(&rpc, 0, sizeof (rpc));
 }
 
+/*
+ * Routes a message to its recipient, possibly asynchronously, and then
+ * passes it to `fwd_cb' (or `discard_cb' if routing failed). Consumes
+ * `msg'. Routing is the last step to modify the message, so it is frozen
+ * before being forwarded, which lets `fwd_cb' reuse its encodings (see
+ * cpdlc_msg_encode_cached).
+ */
 void
 msg_router(const char *conn_addr, bool is_atc, bool is_lws,
     cpdlc_msg_t *msg, const char *to, msg_router_cb_t fwd_cb,
@@ -209,9 +228,10 @@ msg_router(const char *conn_addr, bool is_atc, bool is_lws,
 	ASSERT(fwd_cb != NULL);
 	ASSERT(discard_cb != NULL);
 
+	/* If the RPC router isn't initialized, just pass the message through */
 	if (rpc.tq == NULL) {
-		/* RPC router not initialized, just pass the message through */
 		cpdlc_msg_set_to(msg, to);
+		cpdlc_msg_freeze(msg);
 		fwd_cb(msg, conn_addr, userinfo);
 		cpdlc_msg_free(msg);
 	} else {
@@ -220,12 +240,25 @@ msg_router(const char *conn_addr, bool is_atc, bool is_lws,
 		cpdlc_strlcpy(mri->addr, conn_addr, sizeof (mri->addr));
 		mri->is_atc = is_atc;
 		mri->is_lws = is_lws;
-		mri->msg = msg;
+		/*
+		 * Messages from the caller's decoding arena only live until
+		 * the caller moves on to the next message, so the router
+		 * thread needs its own copy.
+		 */
+		if (cpdlc_msg_is_arena(msg)) {
+			mri->msg = cpdlc_msg_copy(msg);
+			cpdlc_msg_free(msg);
+		} else {
+			mri->msg = msg;
+		}
 		cpdlc_strlcpy(mri->to, to, sizeof (mri->to));
 		mri->fwd_cb = fwd_cb;
 		mri->discard_cb = discard_cb;
 		mri->userinfo = userinfo;
 
-		taskq_submit(rpc.tq, mri);
+		if (cpdlc_msg_get_prio(mri->msg) != CPDLC_PRIO_NORMAL)
+			taskq_submit(rpc.prio_tq, mri);
+		else
+			taskq_submit(rpc.tq, mri);
 	}
 }
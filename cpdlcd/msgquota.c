@@ -27,33 +27,27 @@
 #include <stdlib.h>
 
 #include <acfutils/assert.h>
-#include <acfutils/avl.h>
 #include <acfutils/helpers.h>
 #include <acfutils/safe_alloc.h>
 
+#include "callsign.h"
 #include "common.h"
 #include "msgquota.h"
 
 typedef struct {
-	char		callsign[CALLSIGN_LEN];
 	uint64_t	bytes;
-	avl_node_t	node;
 } msgquota_t;
 
 static bool		inited = false;
-static avl_tree_t	tree;
+static cstbl_t		table;
 static uint64_t		msgquota_max = 16 << 10;	/* 16 KiB */
 
-static int
-msgquota_compar(const void *a, const void *b)
+static void
+msgquota_free_cb(callsign_key_t key, void *value, void *userinfo)
 {
-	const msgquota_t *mqa = a, *mqb = b;
-	int res = strcmp(mqa->callsign, mqb->callsign);
-	if (res < 0)
-		return (-1);
-	if (res > 0)
-		return (1);
-	return (0);
+	UNUSED(key);
+	UNUSED(userinfo);
+	free(value);
 }
 
 void
@@ -62,8 +56,7 @@ msgquota_init(uint64_t max_bytes)
 	ASSERT(!inited);
 	inited = true;
 
-	avl_create(&tree, msgquota_compar, sizeof (msgquota_t),
-	    offsetof(msgquota_t, node));
+	cstbl_create(&table, 0);
 	if (max_bytes != 0)
 		msgquota_max = max_bytes;
 }
@@ -71,66 +64,55 @@ msgquota_init(uint64_t max_bytes)
 void
 msgquota_fini(void)
 {
-	msgquota_t *mq;
-	void *cookie = NULL;
-
 	if (!inited)
 		return;
 	inited = false;
 
-	while ((mq = avl_destroy_nodes(&tree, &cookie)) != NULL)
-		free(mq);
-	avl_destroy(&tree);
+	cstbl_empty(&table, msgquota_free_cb, NULL);
+	cstbl_destroy(&table);
 }
 
 static msgquota_t *
-mq_get(const char *callsign)
+mq_get(callsign_key_t callsign)
 {
-	msgquota_t srch;
 	msgquota_t *mq;
-	avl_index_t where;
-
-	ASSERT(callsign != NULL);
 
-	lacf_strlcpy(srch.callsign, callsign, sizeof (srch.callsign));
-	mq = avl_find(&tree, &srch, &where);
+	mq = cstbl_lookup(&table, callsign);
 	if (mq == NULL) {
 		mq = safe_calloc(1, sizeof (*mq));
-		lacf_strlcpy(mq->callsign, callsign, sizeof (mq->callsign));
-		avl_insert(&tree, mq, where);
+		cstbl_set(&table, callsign, mq);
 	}
 
 	return (mq);
 }
 
 bool
-msgquota_incr(const char *callsign, uint64_t bytes)
+msgquota_incr(callsign_key_t callsign, uint64_t bytes)
 {
 	msgquota_t *mq;
 
-	ASSERT(callsign != 0);
 	ASSERT(bytes > 0);
 
 	mq = mq_get(callsign);
-	if (msgquota_max > 0 && mq->bytes + bytes > msgquota_max)
+	if (msgquota_max > 0 && mq->bytes + bytes > msgquota_max) {
+		if (mq->bytes == 0)
+			free(cstbl_remove(&table, callsign));
 		return (false);
+	}
 	mq->bytes += bytes;
 	return (true);
 }
 
 void
-msgquota_decr(const char *callsign, uint64_t bytes)
+msgquota_decr(callsign_key_t callsign, uint64_t bytes)
 {
 	msgquota_t *mq;
 
-	ASSERT(callsign != 0);
 	ASSERT(bytes > 0);
 
 	mq = mq_get(callsign);
 	ASSERT3U(mq->bytes, >=, bytes);
 	mq->bytes -= bytes;
-	if (mq->bytes == 0) {
-		avl_remove(&tree, mq);
-		free(mq);
-	}
+	if (mq->bytes == 0)
+		free(cstbl_remove(&table, callsign));
 }
@@ -29,6 +29,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "callsign.h"
+
 #ifdef	__cplusplus
 extern "C" {
 #endif
@@ -36,8 +38,8 @@ extern "C" {
 void msgquota_init(uint64_t max_bytes);
 void msgquota_fini(void);
 
-bool msgquota_incr(const char *callsign, uint64_t bytes);
-void msgquota_decr(const char *callsign, uint64_t bytes);
+bool msgquota_incr(callsign_key_t callsign, uint64_t bytes);
+void msgquota_decr(callsign_key_t callsign, uint64_t bytes);
 
 #ifdef	__cplusplus
 }
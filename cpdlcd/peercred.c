@@ -0,0 +1,206 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Access control for clients connecting over Unix-domain sockets. Such
+ * clients don't go through TLS, so instead of checking their client
+ * certificate, we ask the kernel who is on the other end of the socket
+ * and check that against the users and groups allowed by the
+ * "unix/allow_user/..." and "unix/allow_group/..." config keys. If
+ * neither is configured, only the user cpdlcd is running as is allowed.
+ */
+
+#include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+#include <acfutils/log.h>
+#include <acfutils/safe_alloc.h>
+
+#include "peercred.h"
+
+static uid_t	*allow_uids = NULL;
+static size_t	num_allow_uids = 0;
+static gid_t	*allow_gids = NULL;
+static size_t	num_allow_gids = 0;
+
+/*
+ * Parses a user name or numeric user ID.
+ */
+static bool
+parse_uid(const char *str, uid_t *uid)
+{
+	const struct passwd *pw = getpwnam(str);
+	char *end;
+	unsigned long val;
+
+	if (pw != NULL) {
+		*uid = pw->pw_uid;
+		return (true);
+	}
+	errno = 0;
+	val = strtoul(str, &end, 10);
+	if (str[0] == '\0' || *end != '\0' || errno != 0)
+		return (false);
+	*uid = val;
+	return (true);
+}
+
+/*
+ * Parses a group name or numeric group ID.
+ */
+static bool
+parse_gid(const char *str, gid_t *gid)
+{
+	const struct group *gr = getgrnam(str);
+	char *end;
+	unsigned long val;
+
+	if (gr != NULL) {
+		*gid = gr->gr_gid;
+		return (true);
+	}
+	errno = 0;
+	val = strtoul(str, &end, 10);
+	if (str[0] == '\0' || *end != '\0' || errno != 0)
+		return (false);
+	*gid = val;
+	return (true);
+}
+
+bool
+peercred_init(const conf_t *conf)
+{
+	const char *key, *value;
+	void *cookie = NULL;
+
+	ASSERT(conf != NULL);
+
+	while (conf_walk(conf, &key, &value, &cookie)) {
+		if (strncmp(key, "unix/allow_user/", 16) == 0) {
+			uid_t uid;
+
+			if (!parse_uid(value, &uid)) {
+				logMsg("Invalid %s: unknown user \"%s\"", key,
+				    value);
+				goto errout;
+			}
+			allow_uids = safe_realloc(allow_uids,
+			    (num_allow_uids + 1) * sizeof (*allow_uids));
+			allow_uids[num_allow_uids++] = uid;
+		} else if (strncmp(key, "unix/allow_group/", 17) == 0) {
+			gid_t gid;
+
+			if (!parse_gid(value, &gid)) {
+				logMsg("Invalid %s: unknown group \"%s\"", key,
+				    value);
+				goto errout;
+			}
+			allow_gids = safe_realloc(allow_gids,
+			    (num_allow_gids + 1) * sizeof (*allow_gids));
+			allow_gids[num_allow_gids++] = gid;
+		}
+	}
+	if (num_allow_uids == 0 && num_allow_gids == 0) {
+		allow_uids = safe_malloc(sizeof (*allow_uids));
+		allow_uids[num_allow_uids++] = geteuid();
+	}
+	return (true);
+errout:
+	peercred_fini();
+	return (false);
+}
+
+void
+peercred_fini(void)
+{
+	free(allow_uids);
+	allow_uids = NULL;
+	num_allow_uids = 0;
+	free(allow_gids);
+	allow_gids = NULL;
+	num_allow_gids = 0;
+}
+
+/*
+ * Looks up the credentials of the process on the other end of a freshly
+ * accepted Unix-domain socket and checks if it may connect. Fills in
+ * `addr_str' with a description of the peer for logging and returns its
+ * user ID in `uid'.
+ *
+ * @return True if the peer is allowed to connect. False if it isn't or
+ *	its credentials couldn't be determined (the reason is logged).
+ */
+bool
+peercred_check(int fd, char addr_str[SOCKADDR_STRLEN], uid_t *uid)
+{
+	gid_t gid;
+#if	LIN
+	struct ucred cred;
+	socklen_t len = sizeof (cred);
+
+	ASSERT(addr_str != NULL);
+	ASSERT(uid != NULL);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+		logMsg("Can't get Unix socket peer credentials: %s",
+		    strerror(errno));
+		return (false);
+	}
+	*uid = cred.uid;
+	gid = cred.gid;
+	snprintf(addr_str, SOCKADDR_STRLEN, "unix:uid=%u,pid=%u",
+	    (unsigned)cred.uid, (unsigned)cred.pid);
+#else	/* !LIN */
+	ASSERT(addr_str != NULL);
+	ASSERT(uid != NULL);
+
+	if (getpeereid(fd, uid, &gid) != 0) {
+		logMsg("Can't get Unix socket peer credentials: %s",
+		    strerror(errno));
+		return (false);
+	}
+	snprintf(addr_str, SOCKADDR_STRLEN, "unix:uid=%u", (unsigned)*uid);
+#endif	/* !LIN */
+
+	for (size_t i = 0; i < num_allow_uids; i++) {
+		if (allow_uids[i] == *uid)
+			return (true);
+	}
+	for (size_t i = 0; i < num_allow_gids; i++) {
+		if (allow_gids[i] == gid)
+			return (true);
+	}
+	logMsg("Incoming connection refused: %s (gid %u) isn't allowed to "
+	    "connect", addr_str, (unsigned)gid);
+	return (false);
+}
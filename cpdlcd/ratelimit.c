@@ -0,0 +1,343 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Token-bucket rate limiting. Each limit is implemented using the
+ * Generic Cell Rate Algorithm, which is equivalent to a token bucket,
+ * but only needs a single "theoretical arrival time" (TAT) per bucket:
+ * each unit of cost pushes the TAT further into the future by the
+ * limit's emission interval, and a bucket is over its limit once its
+ * TAT is more than the burst window ahead of the current time. This
+ * allows updating a bucket with a single compare-and-swap.
+ *
+ * Buckets are held in fixed-size tables indexed by a hash of their key
+ * (source address or callsign), so that lookups are O(1) and lock-free.
+ * Keys colliding in a table share a bucket, which can only make the
+ * limits stricter for them. Sizing the tables well above the expected
+ * number of distinct clients keeps that rare.
+ */
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <netinet/in.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+#include <acfutils/log.h>
+#include <acfutils/safe_alloc.h>
+
+#include "ratelimit.h"
+
+#define	DFL_TABLE_SIZE	65536
+#define	MAX_TABLE_SIZE	(1 << 24)
+#define	NS_PER_SEC	1000000000ull
+
+typedef struct {
+	const char		*name;
+	/* config */
+	uint64_t		interval_ns;	/* ns per unit of cost */
+	uint64_t		window_ns;	/* burst window */
+	/* state */
+	_Atomic uint64_t	*tats;
+	_Atomic uint64_t	hits;		/* times the limit was hit */
+} limit_t;
+
+static bool		inited = false;
+static limit_t		limits[RL_NUM_LIMITS] = {
+    [RL_ADDR_CONNS] = { .name = "addr_conns" },
+    [RL_ADDR_MSGS] = { .name = "addr_msgs" },
+    [RL_ADDR_BYTES] = { .name = "addr_bytes" },
+    [RL_CALLSIGN_MSGS] = { .name = "callsign_msgs" },
+    [RL_CALLSIGN_BYTES] = { .name = "callsign_bytes" },
+    [RL_LOGONS] = { .name = "logons" }
+};
+static uint64_t		table_mask = DFL_TABLE_SIZE - 1;
+/* time until which a source address is barred, indexed like `tats' */
+static _Atomic uint64_t	*penalties = NULL;
+static uint64_t		penalty_ns = 0;
+static _Atomic uint64_t	penalty_hits = 0;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return (ts.tv_sec * NS_PER_SEC + ts.tv_nsec);
+}
+
+static uint64_t
+mix64(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ull;
+	x ^= x >> 33;
+	return (x);
+}
+
+/*
+ * Sets up the rate limits from the "ratelimit/..." config keys. Limits
+ * which aren't configured are disabled.
+ */
+bool
+ratelimit_init(const conf_t *conf)
+{
+	int table_size = DFL_TABLE_SIZE;
+	int penalty = 0;
+
+	ASSERT(!inited);
+
+	if (conf != NULL) {
+		conf_get_i(conf, "ratelimit/table_size", &table_size);
+		conf_get_i(conf, "ratelimit/penalty", &penalty);
+	}
+	if (table_size < 1 || table_size > MAX_TABLE_SIZE ||
+	    (table_size & (table_size - 1)) != 0) {
+		logMsg("Invalid ratelimit/table_size %d: must be a power of "
+		    "two between 1 and %d", table_size, MAX_TABLE_SIZE);
+		return (false);
+	}
+	table_mask = table_size - 1;
+	penalty_ns = MAX(penalty, 0) * NS_PER_SEC;
+
+	for (int i = 0; i < RL_NUM_LIMITS; i++) {
+		limit_t *l = &limits[i];
+		char key[64];
+		long long rate = 0, burst = 1;
+
+		if (conf != NULL) {
+			snprintf(key, sizeof (key), "ratelimit/%s/rate",
+			    l->name);
+			conf_get_lli(conf, key, &rate);
+			snprintf(key, sizeof (key), "ratelimit/%s/burst",
+			    l->name);
+			conf_get_lli(conf, key, &burst);
+		}
+		if (rate < 0 || (uint64_t)rate > NS_PER_SEC || burst < 1) {
+			logMsg("Invalid ratelimit/%s: rate must be between "
+			    "0 and %llu and burst must be at least 1", l->name,
+			    (unsigned long long)NS_PER_SEC);
+			ratelimit_fini();
+			return (false);
+		}
+		if (rate == 0)
+			continue;
+		l->interval_ns = NS_PER_SEC / rate;
+		/* `burst' units can go through back-to-back */
+		l->window_ns = l->interval_ns * burst;
+		l->tats = safe_calloc(table_size, sizeof (*l->tats));
+	}
+	penalties = safe_calloc(table_size, sizeof (*penalties));
+	inited = true;
+
+	return (true);
+}
+
+void
+ratelimit_fini(void)
+{
+	for (int i = 0; i < RL_NUM_LIMITS; i++) {
+		free(limits[i].tats);
+		limits[i].tats = NULL;
+		limits[i].interval_ns = 0;
+		limits[i].window_ns = 0;
+	}
+	free(penalties);
+	penalties = NULL;
+	inited = false;
+}
+
+/*
+ * Returns the key of a source address for use with the per-address
+ * limits. All ports of an address map to the same key.
+ */
+uint64_t
+ratelimit_addr_key(const struct sockaddr_storage *ss)
+{
+	uint64_t key = 0xcbf29ce484222325ull;	/* FNV-1a */
+	const uint8_t *addr;
+	size_t len;
+
+	ASSERT(ss != NULL);
+	if (ss->ss_family == AF_INET) {
+		addr = (const uint8_t *)
+		    &((const struct sockaddr_in *)ss)->sin_addr;
+		len = sizeof (struct in_addr);
+	} else if (ss->ss_family == AF_INET6) {
+		addr = (const uint8_t *)
+		    &((const struct sockaddr_in6 *)ss)->sin6_addr;
+		len = sizeof (struct in6_addr);
+	} else {
+		return (0);
+	}
+	for (size_t i = 0; i < len; i++) {
+		key ^= addr[i];
+		key *= 0x100000001b3ull;
+	}
+	return (key);
+}
+
+/*
+ * Same as ratelimit_addr_key, but for clients connecting over a
+ * Unix-domain socket, which have no address. All connections of a
+ * given local user map to the same key.
+ */
+uint64_t
+ratelimit_uid_key(uid_t uid)
+{
+	uint64_t key = 0xcbf29ce484222325ull;	/* FNV-1a */
+	const uint8_t *p = (const uint8_t *)&uid;
+
+	key ^= 'u';
+	key *= 0x100000001b3ull;
+	for (size_t i = 0; i < sizeof (uid); i++) {
+		key ^= p[i];
+		key *= 0x100000001b3ull;
+	}
+	return (key);
+}
+
+static inline _Atomic uint64_t *
+get_tat(const limit_t *l, uint64_t key)
+{
+	return (&l->tats[mix64(key) & table_mask]);
+}
+
+/*
+ * Checks if `cost' units can go through a limit without exceeding it.
+ * If so, they are accounted for and true is returned. Otherwise the
+ * limit's state isn't touched and false is returned. This is meant for
+ * things which get refused when over the limit.
+ */
+bool
+ratelimit_allow(rl_limit_t limit, uint64_t key, uint64_t cost)
+{
+	limit_t *l;
+	_Atomic uint64_t *tat_p;
+	uint64_t now, tat, new_tat;
+
+	ASSERT3U(limit, <, RL_NUM_LIMITS);
+	l = &limits[limit];
+	if (l->tats == NULL)
+		return (true);
+
+	now = now_ns();
+	tat_p = get_tat(l, key);
+	tat = atomic_load_explicit(tat_p, memory_order_relaxed);
+	do {
+		new_tat = MAX(tat, now) + cost * l->interval_ns;
+		if (new_tat - now > l->window_ns) {
+			atomic_fetch_add_explicit(&l->hits, 1,
+			    memory_order_relaxed);
+			return (false);
+		}
+	} while (!atomic_compare_exchange_weak_explicit(tat_p, &tat, new_tat,
+	    memory_order_relaxed, memory_order_relaxed));
+
+	return (true);
+}
+
+/*
+ * Unconditionally accounts for `cost' units in a limit. This is meant for
+ * things which have already happened (such as data having been read),
+ * where the only remedy is to slow down what comes after.
+ *
+ * @return The number of microseconds the caller should wait before
+ *	continuing, so as to get back within the limit (0 if it is
+ *	still within the limit).
+ */
+uint64_t
+ratelimit_charge(rl_limit_t limit, uint64_t key, uint64_t cost)
+{
+	limit_t *l;
+	_Atomic uint64_t *tat_p;
+	uint64_t now, tat, new_tat;
+
+	ASSERT3U(limit, <, RL_NUM_LIMITS);
+	l = &limits[limit];
+	if (l->tats == NULL)
+		return (0);
+
+	now = now_ns();
+	tat_p = get_tat(l, key);
+	tat = atomic_load_explicit(tat_p, memory_order_relaxed);
+	do {
+		new_tat = MAX(tat, now) + cost * l->interval_ns;
+	} while (!atomic_compare_exchange_weak_explicit(tat_p, &tat, new_tat,
+	    memory_order_relaxed, memory_order_relaxed));
+	if (new_tat - now <= l->window_ns)
+		return (0);
+	atomic_fetch_add_explicit(&l->hits, 1, memory_order_relaxed);
+
+	return ((new_tat - now - l->window_ns) / 1000);
+}
+
+/*
+ * Bars a source address from connecting for the "ratelimit/penalty"
+ * period. Does nothing if no penalty period is configured.
+ */
+void
+ratelimit_penalize(uint64_t addr_key)
+{
+	if (!inited || penalty_ns == 0)
+		return;
+	atomic_store_explicit(&penalties[mix64(addr_key) & table_mask],
+	    now_ns() + penalty_ns, memory_order_relaxed);
+	atomic_fetch_add_explicit(&penalty_hits, 1, memory_order_relaxed);
+}
+
+/*
+ * Returns true if a source address is currently barred from connecting.
+ */
+bool
+ratelimit_penalized(uint64_t addr_key)
+{
+	if (!inited || penalty_ns == 0)
+		return (false);
+	return (atomic_load_explicit(&penalties[mix64(addr_key) &
+	    table_mask], memory_order_relaxed) > now_ns());
+}
+
+/*
+ * Writes the number of times each limit was hit to a statistics file.
+ */
+void
+ratelimit_write_stats(FILE *fp)
+{
+	ASSERT(fp != NULL);
+	for (int i = 0; i < RL_NUM_LIMITS; i++) {
+		fprintf(fp, "ratelimit_%s_hits = %llu\n", limits[i].name,
+		    (unsigned long long)atomic_load_explicit(&limits[i].hits,
+		    memory_order_relaxed));
+	}
+	fprintf(fp, "ratelimit_penalties = %llu\n",
+	    (unsigned long long)atomic_load_explicit(&penalty_hits,
+	    memory_order_relaxed));
+}
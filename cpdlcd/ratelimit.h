@@ -0,0 +1,70 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_CPDLCD_RATELIMIT_H_
+#define	_CPDLCD_RATELIMIT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <acfutils/conf.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	RL_ADDR_CONNS,		/* new connections per source address */
+	RL_ADDR_MSGS,		/* messages per source address */
+	RL_ADDR_BYTES,		/* input bytes per source address */
+	RL_CALLSIGN_MSGS,	/* messages per logged on callsign */
+	RL_CALLSIGN_BYTES,	/* message bytes per logged on callsign */
+	RL_LOGONS,		/* LOGON attempts per source address */
+	RL_NUM_LIMITS
+} rl_limit_t;
+
+bool ratelimit_init(const conf_t *conf);
+void ratelimit_fini(void);
+
+uint64_t ratelimit_addr_key(const struct sockaddr_storage *ss);
+uint64_t ratelimit_uid_key(uid_t uid);
+
+bool ratelimit_allow(rl_limit_t limit, uint64_t key, uint64_t cost);
+uint64_t ratelimit_charge(rl_limit_t limit, uint64_t key, uint64_t cost);
+
+void ratelimit_penalize(uint64_t addr_key);
+bool ratelimit_penalized(uint64_t addr_key);
+
+void ratelimit_write_stats(FILE *fp);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _CPDLCD_RATELIMIT_H_ */
@@ -0,0 +1,154 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "cpdlc_alloc.h"
+#include "cpdlc_arena.h"
+#include "cpdlc_assert.h"
+
+/* Enough for any of the types we allocate from an arena */
+#define	ARENA_ALIGN		16
+#define	ARENA_ROUNDUP(x)	(((x) + ARENA_ALIGN - 1) & \
+	~(uintptr_t)(ARENA_ALIGN - 1))
+/*
+ * Size of the initial block. This comfortably holds a typical decoded
+ * message with a few segments.
+ */
+#define	ARENA_DFL_BLK_SZ	4096
+/* Upper limit on the memory an arena holds on to across resets */
+#define	ARENA_MAX_KEEP		(64 << 10)
+
+typedef struct arena_blk_s {
+	struct arena_blk_s	*next;
+	size_t			size;	/* usable bytes in `data' */
+	size_t			used;
+	uint8_t			data[];
+} arena_blk_t;
+
+struct cpdlc_arena_s {
+	/* The head of the list is the block we're allocating from */
+	arena_blk_t	*blks;
+	size_t		total;	/* sum of the sizes of all blocks */
+};
+
+static arena_blk_t *
+blk_alloc(size_t size)
+{
+	arena_blk_t *blk = safe_malloc(sizeof (*blk) + size);
+
+	blk->next = NULL;
+	blk->size = size;
+	blk->used = 0;
+
+	return (blk);
+}
+
+static void
+blks_free(cpdlc_arena_t *arena)
+{
+	arena_blk_t *blk, *next;
+
+	for (blk = arena->blks; blk != NULL; blk = next) {
+		next = blk->next;
+		free(blk);
+	}
+	arena->blks = NULL;
+	arena->total = 0;
+}
+
+cpdlc_arena_t *
+cpdlc_arena_alloc(void)
+{
+	cpdlc_arena_t *arena = safe_calloc(1, sizeof (*arena));
+
+	arena->blks = blk_alloc(ARENA_DFL_BLK_SZ);
+	arena->total = ARENA_DFL_BLK_SZ;
+
+	return (arena);
+}
+
+void
+cpdlc_arena_free(cpdlc_arena_t *arena)
+{
+	if (arena == NULL)
+		return;
+	blks_free(arena);
+	free(arena);
+}
+
+/*
+ * Releases all allocations made from the arena at once. If the previous
+ * round of allocations didn't fit into a single block, the blocks are
+ * merged into one, so a similar round next time is again served from a
+ * single allocation.
+ */
+void
+cpdlc_arena_reset(cpdlc_arena_t *arena)
+{
+	size_t size;
+
+	CPDLC_ASSERT(arena != NULL);
+
+	if (arena->blks != NULL && arena->blks->next == NULL) {
+		arena->blks->used = 0;
+		return;
+	}
+	size = MIN(MAX(arena->total, ARENA_DFL_BLK_SZ), ARENA_MAX_KEEP);
+	blks_free(arena);
+	arena->blks = blk_alloc(size);
+	arena->total = size;
+}
+
+/*
+ * Returns `size' bytes of zeroed memory, valid until the arena is
+ * reset or freed.
+ */
+void *
+cpdlc_arena_zalloc(cpdlc_arena_t *arena, size_t size)
+{
+	arena_blk_t *blk;
+	uintptr_t p;
+
+	CPDLC_ASSERT(arena != NULL);
+
+	blk = arena->blks;
+	if (blk == NULL || ARENA_ROUNDUP((uintptr_t)&blk->data[blk->used]) +
+	    size > (uintptr_t)&blk->data[blk->size]) {
+		/* Grow geometrically, so large rounds need few blocks */
+		blk = blk_alloc(MAX(size + ARENA_ALIGN,
+		    MAX(arena->total, ARENA_DFL_BLK_SZ)));
+		blk->next = arena->blks;
+		arena->blks = blk;
+		arena->total += blk->size;
+	}
+	p = ARENA_ROUNDUP((uintptr_t)&blk->data[blk->used]);
+	blk->used = (p + size) - (uintptr_t)blk->data;
+	CPDLC_ASSERT3U(blk->used, <=, blk->size);
+	memset((void *)p, 0, size);
+
+	return ((void *)p);
+}
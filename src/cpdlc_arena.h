@@ -0,0 +1,58 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_LIBCPDLC_ARENA_H_
+#define	_LIBCPDLC_ARENA_H_
+
+#include <stddef.h>
+
+#include "cpdlc_core.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * A simple bump allocator. Allocations are carved out of a list of
+ * large blocks and are never freed individually. Instead, the arena is
+ * reset as a whole once none of its allocations are in use anymore.
+ * An arena isn't thread-safe, the caller must serialize access to it.
+ *
+ * Arenas are primarily meant to be passed to cpdlc_msg_decode_arena,
+ * so that a decoded message and all of its arguments are allocated
+ * from a single reusable arena, rather than from the heap.
+ */
+typedef struct cpdlc_arena_s cpdlc_arena_t;
+
+CPDLC_API cpdlc_arena_t *cpdlc_arena_alloc(void);
+CPDLC_API void cpdlc_arena_free(cpdlc_arena_t *arena);
+CPDLC_API void cpdlc_arena_reset(cpdlc_arena_t *arena);
+CPDLC_API void *cpdlc_arena_zalloc(cpdlc_arena_t *arena, size_t size);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _LIBCPDLC_ARENA_H_ */
@@ -40,6 +40,7 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <poll.h>
 #include <sys/select.h>
 #include <unistd.h>
@@ -111,6 +112,14 @@
 #endif
 
 #define	BITRATE_DELAY		40000	/* us */
+/* number of sent messages for which we keep latency measurements */
+#define	LATENCY_RECS		64
+
+typedef struct {
+	cpdlc_msg_token_t	token;
+	unsigned		min;
+	cpdlc_msg_latency_t	lat;
+} latency_rec_t;
 
 typedef struct outmsgbuf_s {
 	cpdlc_msg_token_t	token;
@@ -119,6 +128,7 @@ typedef struct outmsgbuf_s {
 	size_t			bufsz;
 	size_t			bytes_sent;
 	bool			track_sent;
+	unsigned		min;
 	minilist_node_t		node;
 } outmsgbuf_t;
 
@@ -163,6 +173,8 @@ struct cpdlc_client_s {
 	char				*key_pem_data;
 	char				*cert_pem_data;
 	bool				unenc_local;
+	/* connect over a local Unix-domain socket instead of TCP */
+	char				*unix_path;
 #endif	/* !CPDLC_CLIENT_LWS */
 
 	thread_t			worker;
@@ -215,9 +227,17 @@ struct cpdlc_client_s {
 	/* protected by `lock' */
 	char		*inbuf;
 	unsigned	inbuf_sz;
+	size_t		inbuf_scanned;
 	minilist_t	inmsgbufs;
 	bool		fmt_plain;
 	bool		fmt_arinc622;
+	/*
+	 * Request server timestamps (LATENCY logon option) and record the
+	 * latency of our sent messages in the `latency' ring buffer.
+	 */
+	bool		latency_on;
+	latency_rec_t	latency[LATENCY_RECS];
+	unsigned	latency_next;
 
 	/*
 	 * When any last data was sent or received. Used for keepalive.
@@ -247,11 +267,22 @@ static int cpdlc_lws_cb(struct lws *wsi, enum lws_callback_reasons reason,
 
 static bool resolve_host(cpdlc_client_t *cl);
 static void init_conn(cpdlc_client_t *cl);
+static void init_conn_unix(cpdlc_client_t *cl);
 static void complete_conn(cpdlc_client_t *cl);
 static void tls_handshake(cpdlc_client_t *cl);
 static bool poll_for_msgs(cpdlc_client_t *cl,
     cpdlc_msg_token_t **out_tokens, unsigned *num_out_tokens);
 
+/*
+ * Returns true if the link doesn't go through TLS. That's the case for
+ * unencrypted loopback and Unix-domain socket connections.
+ */
+static inline bool
+link_is_plain(const cpdlc_client_t *cl)
+{
+	return (cl->unenc_local || cl->unix_path != NULL);
+}
+
 #endif	/* !CPDLC_CLIENT_LWS */
 
 static void reset_link_state(cpdlc_client_t *cl);
@@ -277,6 +308,16 @@ static struct lws_protocols proto_list_lws[] = {
     { .name = NULL }	/* list terminator */
 };
 
+/* Offer to compress traffic, if the server supports it */
+static const struct lws_extension lws_exts[] = {
+    {
+	.name = "permessage-deflate",
+	.callback = lws_extension_callback_pm_deflate,
+	.client_offer = "permessage-deflate; client_max_window_bits"
+    },
+    { .name = NULL }	/* list terminator */
+};
+
 #endif	/* CPDLC_CLIENT_LWS */
 
 static void
@@ -350,7 +391,7 @@ check_keepalive(cpdlc_client_t *cl)
 	CPDLC_ASSERT(cl != NULL);
 
 	/* Don't send PING packets on local unencrypted connections */
-	if (cl->unenc_local)
+	if (link_is_plain(cl))
 		return (true);
 	if (cl->keepalive_token != CPDLC_INVALID_MSG_TOKEN) {
 		switch (cpdlc_client_get_msg_status(cl, cl->keepalive_token)) {
@@ -401,7 +442,9 @@ logon_worker(void *userinfo)
 #ifdef	CPDLC_CLIENT_LWS
 	init_conn_lws(cl);
 #else	/* !CPDLC_CLIENT_LWS */
-	if (resolve_host(cl))
+	if (cl->unix_path != NULL)
+		init_conn_unix(cl);
+	else if (resolve_host(cl))
 		init_conn(cl);
 #endif	/* !CPDLC_CLIENT_LWS */
 
@@ -557,6 +600,7 @@ cpdlc_client_free(cpdlc_client_t *cl)
 #ifndef	CPDLC_CLIENT_LWS
 	if (cl->ai != NULL)
 		freeaddrinfo(cl->ai);
+	free(cl->unix_path);
 #endif	/* !CPDLC_CLIENT_LWS */
 
 	mutex_destroy(&cl->lock);
@@ -585,6 +629,27 @@ cpdlc_client_get_arinc622(const cpdlc_client_t *cl)
 	return (cl->fmt_arinc622);
 }
 
+/*
+ * Enables latency measurement. This must be set before logging on, as
+ * it asks the server to stamp the messages it sends us with its receive
+ * and send times (see cpdlc_msg_get_srv_ts).
+ */
+void
+cpdlc_client_set_latency(cpdlc_client_t *cl, bool flag)
+{
+	CPDLC_ASSERT(cl != NULL);
+	mutex_enter(&cl->lock);
+	cl->latency_on = flag;
+	mutex_exit(&cl->lock);
+}
+
+bool
+cpdlc_client_get_latency(const cpdlc_client_t *cl)
+{
+	CPDLC_ASSERT(cl != NULL);
+	return (cl->latency_on);
+}
+
 bool
 cpdlc_client_get_is_atc(const cpdlc_client_t *cl)
 {
@@ -731,6 +796,32 @@ cpdlc_client_get_unencrypted_loopback(const cpdlc_client_t *cl)
 	return (cl->unenc_local);
 }
 
+/*
+ * Makes the client connect to a server running on the same machine
+ * through a Unix-domain socket at `path', instead of going through
+ * TCP & TLS. The host & port settings are then ignored. The server
+ * authorizes the client based on the user it is running as. Pass
+ * NULL to go back to connecting over TCP.
+ */
+void
+cpdlc_client_set_unix_socket(cpdlc_client_t *cl, const char *path)
+{
+	CPDLC_ASSERT(cl != NULL);
+	mutex_enter(&cl->lock);
+	free(cl->unix_path);
+	cl->unix_path = NULL;
+	if (path != NULL)
+		cl->unix_path = strdup(path);
+	mutex_exit(&cl->lock);
+}
+
+const char *
+cpdlc_client_get_unix_socket(const cpdlc_client_t *cl)
+{
+	CPDLC_ASSERT(cl != NULL);
+	return (cl->unix_path);
+}
+
 #endif	/* CPDLC_CLIENT_LWS */
 
 static void
@@ -806,6 +897,7 @@ reset_link_state(cpdlc_client_t *cl)
 	free(cl->inbuf);
 	cl->inbuf = NULL;
 	cl->inbuf_sz = 0;
+	cl->inbuf_scanned = 0;
 
 	while ((inbuf = minilist_remove_head(&cl->inmsgbufs)) != NULL) {
 		cpdlc_msg_free(inbuf->msg);
@@ -823,8 +915,10 @@ init_conn_lws(cpdlc_client_t *cl)
 
 	CPDLC_ASSERT(cl != NULL);
 
+	memset(&info, 0, sizeof (info));
 	info.port = CONTEXT_PORT_NO_LISTEN;
 	info.protocols = proto_list_lws;
+	info.extensions = lws_exts;
 	info.gid = -1;
 	info.uid = -1;
 	info.client_ssl_ca_filepath = cl->cafile;
@@ -835,12 +929,12 @@ init_conn_lws(cpdlc_client_t *cl)
 	info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
 
 	cl->lws_ctx = lws_create_context(&info);
-	memset(&info, 0, sizeof (info));
 	if (cl->lws_ctx == NULL) {
 		fprintf(stderr, "Failed to create lws_ctx\n");
 		return;
 	}
 
+	memset(&ccinfo, 0, sizeof (ccinfo));
 	ccinfo.address = cl->host;
 	ccinfo.port = (cl->port != 0 ? cl->port : DEFAULT_PORT_LWS);
 	ccinfo.path = "/";
@@ -851,7 +945,6 @@ init_conn_lws(cpdlc_client_t *cl)
 	ccinfo.userdata = cl;
 	ccinfo.ssl_connection = LCCSCF_USE_SSL | LCCSCF_ALLOW_SELFSIGNED;
 	cl->lws_sock = lws_client_connect_via_info(&ccinfo);
-	memset(&ccinfo, 0, sizeof (ccinfo));
 	if (cl->lws_sock == NULL) {
 		fprintf(stderr, "Failed to create lws_sock\n");
 		return;
@@ -973,6 +1066,56 @@ init_conn(cpdlc_client_t *cl)
 	set_logon_failure(cl, NULL);
 }
 
+static void
+init_conn_unix(cpdlc_client_t *cl)
+{
+#ifdef	_WIN32
+	CPDLC_ASSERT(cl != NULL);
+	set_logon_failure(cl, "Unix-domain sockets are not supported on "
+	    "this platform");
+#else	/* !_WIN32 */
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	cpdlc_socktype_t sock;
+
+	CPDLC_ASSERT(cl != NULL);
+	CPDLC_ASSERT(cl->unix_path != NULL);
+	CPDLC_ASSERT(!CPDLC_SOCKET_IS_VALID(cl->sock));
+	CPDLC_ASSERT3U(cl->logon_status, ==, CPDLC_LOGON_NONE);
+
+	if (strlen(cl->unix_path) >= sizeof (sun.sun_path)) {
+		set_logon_failure(cl, "%s: socket path too long",
+		    cl->unix_path);
+		return;
+	}
+	cpdlc_strlcpy(sun.sun_path, cl->unix_path, sizeof (sun.sun_path));
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (!CPDLC_SOCKET_IS_VALID(sock)) {
+		set_logon_failure(cl, "%s", cpdlc_get_last_socket_error());
+		return;
+	}
+	/*
+	 * Local connections are established (or refused) right away, so
+	 * there's no need to go through CPDLC_LOGON_CONNECTING_LINK. And
+	 * with no TLS to negotiate, the link is immediately available.
+	 */
+	if (connect(sock, (struct sockaddr *)&sun, sizeof (sun)) < 0) {
+		set_logon_failure(cl, "%s: %s", cl->unix_path,
+		    cpdlc_get_last_socket_error());
+		cpdlc_close_socket(sock);
+		return;
+	}
+	if (!cpdlc_set_fd_nonblock(sock)) {
+		set_logon_failure(cl, "%s", cpdlc_get_last_socket_error());
+		cpdlc_close_socket(sock);
+		return;
+	}
+	cl->sock = sock;
+	cl->logon_status = CPDLC_LOGON_LINK_AVAIL;
+	set_logon_failure(cl, NULL);
+#endif	/* !_WIN32 */
+}
+
 static void
 complete_conn(cpdlc_client_t *cl)
 {
@@ -1161,7 +1304,7 @@ report_gnutls_verify_error(cpdlc_client_t *cl)
 
 	CPDLC_ASSERT(cl != NULL);
 	CPDLC_ASSERT(cl->session != NULL);
-	CPDLC_ASSERT(!cl->unenc_local);
+	CPDLC_ASSERT(!link_is_plain(cl));
 
 	type = gnutls_certificate_type_get(cl->session);
 	status = gnutls_session_get_verify_cert_status(cl->session);
@@ -1257,7 +1400,7 @@ tls_handshake(cpdlc_client_t *cl)
 {
 	CPDLC_ASSERT(cl != NULL);
 	CPDLC_ASSERT3U(cl->logon_status, ==, CPDLC_LOGON_HANDSHAKING_LINK);
-	CPDLC_ASSERT(!cl->unenc_local);
+	CPDLC_ASSERT(!link_is_plain(cl));
 
 #ifdef	CPDLC_WITH_OPENSSL
 	if (!tls_handshake_openssl(cl))
@@ -1293,6 +1436,8 @@ send_logon(cpdlc_client_t *cl)
 		cpdlc_msg_option_add(msg, "PLAIN");
 	if (cl->fmt_arinc622)
 		cpdlc_msg_option_add(msg, "ARINC622");
+	if (cl->latency_on)
+		cpdlc_msg_option_add(msg, "LATENCY");
 	send_msg_impl(cl, msg, false);
 	cpdlc_msg_free(msg);
 
@@ -1332,6 +1477,84 @@ handle_nda(cpdlc_client_t *cl, cpdlc_msg_t *msg, unsigned i)
 		cl->logon.nda = strdup(nda);
 }
 
+/*
+ * Returns the current time in microseconds since the Unix epoch. This is
+ * the time base used by the server in the SRVTS= header.
+ */
+static uint64_t
+wall_clock_us(void)
+{
+#ifdef	_WIN32
+	FILETIME ft;
+	ULARGE_INTEGER li;
+
+	GetSystemTimeAsFileTime(&ft);
+	li.LowPart = ft.dwLowDateTime;
+	li.HighPart = ft.dwHighDateTime;
+	/* FILETIME counts 100ns intervals since 1601-01-01 */
+	return (li.QuadPart / 10 - 11644473600000000llu);
+#else	/* !_WIN32 */
+	struct timespec ts;
+
+	CPDLC_VERIFY(clock_gettime(CLOCK_REALTIME, &ts) == 0);
+	return ((ts.tv_sec * 1000000llu) + (ts.tv_nsec / 1000llu));
+#endif	/* !_WIN32 */
+}
+
+/*
+ * Starts a latency record for a message which has just been fully sent.
+ */
+static void
+latency_msg_sent(cpdlc_client_t *cl, const outmsgbuf_t *outmsgbuf)
+{
+	latency_rec_t *rec;
+
+	CPDLC_ASSERT(cl != NULL);
+	CPDLC_ASSERT(outmsgbuf != NULL);
+
+	rec = &cl->latency[cl->latency_next];
+	cl->latency_next = (cl->latency_next + 1) % LATENCY_RECS;
+	memset(rec, 0, sizeof (*rec));
+	rec->token = outmsgbuf->token;
+	rec->min = outmsgbuf->min;
+	rec->lat.sent = wall_clock_us();
+}
+
+/*
+ * If `msg' is a response to one of our recently sent messages and carries
+ * the server's timestamps, completes the sent message's latency record.
+ */
+static void
+latency_resp_rcvd(cpdlc_client_t *cl, const cpdlc_msg_t *msg)
+{
+	unsigned mrn = cpdlc_msg_get_mrn(msg);
+	uint64_t rx, tx;
+
+	CPDLC_ASSERT(cl != NULL);
+
+	if (mrn == CPDLC_INVALID_MSG_SEQ_NR ||
+	    !cpdlc_msg_get_srv_ts(msg, &rx, &tx)) {
+		return;
+	}
+	/* Search newest first, MINs eventually wrap around */
+	for (unsigned i = 1; i <= LATENCY_RECS; i++) {
+		latency_rec_t *rec = &cl->latency[(cl->latency_next +
+		    LATENCY_RECS - i) % LATENCY_RECS];
+
+		if (rec->lat.sent == 0 || rec->lat.resp_recv != 0 ||
+		    rec->min != mrn) {
+			continue;
+		}
+		rec->lat.resp_srv_rx = rx;
+		rec->lat.resp_srv_tx = tx;
+		rec->lat.resp_recv = wall_clock_us();
+		rec->lat.rtt = rec->lat.resp_recv - rec->lat.sent;
+		rec->lat.srv_time = tx - rx;
+		rec->lat.downlink = rec->lat.resp_recv - tx;
+		break;
+	}
+}
+
 static bool
 queue_incoming_msg(cpdlc_client_t *cl, cpdlc_msg_t *msg)
 {
@@ -1372,6 +1595,8 @@ queue_incoming_msg(cpdlc_client_t *cl, cpdlc_msg_t *msg)
 		cpdlc_msg_free(msg);
 		return (false);
 	}
+	if (cl->latency_on)
+		latency_resp_rcvd(cl, msg);
 
 	inmsgbuf = safe_calloc(1, sizeof (*inmsgbuf));
 	inmsgbuf->msg = msg;
@@ -1458,14 +1683,15 @@ process_input(cpdlc_client_t *cl)
 	CPDLC_ASSERT(cl->inbuf_sz != 0);
 
 	while (consumed_total < cl->inbuf_sz) {
-		int consumed;
+		size_t consumed;
 		cpdlc_msg_t *msg;
 		char error[sizeof (cl->logon_failure)];
 
 		/* Try to decode a message from our accumulated input. */
-		CPDLC_ASSERT3S(consumed_total, <=, cl->inbuf_sz);
-		if (!cpdlc_msg_decode(&cl->inbuf[consumed_total], cl->is_atc,
-		    &msg, &consumed, error, sizeof (error))) {
+		CPDLC_ASSERT3U(consumed_total, <=, cl->inbuf_sz);
+		if (!cpdlc_msg_decode_n(&cl->inbuf[consumed_total],
+		    cl->inbuf_sz - consumed_total, cl->is_atc, &msg, &consumed,
+		    &cl->inbuf_scanned, error, sizeof (error))) {
 			cl->logon_status = CPDLC_LOGON_NONE;
 			cpdlc_strlcpy(cl->logon_failure, error,
 			    sizeof (cl->logon_failure));
@@ -1478,13 +1704,12 @@ process_input(cpdlc_client_t *cl)
 		new_msgs |= process_msg(cl, msg);
 		/* Do not free the message, `process_msg' consumes it */
 		consumed_total += consumed;
-		CPDLC_ASSERT3S(consumed_total, <=, cl->inbuf_sz);
+		CPDLC_ASSERT3U(consumed_total, <=, cl->inbuf_sz);
 	}
 	if (consumed_total != 0) {
-		CPDLC_ASSERT3S(consumed_total, <=, cl->inbuf_sz);
+		CPDLC_ASSERT3U(consumed_total, <=, cl->inbuf_sz);
 		cl->inbuf_sz -= consumed_total;
-		memmove(cl->inbuf, &cl->inbuf[consumed_total],
-		    cl->inbuf_sz + 1);
+		memmove(cl->inbuf, &cl->inbuf[consumed_total], cl->inbuf_sz);
 		cl->inbuf = realloc(cl->inbuf, cl->inbuf_sz);
 	}
 	if (new_msgs)
@@ -1514,8 +1739,8 @@ do_msg_input_lws(cpdlc_client_t *cl, const uint8_t *buf, size_t len)
 	CPDLC_ASSERT(buf != NULL);
 	CPDLC_ASSERT(len != 0);
 
-	cl->inbuf = realloc(cl->inbuf, cl->inbuf_sz + len + 1);
-	cpdlc_strlcpy(&cl->inbuf[cl->inbuf_sz], (const char *)buf, len + 1);
+	cl->inbuf = safe_realloc(cl->inbuf, cl->inbuf_sz + len);
+	memcpy(&cl->inbuf[cl->inbuf_sz], buf, len);
 	cl->inbuf_sz += len;
 	/* Reset the keepalive timer */
 	cl->last_data_rdwr = time(NULL);
@@ -1548,7 +1773,7 @@ do_msg_input(cpdlc_client_t *cl)
 			max_recv = MAX(max_recv, 1);
 		}
 		recvsz = MIN(max_recv, sizeof (buf));
-		if (cl->unenc_local) {
+		if (link_is_plain(cl)) {
 			bytes = recv(cl->sock, (char *)buf, recvsz, 0);
 			if (bytes < 0) {
 				if (!cpdlc_conn_wouldblock()) {
@@ -1597,9 +1822,8 @@ do_msg_input(cpdlc_client_t *cl)
 			cl->rx_in_prog = false;
 			break;
 		}
-		cl->inbuf = safe_realloc(cl->inbuf, cl->inbuf_sz + bytes + 1);
-		cpdlc_strlcpy(&cl->inbuf[cl->inbuf_sz], (const char *)buf,
-		    bytes + 1);
+		cl->inbuf = safe_realloc(cl->inbuf, cl->inbuf_sz + bytes);
+		memcpy(&cl->inbuf[cl->inbuf_sz], buf, bytes);
 		cl->inbuf_sz += bytes;
 		/* Reset the keepalive timer */
 		cl->last_data_rdwr = time(NULL);
@@ -1671,7 +1895,7 @@ do_msg_output(cpdlc_client_t *cl, unsigned *num_tokens_p)
 #else	/* !CPDLC_CLIENT_LWS */
 		send_sz = MIN(max_send, outmsgbuf->bufsz -
 		    outmsgbuf->bytes_sent);
-		if (cl->unenc_local) {
+		if (link_is_plain(cl)) {
 			bytes = send(cl->sock,
 			    &outmsgbuf->buf[outmsgbuf->bytes_sent], send_sz, 0);
 			if (bytes < 0) {
@@ -1738,6 +1962,8 @@ do_msg_output(cpdlc_client_t *cl, unsigned *num_tokens_p)
 		outmsgbuf->buf = NULL;
 		outmsgbuf->bufsz = 0;
 		if (outmsgbuf->track_sent) {
+			if (cl->latency_on)
+				latency_msg_sent(cl, outmsgbuf);
 			minilist_insert_tail(&cl->outmsgbufs.sent, outmsgbuf);
 			tokens = safe_realloc(tokens, (num_tokens + 1) *
 			    sizeof (*tokens));
@@ -1745,6 +1971,15 @@ do_msg_output(cpdlc_client_t *cl, unsigned *num_tokens_p)
 		} else {
 			free(outmsgbuf);
 		}
+#ifdef	CPDLC_CLIENT_LWS
+		/*
+		 * LWS only permits a single lws_write per writable callback,
+		 * so ask for another callback to send the remainder.
+		 */
+		if (minilist_head(&cl->outmsgbufs.sending) != NULL)
+			lws_callback_on_writable(wsi);
+		break;
+#endif	/* CPDLC_CLIENT_LWS */
 	}
 
 	*num_tokens_p = num_tokens;
@@ -1865,9 +2100,9 @@ poll_for_msgs(cpdlc_client_t *cl, cpdlc_msg_token_t **out_tokens,
 	CPDLC_ASSERT(cl != NULL);
 	CPDLC_ASSERT3U(cl->logon_status, >=, CPDLC_LOGON_LINK_AVAIL);
 #ifdef	CPDLC_WITH_OPENSSL
-	CPDLC_ASSERT(cl->ssl != NULL || cl->unenc_local);
+	CPDLC_ASSERT(cl->ssl != NULL || link_is_plain(cl));
 #else
-	CPDLC_ASSERT(cl->session != NULL || cl->unenc_local);
+	CPDLC_ASSERT(cl->session != NULL || link_is_plain(cl));
 #endif
 	CPDLC_ASSERT(CPDLC_SOCKET_IS_VALID(cl->sock));
 	CPDLC_ASSERT(out_tokens != NULL);
@@ -2052,6 +2287,7 @@ static cpdlc_msg_token_t
 send_msg_impl(cpdlc_client_t *cl, cpdlc_msg_t *msg, bool track_sent)
 {
 	outmsgbuf_t *outmsgbuf;
+	unsigned cap = 0;
 
 	CPDLC_ASSERT(cl != NULL);
 	CPDLC_ASSERT(msg != NULL);
@@ -2061,11 +2297,10 @@ send_msg_impl(cpdlc_client_t *cl, cpdlc_msg_t *msg, bool track_sent)
 
 	outmsgbuf = safe_calloc(1, sizeof (*outmsgbuf));
 	outmsgbuf->token = cl->outmsgbufs.next_tok++;
-	outmsgbuf->bufsz = cpdlc_msg_encode(msg, NULL, 0);
-	outmsgbuf->buf = safe_malloc(SENDBUF_PRE_PAD + outmsgbuf->bufsz + 1);
-	cpdlc_msg_encode(msg, &outmsgbuf->buf[SENDBUF_PRE_PAD],
-	    outmsgbuf->bufsz + 1);
+	outmsgbuf->bufsz = cpdlc_msg_encode_buf(msg, &outmsgbuf->buf, &cap,
+	    SENDBUF_PRE_PAD);
 	outmsgbuf->track_sent = track_sent;
+	outmsgbuf->min = cpdlc_msg_get_min(msg);
 
 	minilist_insert_tail(&cl->outmsgbufs.sending, outmsgbuf);
 
@@ -2102,6 +2337,53 @@ cpdlc_client_send_msg(cpdlc_client_t *cl, const cpdlc_msg_t *msg)
 	return (tok);
 }
 
+/*
+ * Sends the same message to multiple stations (e.g. a sector-wide
+ * free text). Rather than sending a separate copy to each recipient,
+ * the message is sent only once with all recipients listed in its TO=
+ * header and the server does the rest. Recipients which aren't
+ * connected get the message once they connect, just like with
+ * cpdlc_client_send_msg. This is only available to ATC stations using
+ * the plain text message format.
+ *
+ * @return The token of the message, or CPDLC_INVALID_MSG_TOKEN if the
+ *	client isn't logged on, the message couldn't be sent this way or
+ *	there were too many recipients (see CPDLC_MAX_TO_LIST).
+ */
+cpdlc_msg_token_t
+cpdlc_client_send_msg_multi(cpdlc_client_t *cl, const cpdlc_msg_t *msg,
+    const char *const *to, unsigned num_to)
+{
+	cpdlc_msg_token_t tok;
+	cpdlc_msg_t *msg_copy;
+
+	CPDLC_ASSERT(cl != NULL);
+	CPDLC_ASSERT(msg != NULL);
+	CPDLC_ASSERT(to != NULL || num_to == 0);
+
+	if (!cl->is_atc || num_to == 0)
+		return (CPDLC_INVALID_MSG_TOKEN);
+
+	mutex_enter(&cl->lock);
+	if (cl->logon.from == NULL ||
+	    cl->logon_status != CPDLC_LOGON_COMPLETE || !cl->fmt_plain) {
+		mutex_exit(&cl->lock);
+		return (CPDLC_INVALID_MSG_TOKEN);
+	}
+	msg_copy = cpdlc_msg_copy(msg);
+	if (!cpdlc_msg_set_to_list(msg_copy, to, num_to)) {
+		mutex_exit(&cl->lock);
+		cpdlc_msg_free(msg_copy);
+		return (CPDLC_INVALID_MSG_TOKEN);
+	}
+	cpdlc_msg_set_from(msg_copy, cl->logon.from);
+	tok = send_msg_impl(cl, msg_copy, true);
+	cpdlc_msg_free(msg_copy);
+	mutex_exit(&cl->lock);
+
+	return (tok);
+}
+
 cpdlc_msg_status_t
 cpdlc_client_get_msg_status(cpdlc_client_t *cl, cpdlc_msg_token_t token)
 {
@@ -2137,6 +2419,38 @@ out:
 	return (status);
 }
 
+/*
+ * Retrieves the latency breakdown of a sent message. Only the most recent
+ * LATENCY_RECS messages sent with latency measurement enabled (see
+ * cpdlc_client_set_latency) are tracked.
+ *
+ * @return True if `lat' has been filled. False if the message is unknown,
+ *	or hasn't been sent out yet.
+ */
+bool
+cpdlc_client_get_msg_latency(cpdlc_client_t *cl, cpdlc_msg_token_t token,
+    cpdlc_msg_latency_t *lat)
+{
+	bool found = false;
+
+	CPDLC_ASSERT(cl != NULL);
+	CPDLC_ASSERT(token != CPDLC_INVALID_MSG_TOKEN);
+	CPDLC_ASSERT(lat != NULL);
+
+	mutex_enter(&cl->lock);
+	for (unsigned i = 0; i < LATENCY_RECS; i++) {
+		if (cl->latency[i].lat.sent != 0 &&
+		    cl->latency[i].token == token) {
+			*lat = cl->latency[i].lat;
+			found = true;
+			break;
+		}
+	}
+	mutex_exit(&cl->lock);
+
+	return (found);
+}
+
 cpdlc_msg_t *
 cpdlc_client_recv_msg(cpdlc_client_t *cl)
 {
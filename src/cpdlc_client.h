@@ -69,6 +69,24 @@ typedef struct cpdlc_client_s cpdlc_client_t;
 typedef uint64_t cpdlc_msg_token_t;
 #define	CPDLC_INVALID_MSG_TOKEN	((cpdlc_msg_token_t)-1)
 
+/*
+ * Latency breakdown of a sent message (see cpdlc_client_get_msg_latency).
+ * Absolute times are in microseconds since the Unix epoch, durations are
+ * in microseconds. All fields other than `sent' are zero until a response
+ * to the message (a message whose MRN matches the sent message's MIN)
+ * has been received.
+ */
+typedef struct {
+	uint64_t	sent;		/* message fully sent to the server */
+	uint64_t	resp_srv_rx;	/* server received the response */
+	uint64_t	resp_srv_tx;	/* server sent the response to us */
+	uint64_t	resp_recv;	/* we received the response */
+	int64_t		rtt;		/* resp_recv - sent */
+	int64_t		srv_time;	/* resp_srv_tx - resp_srv_rx */
+	/* one-way server->client time, only meaningful with synced clocks */
+	int64_t		downlink;	/* resp_recv - resp_srv_tx */
+} cpdlc_msg_latency_t;
+
 typedef void (*cpdlc_msg_recv_cb_t)(cpdlc_client_t *client);
 typedef void (*cpdlc_msg_sent_cb_t)(cpdlc_client_t *client,
     const cpdlc_msg_token_t *token, unsigned num_tokens);
@@ -80,6 +98,8 @@ CPDLC_API void cpdlc_client_set_plain(cpdlc_client_t *cl, bool flag);
 CPDLC_API bool cpdlc_client_get_plain(const cpdlc_client_t *cl);
 CPDLC_API void cpdlc_client_set_arinc622(cpdlc_client_t *cl, bool flag);
 CPDLC_API bool cpdlc_client_get_arinc622(const cpdlc_client_t *cl);
+CPDLC_API void cpdlc_client_set_latency(cpdlc_client_t *cl, bool flag);
+CPDLC_API bool cpdlc_client_get_latency(const cpdlc_client_t *cl);
 
 CPDLC_API bool cpdlc_client_get_is_atc(const cpdlc_client_t *cl);
 
@@ -113,6 +133,9 @@ CPDLC_API void cpdlc_client_set_key_mem(cpdlc_client_t *cl,
 CPDLC_API void cpdlc_client_set_unencrypted_loopback(cpdlc_client_t *cl,
     bool flag);
 CPDLC_API bool cpdlc_client_get_unencrypted_loopback(const cpdlc_client_t *cl);
+CPDLC_API void cpdlc_client_set_unix_socket(cpdlc_client_t *cl,
+    const char *path);
+CPDLC_API const char *cpdlc_client_get_unix_socket(const cpdlc_client_t *cl);
 
 #endif	/* !CPDLC_CLIENT_LWS */
 
@@ -131,8 +154,12 @@ CPDLC_API void cpdlc_client_reset_logon_failure(cpdlc_client_t *cl);
 
 CPDLC_API cpdlc_msg_token_t cpdlc_client_send_msg(cpdlc_client_t *cl,
     const cpdlc_msg_t *msg);
+CPDLC_API cpdlc_msg_token_t cpdlc_client_send_msg_multi(cpdlc_client_t *cl,
+    const cpdlc_msg_t *msg, const char *const *to, unsigned num_to);
 CPDLC_API cpdlc_msg_status_t cpdlc_client_get_msg_status(cpdlc_client_t *cl,
     cpdlc_msg_token_t token);
+CPDLC_API bool cpdlc_client_get_msg_latency(cpdlc_client_t *cl,
+    cpdlc_msg_token_t token, cpdlc_msg_latency_t *lat);
 
 CPDLC_API cpdlc_msg_t *cpdlc_client_recv_msg(cpdlc_client_t *cl);
 
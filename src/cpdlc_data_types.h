@@ -28,6 +28,7 @@
 
 #include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "cpdlc_core.h"
@@ -329,6 +330,49 @@ typedef struct {
 	cpdlc_trk_detail_t	trk_detail;
 } cpdlc_route_t;
 
+/*
+ * Compact form of cpdlc_route_t, with the variable-length arrays sized
+ * to their actual element counts, rather than their maximums. This is
+ * how routes are stored inside of messages. The structure and all of
+ * its arrays live in a single allocation, see cpdlc_route.h.
+ */
+typedef struct {
+	char			name[8];
+	unsigned		num_lat_lon;
+	cpdlc_lat_lon_t		*lat_lon;
+} cpdlc_trk_detail_packed_t;
+
+typedef struct {
+	unsigned		num_atk_wpt;
+	cpdlc_atk_wpt_t		*atk_wpt;
+	cpdlc_rpt_pts_t		rpt_pts;
+	unsigned		num_intc_from;
+	cpdlc_intc_from_t	*intc_from;
+	unsigned		num_hold_at_wpt;
+	cpdlc_hold_at_t		*hold_at_wpt;
+	unsigned		num_wpt_spd_alt;
+	cpdlc_wpt_spd_alt_t	*wpt_spd_alt;
+	unsigned		num_rta;
+	cpdlc_rta_t		*rta;
+} cpdlc_route_add_info_packed_t;
+
+typedef struct {
+	size_t				size;	/* of the whole allocation */
+	char				orig_icao[8];
+	char				dest_icao[8];
+	char				orig_rwy[8];
+	char				dest_rwy[8];
+	cpdlc_proc_t			sid;
+	cpdlc_proc_t			star;
+	cpdlc_proc_t			appch;
+	char				awy_intc[8];
+	unsigned			num_info;
+	cpdlc_route_info_t		*info;
+	cpdlc_route_add_info_packed_t	add_info;
+	/* CPDLC_ROUTE_TRACK_DETAIL */
+	cpdlc_trk_detail_packed_t	trk_detail;
+} cpdlc_route_packed_t;
+
 #define	CPDLC_NULL_WIND		((cpdlc_wind_t){0, 0})
 #define	CPDLC_IS_NULL_WIND(wind) ((wind).dir == 0)
 
@@ -451,7 +495,11 @@ typedef struct {
 	char			acf_type[8];	/* optional */
 	cpdlc_acf_eqpt_code_t	acf_eqpt_code;	/* optional */
 	cpdlc_time_t		time_dep;	/* required */
-	cpdlc_route_t		route;		/* required */
+	/*
+	 * Required. In a PDC returned by cpdlc_msg_seg_get_arg, this
+	 * points into the message and is only valid as long as it is.
+	 */
+	cpdlc_route_packed_t	*route;
 	cpdlc_alt_t		alt_restr;	/* optional */
 	double			freq;		/* required */
 	unsigned		squawk;		/* required */
@@ -516,7 +564,7 @@ typedef union {
 	double			dist;	/* nautical miles */
 	int			vvi;	/* feet per minute */
 	bool			tofrom;	/* true = to, false = from */
-	cpdlc_route_t		*route;
+	cpdlc_route_packed_t	*route;
 	cpdlc_proc_t		proc;
 	unsigned		squawk;
 	char			icao_id[8];
@@ -529,7 +577,7 @@ typedef union {
 	cpdlc_altimeter_t	baro;
 	char			*freetext;
 	unsigned		pob;
-	cpdlc_pos_rep_t		pos_rep;
+	cpdlc_pos_rep_t		*pos_rep;
 	cpdlc_pdc_t		*pdc;
 	cpdlc_tp4table_t	tp4;
 	cpdlc_errinfo_t		errinfo;
@@ -26,10 +26,17 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#if	IBM
+#include <windows.h>
+#endif	/* IBM */
+
 #include "asn1/ATCdownlinkmessage.h"
 #include "asn1/ATCuplinkmessage.h"
 
+#include "cpdlc_alloc.h"
+#include "cpdlc_assert.h"
 #include "cpdlc_msg.h"
+#include "cpdlc_msg_impl.h"
 
 #define	LONG_TIMEOUT		300	/* seconds */
 #define	MED_TIMEOUT		200	/* seconds */
@@ -1650,6 +1657,7 @@ static const cpdlc_msg_info_t ul_infos[] = {
     },
     {
 	.msg_type = CPDLC_UM170_FREETEXT_DISTRESS_text,
+	.prio = CPDLC_PRIO_DISTRESS,
 	.text = "[freetext]",
 	.num_args = 1,
 	.args = { CPDLC_ARG_FREETEXT },
@@ -1800,6 +1808,7 @@ static const cpdlc_msg_info_t ul_infos[] = {
     {
 	/* not supported in ASN.1 encoding */
 	.msg_type = CPDLC_UM197_FREETEXT_HIGH_URG_MED_ALERT_text,
+	.prio = CPDLC_PRIO_URGENT,
 	.text = "[freetext]",
 	.num_args = 1,
 	.args = { CPDLC_ARG_FREETEXT },
@@ -1809,6 +1818,7 @@ static const cpdlc_msg_info_t ul_infos[] = {
     {
 	/* not supported in ASN.1 encoding */
 	.msg_type = CPDLC_UM198_FREETEXT_DISTR_URG_HIGH_ALERT_text,
+	.prio = CPDLC_PRIO_DISTRESS,
 	.text = "[freetext]",
 	.num_args = 1,
 	.args = { CPDLC_ARG_FREETEXT },
@@ -2463,6 +2473,7 @@ static const cpdlc_msg_info_t dl_infos[] = {
     {
 	.is_dl = true,
 	.msg_type = CPDLC_DM55_PAN_PAN_PAN,
+	.prio = CPDLC_PRIO_URGENT,
 	ASN_DOWNLINK_INFO_01(55NULL),
 	.text = "PAN PAN PAN",
 	.resp = CPDLC_RESP_N
@@ -2470,6 +2481,7 @@ static const cpdlc_msg_info_t dl_infos[] = {
     {
 	.is_dl = true,
 	.msg_type = CPDLC_DM56_MAYDAY_MAYDAY_MAYDAY,
+	.prio = CPDLC_PRIO_DISTRESS,
 	ASN_DOWNLINK_INFO_01(56NULL),
 	.text = "MAYDAY MAYDAY MAYDAY",
 	.resp = CPDLC_RESP_N
@@ -2477,6 +2489,7 @@ static const cpdlc_msg_info_t dl_infos[] = {
     {
 	.is_dl = true,
 	.msg_type = CPDLC_DM57_RMNG_FUEL_AND_POB,
+	.prio = CPDLC_PRIO_URGENT,
 	.text = "[fuel] OF FUEL REMAINING AND [persons] PERSONS ON BOARD",
 	.resp = CPDLC_RESP_N,
 	.num_args = 2,
@@ -2487,6 +2500,7 @@ static const cpdlc_msg_info_t dl_infos[] = {
     {
 	.is_dl = true,
 	.msg_type = CPDLC_DM58_CANCEL_EMERG,
+	.prio = CPDLC_PRIO_URGENT,
 	ASN_DOWNLINK_INFO_01(58NULL),
 	.text = "CANCEL EMERGENCY",
 	.resp = CPDLC_RESP_N
@@ -2494,6 +2508,7 @@ static const cpdlc_msg_info_t dl_infos[] = {
     {
 	.is_dl = true,
 	.msg_type = CPDLC_DM59_DIVERTING_TO_pos_VIA_route,
+	.prio = CPDLC_PRIO_URGENT,
 	.text = "DIVERTING TO [pos] VIA [route]",
 	.resp = CPDLC_RESP_N,
 	.num_args = 2,
@@ -2503,6 +2518,7 @@ static const cpdlc_msg_info_t dl_infos[] = {
     {
 	.is_dl = true,
 	.msg_type = CPDLC_DM60_OFFSETTING_dist_dir_OF_ROUTE,
+	.prio = CPDLC_PRIO_URGENT,
 	.text = "OFFSETTING [distance offset] [direction] OF ROUTE",
 	.resp = CPDLC_RESP_N,
 	.num_args = 2,
@@ -2513,6 +2529,7 @@ static const cpdlc_msg_info_t dl_infos[] = {
     {
 	.is_dl = true,
 	.msg_type = CPDLC_DM61_DESCENDING_TO_alt,
+	.prio = CPDLC_PRIO_URGENT,
 	.text = "DESCENDING TO [alt]",
 	.resp = CPDLC_RESP_N,
 	.num_args = 1,
@@ -2651,6 +2668,7 @@ static const cpdlc_msg_info_t dl_infos[] = {
     {
 	.is_dl = true,
 	.msg_type = CPDLC_DM68_FREETEXT_DISTRESS_text,
+	.prio = CPDLC_PRIO_DISTRESS,
 	.text = "[freetext]",
 	.num_args = 1,
 	.args = { CPDLC_ARG_FREETEXT },
@@ -2760,6 +2778,7 @@ static const cpdlc_msg_info_t dl_infos[] = {
     {
 	.is_dl = true,
 	.msg_type = CPDLC_DM80_DEVIATING_dist_dir_OF_ROUTE,
+	.prio = CPDLC_PRIO_URGENT,
 	.text = "DEVIATING [distance offset] [direction] OF ROUTE",
 	.num_args = 2,
 	.args = { CPDLC_ARG_DISTANCE_OFFSET, CPDLC_ARG_DIRECTION },
@@ -2773,3 +2792,155 @@ static const cpdlc_msg_info_t dl_infos[] = {
 const cpdlc_msg_info_t *cpdlc_ul_infos = ul_infos;
 const cpdlc_msg_info_t *cpdlc_dl_infos = dl_infos;
 
+#define	ARRAY_NUM_ELEM(x)	(sizeof (x) / sizeof (*(x)))
+#define	NUM_DM67_SUBTYPES \
+	(CPDLC_DM67i_WHEN_CAN_WE_EXPCT_DES_TO_alt - \
+	CPDLC_DM67b_WE_CAN_ACPT_alt_AT_time + 1)
+
+/*
+ * Direct-indexed lookup tables into `ul_infos' and `dl_infos', keyed by
+ * message type and by ASN.1 element ID. Entries without a matching
+ * message info are NULL.
+ */
+typedef struct {
+	const cpdlc_msg_info_t	*ul[CPDLC_UM208_FREETEXT_LOW_URG_LOW_ALERT_text
+	    + 1];
+	const cpdlc_msg_info_t	*dl[CPDLC_DM80_DEVIATING_dist_dir_OF_ROUTE + 1];
+	/* DM67b through DM67i */
+	const cpdlc_msg_info_t	*dl67[NUM_DM67_SUBTYPES];
+	const cpdlc_msg_info_t	*ul_asn[ATCuplinkmsgelementid_PR_uM182NULL + 1];
+	const cpdlc_msg_info_t	*dl_asn[ATCdownlinkmsgelementid_PR_dM128NULL + 1];
+} infos_tab_t;
+
+static infos_tab_t *infos_tab = NULL;
+
+static void
+infos_tab_fill(const cpdlc_msg_info_t *infos,
+    const cpdlc_msg_info_t **by_type, unsigned num_types,
+    const cpdlc_msg_info_t **by_asn, unsigned num_asn,
+    const cpdlc_msg_info_t **dl67)
+{
+	/*
+	 * Iterating backwards means that where the info arrays contain
+	 * duplicate keys, the first match wins, same as with a linear
+	 * search.
+	 */
+	int n = 0;
+
+	while (infos[n].msg_type != -1)
+		n++;
+	for (int i = n - 1; i >= 0; i--) {
+		const cpdlc_msg_info_t *info = &infos[i];
+
+		CPDLC_ASSERT3S(info->msg_type, >=, 0);
+		CPDLC_ASSERT3U((unsigned)info->msg_type, <, num_types);
+		if (info->msg_subtype != 0) {
+			CPDLC_ASSERT(dl67 != NULL);
+			CPDLC_ASSERT3S(info->msg_subtype, >=,
+			    CPDLC_DM67b_WE_CAN_ACPT_alt_AT_time);
+			CPDLC_ASSERT3S(info->msg_subtype, <=,
+			    CPDLC_DM67i_WHEN_CAN_WE_EXPCT_DES_TO_alt);
+			dl67[info->msg_subtype -
+			    CPDLC_DM67b_WE_CAN_ACPT_alt_AT_time] = info;
+		} else {
+			by_type[info->msg_type] = info;
+		}
+		/* An asn_elem_id of 0 means the message has no ASN.1 form */
+		if (info->asn_elem_id != 0) {
+			CPDLC_ASSERT3U(info->asn_elem_id, <, num_asn);
+			by_asn[info->asn_elem_id] = info;
+		}
+	}
+}
+
+/*
+ * Returns the lookup tables, building them on first use. Threads racing
+ * to do that each build their own copy, the losers discard theirs.
+ */
+static const infos_tab_t *
+infos_tab_get(void)
+{
+	infos_tab_t *tab, *prev = NULL;
+
+#if	defined(_MSC_VER)
+	tab = InterlockedCompareExchangePointer((PVOID volatile *)&infos_tab,
+	    NULL, NULL);
+#else
+	tab = __atomic_load_n(&infos_tab, __ATOMIC_ACQUIRE);
+#endif
+	if (tab != NULL)
+		return (tab);
+
+	tab = safe_calloc(1, sizeof (*tab));
+	infos_tab_fill(ul_infos, tab->ul, ARRAY_NUM_ELEM(tab->ul),
+	    tab->ul_asn, ARRAY_NUM_ELEM(tab->ul_asn), NULL);
+	infos_tab_fill(dl_infos, tab->dl, ARRAY_NUM_ELEM(tab->dl),
+	    tab->dl_asn, ARRAY_NUM_ELEM(tab->dl_asn), tab->dl67);
+#if	defined(_MSC_VER)
+	prev = InterlockedCompareExchangePointer((PVOID volatile *)&infos_tab,
+	    tab, NULL);
+	if (prev != NULL) {
+#else
+	if (!__atomic_compare_exchange_n(&infos_tab, &prev, tab, false,
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+#endif
+		free(tab);
+		tab = prev;
+	}
+	return (tab);
+}
+
+/*
+ * Looks up the message info for a message type. `msg_subtype' must be 0,
+ * except for the DM67b-DM67i messages.
+ *
+ * @return The message info, or NULL if no such message exists.
+ */
+const cpdlc_msg_info_t *
+cpdlc_msg_infos_lookup(bool is_dl, int msg_type, char msg_subtype)
+{
+	const infos_tab_t *tab = infos_tab_get();
+
+	if (msg_type < 0)
+		return (NULL);
+	if (!is_dl) {
+		if (msg_subtype != 0 ||
+		    (unsigned)msg_type >= ARRAY_NUM_ELEM(tab->ul))
+			return (NULL);
+		return (tab->ul[msg_type]);
+	}
+	if ((unsigned)msg_type >= ARRAY_NUM_ELEM(tab->dl))
+		return (NULL);
+	if (msg_subtype == 0)
+		return (tab->dl[msg_type]);
+	if (msg_type != CPDLC_DM67_FREETEXT_NORMAL_text ||
+	    msg_subtype < CPDLC_DM67b_WE_CAN_ACPT_alt_AT_time ||
+	    msg_subtype > CPDLC_DM67i_WHEN_CAN_WE_EXPCT_DES_TO_alt)
+		return (NULL);
+	return (tab->dl67[msg_subtype - CPDLC_DM67b_WE_CAN_ACPT_alt_AT_time]);
+}
+
+/*
+ * Looks up the message info for an ASN.1 message element ID (the
+ * `present' field of an ATCuplinkmsgelementid_t or
+ * ATCdownlinkmsgelementid_t).
+ *
+ * @return The message info, or NULL if no message maps to the ID.
+ */
+const cpdlc_msg_info_t *
+cpdlc_msg_infos_lookup_asn(bool is_dl, unsigned asn_elem_id)
+{
+	const infos_tab_t *tab = infos_tab_get();
+
+	if (asn_elem_id == 0)
+		return (NULL);
+	if (is_dl) {
+		if (asn_elem_id >= ARRAY_NUM_ELEM(tab->dl_asn))
+			return (NULL);
+		return (tab->dl_asn[asn_elem_id]);
+	}
+	if (asn_elem_id >= ARRAY_NUM_ELEM(tab->ul_asn))
+		return (NULL);
+	return (tab->ul_asn[asn_elem_id]);
+}
+
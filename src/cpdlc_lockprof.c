@@ -0,0 +1,337 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#if	IBM
+#include <windows.h>
+#else	/* !IBM */
+#include <time.h>
+#endif	/* !IBM */
+
+#include "cpdlc_assert.h"
+#include "cpdlc_lockprof.h"
+
+/* Max number of locks a single thread can be holding at the same time */
+#define	MAX_HELD	32
+
+#if	defined(_MSC_VER)
+#define	THREAD_LOCAL	__declspec(thread)
+#else
+#define	THREAD_LOCAL	__thread
+#endif
+
+/*
+ * A lock held by the current thread. `t_acq' is zero while the hold has
+ * been suspended by a condition variable wait.
+ */
+typedef struct {
+	const void		*lock;
+	cpdlc_lockprof_site_t	*site;
+	uint64_t		t_acq;
+	uint64_t		hold_acc;	/* hold time before suspending */
+} held_t;
+
+static THREAD_LOCAL held_t	held[MAX_HELD];
+static THREAD_LOCAL unsigned	num_held = 0;
+
+/* All call sites which have been used, linked through their `next' */
+static cpdlc_lockprof_site_t	*sites = NULL;
+
+/* upper bounds of all but the last histogram bucket, in nanoseconds */
+static const uint64_t bucket_lim[CPDLC_LOCKPROF_BUCKETS - 1] = {
+    1000, 10000, 100000, 1000000, 10000000, 100000000
+};
+
+static inline void
+atomic_add(uint64_t *p, uint64_t val)
+{
+#if	defined(_MSC_VER)
+	InterlockedExchangeAdd64((volatile LONG64 *)p, (LONG64)val);
+#else
+	__atomic_fetch_add(p, val, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline uint64_t
+atomic_load(const uint64_t *p)
+{
+#if	defined(_MSC_VER)
+	return (InterlockedCompareExchange64((volatile LONG64 *)p, 0, 0));
+#else
+	return (__atomic_load_n(p, __ATOMIC_RELAXED));
+#endif
+}
+
+static inline void
+atomic_max(uint64_t *p, uint64_t val)
+{
+	uint64_t old = atomic_load(p);
+
+	while (val > old) {
+#if	defined(_MSC_VER)
+		uint64_t prev = InterlockedCompareExchange64(
+		    (volatile LONG64 *)p, (LONG64)val, (LONG64)old);
+		if (prev == old)
+			break;
+		old = prev;
+#else
+		if (__atomic_compare_exchange_n(p, &old, val, true,
+		    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			break;
+		}
+#endif
+	}
+}
+
+/*
+ * Adds a call site to `sites' the first time it is used.
+ */
+static void
+register_site(cpdlc_lockprof_site_t *site)
+{
+#if	defined(_MSC_VER)
+	if (InterlockedCompareExchange((volatile LONG *)&site->registered,
+	    1, 0) != 0) {
+		return;
+	}
+	do {
+		site->next = sites;
+	} while (InterlockedCompareExchangePointer((PVOID volatile *)&sites,
+	    site, site->next) != site->next);
+#else	/* !defined(_MSC_VER) */
+	int unreg = 0;
+
+	if (!__atomic_compare_exchange_n(&site->registered, &unreg, 1, false,
+	    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		return;
+	}
+	site->next = __atomic_load_n(&sites, __ATOMIC_ACQUIRE);
+	while (!__atomic_compare_exchange_n(&sites, &site->next, site, true,
+	    __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+		;
+#endif	/* !defined(_MSC_VER) */
+}
+
+static void
+hist_add(uint64_t hist[CPDLC_LOCKPROF_BUCKETS], uint64_t ns)
+{
+	unsigned b = 0;
+
+	while (b < CPDLC_LOCKPROF_BUCKETS - 1 && ns >= bucket_lim[b])
+		b++;
+	atomic_add(&hist[b], 1);
+}
+
+/*
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+uint64_t
+cpdlc_lockprof_now(void)
+{
+#if	IBM
+	LARGE_INTEGER val, freq;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&val);
+	return ((uint64_t)(((double)val.QuadPart / (double)freq.QuadPart) *
+	    1000000000.0));
+#else	/* !IBM */
+	struct timespec ts;
+
+	CPDLC_VERIFY(clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
+	return ((ts.tv_sec * 1000000000llu) + ts.tv_nsec);
+#endif	/* !IBM */
+}
+
+/*
+ * Records `lock' having been acquired at `site' by the calling thread,
+ * after having started trying at `t_start'. If `contended' is negative,
+ * the acquisition is considered contended if it took over a microsecond.
+ */
+void
+cpdlc_lockprof_acquired(cpdlc_lockprof_site_t *site, const void *lock,
+    uint64_t t_start, int contended)
+{
+	uint64_t now = cpdlc_lockprof_now();
+	uint64_t wait = now - t_start;
+
+	CPDLC_ASSERT(site != NULL);
+	CPDLC_ASSERT(lock != NULL);
+
+	register_site(site);
+	if (contended < 0)
+		contended = (wait >= bucket_lim[0]);
+	atomic_add(&site->acquired, 1);
+	if (contended)
+		atomic_add(&site->contended, 1);
+	atomic_add(&site->wait_sum, wait);
+	atomic_max(&site->wait_max, wait);
+	hist_add(site->wait_hist, wait);
+	/* If we're nested too deep, we just can't record the hold time */
+	if (num_held < MAX_HELD) {
+		held[num_held].lock = lock;
+		held[num_held].site = site;
+		held[num_held].t_acq = now;
+		held[num_held].hold_acc = 0;
+		num_held++;
+	}
+}
+
+/*
+ * Finds the most recent acquisition of `lock' by the calling thread.
+ * Returns -1 if not found.
+ */
+static int
+find_held(const void *lock)
+{
+	for (int i = (int)num_held - 1; i >= 0; i--) {
+		if (held[i].lock == lock)
+			return (i);
+	}
+	return (-1);
+}
+
+/*
+ * Records the calling thread's most recent acquisition of `lock' being
+ * released. Must be called before the lock is actually released.
+ */
+void
+cpdlc_lockprof_released(const void *lock)
+{
+	int i = find_held(lock);
+	held_t *h;
+	uint64_t hold;
+
+	if (i < 0)
+		return;
+	h = &held[i];
+	hold = h->hold_acc;
+	if (h->t_acq != 0)
+		hold += cpdlc_lockprof_now() - h->t_acq;
+	atomic_add(&h->site->hold_sum, hold);
+	atomic_max(&h->site->hold_max, hold);
+	hist_add(h->site->hold_hist, hold);
+	/* Locks needn't be released in reverse acquisition order */
+	memmove(&held[i], &held[i + 1], (num_held - i - 1) * sizeof (*held));
+	num_held--;
+}
+
+/*
+ * Condition variable waits release the lock while sleeping. These two
+ * stop and restart the hold time accounting around such a wait.
+ */
+void
+cpdlc_lockprof_suspend(const void *lock)
+{
+	int i = find_held(lock);
+
+	if (i >= 0 && held[i].t_acq != 0) {
+		held[i].hold_acc += cpdlc_lockprof_now() - held[i].t_acq;
+		held[i].t_acq = 0;
+	}
+}
+
+void
+cpdlc_lockprof_resume(const void *lock)
+{
+	int i = find_held(lock);
+
+	if (i >= 0 && held[i].t_acq == 0)
+		held[i].t_acq = cpdlc_lockprof_now();
+}
+
+static void
+dump_hist(FILE *fp, const char *prefix, const char *stat,
+    const uint64_t hist[CPDLC_LOCKPROF_BUCKETS])
+{
+	fprintf(fp, "%s_%s =", prefix, stat);
+	for (int b = 0; b < CPDLC_LOCKPROF_BUCKETS; b++) {
+		fprintf(fp, "%s%llu", b == 0 ? " " : ",",
+		    (unsigned long long)atomic_load(&hist[b]));
+	}
+	fprintf(fp, "\n");
+}
+
+/*
+ * Writes the statistics of all lock call sites used so far to `fp' as
+ * "lock_<file>_<line>_<stat> = <value>" lines. Times are in nanoseconds.
+ * The histograms are comma-separated lists of counts, with the bucket
+ * limits given by the "lock_hist_buckets" line.
+ */
+void
+cpdlc_lockprof_dump(FILE *fp)
+{
+	CPDLC_ASSERT(fp != NULL);
+
+	fprintf(fp, "lock_hist_buckets = 1us,10us,100us,1ms,10ms,100ms,inf\n");
+	for (cpdlc_lockprof_site_t *site = sites; site != NULL;
+	    site = site->next) {
+		const char *file = strrchr(site->file, '/');
+		char prefix[128];
+		uint64_t acquired = atomic_load(&site->acquired);
+
+		file = (file != NULL ? file + 1 : site->file);
+		snprintf(prefix, sizeof (prefix), "lock_%s_%d", file,
+		    site->line);
+		fprintf(fp, "%s_name = %s\n", prefix, site->name);
+		fprintf(fp, "%s_acquired = %llu\n", prefix,
+		    (unsigned long long)acquired);
+		fprintf(fp, "%s_contended = %llu\n", prefix,
+		    (unsigned long long)atomic_load(&site->contended));
+		fprintf(fp, "%s_wait_avg = %llu\n", prefix,
+		    (unsigned long long)(acquired != 0 ?
+		    atomic_load(&site->wait_sum) / acquired : 0));
+		fprintf(fp, "%s_wait_max = %llu\n", prefix,
+		    (unsigned long long)atomic_load(&site->wait_max));
+		dump_hist(fp, prefix, "wait_hist", site->wait_hist);
+		fprintf(fp, "%s_hold_avg = %llu\n", prefix,
+		    (unsigned long long)(acquired != 0 ?
+		    atomic_load(&site->hold_sum) / acquired : 0));
+		fprintf(fp, "%s_hold_max = %llu\n", prefix,
+		    (unsigned long long)atomic_load(&site->hold_max));
+		dump_hist(fp, prefix, "hold_hist", site->hold_hist);
+	}
+}
+
+/*
+ * Zeroes the statistics of all call sites. Concurrent acquisitions may
+ * or may not be counted.
+ */
+void
+cpdlc_lockprof_reset(void)
+{
+	for (cpdlc_lockprof_site_t *site = sites; site != NULL;
+	    site = site->next) {
+		site->acquired = 0;
+		site->contended = 0;
+		site->wait_sum = 0;
+		site->wait_max = 0;
+		site->hold_sum = 0;
+		site->hold_max = 0;
+		memset(site->wait_hist, 0, sizeof (site->wait_hist));
+		memset(site->hold_hist, 0, sizeof (site->hold_hist));
+	}
+}
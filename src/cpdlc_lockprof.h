@@ -0,0 +1,111 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_LIBCPDLC_LOCKPROF_H_
+#define	_LIBCPDLC_LOCKPROF_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cpdlc_core.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Lock profiling. When built with CPDLC_LOCK_PROFILE defined, every
+ * mutex_enter call site (see cpdlc_thread.h) gets its own statically
+ * allocated cpdlc_lockprof_site_t, which records how many times the
+ * lock was acquired there, how many of those acquisitions had to wait
+ * for another thread, and histograms of how long the caller waited for
+ * the lock and how long it then held it. Use cpdlc_lockprof_dump to
+ * print the statistics of all call sites which have been used so far.
+ *
+ * Without CPDLC_LOCK_PROFILE, mutex_enter and mutex_exit compile down
+ * to the plain OS locking calls and nothing is recorded.
+ */
+
+#define	CPDLC_LOCKPROF_BUCKETS	7
+
+typedef struct cpdlc_lockprof_site_s {
+	const char	*file;
+	int		line;
+	const char	*name;		/* lock expression as written */
+	int		registered;
+	uint64_t	acquired;
+	uint64_t	contended;
+	uint64_t	wait_sum;	/* nanoseconds */
+	uint64_t	wait_max;	/* nanoseconds */
+	uint64_t	hold_sum;	/* nanoseconds */
+	uint64_t	hold_max;	/* nanoseconds */
+	uint64_t	wait_hist[CPDLC_LOCKPROF_BUCKETS];
+	uint64_t	hold_hist[CPDLC_LOCKPROF_BUCKETS];
+	struct cpdlc_lockprof_site_s *next;
+} cpdlc_lockprof_site_t;
+
+CPDLC_API uint64_t cpdlc_lockprof_now(void);
+CPDLC_API void cpdlc_lockprof_acquired(cpdlc_lockprof_site_t *site,
+    const void *lock, uint64_t t_start, int contended);
+CPDLC_API void cpdlc_lockprof_released(const void *lock);
+CPDLC_API void cpdlc_lockprof_suspend(const void *lock);
+CPDLC_API void cpdlc_lockprof_resume(const void *lock);
+CPDLC_API void cpdlc_lockprof_dump(FILE *fp);
+CPDLC_API void cpdlc_lockprof_reset(void);
+
+/*
+ * Acquires a lock and records the acquisition. `tryenter' is an expression
+ * attempting to acquire the lock without blocking, yielding true on
+ * success, and `enter' is the blocking acquisition, performed only if
+ * `tryenter' failed. If the lock implementation offers no non-blocking
+ * acquisition, pass `false' as `tryenter' and use -1 as `contended'
+ * instead, in which case contention is inferred from the wait time.
+ */
+#define	CPDLC_LOCKPROF_ENTER_IMPL(lock, tryenter, enter, contended) \
+	do { \
+		static cpdlc_lockprof_site_t _lockprof_site = { \
+		    __FILE__, __LINE__, #lock, 0, 0, 0, 0, 0, 0, 0, {0}, \
+		    {0}, NULL \
+		}; \
+		uint64_t _lockprof_t0 = cpdlc_lockprof_now(); \
+		int _lockprof_cont = 0; \
+		if (!(tryenter)) { \
+			enter; \
+			_lockprof_cont = (contended); \
+		} \
+		cpdlc_lockprof_acquired(&_lockprof_site, (lock), \
+		    _lockprof_t0, _lockprof_cont); \
+	} while (0)
+#define	CPDLC_LOCKPROF_ENTER(lock, tryenter, enter) \
+	CPDLC_LOCKPROF_ENTER_IMPL(lock, tryenter, enter, 1)
+#define	CPDLC_LOCKPROF_ENTER_UNTRIED(lock, enter) \
+	CPDLC_LOCKPROF_ENTER_IMPL(lock, false, enter, -1)
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _LIBCPDLC_LOCKPROF_H_ */
@@ -26,11 +26,16 @@
 #include <ctype.h>
 #include <math.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
 
+#if	IBM
+#include <windows.h>
+#endif	/* IBM */
+
 #include "cpdlc_alloc.h"
 #include "cpdlc_assert.h"
 #include "cpdlc_hexcode.h"
@@ -39,12 +44,54 @@
 #include "cpdlc_msg_impl.h"
 #include "cpdlc_string.h"
 
+#define	ASSERT_MSG_MUTABLE(msg) \
+	CPDLC_ASSERT_MSG(!(msg)->frozen, "Attempted to modify frozen " \
+	    "message %p", (msg))
+
+struct cpdlc_msg_enc_s {
+	unsigned	len;
+	char		buf[];
+};
+
+static bool msg_materialize(const cpdlc_msg_t *msg, char *reason,
+    unsigned reason_cap);
+
+/*
+ * Reads a message's `segs' pointer, which msg_materialize can replace
+ * even in a frozen message.
+ */
+static cpdlc_msg_seg_t *
+msg_segs_load(const cpdlc_msg_t *msg)
+{
+#if	defined(_MSC_VER)
+	return (InterlockedCompareExchangePointer(
+	    (PVOID volatile *)&msg->segs, NULL, NULL));
+#else
+	return (__atomic_load_n(&msg->segs, __ATOMIC_ACQUIRE));
+#endif
+}
+
+/*
+ * Replaces a message's `segs' with `new_segs', unless it no longer
+ * points to `old_segs'.
+ */
+static bool
+msg_segs_publish(const cpdlc_msg_t *msg, cpdlc_msg_seg_t *old_segs,
+    cpdlc_msg_seg_t *new_segs)
+{
+	cpdlc_msg_seg_t **segs_p = (cpdlc_msg_seg_t **)&msg->segs;
+#if	defined(_MSC_VER)
+	return (InterlockedCompareExchangePointer((PVOID volatile *)segs_p,
+	    new_segs, old_segs) == old_segs);
+#else
+	return (__atomic_compare_exchange_n(segs_p, &old_segs, new_segs,
+	    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+#endif
+}
+
 static const cpdlc_msg_info_t *
 msg_infos_lookup(bool is_dl, int msg_type, char msg_subtype)
 {
-	const cpdlc_msg_info_t *infos =
-	    (is_dl ? cpdlc_dl_infos : cpdlc_ul_infos);
-
 	CPDLC_ASSERT3S(msg_type, >=, 0);
 	if (is_dl) {
 		CPDLC_ASSERT3S(msg_type, <=,
@@ -59,16 +106,7 @@ msg_infos_lookup(bool is_dl, int msg_type, char msg_subtype)
 		    msg_subtype <= CPDLC_DM67i_WHEN_CAN_WE_EXPCT_DES_TO_alt));
 	}
 
-	for (int i = 0; infos[i].msg_type != -1; i++) {
-		const cpdlc_msg_info_t *info = &infos[i];
-
-		if (info->is_dl == is_dl && info->msg_type == msg_type &&
-		    info->msg_subtype == msg_subtype) {
-			return (info);
-		}
-	}
-
-	return (NULL);
+	return (cpdlc_msg_infos_lookup(is_dl, msg_type, msg_subtype));
 }
 
 unsigned
@@ -194,7 +232,7 @@ serialize_pbd(const cpdlc_pbd_t *pbd, bool readable, unsigned *len_p,
 }
 
 static void
-serialize_trk_detail(const cpdlc_trk_detail_t *trk, bool readable,
+serialize_trk_detail(const cpdlc_trk_detail_packed_t *trk, bool readable,
     unsigned *len_p, char **outbuf_p, unsigned *cap_p)
 {
 	CPDLC_ASSERT(trk != NULL);
@@ -218,7 +256,7 @@ serialize_trk_detail(const cpdlc_trk_detail_t *trk, bool readable,
 }
 
 static void
-serialize_route_info(const cpdlc_route_t *route,
+serialize_route_info(const cpdlc_route_packed_t *route,
     const cpdlc_route_info_t *info, bool readable,
     unsigned *len_p, char **outbuf_p, unsigned *cap_p)
 {
@@ -289,7 +327,7 @@ serialize_route_info(const cpdlc_route_t *route,
 }
 
 static void
-serialize_route(const cpdlc_route_t *route, bool readable,
+serialize_route(const cpdlc_route_packed_t *route, bool readable,
     char *outbuf, unsigned cap)
 {
 	unsigned len = 0;
@@ -793,6 +831,7 @@ serialize_pdc(const cpdlc_pdc_t *pdc, bool readable,
 	char routebuf[8192] = {}, textbuf[8192] = {};
 
 	CPDLC_ASSERT(pdc != NULL);
+	CPDLC_ASSERT(pdc->route != NULL);
 	CPDLC_ASSERT(n_bytes_p != NULL);
 	CPDLC_ASSERT(buf_p != NULL);
 	CPDLC_ASSERT(cap_p != NULL);
@@ -817,10 +856,10 @@ serialize_pdc(const cpdlc_pdc_t *pdc, bool readable,
 	APPEND_SNPRINTF(*n_bytes_p, *buf_p, *cap_p, " %02d%02d",
 	    pdc->time_dep.hrs, pdc->time_dep.mins);
 	if (readable) {
-		serialize_route(&pdc->route, true, routebuf, sizeof (routebuf));
+		serialize_route(pdc->route, true, routebuf, sizeof (routebuf));
 		APPEND_SNPRINTF(*n_bytes_p, *buf_p, *cap_p, " %s", routebuf);
 	} else {
-		serialize_route(&pdc->route, false, routebuf,
+		serialize_route(pdc->route, false, routebuf,
 		    sizeof (routebuf));
 		cpdlc_escape_percent(routebuf, textbuf, sizeof (textbuf));
 		APPEND_SNPRINTF(*n_bytes_p, *buf_p, *cap_p, " %s", textbuf);
@@ -1116,8 +1155,10 @@ cpdlc_encode_msg_arg(const cpdlc_arg_type_t arg_type, const cpdlc_arg_t *arg,
 		break;
 	case CPDLC_ARG_POSREPORT: {
 		char repbuf[1024] = {};
-		serialize_posreport(&arg->pos_rep, readable, repbuf,
-		    sizeof (repbuf));
+		if (arg->pos_rep != NULL) {
+			serialize_posreport(arg->pos_rep, readable, repbuf,
+			    sizeof (repbuf));
+		}
 		if (readable) {
 			APPEND_SNPRINTF(*n_bytes_p, *buf_p, *cap_p, "%s",
 			    repbuf);
@@ -1210,6 +1251,7 @@ cpdlc_msg_alloc(cpdlc_pkt_t pkt_type)
 	cpdlc_msg_t *msg = safe_calloc(1, sizeof (cpdlc_msg_t));
 
 	CPDLC_ASSERT3U(pkt_type, <=, CPDLC_PKT_PONG);
+	msg->refcnt = 1;
 	msg->ts = make_timestamp();
 	msg->mrn = CPDLC_INVALID_MSG_SEQ_NR;
 	msg->pkt_type = pkt_type;
@@ -1218,12 +1260,48 @@ cpdlc_msg_alloc(cpdlc_pkt_t pkt_type)
 	return (msg);
 }
 
-static cpdlc_route_t *
-duplicate_route(const cpdlc_route_t *route_in)
+/*
+ * Allocation of the out-of-line parts of a message. Messages decoded
+ * into an arena (see cpdlc_msg_decode_arena) take all of their memory
+ * from the arena and never free any of it individually.
+ */
+void *
+cpdlc_msg_zalloc(const cpdlc_msg_t *msg, size_t size)
 {
-	cpdlc_route_t *route_out = safe_malloc(sizeof (*route_out));
-	memcpy(route_out, route_in, sizeof (*route_out));
-	return (route_out);
+	if (msg->arena != NULL)
+		return (cpdlc_arena_zalloc(msg->arena, size));
+	return (safe_calloc(1, size));
+}
+
+void
+cpdlc_msg_mem_free(const cpdlc_msg_t *msg, void *ptr)
+{
+	if (msg->arena == NULL)
+		free(ptr);
+}
+
+static void *
+msg_realloc(const cpdlc_msg_t *msg, void *ptr, size_t old_size,
+    size_t new_size)
+{
+	void *new_ptr;
+
+	if (msg->arena == NULL)
+		return (safe_realloc(ptr, new_size));
+	new_ptr = cpdlc_arena_zalloc(msg->arena, new_size);
+	if (ptr != NULL)
+		memcpy(new_ptr, ptr, MIN(old_size, new_size));
+	return (new_ptr);
+}
+
+static char *
+msg_strdup(const cpdlc_msg_t *msg, const char *str)
+{
+	size_t l = strlen(str) + 1;
+	char *dup = cpdlc_msg_zalloc(msg, l);
+
+	memcpy(dup, str, l);
+	return (dup);
 }
 
 static cpdlc_pdc_t *
@@ -1231,21 +1309,151 @@ duplicate_pdc(const cpdlc_pdc_t *pdc_in)
 {
 	cpdlc_pdc_t *pdc_out = safe_malloc(sizeof (*pdc_out));
 	memcpy(pdc_out, pdc_in, sizeof (*pdc_out));
+	if (pdc_in->route != NULL)
+		pdc_out->route = cpdlc_route_packed_copy(pdc_in->route);
 	return (pdc_out);
 }
 
+static cpdlc_pos_rep_t *
+duplicate_pos_rep(const cpdlc_pos_rep_t *pos_rep_in)
+{
+	cpdlc_pos_rep_t *pos_rep_out = safe_malloc(sizeof (*pos_rep_out));
+	memcpy(pos_rep_out, pos_rep_in, sizeof (*pos_rep_out));
+	return (pos_rep_out);
+}
+
+/*
+ * Frees the out-of-line arguments of a message segment.
+ */
+static void
+seg_free_args(const cpdlc_msg_t *msg, cpdlc_msg_seg_t *seg)
+{
+	if (seg->info == NULL || msg->arena != NULL)
+		return;
+	for (unsigned i = 0; i < seg->info->num_args; i++) {
+		switch (seg->info->args[i]) {
+		case CPDLC_ARG_ROUTE:
+			cpdlc_route_packed_free(seg->args[i].route);
+			break;
+		case CPDLC_ARG_PDC:
+			if (seg->args[i].pdc != NULL)
+				free(seg->args[i].pdc->route);
+			free(seg->args[i].pdc);
+			break;
+		case CPDLC_ARG_FREETEXT:
+			free(seg->args[i].freetext);
+			break;
+		case CPDLC_ARG_POSREPORT:
+			free(seg->args[i].pos_rep);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/*
+ * Appends a zeroed segment to the message's `segs' array. The caller
+ * must still increment `num_segs' to make the segment part of the
+ * message.
+ */
+static cpdlc_msg_seg_t *
+msg_seg_grow(cpdlc_msg_t *msg)
+{
+	CPDLC_ASSERT3U(msg->num_segs, <, CPDLC_MAX_MSG_SEGS);
+	msg->segs = msg_realloc(msg, msg->segs,
+	    msg->num_segs * sizeof (*msg->segs),
+	    (msg->num_segs + 1) * sizeof (*msg->segs));
+	memset(&msg->segs[msg->num_segs], 0, sizeof (*msg->segs));
+	return (&msg->segs[msg->num_segs]);
+}
+
+/*
+ * Appends a MSG= header as received, `start' pointing at "MSG=" and
+ * `end' at its terminating '/' or NUL, to the message's `raw_segs'.
+ */
+static void
+raw_segs_append(cpdlc_msg_t *msg, const char *start, const char *end)
+{
+	unsigned l = end - start;
+
+	msg->raw_segs = msg_realloc(msg, msg->raw_segs,
+	    msg->raw_segs != NULL ? msg->raw_segs_len + 1 : 0,
+	    msg->raw_segs_len + l + 2);
+	msg->raw_segs[msg->raw_segs_len] = '/';
+	memcpy(&msg->raw_segs[msg->raw_segs_len + 1], start, l);
+	msg->raw_segs_len += l + 1;
+	msg->raw_segs[msg->raw_segs_len] = '\0';
+}
+
+/*
+ * Must be called whenever the segments change, since the message text
+ * as received (`raw_segs' and `raw_arinc622') no longer matches them.
+ */
+static void
+raw_segs_drop(cpdlc_msg_t *msg)
+{
+	/* Lazy arguments can't be decoded once `raw_segs' is gone */
+	if (msg->lazy_segs != NULL) {
+		if (msg_materialize(msg, NULL, 0))
+			cpdlc_msg_mem_free(msg, msg->lazy_segs);
+		else
+			msg->args_malformed = true;
+		msg->lazy_segs = NULL;
+	}
+	cpdlc_msg_mem_free(msg, msg->raw_segs);
+	msg->raw_segs = NULL;
+	msg->raw_segs_len = 0;
+	cpdlc_msg_mem_free(msg, msg->raw_arinc622);
+	msg->raw_arinc622 = NULL;
+}
+
 cpdlc_msg_t *
 cpdlc_msg_copy(const cpdlc_msg_t *oldmsg)
 {
 	cpdlc_msg_t *newmsg = safe_calloc(1, sizeof (cpdlc_msg_t));
+	const cpdlc_msg_seg_t *oldsegs = msg_segs_load(oldmsg);
 
 	memcpy(newmsg, oldmsg, sizeof (*newmsg));
+	/* The copy always lives on the heap and starts out mutable */
+	newmsg->arena = NULL;
+	newmsg->refcnt = 1;
+	newmsg->frozen = false;
+	memset(newmsg->enc_cache, 0, sizeof (newmsg->enc_cache));
+	if (oldmsg->num_segs != 0) {
+		newmsg->segs = safe_malloc(oldmsg->num_segs *
+		    sizeof (*newmsg->segs));
+		memcpy(newmsg->segs, oldsegs,
+		    oldmsg->num_segs * sizeof (*newmsg->segs));
+	} else {
+		newmsg->segs = NULL;
+	}
+	/* The copy's arguments can still be decoded from its `raw_segs' */
+	newmsg->lazy_segs = (oldsegs == oldmsg->lazy_segs ? newmsg->segs :
+	    NULL);
 	if (oldmsg->logon_data != NULL)
 		newmsg->logon_data = strdup(oldmsg->logon_data);
+	if (oldmsg->raw_segs != NULL) {
+		newmsg->raw_segs = safe_malloc(oldmsg->raw_segs_len + 1);
+		memcpy(newmsg->raw_segs, oldmsg->raw_segs,
+		    oldmsg->raw_segs_len + 1);
+	}
+	if (oldmsg->raw_arinc622 != NULL) {
+		size_t l = strlen(oldmsg->raw_arinc622) + 1;
+
+		newmsg->raw_arinc622 = safe_malloc(l);
+		memcpy(newmsg->raw_arinc622, oldmsg->raw_arinc622, l);
+	}
+	if (oldmsg->to_list != NULL) {
+		newmsg->to_list = safe_malloc(oldmsg->num_to_list *
+		    sizeof (*newmsg->to_list));
+		memcpy(newmsg->to_list, oldmsg->to_list,
+		    oldmsg->num_to_list * sizeof (*newmsg->to_list));
+	}
 	newmsg->arinc622 = oldmsg->arinc622;
 
 	for (unsigned i = 0; i < oldmsg->num_segs; i++) {
-		const cpdlc_msg_seg_t *oldseg = &oldmsg->segs[i];
+		const cpdlc_msg_seg_t *oldseg = &oldsegs[i];
 		cpdlc_msg_seg_t *newseg = &newmsg->segs[i];
 
 		if (oldseg->info == NULL)
@@ -1253,7 +1461,7 @@ cpdlc_msg_copy(const cpdlc_msg_t *oldmsg)
 		for (unsigned j = 0; j < oldseg->info->num_args; j++) {
 			if (oldseg->info->args[j] == CPDLC_ARG_ROUTE &&
 			    oldseg->args[j].route != NULL) {
-				newseg->args[j].route = duplicate_route(
+				newseg->args[j].route = cpdlc_route_packed_copy(
 				    oldseg->args[j].route);
 			} else if (oldseg->info->args[j] ==
 			    CPDLC_ARG_FREETEXT &&
@@ -1264,6 +1472,11 @@ cpdlc_msg_copy(const cpdlc_msg_t *oldmsg)
 			    oldseg->args[j].pdc != NULL) {
 				newseg->args[j].pdc = duplicate_pdc(
 				    oldseg->args[j].pdc);
+			} else if (oldseg->info->args[j] ==
+			    CPDLC_ARG_POSREPORT &&
+			    oldseg->args[j].pos_rep != NULL) {
+				newseg->args[j].pos_rep = duplicate_pos_rep(
+				    oldseg->args[j].pos_rep);
 			}
 		}
 	}
@@ -1271,27 +1484,82 @@ cpdlc_msg_copy(const cpdlc_msg_t *oldmsg)
 	return (newmsg);
 }
 
+static unsigned
+refcnt_add(unsigned *refcnt, int delta)
+{
+#if	defined(_MSC_VER)
+	return (InterlockedExchangeAdd((LONG volatile *)refcnt, delta) +
+	    delta);
+#else
+	return (__atomic_add_fetch(refcnt, delta, __ATOMIC_ACQ_REL));
+#endif
+}
+
+/*
+ * Adds a reference to a message, so it can be shared between multiple
+ * owners. Every owner releases its reference using cpdlc_msg_free and
+ * the message is only freed once the last reference is gone. Shared
+ * messages should be frozen (see cpdlc_msg_freeze), so that none of the
+ * owners can change them under the others' hands. References do not
+ * extend the lifetime of messages allocated from an arena.
+ *
+ * @return `msg', for convenience.
+ */
+cpdlc_msg_t *
+cpdlc_msg_hold(cpdlc_msg_t *msg)
+{
+	CPDLC_ASSERT(msg != NULL);
+	CPDLC_VERIFY3U(refcnt_add(&msg->refcnt, 1), >, 1);
+	return (msg);
+}
+
+/*
+ * Makes a message immutable. Any attempt to modify it afterwards trips
+ * an assertion. Frozen messages can be safely shared between threads
+ * and their encodings are cached (see cpdlc_msg_encode_cached). Use
+ * cpdlc_msg_copy to obtain a modifiable copy of a frozen message.
+ */
 void
-cpdlc_msg_free(cpdlc_msg_t *msg)
+cpdlc_msg_freeze(cpdlc_msg_t *msg)
 {
 	CPDLC_ASSERT(msg != NULL);
+	msg->frozen = true;
+}
 
-	free(msg->logon_data);
+bool
+cpdlc_msg_is_frozen(const cpdlc_msg_t *msg)
+{
+	CPDLC_ASSERT(msg != NULL);
+	return (msg->frozen);
+}
 
-	for (unsigned i = 0; i < msg->num_segs; i++) {
-		cpdlc_msg_seg_t *seg = &msg->segs[i];
+/*
+ * Releases a reference to a message (see cpdlc_msg_hold), freeing the
+ * message when it was the last one.
+ */
+void
+cpdlc_msg_free(cpdlc_msg_t *msg)
+{
+	CPDLC_ASSERT(msg != NULL);
 
-		if (seg->info == NULL)
-			continue;
-		for (unsigned j = 0; j < seg->info->num_args; j++) {
-			if (seg->info->args[j] == CPDLC_ARG_ROUTE)
-				free(seg->args[j].route);
-			if (seg->info->args[j] == CPDLC_ARG_PDC)
-				free(seg->args[j].pdc);
-			else if (seg->info->args[j] == CPDLC_ARG_FREETEXT)
-				free(seg->args[j].freetext);
-		}
-	}
+	/* Released all at once when the arena is reset */
+	if (msg->arena != NULL)
+		return;
+	if (refcnt_add(&msg->refcnt, -1) != 0)
+		return;
+	for (unsigned i = 0; i < sizeof (msg->enc_cache) /
+	    sizeof (*msg->enc_cache); i++)
+		free(msg->enc_cache[i]);
+	free(msg->logon_data);
+	free(msg->to_list);
+	free(msg->raw_segs);
+	free(msg->raw_arinc622);
+
+	for (unsigned i = 0; i < msg->num_segs; i++)
+		seg_free_args(msg, &msg->segs[i]);
+	if (msg->lazy_segs != msg->segs)
+		free(msg->lazy_segs);
+	free(msg->segs);
 	free(msg);
 }
 
@@ -1299,6 +1567,7 @@ int
 cpdlc_msg_option_add(cpdlc_msg_t *msg, const char *opt)
 {
 	CPDLC_ASSERT(msg != NULL);
+	ASSERT_MSG_MUTABLE(msg);
 	CPDLC_ASSERT(opt != NULL);
 	if (msg->num_opts >= CPDLC_MAX_OPTS)
 		return (-1);
@@ -1314,6 +1583,7 @@ void
 cpdlc_msg_option_remove(cpdlc_msg_t *msg, const char *opt)
 {
 	CPDLC_ASSERT(msg != NULL);
+	ASSERT_MSG_MUTABLE(msg);
 	CPDLC_ASSERT(opt != NULL);
 	for (unsigned i = 0; i < msg->num_opts; i++) {
 		if (strcmp(msg->opts[i], opt) == 0) {
@@ -1359,6 +1629,7 @@ void
 cpdlc_msg_set_imi(cpdlc_msg_t *msg, cpdlc_imi_t imi)
 {
 	CPDLC_ASSERT(msg != NULL);
+	ASSERT_MSG_MUTABLE(msg);
 	msg->arinc622.imi = imi;
 	if (imi == CPDLC_IMI_DISC_REQUEST)
 		msg->is_logoff = true;
@@ -1386,6 +1657,24 @@ pkt_type2str(cpdlc_pkt_t pkt_type)
 	}
 }
 
+/*
+ * Returns true if encoding a message in the given formats involves its
+ * segment arguments, rather than just the message text as received.
+ */
+static bool
+msg_enc_needs_args(const cpdlc_msg_t *msg, bool fmt_plain, bool fmt_arinc622)
+{
+	return ((fmt_plain && msg->raw_segs == NULL) ||
+	    (fmt_arinc622 && !cpdlc_msg_arinc622_passthru(msg)));
+}
+
+/*
+ * Encodes a message into `buf'. Returns the length of the encoded
+ * message, excluding the terminating NUL byte. If the message was
+ * decoded with CPDLC_DECODE_LAZY_ARGS and its arguments turn out to be
+ * malformed, nothing is encoded: `buf' is set to an empty string and 0
+ * is returned. Use cpdlc_msg_validate to find out why.
+ */
 unsigned
 cpdlc_msg_encode(const cpdlc_msg_t *msg, char *buf, unsigned cap)
 {
@@ -1393,6 +1682,12 @@ cpdlc_msg_encode(const cpdlc_msg_t *msg, char *buf, unsigned cap)
 
 	CPDLC_ASSERT(msg != NULL);
 	CPDLC_ASSERT(buf != NULL || cap == 0);
+	if (msg_enc_needs_args(msg, msg->fmt_plain, msg->fmt_arinc622) &&
+	    !msg_materialize(msg, NULL, 0)) {
+		if (cap != 0)
+			buf[0] = '\0';
+		return (0);
+	}
 
 	APPEND_SNPRINTF(n_bytes, buf, cap, "PKT=%s",
 	    pkt_type2str(msg->pkt_type));
@@ -1401,7 +1696,21 @@ cpdlc_msg_encode(const cpdlc_msg_t *msg, char *buf, unsigned cap)
 		APPEND_SNPRINTF(n_bytes, buf, cap, "/TS=%02d%02d%02d",
 		    msg->ts.hrs, msg->ts.mins, msg->ts.secs);
 	}
-	if (msg->to[0] != '\0' && msg->fmt_plain) {
+	if (msg->srv_ts.rx != 0 && msg->srv_ts.tx != 0) {
+		APPEND_SNPRINTF(n_bytes, buf, cap, "/SRVTS=%llu,%llu",
+		    (unsigned long long)msg->srv_ts.rx,
+		    (unsigned long long)msg->srv_ts.tx);
+	}
+	if (msg->num_to_list != 0 && msg->fmt_plain) {
+		APPEND_SNPRINTF(n_bytes, buf, cap, "/TO=");
+		for (unsigned i = 0; i < msg->num_to_list; i++) {
+			char textbuf[32] = {};
+			cpdlc_escape_percent(msg->to_list[i], textbuf,
+			    sizeof (textbuf));
+			APPEND_SNPRINTF(n_bytes, buf, cap, "%s%s",
+			    i != 0 ? "," : "", textbuf);
+		}
+	} else if (msg->to[0] != '\0' && msg->fmt_plain) {
 		char textbuf[32] = {};
 		cpdlc_escape_percent(msg->to, textbuf,
 		    sizeof (textbuf));
@@ -1433,9 +1742,15 @@ cpdlc_msg_encode(const cpdlc_msg_t *msg, char *buf, unsigned cap)
 		    sizeof (textbuf));
 		APPEND_SNPRINTF(n_bytes, buf, cap, "/FROM=%s", textbuf);
 	}
-	if (msg->fmt_arinc622)
+	if (msg->fmt_arinc622 && cpdlc_msg_arinc622_passthru(msg)) {
+		APPEND_SNPRINTF(n_bytes, buf, cap, "/ARINC622=%s",
+		    msg->raw_arinc622);
+	} else if (msg->fmt_arinc622) {
 		cpdlc_msg_encode_arinc622(msg, &n_bytes, &buf, &cap);
-	if (msg->fmt_plain) {
+	}
+	if (msg->fmt_plain && msg->raw_segs != NULL) {
+		APPEND_SNPRINTF(n_bytes, buf, cap, "%s", msg->raw_segs);
+	} else if (msg->fmt_plain) {
 		for (unsigned i = 0; i < msg->num_segs; i++)
 			encode_seg(&msg->segs[i], &n_bytes, &buf, &cap);
 	}
@@ -1444,6 +1759,171 @@ cpdlc_msg_encode(const cpdlc_msg_t *msg, char *buf, unsigned cap)
 	return (n_bytes);
 }
 
+/*
+ * Encodes a message into a growable buffer, starting at offset `off'.
+ * Unlike calling cpdlc_msg_encode twice (once to size the buffer and
+ * again to fill it), this runs the encoder only once for all but very
+ * large messages. Short of room, the output goes to a scratch buffer
+ * first and is then copied into the grown buffer.
+ *
+ * @param buf_p Pointer to the malloc'd buffer to encode into. Pass a
+ *	pointer to NULL to have a new buffer allocated. The buffer is
+ *	grown with realloc if it is too small, so it must be released
+ *	with free().
+ * @param cap_p Pointer to the current capacity of `*buf_p' in bytes.
+ *	Updated if the buffer is grown.
+ * @param off Offset in `*buf_p' at which to place the encoded message.
+ *	The first `off' bytes of the buffer are preserved.
+ *
+ * @return The length of the encoded message, excluding the terminating
+ *	NUL byte, which is always written. 0 if the message couldn't be
+ *	encoded (see cpdlc_msg_encode).
+ */
+unsigned
+cpdlc_msg_encode_buf(const cpdlc_msg_t *msg, char **buf_p, unsigned *cap_p,
+    unsigned off)
+{
+	char scratch[2048];
+	char *buf;
+	unsigned cap, n_bytes;
+
+	CPDLC_ASSERT(msg != NULL);
+	CPDLC_ASSERT(buf_p != NULL);
+	CPDLC_ASSERT(cap_p != NULL);
+	CPDLC_ASSERT(*buf_p != NULL || *cap_p == 0);
+
+	if (*cap_p > off && *cap_p - off >= sizeof (scratch)) {
+		buf = *buf_p + off;
+		cap = *cap_p - off;
+	} else {
+		buf = scratch;
+		cap = sizeof (scratch);
+	}
+	n_bytes = cpdlc_msg_encode(msg, buf, cap);
+	if (*cap_p < off + n_bytes + 1) {
+		*cap_p = off + n_bytes + 1;
+		*buf_p = safe_realloc(*buf_p, *cap_p);
+	}
+	if (n_bytes < cap) {
+		if (buf == scratch)
+			memcpy(*buf_p + off, scratch, n_bytes + 1);
+	} else {
+		/* Didn't fit into the initial buffer, encode again */
+		unsigned n_bytes2 = cpdlc_msg_encode(msg, *buf_p + off,
+		    n_bytes + 1);
+		CPDLC_ASSERT3U(n_bytes, ==, n_bytes2);
+	}
+	return (n_bytes);
+}
+
+/*
+ * Encodes a message into an exactly-sized, newly allocated buffer. The
+ * caller must free the returned buffer using free(). If the message
+ * couldn't be encoded (see cpdlc_msg_encode), the buffer holds an empty
+ * string.
+ *
+ * @param len_p Optional return parameter for the length of the encoded
+ *	message, excluding the terminating NUL byte.
+ */
+char *
+cpdlc_msg_encode_alloc(const cpdlc_msg_t *msg, unsigned *len_p)
+{
+	char *buf = NULL;
+	unsigned cap = 0;
+	unsigned len = cpdlc_msg_encode_buf(msg, &buf, &cap, 0);
+
+	if (len_p != NULL)
+		*len_p = len;
+	return (buf);
+}
+
+/*
+ * Returns the encoding of a frozen message (see cpdlc_msg_freeze) in
+ * the given format(s), as if its fmt_plain and fmt_arinc622 fields had
+ * been set to `fmt_plain' and `fmt_arinc622'. Each format combination
+ * is only encoded once, on first use, so a message which goes out to
+ * many recipients, or is also logged, isn't encoded over and over.
+ *
+ * @param len_p Optional return parameter for the length of the encoded
+ *	message, excluding the terminating NUL byte.
+ *
+ * @return The NUL-terminated encoding. It is owned by the message and
+ *	remains valid for as long as the message does. If the message
+ *	couldn't be encoded (see cpdlc_msg_encode), this is an empty
+ *	string, which isn't cached.
+ */
+const char *
+cpdlc_msg_encode_cached(const cpdlc_msg_t *msg, bool fmt_plain,
+    bool fmt_arinc622, unsigned *len_p)
+{
+	cpdlc_msg_enc_t **slot;
+	cpdlc_msg_enc_t *enc, *prev = NULL;
+	cpdlc_msg_t tmp;
+	char *buf = NULL;
+	unsigned cap = 0, len;
+
+	CPDLC_ASSERT(msg != NULL);
+	CPDLC_ASSERT_MSG(msg->frozen, "Message %p must be frozen to use "
+	    "cached encodings", msg);
+
+	/* The cache isn't part of the message's logical contents */
+	slot = (cpdlc_msg_enc_t **)&msg->enc_cache[(fmt_plain ? 1 : 0) |
+	    (fmt_arinc622 ? 2 : 0)];
+#if	defined(_MSC_VER)
+	enc = InterlockedCompareExchangePointer((PVOID volatile *)slot,
+	    NULL, NULL);
+#else
+	enc = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+#endif
+	if (enc != NULL)
+		goto out;
+	/*
+	 * Encoding only reads the message, so a shallow copy suffices to
+	 * switch the formats. Any lazy arguments must be decoded in the
+	 * message itself though, not in the copy.
+	 */
+	if (msg_enc_needs_args(msg, fmt_plain, fmt_arinc622) &&
+	    !msg_materialize(msg, NULL, 0)) {
+		if (len_p != NULL)
+			*len_p = 0;
+		return ("");
+	}
+	tmp = *msg;
+	tmp.segs = msg_segs_load(msg);
+	tmp.lazy_segs = NULL;
+	tmp.fmt_plain = fmt_plain;
+	tmp.fmt_arinc622 = fmt_arinc622;
+	len = cpdlc_msg_encode_buf(&tmp, &buf, &cap,
+	    offsetof(cpdlc_msg_enc_t, buf));
+	if (msg->arena != NULL) {
+		/* Arena messages are confined to a single thread */
+		enc = cpdlc_arena_zalloc(msg->arena,
+		    offsetof(cpdlc_msg_enc_t, buf) + len + 1);
+		memcpy(enc->buf, &buf[offsetof(cpdlc_msg_enc_t, buf)],
+		    len + 1);
+		free(buf);
+	} else {
+		enc = (cpdlc_msg_enc_t *)buf;
+	}
+	enc->len = len;
+	/* Another thread could have beaten us to it */
+#if	defined(_MSC_VER)
+	prev = InterlockedCompareExchangePointer((PVOID volatile *)slot,
+	    enc, NULL);
+	if (prev != NULL) {
+#else
+	if (!__atomic_compare_exchange_n(slot, &prev, enc, false,
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+#endif
+		cpdlc_msg_mem_free(msg, enc);
+		enc = prev;
+	}
+out:
+	if (len_p != NULL)
+		*len_p = enc->len;
+	return (enc->buf);
+}
+
 static void
 readable_seg(const cpdlc_msg_seg_t *seg, unsigned *n_bytes_p, char **buf_p,
     unsigned *cap_p)
@@ -1488,11 +1968,23 @@ readable_seg(const cpdlc_msg_seg_t *seg, unsigned *n_bytes_p, char **buf_p,
 	}
 }
 
+/*
+ * Renders the message's segments as human-readable text. Like
+ * cpdlc_msg_encode, this yields an empty string and returns 0 if the
+ * message's lazily decoded arguments are malformed.
+ */
 unsigned
 cpdlc_msg_readable(const cpdlc_msg_t *msg, char *buf, unsigned cap)
 {
 	unsigned n_bytes = 0;
 
+	CPDLC_ASSERT(msg != NULL);
+	CPDLC_ASSERT(buf != NULL || cap == 0);
+	if (!msg_materialize(msg, NULL, 0)) {
+		if (cap != 0)
+			buf[0] = '\0';
+		return (0);
+	}
 	for (unsigned i = 0; i < msg->num_segs; i++) {
 		readable_seg(&msg->segs[i], &n_bytes, &buf, &cap);
 		if (i + 1 < msg->num_segs)
@@ -1531,6 +2023,12 @@ validate_logon_logoff_message(const cpdlc_msg_t *msg, char *reason,
 static bool
 validate_message(const cpdlc_msg_t *msg, char *reason, unsigned reason_cap)
 {
+	if (msg->num_to_list != 0 && (msg->is_logon || msg->is_logoff ||
+	    msg->pkt_type != CPDLC_PKT_CPDLC)) {
+		MALFORMED_MSG("only CPDLC messages may have multiple "
+		    "recipients");
+		return (false);
+	}
 	/* LOGON message format is special */
 	if (msg->is_logon || msg->is_logoff)
 		return (validate_logon_logoff_message(msg, reason, reason_cap));
@@ -2224,8 +2722,8 @@ errout:
 }
 
 static bool
-parse_pdc(const char *start, const char *end, cpdlc_pdc_t *pdc,
-    char *reason, unsigned reason_cap)
+parse_pdc(const cpdlc_msg_t *msg, const char *start, const char *end,
+    cpdlc_pdc_t *pdc, char *reason, unsigned reason_cap)
 {
 	char textbuf[8192] = {}, routebuf[8192] = {};
 	cpdlc_route_t *route;
@@ -2291,7 +2789,8 @@ parse_pdc(const char *start, const char *end, cpdlc_pdc_t *pdc,
 		MALFORMED_MSG("error parsing PDC: malformed route");
 		return (false);
 	}
-	pdc->route = *route;
+	CPDLC_ASSERT(pdc->route == NULL);
+	pdc->route = cpdlc_route_pack_arena(route, msg->arena);
 	free(route);
 	SKIP_NONSPACE(start, end);
 	SKIP_SPACE(start, end);
@@ -2323,8 +2822,9 @@ parse_pdc(const char *start, const char *end, cpdlc_pdc_t *pdc,
 }
 
 static bool
-msg_decode_seg(cpdlc_msg_seg_t *seg, const char *start, const char *end,
-    char *reason, unsigned reason_cap)
+msg_decode_seg(const cpdlc_msg_t *msg, cpdlc_msg_seg_t *seg,
+    const char *start, const char *end, bool hdr_only, char *reason,
+    unsigned reason_cap)
 {
 	bool is_dl;
 	int msg_type;
@@ -2394,6 +2894,9 @@ msg_decode_seg(cpdlc_msg_seg_t *seg, const char *start, const char *end,
 		MALFORMED_MSG("expected space after message type");
 		return (false);
 	}
+	/* Segments without arguments needn't be decoded lazily */
+	if (hdr_only && info->num_args != 0)
+		return (true);
 	SKIP_SPACE(start, end);
 
 	for (num_args = 0; num_args < info->num_args && start < end;
@@ -2562,6 +3065,7 @@ msg_decode_seg(cpdlc_msg_seg_t *seg, const char *start, const char *end,
 			break;
 		case CPDLC_ARG_ROUTE: {
 			char *buf;
+			cpdlc_route_t *route;
 
 			cpdlc_strlcpy(textbuf, start, MIN(sizeof (textbuf),
 			    (uintptr_t)(end - start) + 1));
@@ -2573,10 +3077,12 @@ msg_decode_seg(cpdlc_msg_seg_t *seg, const char *start, const char *end,
 			CPDLC_ASSERT(arg->route == NULL);
 			buf = safe_malloc(l + 1);
 			cpdlc_unescape_percent(textbuf, buf, l + 1);
-			arg->route = parse_route(buf, reason, reason_cap);
+			route = parse_route(buf, reason, reason_cap);
 			free(buf);
-			if (arg->route == NULL)
+			if (route == NULL)
 				return (false);
+			arg->route = cpdlc_route_pack_arena(route, msg->arena);
+			free(route);
 			start = end;
 			break;
 		}
@@ -2711,8 +3217,8 @@ msg_decode_seg(cpdlc_msg_seg_t *seg, const char *start, const char *end,
 				MALFORMED_MSG("invalid URL escape");
 				return (false);
 			}
-			free(arg->freetext);
-			arg->freetext = malloc(l + 1);
+			cpdlc_msg_mem_free(msg, arg->freetext);
+			arg->freetext = cpdlc_msg_zalloc(msg, l + 1);
 			cpdlc_unescape_percent(textbuf, arg->freetext, l + 1);
 			start = end;
 			break;
@@ -2732,7 +3238,10 @@ msg_decode_seg(cpdlc_msg_seg_t *seg, const char *start, const char *end,
 			    (unsigned)(arg_end - start) + 1));
 			cpdlc_unescape_percent(tmpbuf, textbuf,
 			    sizeof (textbuf));
-			if (!parse_posreport(textbuf, &arg->pos_rep,
+			CPDLC_ASSERT(arg->pos_rep == NULL);
+			arg->pos_rep = cpdlc_msg_zalloc(msg,
+			    sizeof (*arg->pos_rep));
+			if (!parse_posreport(textbuf, arg->pos_rep,
 			    reason, reason_cap)) {
 				return (false);
 			}
@@ -2740,11 +3249,13 @@ msg_decode_seg(cpdlc_msg_seg_t *seg, const char *start, const char *end,
 		}
 		case CPDLC_ARG_PDC:
 			CPDLC_ASSERT(arg->pdc == NULL);
-			arg->pdc = safe_calloc(1, sizeof (*arg->pdc));
-			if (!parse_pdc(start, end, arg->pdc, reason,
+			arg->pdc = cpdlc_msg_zalloc(msg, sizeof (*arg->pdc));
+			if (!parse_pdc(msg, start, end, arg->pdc, reason,
 			    reason_cap)) {
 				return (false);
 			}
+			/* The PDC takes up the rest of the segment */
+			start = end;
 			break;
 		case CPDLC_ARG_TP4TABLE:
 			if (sscanf(start, "%d", (int *)&arg->tp4) != 1 ||
@@ -2802,43 +3313,170 @@ end:
 	return (true);
 }
 
-bool
-cpdlc_msg_decode(const char *in_buf, bool is_dl, cpdlc_msg_t **msg_p,
-    int *consumed, char *reason, unsigned reason_cap)
+/*
+ * Decodes the segment arguments of a message decoded using
+ * CPDLC_DECODE_LAZY_ARGS from its `raw_segs' or `raw_arinc622'. This
+ * doesn't change the message's logical contents, so it's done on const
+ * and frozen messages too. The decoded segments are built in a new
+ * array and then published in `segs' atomically, so concurrent readers
+ * see either the lazy segments or the fully decoded ones.
+ *
+ * On failure, the message stays lazy and its arguments remain zeroed,
+ * so callers must never use them (nor encode them) after a false
+ * return.
+ */
+static bool
+msg_materialize(const cpdlc_msg_t *msg, char *reason, unsigned reason_cap)
 {
-	const char *start, *term;
-	cpdlc_msg_t *msg;
-	bool pkt_type_seen = false;
-	bool skipped_cr = false;
+	cpdlc_msg_seg_t *lazy = msg->lazy_segs, *segs;
+	unsigned num_segs;
+	bool ok = true;
 
-	CPDLC_ASSERT(in_buf != NULL);
-	CPDLC_ASSERT(msg_p != NULL);
-	CPDLC_ASSERT(consumed != NULL);
-	CPDLC_ASSERT(reason != NULL || reason_cap == 0);
+	if (msg->args_malformed) {
+		MALFORMED_MSG("message arguments failed to decode");
+		return (false);
+	}
+	if (lazy == NULL || msg_segs_load(msg) != lazy)
+		return (true);
 
-	term = strchr(in_buf, '\n');
-	if (term != NULL) {
-		if (term > in_buf && *(term - 1) == '\r') {
-			term -= 1;
-			skipped_cr = true;
-		}
+	if (msg->raw_arinc622 != NULL) {
+		/* Decoding into a scratch message yields just the segments */
+		const char *raw = msg->raw_arinc622;
+		cpdlc_msg_t tmp = { .arena = msg->arena, .refcnt = 1 };
+
+		ok = cpdlc_msg_decode_arinc622(&tmp, raw, raw + strlen(raw),
+		    lazy[0].info->is_dl, 0, reason, reason_cap);
+		CPDLC_ASSERT(!ok || tmp.num_segs == msg->num_segs);
+		segs = tmp.segs;
+		num_segs = tmp.num_segs;
 	} else {
-		term = strchr(in_buf, '\r');
+		const char *start = msg->raw_segs;
+
+		CPDLC_ASSERT(start != NULL);
+		segs = cpdlc_msg_zalloc(msg, msg->num_segs * sizeof (*segs));
+		num_segs = msg->num_segs;
+		for (unsigned i = 0; i < num_segs; i++) {
+			const char *end;
+
+			CPDLC_ASSERT(strncmp(start, "/MSG=", 5) == 0);
+			start += 5;
+			end = strchr(start, '/');
+			if (end == NULL)
+				end = start + strlen(start);
+			if (!msg_decode_seg(msg, &segs[i], start, end, false,
+			    reason, reason_cap)) {
+				ok = false;
+				break;
+			}
+			start = end;
+		}
 	}
-	if (term == NULL) {
-		/* No complete message in buffer */
-		*msg_p = NULL;
-		if (consumed != NULL)
-			*consumed = 0;
+	if (ok && msg_segs_publish(msg, lazy, segs))
+		return (true);
+	/* Decoding failed, or another thread has beaten us to it */
+	for (unsigned i = 0; i < num_segs; i++)
+		seg_free_args(msg, &segs[i]);
+	cpdlc_msg_mem_free(msg, segs);
+
+	return (ok);
+}
+
+/*
+ * Fully decodes a message received with CPDLC_DECODE_LAZY_ARGS, which
+ * validates its segment arguments. For any other message, this simply
+ * returns true, as it has been validated when it was decoded.
+ *
+ * @return True if the message is valid, false if it's malformed (with
+ *	the error description in `reason').
+ */
+bool
+cpdlc_msg_validate(const cpdlc_msg_t *msg, char *reason, unsigned reason_cap)
+{
+	CPDLC_ASSERT(msg != NULL);
+	CPDLC_ASSERT(reason != NULL || reason_cap == 0);
+	return (msg_materialize(msg, reason, reason_cap));
+}
+
+/*
+ * Appends a recipient to the multi-recipient list of a message. Empty
+ * and duplicate recipients are ignored.
+ */
+static bool
+to_list_add(cpdlc_msg_t *msg, const char *to)
+{
+	if (to[0] == '\0')
 		return (true);
+	for (unsigned i = 0; i < msg->num_to_list; i++) {
+		if (strcmp(msg->to_list[i], to) == 0)
+			return (true);
 	}
+	if (msg->num_to_list == CPDLC_MAX_TO_LIST)
+		return (false);
+	msg->to_list = msg_realloc(msg, msg->to_list,
+	    msg->num_to_list * sizeof (*msg->to_list),
+	    (msg->num_to_list + 1) * sizeof (*msg->to_list));
+	memset(msg->to_list[msg->num_to_list], 0, sizeof (*msg->to_list));
+	cpdlc_strlcpy(msg->to_list[msg->num_to_list], to,
+	    sizeof (*msg->to_list));
+	msg->num_to_list++;
+	return (true);
+}
 
-	msg = safe_calloc(1, sizeof (*msg));
+static bool
+decode_to_list(cpdlc_msg_t *msg, const char *start, const char *end,
+    char *reason, unsigned reason_cap)
+{
+	cpdlc_msg_mem_free(msg, msg->to_list);
+	msg->to_list = NULL;
+	msg->num_to_list = 0;
+
+	while (start < end) {
+		const char *comma = memchr(start, ',', end - start);
+		char textbuf[32], to[CPDLC_CALLSIGN_LEN];
+
+		if (comma == NULL)
+			comma = end;
+		cpdlc_strlcpy(textbuf, start, MIN(sizeof (textbuf),
+		    (uintptr_t)(comma - start) + 1));
+		cpdlc_unescape_percent(textbuf, to, sizeof (to));
+		if (!to_list_add(msg, to)) {
+			MALFORMED_MSG("too many recipients in TO header");
+			return (false);
+		}
+		start = comma + 1;
+	}
+	if (msg->num_to_list == 0) {
+		MALFORMED_MSG("empty TO header recipient list");
+		return (false);
+	}
+	return (true);
+}
+
+/*
+ * Decodes a single message. `in_buf' must be NUL-terminated at the end
+ * of the message (without the line terminator). If `arena' is non-NULL,
+ * the message is allocated from it. `flags' is a combination of
+ * cpdlc_decode_flags_t.
+ */
+static bool
+decode_line(const char *in_buf, bool is_dl, cpdlc_arena_t *arena,
+    unsigned flags, cpdlc_msg_t **msg_p, char *reason, unsigned reason_cap)
+{
+	const char *term = in_buf + strlen(in_buf);
+	cpdlc_msg_t *msg;
+	bool pkt_type_seen = false;
+
+	if (arena != NULL) {
+		msg = cpdlc_arena_zalloc(arena, sizeof (*msg));
+		msg->arena = arena;
+	} else {
+		msg = safe_calloc(1, sizeof (*msg));
+	}
+	msg->refcnt = 1;
 	msg->min = CPDLC_INVALID_MSG_SEQ_NR;
 	msg->mrn = CPDLC_INVALID_MSG_SEQ_NR;
 	msg->ts = make_timestamp();
 
-	start = in_buf;
 	while (in_buf < term) {
 		const char *sep = strchr(in_buf, '/');
 
@@ -2872,6 +3510,15 @@ cpdlc_msg_decode(const char *in_buf, bool is_dl, cpdlc_msg_t **msg_p,
 				goto errout;
 			}
 			msg->ts.set = true;
+		} else if (strncmp(in_buf, "SRVTS=", 6) == 0) {
+			unsigned long long rx, tx;
+			if (sscanf(&in_buf[6], "%llu,%llu", &rx, &tx) != 2 ||
+			    rx == 0 || tx < rx) {
+				MALFORMED_MSG("invalid SRVTS value");
+				goto errout;
+			}
+			msg->srv_ts.rx = rx;
+			msg->srv_ts.tx = tx;
 		} else if (strncmp(in_buf, "MIN=", 4) == 0) {
 			if (sscanf(&in_buf[4], "%u", &msg->min) != 1) {
 				MALFORMED_MSG("invalid MIN value");
@@ -2886,21 +3533,31 @@ cpdlc_msg_decode(const char *in_buf, bool is_dl, cpdlc_msg_t **msg_p,
 			unsigned l = (sep - &in_buf[6]);
 			char *textbuf = safe_malloc(l + 1);
 
-			free(msg->logon_data);
+			cpdlc_msg_mem_free(msg, msg->logon_data);
 			cpdlc_strlcpy(textbuf, &in_buf[6], l + 1);
-			msg->logon_data = safe_malloc(l + 1);
+			msg->logon_data = cpdlc_msg_zalloc(msg, l + 1);
 			cpdlc_unescape_percent(textbuf, msg->logon_data, l + 1);
 			msg->is_logon = true;
 			free(textbuf);
 		} else if (strncmp(in_buf, "LOGOFF", 6) == 0) {
 			msg->is_logoff = true;
 		} else if (strncmp(in_buf, "TO=", 3) == 0) {
+			const char *comma = memchr(&in_buf[3], ',',
+			    sep - &in_buf[3]);
 			char textbuf[32];
 
-			cpdlc_strlcpy(textbuf, &in_buf[3], MIN(sizeof (textbuf),
-			    (uintptr_t)(sep - &in_buf[3]) + 1));
-			cpdlc_unescape_percent(textbuf, msg->to,
-			    sizeof (msg->to));
+			if (comma != NULL) {
+				if (!decode_to_list(msg, &in_buf[3], sep,
+				    reason, reason_cap)) {
+					goto errout;
+				}
+			} else {
+				cpdlc_strlcpy(textbuf, &in_buf[3],
+				    MIN(sizeof (textbuf),
+				    (uintptr_t)(sep - &in_buf[3]) + 1));
+				cpdlc_unescape_percent(textbuf, msg->to,
+				    sizeof (msg->to));
+			}
 		} else if (strncmp(in_buf, "FROM=", 5) == 0) {
 			char textbuf[32];
 
@@ -2917,40 +3574,61 @@ cpdlc_msg_decode(const char *in_buf, bool is_dl, cpdlc_msg_t **msg_p,
 					    "segments");
 					goto errout;
 				}
-				seg = &msg->segs[msg->num_segs];
-				if (!msg_decode_seg(seg, &in_buf[4], sep,
+				seg = msg_seg_grow(msg);
+				if (!msg_decode_seg(msg, seg, &in_buf[4], sep,
+				    (flags & CPDLC_DECODE_LAZY_ARGS) != 0,
 				    reason, reason_cap)) {
+					seg_free_args(msg, seg);
 					goto errout;
 				}
 				if (msg->num_segs > 0 &&
 				    seg->info->is_dl != is_dl) {
 					MALFORMED_MSG("can't mix DM and UM "
 					    "message segments");
+					seg_free_args(msg, seg);
 					goto errout;
 				}
 				msg->num_segs++;
+				if (flags & (CPDLC_DECODE_KEEP_RAW |
+				    CPDLC_DECODE_LAZY_ARGS)) {
+					raw_segs_append(msg, in_buf, sep);
+				}
 			}
 			msg->fmt_plain = true;
 		} else if (strncmp(in_buf, "ARINC622=", 9) == 0) {
+			if (msg->fmt_arinc622) {
+				MALFORMED_MSG("duplicate ARINC622 header");
+				goto errout;
+			}
 			if (!msg->fmt_plain && !cpdlc_msg_decode_arinc622(msg,
-			    &in_buf[9], sep, is_dl, reason, reason_cap)) {
+			    &in_buf[9], sep, is_dl, flags, reason,
+			    reason_cap)) {
 				goto errout;
 			}
+			if (!msg->fmt_plain && (flags &
+			    (CPDLC_DECODE_KEEP_RAW | CPDLC_DECODE_LAZY_ARGS))) {
+				unsigned l = sep - &in_buf[9];
+
+				msg->raw_arinc622 = cpdlc_msg_zalloc(msg, l + 1);
+				memcpy(msg->raw_arinc622, &in_buf[9], l);
+			}
 			msg->fmt_arinc622 = true;
 		} else if (strncmp(in_buf, "OPTIONS=", 8) == 0) {
-			char tmp[128];
-			unsigned n_opts;
-			char **opts;
-			cpdlc_strlcpy(tmp, &in_buf[8], MIN(sizeof (tmp),
-			    (unsigned)(sep - &in_buf[8]) + 1));
-			opts = cpdlc_strsplit(tmp, ",", false, &n_opts);
-			for (unsigned i = 0; i < n_opts && i < CPDLC_MAX_OPTS;
-			    i++) {
-				cpdlc_strlcpy(msg->opts[i], opts[i],
-				    sizeof (msg->opts[i]));
+			const char *opt = &in_buf[8];
+
+			while (msg->num_opts < CPDLC_MAX_OPTS) {
+				const char *comma = memchr(opt, ',', sep - opt);
+
+				if (comma == NULL)
+					comma = sep;
+				cpdlc_strlcpy(msg->opts[msg->num_opts], opt,
+				    MIN(sizeof (*msg->opts),
+				    (uintptr_t)(comma - opt) + 1));
 				msg->num_opts++;
+				if (comma == sep)
+					break;
+				opt = comma + 1;
 			}
-			cpdlc_free_strlist(opts, n_opts);
 		} else {
 			MALFORMED_MSG("unknown message header");
 			goto errout;
@@ -2965,24 +3643,166 @@ cpdlc_msg_decode(const char *in_buf, bool is_dl, cpdlc_msg_t **msg_p,
 	}
 	if (!validate_message(msg, reason, reason_cap))
 		goto errout;
+	if ((flags & CPDLC_DECODE_LAZY_ARGS) && msg->raw_segs != NULL)
+		msg->lazy_segs = msg->segs;
 
 	*msg_p = msg;
-	if (consumed != NULL)
-		*consumed = ((term - start) + 1 + (skipped_cr ? 1 : 0));
 	return (true);
 errout:
-	free(msg);
+	cpdlc_msg_free(msg);
 	*msg_p = NULL;
-	if (consumed != NULL)
-		*consumed = 0;
 	return (false);
 }
 
+/*
+ * Decodes the first message from a buffer of received data. Messages
+ * are terminated by "\n" or "\r\n". As with cpdlc_msg_decode, a lone
+ * "\r" only acts as the terminator if the buffer contains no "\n" at
+ * all. Unlike cpdlc_msg_decode, the buffer needn't be NUL-terminated
+ * and nothing beyond the first `len' bytes is ever looked at.
+ *
+ * @param in_buf Input data.
+ * @param len Number of bytes in `in_buf'.
+ * @param is_dl True if the message is expected to be a downlink message.
+ * @param arena Optional arena to allocate the message from. The message
+ *	can then be passed to cpdlc_msg_free as usual (which does nothing),
+ *	but it is only valid until the arena is reset. Use cpdlc_msg_copy
+ *	to obtain a copy of it on the heap, which outlives the arena.
+ * @param flags A combination of cpdlc_decode_flags_t values.
+ * @param msg_p Return parameter for the decoded message, or NULL if
+ *	`in_buf' doesn't contain a complete message yet.
+ * @param consumed Return parameter for the number of bytes of `in_buf'
+ *	taken up by the decoded message, including its line terminator.
+ * @param scanned Optional resume offset. When input is accumulated in a
+ *	buffer and a message arrives in several pieces, this avoids
+ *	searching the same data for a line terminator over and over. Set
+ *	it to 0 for a new buffer and keep passing it in, together with the
+ *	grown buffer. It is reset to 0 when a message is returned, since
+ *	the caller then moves on past the message.
+ * @param reason Buffer for the error description on failure.
+ * @param reason_cap Capacity of `reason'.
+ *
+ * @return True on success (including when no complete message is
+ *	available yet), false if the message was malformed.
+ */
+bool
+cpdlc_msg_decode_arena(const char *in_buf, size_t len, bool is_dl,
+    cpdlc_arena_t *arena, unsigned flags, cpdlc_msg_t **msg_p,
+    size_t *consumed, size_t *scanned, char *reason, unsigned reason_cap)
+{
+	size_t off = (scanned != NULL ? *scanned : 0), term, term_len;
+	const char *nl, *cr;
+	char stackbuf[1024];
+	char *line;
+	bool res;
+
+	CPDLC_ASSERT(in_buf != NULL || len == 0);
+	CPDLC_ASSERT(msg_p != NULL);
+	CPDLC_ASSERT(consumed != NULL);
+	CPDLC_ASSERT3U(off, <=, len);
+	CPDLC_ASSERT(reason != NULL || reason_cap == 0);
+
+	/*
+	 * A lone "\r" only terminates a message if there's no "\n" in the
+	 * buffer at all. Since we return as soon as we find either, there
+	 * can't be a "\r" before `off'.
+	 */
+	nl = memchr(&in_buf[off], '\n', len - off);
+	cr = (nl == NULL ? memchr(&in_buf[off], '\r', len - off) : NULL);
+	if (nl == NULL && cr == NULL) {
+		/* No complete message in buffer */
+		if (scanned != NULL)
+			*scanned = len;
+		*msg_p = NULL;
+		*consumed = 0;
+		return (true);
+	}
+	if (nl != NULL) {
+		term = nl - in_buf;
+		term_len = 1;
+		if (term > 0 && in_buf[term - 1] == '\r') {
+			term--;
+			term_len++;
+		}
+	} else {
+		term = cr - in_buf;
+		term_len = 1;
+	}
+	if (scanned != NULL)
+		*scanned = 0;
+	/*
+	 * The header parsers rely on NUL-terminated input, so we decode
+	 * from a copy of just this one message.
+	 */
+	line = (term < sizeof (stackbuf) ? stackbuf : safe_malloc(term + 1));
+	memcpy(line, in_buf, term);
+	line[term] = '\0';
+	res = decode_line(line, is_dl, arena, flags, msg_p, reason,
+	    reason_cap);
+	if (line != stackbuf)
+		free(line);
+	*consumed = (res ? term + term_len : 0);
+
+	return (res);
+}
+
+/*
+ * Same as cpdlc_msg_decode_arena, but always allocates the message on
+ * the heap and uses no special decoding flags.
+ */
+bool
+cpdlc_msg_decode_n(const char *in_buf, size_t len, bool is_dl,
+    cpdlc_msg_t **msg_p, size_t *consumed, size_t *scanned, char *reason,
+    unsigned reason_cap)
+{
+	return (cpdlc_msg_decode_arena(in_buf, len, is_dl, NULL, 0, msg_p,
+	    consumed, scanned, reason, reason_cap));
+}
+
+/*
+ * Returns true if the message was allocated from an arena and thus
+ * doesn't outlive it (see cpdlc_msg_decode_arena).
+ */
+bool
+cpdlc_msg_is_arena(const cpdlc_msg_t *msg)
+{
+	CPDLC_ASSERT(msg != NULL);
+	return (msg->arena != NULL);
+}
+
+/*
+ * Same as cpdlc_msg_decode_n, but for a NUL-terminated input buffer.
+ */
+bool
+cpdlc_msg_decode(const char *in_buf, bool is_dl, cpdlc_msg_t **msg_p,
+    int *consumed, char *reason, unsigned reason_cap)
+{
+	size_t n;
+	bool res;
+
+	CPDLC_ASSERT(in_buf != NULL);
+	CPDLC_ASSERT(consumed != NULL);
+
+	res = cpdlc_msg_decode_n(in_buf, strlen(in_buf), is_dl, msg_p, &n,
+	    NULL, reason, reason_cap);
+	*consumed = n;
+
+	return (res);
+}
+
+/*
+ * Sets the recipient of a message. This replaces any multi-recipient
+ * list previously set using cpdlc_msg_set_to_list.
+ */
 void
 cpdlc_msg_set_to(cpdlc_msg_t *msg, const char *to)
 {
+	ASSERT_MSG_MUTABLE(msg);
 	memset(msg->to, 0, sizeof (msg->to));
 	cpdlc_strlcpy(msg->to, to, sizeof (msg->to));
+	cpdlc_msg_mem_free(msg, msg->to_list);
+	msg->to_list = NULL;
+	msg->num_to_list = 0;
 }
 
 const char *
@@ -2991,9 +3811,58 @@ cpdlc_msg_get_to(const cpdlc_msg_t *msg)
 	return (msg->to);
 }
 
+/*
+ * Sets multiple recipients for a message. The message is sent only
+ * once, with the recipients listed in its TO= header, and the server
+ * delivers a copy to each of them. This is only available to ATC
+ * stations and only for CPDLC messages. Empty and duplicate entries in
+ * `to' are skipped. Passing an empty list clears the recipient list.
+ *
+ * @return False if `to' contains more than CPDLC_MAX_TO_LIST distinct
+ *	recipients. The recipient list is then left cleared.
+ */
+bool
+cpdlc_msg_set_to_list(cpdlc_msg_t *msg, const char *const *to,
+    unsigned num_to)
+{
+	CPDLC_ASSERT(msg != NULL);
+	ASSERT_MSG_MUTABLE(msg);
+	CPDLC_ASSERT(to != NULL || num_to == 0);
+
+	cpdlc_msg_set_to(msg, "");
+	for (unsigned i = 0; i < num_to; i++) {
+		CPDLC_ASSERT(to[i] != NULL);
+		if (!to_list_add(msg, to[i])) {
+			cpdlc_msg_set_to(msg, "");
+			return (false);
+		}
+	}
+	return (true);
+}
+
+/*
+ * Returns the number of recipients set using cpdlc_msg_set_to_list,
+ * or 0 if the message has a single recipient (see cpdlc_msg_get_to).
+ */
+unsigned
+cpdlc_msg_get_to_list_len(const cpdlc_msg_t *msg)
+{
+	CPDLC_ASSERT(msg != NULL);
+	return (msg->num_to_list);
+}
+
+const char *
+cpdlc_msg_get_to_list(const cpdlc_msg_t *msg, unsigned nr)
+{
+	CPDLC_ASSERT(msg != NULL);
+	CPDLC_ASSERT3U(nr, <, msg->num_to_list);
+	return (msg->to_list[nr]);
+}
+
 void
 cpdlc_msg_set_from(cpdlc_msg_t *msg, const char *from)
 {
+	ASSERT_MSG_MUTABLE(msg);
 	memset(msg->from, 0, sizeof (msg->from));
 	cpdlc_strlcpy(msg->from, from, sizeof (msg->from));
 }
@@ -3013,10 +3882,69 @@ cpdlc_msg_get_dl(const cpdlc_msg_t *msg)
 	return (msg->segs[0].info->is_dl);
 }
 
+/*
+ * Returns the delivery priority class of a single message element.
+ */
+cpdlc_prio_t
+cpdlc_msg_info_get_prio(const cpdlc_msg_info_t *info)
+{
+	CPDLC_ASSERT(info != NULL);
+	return (info->prio);
+}
+
+/*
+ * Returns the delivery priority class of a message. This is the highest
+ * priority class of any of the message's segments.
+ */
+cpdlc_prio_t
+cpdlc_msg_get_prio(const cpdlc_msg_t *msg)
+{
+	cpdlc_prio_t prio = CPDLC_PRIO_NORMAL;
+
+	CPDLC_ASSERT(msg != NULL);
+	for (unsigned i = 0; i < msg->num_segs; i++) {
+		CPDLC_ASSERT(msg->segs[i].info != NULL);
+		prio = MAX(prio, cpdlc_msg_info_get_prio(msg->segs[i].info));
+	}
+	return (prio);
+}
+
+/*
+ * Sets the server receive & send time of a message (microseconds since
+ * the Unix epoch). The SRVTS= header is only encoded if both are set.
+ */
+void
+cpdlc_msg_set_srv_ts(cpdlc_msg_t *msg, uint64_t rx, uint64_t tx)
+{
+	CPDLC_ASSERT(msg != NULL);
+	ASSERT_MSG_MUTABLE(msg);
+	msg->srv_ts.rx = rx;
+	msg->srv_ts.tx = tx;
+}
+
+/*
+ * Retrieves the server receive & send times of a message, as stamped by
+ * the server on connections which requested it using the LATENCY logon
+ * option. Returns false if the message doesn't carry them.
+ */
+bool
+cpdlc_msg_get_srv_ts(const cpdlc_msg_t *msg, uint64_t *rx, uint64_t *tx)
+{
+	CPDLC_ASSERT(msg != NULL);
+	if (msg->srv_ts.rx == 0 || msg->srv_ts.tx == 0)
+		return (false);
+	if (rx != NULL)
+		*rx = msg->srv_ts.rx;
+	if (tx != NULL)
+		*tx = msg->srv_ts.tx;
+	return (true);
+}
+
 void
 cpdlc_msg_set_min(cpdlc_msg_t *msg, unsigned min)
 {
 	CPDLC_ASSERT(msg != NULL);
+	ASSERT_MSG_MUTABLE(msg);
 	CPDLC_ASSERT(min != CPDLC_INVALID_MSG_SEQ_NR);
 	msg->min = min;
 }
@@ -3032,6 +3960,7 @@ void
 cpdlc_msg_set_mrn(cpdlc_msg_t *msg, unsigned mrn)
 {
 	CPDLC_ASSERT(msg != NULL);
+	ASSERT_MSG_MUTABLE(msg);
 	CPDLC_ASSERT(mrn != CPDLC_INVALID_MSG_SEQ_NR);
 	msg->mrn = mrn;
 }
@@ -3054,9 +3983,10 @@ void
 cpdlc_msg_set_logon_data(cpdlc_msg_t *msg, const char *logon_data)
 {
 	CPDLC_ASSERT(msg != NULL);
-	free(msg->logon_data);
+	ASSERT_MSG_MUTABLE(msg);
+	cpdlc_msg_mem_free(msg, msg->logon_data);
 	if (logon_data != NULL) {
-		msg->logon_data = strdup(logon_data);
+		msg->logon_data = msg_strdup(msg, logon_data);
 		msg->is_logon = true;
 	} else {
 		msg->logon_data = NULL;
@@ -3068,6 +3998,7 @@ void
 cpdlc_msg_set_logoff(cpdlc_msg_t *msg, bool is_logoff)
 {
 	CPDLC_ASSERT(msg != NULL);
+	ASSERT_MSG_MUTABLE(msg);
 	msg->is_logoff = is_logoff;
 }
 
@@ -3092,6 +4023,7 @@ cpdlc_msg_add_seg(cpdlc_msg_t *msg, bool is_dl, unsigned msg_type,
 	cpdlc_msg_seg_t *seg;
 
 	CPDLC_ASSERT(msg != NULL);
+	ASSERT_MSG_MUTABLE(msg);
 	if (!is_dl) {
 		CPDLC_ASSERT3U(msg_type, <=,
 		    CPDLC_UM208_FREETEXT_LOW_URG_LOW_ALERT_text);
@@ -3111,7 +4043,8 @@ cpdlc_msg_add_seg(cpdlc_msg_t *msg, bool is_dl, unsigned msg_type,
 	    "message %p", msg);
 	if (msg->num_segs >= CPDLC_MAX_MSG_SEGS)
 		return (-1);
-	seg = &msg->segs[msg->num_segs];
+	raw_segs_drop(msg);
+	seg = msg_seg_grow(msg);
 
 	seg->info = msg_infos_lookup(is_dl, msg_type, msg_subtype);
 	CPDLC_ASSERT(seg->info != NULL);
@@ -3125,23 +4058,23 @@ cpdlc_msg_del_seg(cpdlc_msg_t *msg, unsigned seg_nr)
 	cpdlc_msg_seg_t *seg;
 
 	CPDLC_ASSERT(msg != NULL);
+	ASSERT_MSG_MUTABLE(msg);
 	CPDLC_ASSERT3U(seg_nr, <, msg->num_segs);
 	/*
 	 * Simply shift all the message segments after this one,
 	 * forward by one step.
 	 */
+	raw_segs_drop(msg);
 	seg = &msg->segs[seg_nr];
 	CPDLC_ASSERT(seg->info != NULL);
-	for (unsigned i = 0; i < msg->segs[seg_nr].info->num_args; i++) {
-		if (seg->info->args[i] == CPDLC_ARG_ROUTE)
-			free(seg->args[i].route);
-		else if (seg->info->args[i] == CPDLC_ARG_FREETEXT)
-			free(seg->args[i].freetext);
-	}
+	seg_free_args(msg, seg);
 	memmove(&msg->segs[seg_nr], &msg->segs[seg_nr + 1],
 	    (msg->num_segs - seg_nr - 1) * sizeof (cpdlc_msg_seg_t));
-	memset(&msg->segs[msg->num_segs], 0, sizeof (cpdlc_msg_seg_t));
 	msg->num_segs--;
+	if (msg->num_segs == 0) {
+		cpdlc_msg_mem_free(msg, msg->segs);
+		msg->segs = NULL;
+	}
 }
 
 unsigned
@@ -3183,15 +4116,17 @@ cpdlc_msg_seg_set_arg(cpdlc_msg_t *msg, unsigned seg_nr, unsigned arg_nr,
 	cpdlc_arg_t *arg;
 
 	CPDLC_ASSERT(msg != NULL);
+	ASSERT_MSG_MUTABLE(msg);
 	CPDLC_ASSERT3U(seg_nr, <, msg->num_segs);
+	CPDLC_ASSERT(arg_val1 != NULL);
+	/* Must go first, as this might replace `segs' */
+	raw_segs_drop(msg);
 	seg = &msg->segs[seg_nr];
 	CPDLC_ASSERT(seg->info != NULL);
 	info = seg->info;
 	CPDLC_ASSERT3U(arg_nr, <, info->num_args);
 	arg = &seg->args[arg_nr];
 
-	CPDLC_ASSERT(arg_val1 != NULL);
-
 	switch (info->args[arg_nr]) {
 	case CPDLC_ARG_ALTITUDE:
 		CPDLC_ASSERT(arg_val2 != NULL);
@@ -3227,9 +4162,9 @@ cpdlc_msg_seg_set_arg(cpdlc_msg_t *msg, unsigned seg_nr, unsigned arg_nr,
 		arg->tofrom = *(bool *)arg_val1;
 		break;
 	case CPDLC_ARG_ROUTE:
-		if (arg->route != NULL)
-			free(arg->route);
-		arg->route = duplicate_route(arg_val1);
+		if (arg->route != NULL && msg->arena == NULL)
+			cpdlc_route_packed_free(arg->route);
+		arg->route = cpdlc_route_pack_arena(arg_val1, msg->arena);
 		break;
 	case CPDLC_ARG_PROCEDURE:
 		arg->proc = *(const cpdlc_proc_t *)arg_val1;
@@ -3258,15 +4193,32 @@ cpdlc_msg_seg_set_arg(cpdlc_msg_t *msg, unsigned seg_nr, unsigned arg_nr,
 		break;
 	case CPDLC_ARG_FREETEXT:
 		if (arg->freetext != NULL)
-			free(arg->freetext);
-		arg->freetext = strdup(arg_val1);
+			cpdlc_msg_mem_free(msg, arg->freetext);
+		arg->freetext = msg_strdup(msg, arg_val1);
 		break;
 	case CPDLC_ARG_PERSONS:
 		arg->pob = *(unsigned *)arg_val1;
 		CPDLC_ASSERT3U(arg->pob, <=, 1024);
 		break;
+	case CPDLC_ARG_PDC: {
+		const cpdlc_pdc_t *pdc = arg_val1;
+
+		CPDLC_ASSERT(pdc->route != NULL);
+		if (arg->pdc != NULL) {
+			cpdlc_msg_mem_free(msg, arg->pdc->route);
+			cpdlc_msg_mem_free(msg, arg->pdc);
+		}
+		arg->pdc = cpdlc_msg_zalloc(msg, sizeof (*arg->pdc));
+		*arg->pdc = *pdc;
+		arg->pdc->route = cpdlc_route_packed_copy_arena(pdc->route,
+		    msg->arena);
+		break;
+	}
 	case CPDLC_ARG_POSREPORT:
-		arg->pos_rep = *(cpdlc_pos_rep_t *)arg_val1;
+		if (arg->pos_rep != NULL)
+			cpdlc_msg_mem_free(msg, arg->pos_rep);
+		arg->pos_rep = cpdlc_msg_zalloc(msg, sizeof (*arg->pos_rep));
+		*arg->pos_rep = *(const cpdlc_pos_rep_t *)arg_val1;
 		break;
 	case CPDLC_ARG_TP4TABLE:
 		arg->tp4 = *(cpdlc_tp4table_t *)arg_val1;
@@ -3291,6 +4243,12 @@ cpdlc_msg_seg_set_arg(cpdlc_msg_t *msg, unsigned seg_nr, unsigned arg_nr,
 	}
 }
 
+/*
+ * Reads a segment argument. If the message was decoded with
+ * CPDLC_DECODE_LAZY_ARGS and its arguments are malformed, the outputs
+ * are left untouched and 0 is returned. Check cpdlc_msg_validate first
+ * to tell that apart from a genuine zero value.
+ */
 unsigned
 cpdlc_msg_seg_get_arg(const cpdlc_msg_t *msg, unsigned seg_nr, unsigned arg_nr,
     void *arg_val1, unsigned str_cap, void *arg_val2)
@@ -3301,6 +4259,9 @@ cpdlc_msg_seg_get_arg(const cpdlc_msg_t *msg, unsigned seg_nr, unsigned arg_nr,
 
 	CPDLC_ASSERT(msg != NULL);
 	CPDLC_ASSERT3U(seg_nr, <, msg->num_segs);
+	/* Malformed lazy arguments mustn't be passed off as zero values */
+	if (!msg_materialize(msg, NULL, 0))
+		return (0);
 	seg = &msg->segs[seg_nr];
 	CPDLC_ASSERT(seg->info != NULL);
 	info = seg->info;
@@ -3355,7 +4316,7 @@ cpdlc_msg_seg_get_arg(const cpdlc_msg_t *msg, unsigned seg_nr, unsigned arg_nr,
 			memset(arg_val1, 0, sizeof (cpdlc_route_t));
 			return (0);
 		}
-		memcpy(arg_val1, arg->route, sizeof (cpdlc_route_t));
+		cpdlc_route_unpack(arg->route, arg_val1);
 		return (sizeof (cpdlc_route_t));
 	case CPDLC_ARG_PROCEDURE:
 		CPDLC_ASSERT(arg_val1 != NULL || str_cap == 0);
@@ -3404,12 +4365,20 @@ cpdlc_msg_seg_get_arg(const cpdlc_msg_t *msg, unsigned seg_nr, unsigned arg_nr,
 		return (sizeof (arg->pob));
 	case CPDLC_ARG_POSREPORT:
 		CPDLC_ASSERT(arg_val1 != NULL);
-		*(cpdlc_pos_rep_t *)arg_val1 = arg->pos_rep;
-		return (sizeof (arg->pos_rep));
+		if (arg->pos_rep == NULL) {
+			memset(arg_val1, 0, sizeof (cpdlc_pos_rep_t));
+			return (0);
+		}
+		*(cpdlc_pos_rep_t *)arg_val1 = *arg->pos_rep;
+		return (sizeof (cpdlc_pos_rep_t));
 	case CPDLC_ARG_PDC:
 		CPDLC_ASSERT(arg_val1 != NULL);
+		if (arg->pdc == NULL) {
+			memset(arg_val1, 0, sizeof (cpdlc_pdc_t));
+			return (0);
+		}
 		*(cpdlc_pdc_t *)arg_val1 = *arg->pdc;
-		return (sizeof (arg->pos_rep));
+		return (sizeof (cpdlc_pdc_t));
 	case CPDLC_ARG_TP4TABLE:
 		CPDLC_ASSERT(arg_val1 != NULL);
 		*(cpdlc_tp4table_t *)arg_val1 = arg->tp4;
@@ -3435,3 +4404,28 @@ cpdlc_msg_seg_get_arg(const cpdlc_msg_t *msg, unsigned seg_nr, unsigned arg_nr,
 	    "invalid argument %d type %x", msg, seg_nr, info->is_dl,
 	    info->msg_type, info->msg_subtype, arg_nr, info->args[arg_nr]);
 }
+
+/*
+ * Returns a route argument in its packed form, as stored in the message,
+ * so it can be read using the cpdlc_route_packed_get_* accessors without
+ * unpacking it into a full-size cpdlc_route_t. The route remains owned by
+ * the message. Returns NULL if the argument is unset, or if the message's
+ * lazily decoded arguments are malformed.
+ */
+const cpdlc_route_packed_t *
+cpdlc_msg_seg_get_route(const cpdlc_msg_t *msg, unsigned seg_nr,
+    unsigned arg_nr)
+{
+	const cpdlc_msg_seg_t *seg;
+
+	CPDLC_ASSERT(msg != NULL);
+	CPDLC_ASSERT3U(seg_nr, <, msg->num_segs);
+	if (!msg_materialize(msg, NULL, 0))
+		return (NULL);
+	seg = &msg->segs[seg_nr];
+	CPDLC_ASSERT(seg->info != NULL);
+	CPDLC_ASSERT3U(arg_nr, <, seg->info->num_args);
+	CPDLC_ASSERT3U(seg->info->args[arg_nr], ==, CPDLC_ARG_ROUTE);
+
+	return (seg->args[arg_nr].route);
+}
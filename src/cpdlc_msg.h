@@ -30,8 +30,10 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "cpdlc_arena.h"
 #include "cpdlc_core.h"
 #include "cpdlc_data_types.h"
+#include "cpdlc_route.h"
 
 #ifdef	__cplusplus
 extern "C" {
@@ -350,7 +352,8 @@ enum {
     CPDLC_MAX_RESP_MSGS = 4,
     CPDLC_MAX_MSG_SEGS = 5,
     CPDLC_MAX_VERSION_NR = 1,
-    CPDLC_CALLSIGN_LEN = 8
+    CPDLC_CALLSIGN_LEN = 8,
+    CPDLC_MAX_TO_LIST = 64
 };
 
 typedef struct {
@@ -359,6 +362,17 @@ typedef struct {
 	uintptr_t		seq_idx;
 } cpdlc_asn_arg_info_t;
 
+/*
+ * Delivery priority class of a message, derived from the message elements
+ * it contains (see cpdlc_msg_get_prio). Higher values are more urgent.
+ */
+typedef enum {
+	CPDLC_PRIO_NORMAL,
+	CPDLC_PRIO_URGENT,	/* PAN, emergency reports, urgent text */
+	CPDLC_PRIO_DISTRESS,	/* MAYDAY and distress free text */
+	CPDLC_NUM_PRIOS
+} cpdlc_prio_t;
+
 typedef struct {
 	bool			is_dl;
 	int			msg_type;
@@ -373,6 +387,7 @@ typedef struct {
 	unsigned		num_resp_msgs;
 	int			resp_msg_types[CPDLC_MAX_RESP_MSGS];
 	int			resp_msg_subtypes[CPDLC_MAX_RESP_MSGS];
+	cpdlc_prio_t		prio;
 } cpdlc_msg_info_t;
 
 typedef struct {
@@ -400,8 +415,38 @@ typedef enum {
 	CPDLC_IMI_DISC_REQUEST,
 } cpdlc_imi_t;
 
+/*
+ * Flags for cpdlc_msg_decode_arena.
+ */
+typedef enum {
+	/*
+	 * Keep the MSG= headers of plain-format messages, or the ARINC622=
+	 * header, exactly as they were received (see `raw_segs' and
+	 * `raw_arinc622' in cpdlc_msg_t), so that forwarding the message
+	 * doesn't need to re-encode its segments.
+	 */
+	CPDLC_DECODE_KEEP_RAW = 1 << 0,
+	/*
+	 * Only decode the headers and the message element of each MSG=
+	 * header. Segment arguments are decoded on first access (e.g. by
+	 * cpdlc_msg_seg_get_arg or when encoding to another format), or
+	 * explicitly using cpdlc_msg_validate. Implies KEEP_RAW. ARINC622=
+	 * messages are only checked for their IMI, callsign and CRC, with
+	 * the header and message element read straight from the PER data.
+	 * That only works for messages with a single element, others are
+	 * always decoded fully. If the arguments turn out to be malformed,
+	 * the message can't be encoded in a format which needs them, nor
+	 * can its arguments be read (see cpdlc_msg_encode and
+	 * cpdlc_msg_seg_get_arg).
+	 */
+	CPDLC_DECODE_LAZY_ARGS = 1 << 1
+} cpdlc_decode_flags_t;
+
 #define	CPDLC_MAX_OPTS		4
 
+/* Cached encoding of a frozen message, see cpdlc_msg_encode_cached */
+typedef struct cpdlc_msg_enc_s cpdlc_msg_enc_t;
+
 typedef struct {
 	cpdlc_pkt_t		pkt_type;
 	unsigned		min;
@@ -409,11 +454,44 @@ typedef struct {
 	cpdlc_timestamp_t	ts;
 	char			from[CPDLC_CALLSIGN_LEN];
 	char			to[CPDLC_CALLSIGN_LEN];
+	/*
+	 * Multi-recipient TO= header (see cpdlc_msg_set_to_list). If set,
+	 * this is sent instead of `to'.
+	 */
+	unsigned		num_to_list;
+	char			(*to_list)[CPDLC_CALLSIGN_LEN];
 	bool			is_logon;
 	bool			is_logoff;
 	char			*logon_data;
 	unsigned		num_segs;
-	cpdlc_msg_seg_t		segs[CPDLC_MAX_MSG_SEGS];
+	/* allocated to hold exactly `num_segs' segments */
+	cpdlc_msg_seg_t		*segs;
+	/*
+	 * With CPDLC_DECODE_KEEP_RAW, the message's MSG= headers as
+	 * received ("/MSG=.../MSG=..."). The plain format encoder emits
+	 * these verbatim in place of encoding `segs'. Dropped as soon as
+	 * the segments are modified.
+	 */
+	char			*raw_segs;
+	unsigned		raw_segs_len;
+	/*
+	 * Same as `raw_segs', but for ARINC622-format messages, holding
+	 * the ARINC622= header's value. It is emitted verbatim as long as
+	 * the message's IMI, callsign, MIN and MRN still match it.
+	 */
+	char			*raw_arinc622;
+	/*
+	 * With CPDLC_DECODE_LAZY_ARGS, the segments as decoded, with only
+	 * their `info' set. As long as `segs' points here, the arguments
+	 * still need decoding from `raw_segs' or `raw_arinc622'. The fully
+	 * decoded array then replaces it in `segs'.
+	 */
+	cpdlc_msg_seg_t		*lazy_segs;
+	/*
+	 * Set if the lazy arguments failed to decode after `raw_segs' or
+	 * `raw_arinc622' were dropped, so they can never be decoded now.
+	 */
+	bool			args_malformed;
 	bool			fmt_plain;
 	bool			fmt_arinc622;
 	struct {
@@ -422,6 +500,28 @@ typedef struct {
 	} arinc622;
 	unsigned		num_opts;
 	char			opts[CPDLC_MAX_OPTS][12];
+	/*
+	 * Server receive & send times (SRVTS= header), in microseconds
+	 * since the Unix epoch. Zero if not set.
+	 */
+	struct {
+		uint64_t	rx;
+		uint64_t	tx;
+	} srv_ts;
+	/*
+	 * If non-NULL, all of the message's memory was allocated from
+	 * this arena (see cpdlc_msg_decode_arena).
+	 */
+	cpdlc_arena_t		*arena;
+	/* see cpdlc_msg_hold */
+	unsigned		refcnt;
+	/*
+	 * Once frozen (see cpdlc_msg_freeze), the message can no longer
+	 * be modified and its encodings are cached on first use, indexed
+	 * by fmt_plain | (fmt_arinc622 << 1).
+	 */
+	bool			frozen;
+	cpdlc_msg_enc_t		*enc_cache[4];
 } cpdlc_msg_t;
 
 extern const cpdlc_msg_info_t *cpdlc_ul_infos;
@@ -430,6 +530,9 @@ extern const cpdlc_msg_info_t *cpdlc_dl_infos;
 CPDLC_API cpdlc_msg_t *cpdlc_msg_alloc(cpdlc_pkt_t pkt_type);
 CPDLC_API cpdlc_msg_t *cpdlc_msg_copy(const cpdlc_msg_t *oldmsg);
 CPDLC_API void cpdlc_msg_free(cpdlc_msg_t *msg);
+CPDLC_API cpdlc_msg_t *cpdlc_msg_hold(cpdlc_msg_t *msg);
+CPDLC_API void cpdlc_msg_freeze(cpdlc_msg_t *msg);
+CPDLC_API bool cpdlc_msg_is_frozen(const cpdlc_msg_t *msg);
 
 CPDLC_API int cpdlc_msg_option_add(cpdlc_msg_t *msg, const char *opt);
 CPDLC_API void cpdlc_msg_option_remove(cpdlc_msg_t *msg, const char *opt);
@@ -442,10 +545,25 @@ CPDLC_API cpdlc_imi_t cpdlc_msg_get_imi(const cpdlc_msg_t *msg);
 
 CPDLC_API unsigned cpdlc_msg_encode(const cpdlc_msg_t *msg, char *buf,
     unsigned cap);
+CPDLC_API unsigned cpdlc_msg_encode_buf(const cpdlc_msg_t *msg, char **buf_p,
+    unsigned *cap_p, unsigned off);
+CPDLC_API char *cpdlc_msg_encode_alloc(const cpdlc_msg_t *msg,
+    unsigned *len_p);
+CPDLC_API const char *cpdlc_msg_encode_cached(const cpdlc_msg_t *msg,
+    bool fmt_plain, bool fmt_arinc622, unsigned *len_p);
 CPDLC_API unsigned cpdlc_msg_readable(const cpdlc_msg_t *msg, char *buf,
     unsigned cap);
 CPDLC_API bool cpdlc_msg_decode(const char *in_buf, bool is_dl,
     cpdlc_msg_t **msg, int *consumed, char *reason, unsigned reason_cap);
+CPDLC_API bool cpdlc_msg_decode_n(const char *in_buf, size_t len, bool is_dl,
+    cpdlc_msg_t **msg, size_t *consumed, size_t *scanned, char *reason,
+    unsigned reason_cap);
+CPDLC_API bool cpdlc_msg_decode_arena(const char *in_buf, size_t len,
+    bool is_dl, cpdlc_arena_t *arena, unsigned flags, cpdlc_msg_t **msg,
+    size_t *consumed, size_t *scanned, char *reason, unsigned reason_cap);
+CPDLC_API bool cpdlc_msg_is_arena(const cpdlc_msg_t *msg);
+CPDLC_API bool cpdlc_msg_validate(const cpdlc_msg_t *msg, char *reason,
+    unsigned reason_cap);
 
 void cpdlc_encode_msg_arg(const cpdlc_arg_type_t arg_type,
     const cpdlc_arg_t *arg, bool readable, unsigned *n_bytes_p,
@@ -453,9 +571,21 @@ void cpdlc_encode_msg_arg(const cpdlc_arg_type_t arg_type,
 
 CPDLC_API void cpdlc_msg_set_to(cpdlc_msg_t *msg, const char *to);
 CPDLC_API const char *cpdlc_msg_get_to(const cpdlc_msg_t *msg);
+CPDLC_API bool cpdlc_msg_set_to_list(cpdlc_msg_t *msg, const char *const *to,
+    unsigned num_to);
+CPDLC_API unsigned cpdlc_msg_get_to_list_len(const cpdlc_msg_t *msg);
+CPDLC_API const char *cpdlc_msg_get_to_list(const cpdlc_msg_t *msg,
+    unsigned nr);
 CPDLC_API void cpdlc_msg_set_from(cpdlc_msg_t *msg, const char *from);
 CPDLC_API const char *cpdlc_msg_get_from(const cpdlc_msg_t *msg);
 CPDLC_API bool cpdlc_msg_get_dl(const cpdlc_msg_t *msg);
+CPDLC_API cpdlc_prio_t cpdlc_msg_info_get_prio(const cpdlc_msg_info_t *info);
+CPDLC_API cpdlc_prio_t cpdlc_msg_get_prio(const cpdlc_msg_t *msg);
+
+CPDLC_API void cpdlc_msg_set_srv_ts(cpdlc_msg_t *msg, uint64_t rx,
+    uint64_t tx);
+CPDLC_API bool cpdlc_msg_get_srv_ts(const cpdlc_msg_t *msg, uint64_t *rx,
+    uint64_t *tx);
 
 CPDLC_API void cpdlc_msg_set_min(cpdlc_msg_t *msg, unsigned min);
 CPDLC_API unsigned cpdlc_msg_get_min(const cpdlc_msg_t *msg);
@@ -483,6 +613,8 @@ CPDLC_API void cpdlc_msg_seg_set_arg(cpdlc_msg_t *msg, unsigned seg_nr,
 CPDLC_API unsigned cpdlc_msg_seg_get_arg(const cpdlc_msg_t *msg,
     unsigned seg_nr, unsigned arg_nr, void *arg_val1, unsigned str_cap,
     void *arg_val2);
+CPDLC_API const cpdlc_route_packed_t *cpdlc_msg_seg_get_route(
+    const cpdlc_msg_t *msg, unsigned seg_nr, unsigned arg_nr);
 
 unsigned CPDLC_API cpdlc_escape_percent(const char *in_buf, char *out_buf,
     unsigned cap);
@@ -23,6 +23,8 @@
  * OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <ctype.h>
+
 #include "asn1/ATCuplinkmessage.h"
 #include "asn1/ATCdownlinkmessage.h"
 
@@ -598,7 +600,7 @@ encode_pb_asn(const cpdlc_pb_t *pb_in, Placebearing_t *pb_out)
 }
 
 static void
-encode_trk_detail_asn(const cpdlc_trk_detail_t *trk_in,
+encode_trk_detail_asn(const cpdlc_trk_detail_packed_t *trk_in,
     Trackdetail_t *trk_out)
 {
 	CPDLC_ASSERT(trk_in != NULL);
@@ -614,7 +616,7 @@ encode_trk_detail_asn(const cpdlc_trk_detail_t *trk_in,
 }
 
 static void
-encode_route_info(const cpdlc_route_t *route,
+encode_route_info(const cpdlc_route_packed_t *route,
     const cpdlc_route_info_t *info_in, Routeinformation_t *info_out)
 {
 	CPDLC_ASSERT(route != NULL);
@@ -667,7 +669,8 @@ encode_route_info(const cpdlc_route_t *route,
 }
 
 static void
-encode_route_asn(const cpdlc_route_t *route_in, Routeclearance_t *route_out)
+encode_route_asn(const cpdlc_route_packed_t *route_in,
+    Routeclearance_t *route_out)
 {
 	CPDLC_ASSERT(route_in != NULL);
 	CPDLC_ASSERT(route_out != NULL);
@@ -894,6 +897,7 @@ static void
 encode_pdc_asn(const cpdlc_pdc_t *pdc_in, Predepartureclearance_t *pdc_out)
 {
 	CPDLC_ASSERT(pdc_in != NULL);
+	CPDLC_ASSERT(pdc_in->route != NULL);
 	CPDLC_ASSERT(pdc_out != NULL);
 
 	ia5strlcpy_out(&pdc_out->aircraftflightidentification, pdc_in->acf_id);
@@ -911,7 +915,7 @@ encode_pdc_asn(const cpdlc_pdc_t *pdc_in, Predepartureclearance_t *pdc_out)
 		    pdc_out->aircraftequipmentcode);
 	}
 	encode_time_asn(&pdc_in->time_dep, &pdc_out->timedepartureedct);
-	encode_route_asn(&pdc_in->route, &pdc_out->routeclearance);
+	encode_route_asn(pdc_in->route, &pdc_out->routeclearance);
 	if (!CPDLC_IS_NULL_ALT(pdc_in->alt_restr)) {
 		pdc_out->altituderestriction =
 		    safe_calloc(1, sizeof (*pdc_out->altituderestriction));
@@ -1051,7 +1055,8 @@ msg_encode_seg_common(const cpdlc_msg_seg_t *seg, void *el)
 			    get_asn_arg_ptr_wr(seg->info, i, el));
 			break;
 		case CPDLC_ARG_POSREPORT:
-			encode_posreport_asn(&seg->args[i].pos_rep,
+			CPDLC_ASSERT(seg->args[i].pos_rep != NULL);
+			encode_posreport_asn(seg->args[i].pos_rep,
 			    get_asn_arg_ptr_wr(seg->info, i, el));
 			break;
 		case CPDLC_ARG_PDC:
@@ -1607,13 +1612,13 @@ decode_baro_asn(const Altimeter_t *baro, double *val_out, bool *hpa_out)
 }
 
 static char *
-decode_freetext_asn(const Freetext_t *freetext_in)
+decode_freetext_asn(const cpdlc_msg_t *msg, const Freetext_t *freetext_in)
 {
 	char *freetext_out;
 	CPDLC_ASSERT(freetext_in != NULL);
 	if (freetext_in->size > 256)
 		return (NULL);
-	freetext_out = safe_malloc(freetext_in->size + 1);
+	freetext_out = cpdlc_msg_zalloc(msg, freetext_in->size + 1);
 	ia5strlcpy_in(freetext_out, freetext_in, freetext_in->size + 1);
 	return (freetext_out);
 }
@@ -2109,6 +2114,23 @@ decode_route_asn(const Routeclearance_t *rc, cpdlc_route_t *route)
 	return (route);
 }
 
+/*
+ * Decodes a route into its packed form, allocated from the
+ * message's memory. Returns NULL if the route is malformed.
+ */
+static cpdlc_route_packed_t *
+decode_route_packed_asn(const cpdlc_msg_t *msg, const Routeclearance_t *rc)
+{
+	cpdlc_route_t *route = safe_calloc(1, sizeof (*route));
+	cpdlc_route_packed_t *packed = NULL;
+
+	if (decode_route_asn(rc, route))
+		packed = cpdlc_route_pack_arena(route, msg->arena);
+	free(route);
+
+	return (packed);
+}
+
 static void
 decode_icao_name(const ICAOunitname_t *icaoname_in,
     cpdlc_icao_name_t *icaoname_out)
@@ -2219,7 +2241,8 @@ decode_acf_eqpt_code_asn(const Aircraftequipmentcode_t *eqpt_in,
 }
 
 static bool
-decode_pdc_asn(const Predepartureclearance_t *pdc_in, cpdlc_pdc_t *pdc_out)
+decode_pdc_asn(const cpdlc_msg_t *msg, const Predepartureclearance_t *pdc_in,
+    cpdlc_pdc_t *pdc_out)
 {
 	CPDLC_ASSERT(pdc_in != NULL);
 	CPDLC_ASSERT(pdc_out != NULL);
@@ -2233,7 +2256,9 @@ decode_pdc_asn(const Predepartureclearance_t *pdc_in, cpdlc_pdc_t *pdc_out)
 	decode_acf_eqpt_code_asn(pdc_in->aircraftequipmentcode,
 	    &pdc_out->acf_eqpt_code);
 	pdc_out->time_dep = decode_time_asn(&pdc_in->timedepartureedct);
-	if (!decode_route_asn(&pdc_in->routeclearance, &pdc_out->route))
+	CPDLC_ASSERT(pdc_out->route == NULL);
+	pdc_out->route = decode_route_packed_asn(msg, &pdc_in->routeclearance);
+	if (pdc_out->route == NULL)
 		return (false);
 	pdc_out->alt_restr = decode_alt_asn(pdc_in->altituderestriction);
 	pdc_out->freq = pdc_in->frequencydeparture / 1000.0;
@@ -2284,9 +2309,10 @@ decode_legtype_asn(const Legtype_t *leg)
 }
 
 static bool
-decode_msg_elem(cpdlc_msg_seg_t *seg, const cpdlc_msg_info_t *info,
-    const void *elem)
+decode_msg_elem(const cpdlc_msg_t *msg, cpdlc_msg_seg_t *seg,
+    const cpdlc_msg_info_t *info, const void *elem)
 {
+	CPDLC_ASSERT(msg != NULL);
 	CPDLC_ASSERT(seg != NULL);
 	CPDLC_ASSERT(info != NULL);
 	CPDLC_ASSERT(elem != NULL);
@@ -2330,12 +2356,10 @@ decode_msg_elem(cpdlc_msg_seg_t *seg, const cpdlc_msg_info_t *info,
 			    decode_tofrom_asn(get_asn_arg_ptr(info, i, elem));
 			break;
 		case CPDLC_ARG_ROUTE:
-			seg->args[i].route =
-			    safe_calloc(1, sizeof (*seg->args[i].route));
-			if (!decode_route_asn(get_asn_arg_ptr(info, i, elem),
-			    seg->args[i].route)) {
+			seg->args[i].route = decode_route_packed_asn(msg,
+			    get_asn_arg_ptr(info, i, elem));
+			if (seg->args[i].route == NULL)
 				return (false);
-			}
 			break;
 		case CPDLC_ARG_PROCEDURE:
 			decode_proc_asn(get_asn_arg_ptr(info, i, elem),
@@ -2369,7 +2393,7 @@ decode_msg_elem(cpdlc_msg_seg_t *seg, const cpdlc_msg_info_t *info,
 			    &seg->args[i].baro.hpa);
 			break;
 		case CPDLC_ARG_FREETEXT:
-			seg->args[i].freetext = decode_freetext_asn(
+			seg->args[i].freetext = decode_freetext_asn(msg,
 			    get_asn_arg_ptr(info, i, elem));
 			if (seg->args[i].freetext == NULL)
 				return (false);
@@ -2379,14 +2403,17 @@ decode_msg_elem(cpdlc_msg_seg_t *seg, const cpdlc_msg_info_t *info,
 			    get_asn_arg_ptr(info, i, elem));
 			break;
 		case CPDLC_ARG_POSREPORT:
+			CPDLC_ASSERT(seg->args[i].pos_rep == NULL);
+			seg->args[i].pos_rep = cpdlc_msg_zalloc(msg,
+			    sizeof (*seg->args[i].pos_rep));
 			decode_pos_rep_asn(get_asn_arg_ptr(info, i, elem),
-			    &seg->args[i].pos_rep);
+			    seg->args[i].pos_rep);
 			break;
 		case CPDLC_ARG_PDC:
 			CPDLC_ASSERT(seg->args[i].pdc == NULL);
-			seg->args[i].pdc =
-			    safe_calloc(1, sizeof (*seg->args[i].pdc));
-			if (!decode_pdc_asn(get_asn_arg_ptr(info, i, elem),
+			seg->args[i].pdc = cpdlc_msg_zalloc(msg,
+			    sizeof (*seg->args[i].pdc));
+			if (!decode_pdc_asn(msg, get_asn_arg_ptr(info, i, elem),
 			    seg->args[i].pdc)) {
 				return (false);
 			}
@@ -2419,24 +2446,21 @@ decode_msg_elem(cpdlc_msg_seg_t *seg, const cpdlc_msg_info_t *info,
 static bool
 dl_msg_decode_asn_seg(cpdlc_msg_t *msg, const ATCdownlinkmsgelementid_t *elem)
 {
+	const cpdlc_msg_info_t *info;
+
 	CPDLC_ASSERT(msg != NULL);
 	CPDLC_ASSERT(elem != NULL);
 
 	if (elem->present == ATCdownlinkmsgelementid_PR_NOTHING)
 		return (true);
-	for (const cpdlc_msg_info_t *info = cpdlc_dl_infos;
-	    info->msg_type != -1; info++) {
-		if ((unsigned)elem->present == info->asn_elem_id) {
-			int nr = cpdlc_msg_add_seg(msg, true, info->msg_type,
-			    info->msg_subtype);
-			cpdlc_msg_seg_t *seg;
-
-			CPDLC_ASSERT(nr >= 0);
-			seg = &msg->segs[nr];
-			if (!decode_msg_elem(seg, info, elem))
-				return (false);
-			break;
-		}
+	info = cpdlc_msg_infos_lookup_asn(true, elem->present);
+	if (info != NULL) {
+		int nr = cpdlc_msg_add_seg(msg, true, info->msg_type,
+		    info->msg_subtype);
+
+		CPDLC_ASSERT(nr >= 0);
+		if (!decode_msg_elem(msg, &msg->segs[nr], info, elem))
+			return (false);
 	}
 	return (true);
 }
@@ -2444,24 +2468,21 @@ dl_msg_decode_asn_seg(cpdlc_msg_t *msg, const ATCdownlinkmsgelementid_t *elem)
 static bool
 ul_msg_decode_asn_seg(cpdlc_msg_t *msg, const ATCuplinkmsgelementid_t *elem)
 {
+	const cpdlc_msg_info_t *info;
+
 	CPDLC_ASSERT(msg != NULL);
 	CPDLC_ASSERT(elem != NULL);
 
 	if (elem->present == ATCuplinkmsgelementid_PR_NOTHING)
 		return (true);
-	for (const cpdlc_msg_info_t *info = cpdlc_ul_infos;
-	    info->msg_type != -1; info++) {
-		if ((unsigned)elem->present == info->asn_elem_id) {
-			int nr = cpdlc_msg_add_seg(msg, false, info->msg_type,
-			    info->msg_subtype);
-			cpdlc_msg_seg_t *seg;
-
-			CPDLC_ASSERT(nr >= 0);
-			seg = &msg->segs[nr];
-			if (!decode_msg_elem(seg, info, elem))
-				return (false);
-			break;
-		}
+	info = cpdlc_msg_infos_lookup_asn(false, elem->present);
+	if (info != NULL) {
+		int nr = cpdlc_msg_add_seg(msg, false, info->msg_type,
+		    info->msg_subtype);
+
+		CPDLC_ASSERT(nr >= 0);
+		if (!decode_msg_elem(msg, &msg->segs[nr], info, elem))
+			return (false);
 	}
 	return (true);
 }
@@ -2529,9 +2550,179 @@ msg_decode_asn(cpdlc_msg_t *msg, const void *struct_ptr, bool is_dl)
 	return (true);
 }
 
+/*
+ * The part of an ATC{up,down}linkmessage we can read straight from its
+ * PER encoding (see decode_hdr_per).
+ */
+typedef struct {
+	bool		more_elems;
+	unsigned	min;
+	unsigned	mrn;
+	bool		ts_set;
+	unsigned	hrs, mins, secs;
+	/* `present' value of the first message element */
+	int		elem_id;
+} per_hdr_t;
+
+/*
+ * Reads `nbits' bits of PER data, failing if the data runs out.
+ */
+static bool
+get_bits(asn_per_data_t *pd, int nbits, unsigned *val)
+{
+	int32_t v = per_get_few_bits(pd, nbits);
+
+	if (v < 0)
+		return (false);
+	*val = v;
+	return (true);
+}
+
+/*
+ * Reads the message header and the ID of the first message element
+ * from PER-encoded data, without decoding the whole message. Their bit
+ * layout is:
+ *	- 1 bit: presence of the message element sequence (seqOf)
+ *	- 2 bits: presence of the MRN and timestamp in the header
+ *	- 6 bits: MIN, optionally followed by 6 bits MRN and a timestamp
+ *	  of 5 bits hours, 6 bits minutes and 6 bits seconds
+ *	- the CHOICE index of the first message element
+ * Anything beyond that needs a full decode, as finding the next element
+ * involves decoding the arguments of the first.
+ */
+static bool
+decode_hdr_per(const uint8_t *buf, unsigned len, bool is_dl, per_hdr_t *hdr)
+{
+	asn_TYPE_descriptor_t *td = (is_dl ? &asn_DEF_ATCdownlinkmsgelementid :
+	    &asn_DEF_ATCuplinkmsgelementid);
+	const asn_CHOICE_specifics_t *specs = td->specifics;
+	asn_per_data_t pd = { .buffer = buf, .nbits = len * 8 };
+	unsigned pre, idx;
+
+	CPDLC_ASSERT(specs->ext_start < 0);
+	memset(hdr, 0, sizeof (*hdr));
+	hdr->mrn = CPDLC_INVALID_MSG_SEQ_NR;
+
+	if (!get_bits(&pd, 3, &pre) || !get_bits(&pd, 6, &hdr->min))
+		return (false);
+	hdr->more_elems = ((pre & 4) != 0);
+	if ((pre & 2) != 0 && !get_bits(&pd, 6, &hdr->mrn))
+		return (false);
+	if ((pre & 1) != 0) {
+		hdr->ts_set = true;
+		if (!get_bits(&pd, 5, &hdr->hrs) ||
+		    !get_bits(&pd, 6, &hdr->mins) ||
+		    !get_bits(&pd, 6, &hdr->secs) ||
+		    hdr->hrs > 23 || hdr->mins > 59 || hdr->secs > 59) {
+			return (false);
+		}
+	}
+	if (!get_bits(&pd, td->per_constraints->value.range_bits, &idx) ||
+	    idx >= (unsigned)td->elements_count) {
+		return (false);
+	}
+	if (specs->canonical_order != NULL)
+		idx = specs->canonical_order[idx];
+	hdr->elem_id = idx + 1;
+
+	return (true);
+}
+
+/*
+ * Checks that a callsign in an ARINC 622 message consists of nothing but
+ * the padding dots, followed by letters and digits (see
+ * cpdlc_padd_callsign).
+ */
+static bool
+callsign_padding_valid(const char *cs)
+{
+	unsigned i = 0;
+
+	while (i < CPDLC_CS_LEN && cs[i] == '.')
+		i++;
+	for (; i < CPDLC_CS_LEN; i++) {
+		if (!isalnum((unsigned char)cs[i]))
+			return (false);
+	}
+	return (true);
+}
+
+/*
+ * Returns true if a message still matches the ARINC622= header it was
+ * decoded from (see `raw_arinc622' in cpdlc_msg_t), so that it can be
+ * encoded by simply copying that.
+ */
+bool
+cpdlc_msg_arinc622_passthru(const cpdlc_msg_t *msg)
+{
+	const char *raw;
+	char cs_padd[8];
+	uint8_t hdrbuf[8];
+	unsigned hexlen;
+	per_hdr_t hdr;
+	bool is_dl;
+
+	CPDLC_ASSERT(msg != NULL);
+	raw = msg->raw_arinc622;
+	if (raw == NULL || msg->num_segs == 0)
+		return (false);
+	is_dl = msg->segs[0].info->is_dl;
+	cpdlc_padd_callsign(is_dl ? msg->from : msg->to, cs_padd);
+	if (strncmp(raw, imi2str(msg->arinc622.imi), CPDLC_IMI_LEN) != 0 ||
+	    strncmp(&raw[CPDLC_IMI_LEN], cs_padd, CPDLC_CS_LEN) != 0) {
+		return (false);
+	}
+	/* This was all validated during decoding */
+	hexlen = MIN(strlen(&raw[CPDLC_DATA_OFF]), 2 * sizeof (hdrbuf));
+	CPDLC_VERIFY(cpdlc_hex_dec(&raw[CPDLC_DATA_OFF], hexlen, hdrbuf,
+	    hexlen / 2));
+	CPDLC_VERIFY(decode_hdr_per(hdrbuf, hexlen / 2, is_dl, &hdr));
+
+	if (hdr.min != msg->min % 64)
+		return (false);
+	if (msg->mrn == CPDLC_INVALID_MSG_SEQ_NR)
+		return (hdr.mrn == CPDLC_INVALID_MSG_SEQ_NR);
+	return (hdr.mrn == msg->mrn % 64);
+}
+
+/*
+ * Decodes just the header and the single message element of a message
+ * (see decode_hdr_per). The element's arguments are left for later
+ * (see CPDLC_DECODE_LAZY_ARGS).
+ *
+ * @return False if the message needs to be decoded fully.
+ */
+static bool
+decode_arinc622_lazy(cpdlc_msg_t *msg, const uint8_t *buf, unsigned len,
+    bool is_dl)
+{
+	const cpdlc_msg_info_t *info;
+	per_hdr_t hdr;
+
+	if (!decode_hdr_per(buf, len, is_dl, &hdr) || hdr.more_elems)
+		return (false);
+	info = cpdlc_msg_infos_lookup_asn(is_dl, hdr.elem_id);
+	if (info == NULL)
+		return (false);
+	msg->min = hdr.min;
+	msg->mrn = hdr.mrn;
+	if (hdr.ts_set) {
+		msg->ts.set = true;
+		msg->ts.hrs = hdr.hrs;
+		msg->ts.mins = hdr.mins;
+		msg->ts.secs = hdr.secs;
+	}
+	CPDLC_VERIFY3S(cpdlc_msg_add_seg(msg, is_dl, info->msg_type,
+	    info->msg_subtype), ==, 0);
+	msg->lazy_segs = msg->segs;
+
+	return (true);
+}
+
 bool
 cpdlc_msg_decode_arinc622(cpdlc_msg_t *msg, const char *start,
-    const char *end, bool is_dl, char *reason, unsigned reason_cap)
+    const char *end, bool is_dl, unsigned flags, char *reason,
+    unsigned reason_cap)
 {
 	uint8_t *rawbuf;
 	unsigned binsz, rawsz;
@@ -2566,7 +2757,12 @@ cpdlc_msg_decode_arinc622(cpdlc_msg_t *msg, const char *start,
 		return (false);
 	}
 	cpdlc_strlcpy(msg->arinc622.acf_id, &start[CPDLC_IMI_LEN],
-	    sizeof (msg->arinc622.acf_id));
+	    CPDLC_CS_LEN + 1);
+	if (!callsign_padding_valid(msg->arinc622.acf_id)) {
+		MALFORMED_MSG("malformed ARINC 622 data: invalid callsign "
+		    "\"%s\"", msg->arinc622.acf_id);
+		return (false);
+	}
 	start += CPDLC_DATA_OFF;
 	if ((end - start) % 2 != 0) {
 		MALFORMED_MSG("malformed ARINC 622 data: expected even number "
@@ -2590,6 +2786,11 @@ cpdlc_msg_decode_arinc622(cpdlc_msg_t *msg, const char *start,
 		MALFORMED_MSG("malformed ARINC 622 data: CRC mismatch");
 		goto errout;
 	}
+	if ((flags & CPDLC_DECODE_LAZY_ARGS) && decode_arinc622_lazy(msg,
+	    &rawbuf[CPDLC_DATA_OFF], binsz - CPDLC_CRC_LEN, is_dl)) {
+		free(rawbuf);
+		return (true);
+	}
 	td = (is_dl ? &asn_DEF_ATCdownlinkmessage : &asn_DEF_ATCuplinkmessage);
 	rval = uper_decode_complete(0, td, &struct_ptr, &rawbuf[CPDLC_DATA_OFF],
 	    binsz - CPDLC_CRC_LEN);
@@ -2606,13 +2807,15 @@ cpdlc_msg_decode_arinc622(cpdlc_msg_t *msg, const char *start,
 	if (!msg_decode_asn(msg, struct_ptr, is_dl)) {
 		MALFORMED_MSG("error decoding ARINC 622 ASN.1 data: "
 		    "error interpreting parsed data structures");
-		ASN_STRUCT_FREE(*td, struct_ptr);
 		goto errout;
 	}
 	td->free_struct(td, struct_ptr, 0);
 	free(rawbuf);
 	return (true);
 errout:
+	/* A failed decode can leave a partially decoded structure behind */
+	if (struct_ptr != NULL)
+		ASN_STRUCT_FREE(*td, struct_ptr);
 	free(rawbuf);
 	return (false);
 }
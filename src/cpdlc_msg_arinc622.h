@@ -41,7 +41,9 @@ enum {
 bool cpdlc_msg_encode_arinc622(const cpdlc_msg_t *msg, unsigned *n_bytes_p,
     char **buf_p, unsigned *cap_p);
 bool cpdlc_msg_decode_arinc622(cpdlc_msg_t *msg, const char *start,
-    const char *end, bool is_dl, char *reason, unsigned reason_cap);
+    const char *end, bool is_dl, unsigned flags, char *reason,
+    unsigned reason_cap);
+bool cpdlc_msg_arinc622_passthru(const cpdlc_msg_t *msg);
 
 static inline void
 cpdlc_padd_callsign(const char *cs_in, char cs_out[8])
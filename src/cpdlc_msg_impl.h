@@ -30,6 +30,13 @@
 extern "C" {
 #endif
 
+const cpdlc_msg_info_t *cpdlc_msg_infos_lookup(bool is_dl, int msg_type,
+    char msg_subtype);
+const cpdlc_msg_info_t *cpdlc_msg_infos_lookup_asn(bool is_dl,
+    unsigned asn_elem_id);
+void *cpdlc_msg_zalloc(const cpdlc_msg_t *msg, size_t size);
+void cpdlc_msg_mem_free(const cpdlc_msg_t *msg, void *ptr);
+
 #define	APPEND_SNPRINTF(__total_bytes, __bufptr, __bufcap, ...) \
 	do { \
 		int __needed = snprintf((__bufptr), (__bufcap), __VA_ARGS__); \
@@ -72,7 +79,7 @@ is_valid_lat_lon(cpdlc_lat_lon_t ll)
 	    ll.lon >= -180 && ll.lon <= 180);
 }
 
-static void
+static inline void
 set_error(char *reason, unsigned cap, const char *fmt, ...)
 {
 	va_list ap;
@@ -0,0 +1,234 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "cpdlc_alloc.h"
+#include "cpdlc_arena.h"
+#include "cpdlc_assert.h"
+#include "cpdlc_route.h"
+
+/*
+ * All arrays in a packed route are placed right behind the structure
+ * itself. Every array starts on an 8-byte boundary, which suffices for
+ * the doubles inside of them.
+ */
+#define	PACKED_ROUNDUP(x)	(((x) + 7) & ~(size_t)7)
+
+#define	ARRAY_SIZE(x)	(sizeof (x) / sizeof (*(x)))
+
+/*
+ * Iterates over all the variable-length arrays of a route. `XX' is
+ * invoked with the name of the array and of its element count, as
+ * members of both cpdlc_route_t and cpdlc_route_packed_t, as well as
+ * the maximum number of elements in cpdlc_route_t.
+ */
+#define	ROUTE_ARRAYS(XX) \
+	XX(info, num_info, CPDLC_ROUTE_MAX_INFO) \
+	XX(add_info.atk_wpt, add_info.num_atk_wpt, \
+	    ARRAY_SIZE(((cpdlc_route_t *)0)->add_info.atk_wpt)) \
+	XX(add_info.intc_from, add_info.num_intc_from, \
+	    ARRAY_SIZE(((cpdlc_route_t *)0)->add_info.intc_from)) \
+	XX(add_info.hold_at_wpt, add_info.num_hold_at_wpt, \
+	    ARRAY_SIZE(((cpdlc_route_t *)0)->add_info.hold_at_wpt)) \
+	XX(add_info.wpt_spd_alt, add_info.num_wpt_spd_alt, \
+	    ARRAY_SIZE(((cpdlc_route_t *)0)->add_info.wpt_spd_alt)) \
+	XX(add_info.rta, add_info.num_rta, \
+	    ARRAY_SIZE(((cpdlc_route_t *)0)->add_info.rta)) \
+	XX(trk_detail.lat_lon, trk_detail.num_lat_lon, \
+	    CPDLC_TRK_DETAIL_MAX_LAT_LON)
+
+static void
+copy_hdr(const cpdlc_route_t *route, cpdlc_route_packed_t *packed)
+{
+	memcpy(packed->orig_icao, route->orig_icao, sizeof (packed->orig_icao));
+	memcpy(packed->dest_icao, route->dest_icao, sizeof (packed->dest_icao));
+	memcpy(packed->orig_rwy, route->orig_rwy, sizeof (packed->orig_rwy));
+	memcpy(packed->dest_rwy, route->dest_rwy, sizeof (packed->dest_rwy));
+	packed->sid = route->sid;
+	packed->star = route->star;
+	packed->appch = route->appch;
+	memcpy(packed->awy_intc, route->awy_intc, sizeof (packed->awy_intc));
+	packed->add_info.rpt_pts = route->add_info.rpt_pts;
+	memcpy(packed->trk_detail.name, route->trk_detail.name,
+	    sizeof (packed->trk_detail.name));
+}
+
+cpdlc_route_packed_t *
+cpdlc_route_pack(const cpdlc_route_t *route)
+{
+	return (cpdlc_route_pack_arena(route, NULL));
+}
+
+/*
+ * Same as cpdlc_route_pack, but if `arena' isn't NULL, the packed route
+ * is allocated from it and must not be passed to cpdlc_route_packed_free.
+ */
+cpdlc_route_packed_t *
+cpdlc_route_pack_arena(const cpdlc_route_t *route, cpdlc_arena_t *arena)
+{
+	size_t size = PACKED_ROUNDUP(sizeof (cpdlc_route_packed_t));
+	cpdlc_route_packed_t *packed;
+	uint8_t *p;
+
+	CPDLC_ASSERT(route != NULL);
+
+#define	ARRAY_SIZE_ADD(array, num, max) \
+	CPDLC_ASSERT3U(route->num, <=, max); \
+	size += PACKED_ROUNDUP(route->num * sizeof (*route->array));
+	ROUTE_ARRAYS(ARRAY_SIZE_ADD)
+#undef	ARRAY_SIZE_ADD
+
+	if (arena != NULL)
+		packed = cpdlc_arena_zalloc(arena, size);
+	else
+		packed = safe_calloc(1, size);
+	packed->size = size;
+	copy_hdr(route, packed);
+	p = (uint8_t *)packed + PACKED_ROUNDUP(sizeof (*packed));
+
+#define	ARRAY_PACK(array, num, max) \
+	packed->num = route->num; \
+	if (route->num != 0) { \
+		size_t sz = route->num * sizeof (*route->array); \
+		packed->array = (void *)p; \
+		memcpy(packed->array, route->array, sz); \
+		p += PACKED_ROUNDUP(sz); \
+	}
+	ROUTE_ARRAYS(ARRAY_PACK)
+#undef	ARRAY_PACK
+	CPDLC_ASSERT3P(p, ==, (uint8_t *)packed + size);
+
+	return (packed);
+}
+
+void
+cpdlc_route_unpack(const cpdlc_route_packed_t *packed, cpdlc_route_t *route)
+{
+	CPDLC_ASSERT(packed != NULL);
+	CPDLC_ASSERT(route != NULL);
+
+	memset(route, 0, sizeof (*route));
+	memcpy(route->orig_icao, packed->orig_icao, sizeof (route->orig_icao));
+	memcpy(route->dest_icao, packed->dest_icao, sizeof (route->dest_icao));
+	memcpy(route->orig_rwy, packed->orig_rwy, sizeof (route->orig_rwy));
+	memcpy(route->dest_rwy, packed->dest_rwy, sizeof (route->dest_rwy));
+	route->sid = packed->sid;
+	route->star = packed->star;
+	route->appch = packed->appch;
+	memcpy(route->awy_intc, packed->awy_intc, sizeof (route->awy_intc));
+	route->add_info.rpt_pts = packed->add_info.rpt_pts;
+	memcpy(route->trk_detail.name, packed->trk_detail.name,
+	    sizeof (route->trk_detail.name));
+
+#define	ARRAY_UNPACK(array, num, max) \
+	CPDLC_ASSERT3U(packed->num, <=, max); \
+	route->num = packed->num; \
+	if (packed->num != 0) { \
+		memcpy(route->array, packed->array, \
+		    packed->num * sizeof (*packed->array)); \
+	}
+	ROUTE_ARRAYS(ARRAY_UNPACK)
+#undef	ARRAY_UNPACK
+}
+
+cpdlc_route_packed_t *
+cpdlc_route_packed_copy(const cpdlc_route_packed_t *packed)
+{
+	return (cpdlc_route_packed_copy_arena(packed, NULL));
+}
+
+/*
+ * Same as cpdlc_route_packed_copy, but if `arena' isn't NULL, the copy
+ * is allocated from it and must not be passed to cpdlc_route_packed_free.
+ */
+cpdlc_route_packed_t *
+cpdlc_route_packed_copy_arena(const cpdlc_route_packed_t *packed,
+    cpdlc_arena_t *arena)
+{
+	cpdlc_route_packed_t *copy;
+
+	CPDLC_ASSERT(packed != NULL);
+
+	if (arena != NULL)
+		copy = cpdlc_arena_zalloc(arena, packed->size);
+	else
+		copy = safe_malloc(packed->size);
+	memcpy(copy, packed, packed->size);
+	/* Point the array pointers at the copy's own storage */
+#define	ARRAY_REBASE(array, num, max) \
+	if (packed->array != NULL) { \
+		copy->array = (void *)((uint8_t *)copy + \
+		    ((const uint8_t *)packed->array - \
+		    (const uint8_t *)packed)); \
+	}
+	ROUTE_ARRAYS(ARRAY_REBASE)
+#undef	ARRAY_REBASE
+
+	return (copy);
+}
+
+void
+cpdlc_route_packed_free(cpdlc_route_packed_t *packed)
+{
+	free(packed);
+}
+
+/*
+ * Defines the element count & element getters for one of the arrays of
+ * a packed route (see ROUTE_ARRAYS).
+ */
+#define	PACKED_GETTERS(name, array, num, type) \
+	unsigned \
+	cpdlc_route_packed_get_num_ ## name( \
+	    const cpdlc_route_packed_t *packed) \
+	{ \
+		CPDLC_ASSERT(packed != NULL); \
+		return (packed->num); \
+	} \
+	const type * \
+	cpdlc_route_packed_get_ ## name(const cpdlc_route_packed_t *packed, \
+	    unsigned nr) \
+	{ \
+		CPDLC_ASSERT(packed != NULL); \
+		CPDLC_ASSERT3U(nr, <, packed->num); \
+		return (&packed->array[nr]); \
+	}
+
+PACKED_GETTERS(info, info, num_info, cpdlc_route_info_t)
+PACKED_GETTERS(atk_wpt, add_info.atk_wpt, add_info.num_atk_wpt,
+    cpdlc_atk_wpt_t)
+PACKED_GETTERS(intc_from, add_info.intc_from, add_info.num_intc_from,
+    cpdlc_intc_from_t)
+PACKED_GETTERS(hold_at_wpt, add_info.hold_at_wpt, add_info.num_hold_at_wpt,
+    cpdlc_hold_at_t)
+PACKED_GETTERS(wpt_spd_alt, add_info.wpt_spd_alt, add_info.num_wpt_spd_alt,
+    cpdlc_wpt_spd_alt_t)
+PACKED_GETTERS(rta, add_info.rta, add_info.num_rta, cpdlc_rta_t)
+PACKED_GETTERS(trk_lat_lon, trk_detail.lat_lon, trk_detail.num_lat_lon,
+    cpdlc_lat_lon_t)
+
+#undef	PACKED_GETTERS
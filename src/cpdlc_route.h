@@ -0,0 +1,95 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef	_LIBCPDLC_ROUTE_H_
+#define	_LIBCPDLC_ROUTE_H_
+
+#include <stddef.h>
+
+#include "cpdlc_arena.h"
+#include "cpdlc_core.h"
+#include "cpdlc_data_types.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Conversion between the fixed-size cpdlc_route_t and the compact
+ * cpdlc_route_packed_t form, in which routes are stored inside of
+ * messages. Packed routes are a single allocation and must be freed
+ * using cpdlc_route_packed_free.
+ */
+CPDLC_API cpdlc_route_packed_t *cpdlc_route_pack(const cpdlc_route_t *route);
+CPDLC_API cpdlc_route_packed_t *cpdlc_route_pack_arena(
+    const cpdlc_route_t *route, cpdlc_arena_t *arena);
+CPDLC_API void cpdlc_route_unpack(const cpdlc_route_packed_t *packed,
+    cpdlc_route_t *route);
+CPDLC_API cpdlc_route_packed_t *cpdlc_route_packed_copy(
+    const cpdlc_route_packed_t *packed);
+CPDLC_API cpdlc_route_packed_t *cpdlc_route_packed_copy_arena(
+    const cpdlc_route_packed_t *packed, cpdlc_arena_t *arena);
+CPDLC_API void cpdlc_route_packed_free(cpdlc_route_packed_t *packed);
+
+/*
+ * Element accessors for the variable-length arrays of a packed route.
+ * These let callers walk a route in place, without unpacking it into a
+ * full-size cpdlc_route_t. The fixed-size fields of the route can be
+ * read directly from cpdlc_route_packed_t.
+ */
+CPDLC_API unsigned cpdlc_route_packed_get_num_info(
+    const cpdlc_route_packed_t *packed);
+CPDLC_API const cpdlc_route_info_t *cpdlc_route_packed_get_info(
+    const cpdlc_route_packed_t *packed, unsigned nr);
+CPDLC_API unsigned cpdlc_route_packed_get_num_atk_wpt(
+    const cpdlc_route_packed_t *packed);
+CPDLC_API const cpdlc_atk_wpt_t *cpdlc_route_packed_get_atk_wpt(
+    const cpdlc_route_packed_t *packed, unsigned nr);
+CPDLC_API unsigned cpdlc_route_packed_get_num_intc_from(
+    const cpdlc_route_packed_t *packed);
+CPDLC_API const cpdlc_intc_from_t *cpdlc_route_packed_get_intc_from(
+    const cpdlc_route_packed_t *packed, unsigned nr);
+CPDLC_API unsigned cpdlc_route_packed_get_num_hold_at_wpt(
+    const cpdlc_route_packed_t *packed);
+CPDLC_API const cpdlc_hold_at_t *cpdlc_route_packed_get_hold_at_wpt(
+    const cpdlc_route_packed_t *packed, unsigned nr);
+CPDLC_API unsigned cpdlc_route_packed_get_num_wpt_spd_alt(
+    const cpdlc_route_packed_t *packed);
+CPDLC_API const cpdlc_wpt_spd_alt_t *cpdlc_route_packed_get_wpt_spd_alt(
+    const cpdlc_route_packed_t *packed, unsigned nr);
+CPDLC_API unsigned cpdlc_route_packed_get_num_rta(
+    const cpdlc_route_packed_t *packed);
+CPDLC_API const cpdlc_rta_t *cpdlc_route_packed_get_rta(
+    const cpdlc_route_packed_t *packed, unsigned nr);
+CPDLC_API unsigned cpdlc_route_packed_get_num_trk_lat_lon(
+    const cpdlc_route_packed_t *packed);
+CPDLC_API const cpdlc_lat_lon_t *cpdlc_route_packed_get_trk_lat_lon(
+    const cpdlc_route_packed_t *packed, unsigned nr);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _LIBCPDLC_ROUTE_H_ */
@@ -46,6 +46,9 @@
 #endif	/* LIN */
 
 #include "cpdlc_alloc.h"
+#ifdef	CPDLC_LOCK_PROFILE
+#include "cpdlc_lockprof.h"
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -121,6 +124,10 @@ extern "C" {
  *			}
  *		}
  *		mutex_exit(&my_lock);			-- release the lock
+ *
+ * When built with CPDLC_LOCK_PROFILE defined, mutex_enter, mutex_exit and
+ * the CV wait functions also record per-call-site lock contention, wait
+ * and hold times. See cpdlc_lockprof.h for details.
  */
 
 typedef struct {
@@ -144,8 +151,9 @@ typedef struct {
 		pthread_mutex_init((mtx), &attr); \
 	} while (0)
 #define	mutex_destroy(mtx)	pthread_mutex_destroy((mtx))
-#define	mutex_enter(mtx)	pthread_mutex_lock((mtx))
-#define	mutex_exit(mtx)		pthread_mutex_unlock((mtx))
+#define	_cpdlc_mutex_enter(mtx)		pthread_mutex_lock((mtx))
+#define	_cpdlc_mutex_tryenter(mtx)	(pthread_mutex_trylock((mtx)) == 0)
+#define	_cpdlc_mutex_exit(mtx)		pthread_mutex_unlock((mtx))
 
 static void *_cpdlc_thread_start_routine(void *arg) CPDLC_UNUSED_ATTR;
 static void *
@@ -178,9 +186,9 @@ thread_create(thread_t *thrp, void (*proc)(void *), void *arg)
 #define	thread_set_name(name)	pthread_setname_np((name))
 #endif	/* APL */
 
-#define	cv_wait(cv, mtx)	pthread_cond_wait((cv), (mtx))
+#define	_cpdlc_cv_wait(cv, mtx)	pthread_cond_wait((cv), (mtx))
 static inline int
-cv_timedwait(condvar_t *cv, mutex_t *mtx, uint64_t limit)
+_cpdlc_cv_timedwait(condvar_t *cv, mutex_t *mtx, uint64_t limit)
 {
 	struct timespec ts = { .tv_sec = (time_t)(limit / 1000000),
 	    .tv_nsec = (long)((limit % 1000000) * 1000) };
@@ -232,12 +240,14 @@ typedef struct {
 		DeleteCriticalSection(&(x)->cs); \
 		(x)->inited = FALSE; \
 	} while (0)
-#define	mutex_enter(x) \
+#define	_cpdlc_mutex_enter(x) \
 	do { \
 		CPDLC_ASSERT((x)->inited); \
 		EnterCriticalSection(&(x)->cs); \
 	} while (0)
-#define	mutex_exit(x) \
+#define	_cpdlc_mutex_tryenter(x) \
+	(CPDLC_ASSERT((x)->inited), TryEnterCriticalSection(&(x)->cs))
+#define	_cpdlc_mutex_exit(x) \
 	do { \
 		CPDLC_ASSERT((x)->inited); \
 		LeaveCriticalSection(&(x)->cs); \
@@ -282,10 +292,10 @@ cpdlc_thread_microclock(void)
 	return (((double)val.QuadPart / (double)freq.QuadPart) * 1000000.0);
 }
 
-#define	cv_wait(cv, mtx) \
+#define	_cpdlc_cv_wait(cv, mtx) \
 	CPDLC_VERIFY(SleepConditionVariableCS((cv), &(mtx)->cs, INFINITE))
 static inline int
-cv_timedwait(condvar_t *cv, mutex_t *mtx, uint64_t limit)
+_cpdlc_cv_timedwait(condvar_t *cv, mutex_t *mtx, uint64_t limit)
 {
 	uint64_t now = cpdlc_thread_microclock();
 	if (now < limit) {
@@ -315,6 +325,43 @@ cv_timedwait(condvar_t *cv, mutex_t *mtx, uint64_t limit)
 
 #endif	/* IBM */
 
+#ifdef	CPDLC_LOCK_PROFILE
+
+#define	mutex_enter(mtx) \
+	CPDLC_LOCKPROF_ENTER(mtx, _cpdlc_mutex_tryenter(mtx), \
+	    _cpdlc_mutex_enter(mtx))
+#define	mutex_exit(mtx) \
+	do { \
+		cpdlc_lockprof_released((mtx)); \
+		_cpdlc_mutex_exit(mtx); \
+	} while (0)
+#define	cv_wait(cv, mtx) \
+	do { \
+		cpdlc_lockprof_suspend((mtx)); \
+		_cpdlc_cv_wait((cv), (mtx)); \
+		cpdlc_lockprof_resume((mtx)); \
+	} while (0)
+static inline int
+cv_timedwait(condvar_t *cv, mutex_t *mtx, uint64_t limit)
+{
+	int res;
+
+	cpdlc_lockprof_suspend(mtx);
+	res = _cpdlc_cv_timedwait(cv, mtx, limit);
+	cpdlc_lockprof_resume(mtx);
+
+	return (res);
+}
+
+#else	/* !CPDLC_LOCK_PROFILE */
+
+#define	mutex_enter(mtx)		_cpdlc_mutex_enter(mtx)
+#define	mutex_exit(mtx)			_cpdlc_mutex_exit(mtx)
+#define	cv_wait(cv, mtx)		_cpdlc_cv_wait((cv), (mtx))
+#define	cv_timedwait(cv, mtx, limit)	_cpdlc_cv_timedwait((cv), (mtx), (limit))
+
+#endif	/* !CPDLC_LOCK_PROFILE */
+
 #ifdef	DEBUG
 #define	CPDLC_ASSERT_MUTEX_HELD(mtx)		CPDLC_VERIFY_MUTEX_HELD(mtx)
 #define	CPDLC_ASSERT_MUTEX_NOT_HELD(mtx)	CPDLC_VERIFY_MUTEX_NOT_HELD(mtx)
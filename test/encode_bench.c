@@ -0,0 +1,189 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * encode_bench: measures message encoding throughput. For each sample
+ * message and output format, it compares encoding by calling
+ * cpdlc_msg_encode twice (once to size the buffer, once to fill it),
+ * against cpdlc_msg_encode_alloc and cpdlc_msg_encode_buf (reusing the
+ * same buffer for all messages, as the server's output path does).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/cpdlc_alloc.h"
+#include "../src/cpdlc_assert.h"
+#include "../src/cpdlc_msg.h"
+
+#define	DFL_NUM_ITER	100000
+
+static const struct {
+	const char	*text;
+	bool		is_dl;
+} samples[] = {
+    { "PKT=CPDLC/MIN=1/FROM=N650CL/TO=KZNY/MSG=DM0\n", true },
+    { "PKT=CPDLC/MIN=2/FROM=N650CL/TO=KZNY/MSG=DM6 FL350/MSG=DM0\n",
+      true },
+    { "PKT=CPDLC/MIN=3/FROM=N650CL/TO=KZNY/MSG=DM67 REQUEST%20WX%20"
+      "DEVIATION/MSG=DM0\n", true },
+    { "PKT=CPDLC/MIN=4/MRN=2/FROM=KZNY/TO=N650CL/MSG=UM20 FL350\n",
+      false },
+    { "PKT=CPDLC/MIN=5/MRN=2/FROM=KZNY/TO=N650CL/MSG=UM20 FL350/"
+      "MSG=UM169 MAINTAIN%20FL350%20UNTIL%20FURTHER%20ADVISED\n", false },
+    { "PKT=CPDLC/MIN=6/FROM=KZNY/TO=N650CL/MSG=UM80 ORIG%3aKJFK%20"
+      "DEST%3aEGLL%20FIX0%20LATLON%3a41.0000,%2d51.0000%20FIX2%20"
+      "LATLON%3a43.0000,%2d53.0000%20FIX4%20\n", false }
+};
+
+static const struct {
+	const char	*name;
+	bool		fmt_plain;
+	bool		fmt_arinc622;
+} fmts[] = {
+    { "plain", true, false },
+    { "ARINC 622", false, true },
+    { "both", true, true }
+};
+
+static uint64_t
+mono_us(void)
+{
+	struct timespec ts;
+
+	CPDLC_VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return (ts.tv_sec * 1000000llu + ts.tv_nsec / 1000);
+}
+
+static void
+print_usage(const char *progname, FILE *fp)
+{
+	fprintf(fp, "Usage: %s [-h] [-i <iterations>]\n"
+	    "  -h : show this help screen\n"
+	    "  -i <iterations> : number of times each message is encoded "
+	    "(default: %d)\n", progname, DFL_NUM_ITER);
+}
+
+static void
+report(const char *what, uint64_t start, uint64_t end, unsigned num_iter,
+    unsigned long long num_bytes)
+{
+	double secs = (end - start) / 1000000.0;
+
+	printf("    %-24s %10.0f msgs/s %8.2f MB/s\n", what, num_iter / secs,
+	    num_bytes / secs / 1000000.0);
+}
+
+static void
+bench_msg(const cpdlc_msg_t *msg, unsigned num_iter)
+{
+	unsigned long long num_bytes;
+	uint64_t start;
+	char *buf = NULL;
+	unsigned cap = 0;
+
+	num_bytes = 0;
+	start = mono_us();
+	for (unsigned i = 0; i < num_iter; i++) {
+		unsigned l = cpdlc_msg_encode(msg, NULL, 0);
+		char *out = safe_malloc(l + 1);
+
+		num_bytes += cpdlc_msg_encode(msg, out, l + 1);
+		free(out);
+	}
+	report("cpdlc_msg_encode x2", start, mono_us(), num_iter, num_bytes);
+
+	num_bytes = 0;
+	start = mono_us();
+	for (unsigned i = 0; i < num_iter; i++) {
+		unsigned l;
+
+		free(cpdlc_msg_encode_alloc(msg, &l));
+		num_bytes += l;
+	}
+	report("cpdlc_msg_encode_alloc", start, mono_us(), num_iter,
+	    num_bytes);
+
+	num_bytes = 0;
+	start = mono_us();
+	for (unsigned i = 0; i < num_iter; i++)
+		num_bytes += cpdlc_msg_encode_buf(msg, &buf, &cap, 0);
+	report("cpdlc_msg_encode_buf", start, mono_us(), num_iter, num_bytes);
+	free(buf);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int opt;
+	unsigned num_iter = DFL_NUM_ITER;
+
+	while ((opt = getopt(argc, argv, "hi:")) != -1) {
+		switch (opt) {
+		case 'h':
+			print_usage(argv[0], stdout);
+			return (0);
+		case 'i':
+			num_iter = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0], stderr);
+			return (1);
+		}
+	}
+	if (num_iter == 0) {
+		print_usage(argv[0], stderr);
+		return (1);
+	}
+
+	for (unsigned i = 0; i < sizeof (samples) / sizeof (*samples); i++) {
+		cpdlc_msg_t *msg;
+		int consumed;
+		char reason[128];
+
+		if (!cpdlc_msg_decode(samples[i].text, samples[i].is_dl, &msg,
+		    &consumed, reason, sizeof (reason))) {
+			fprintf(stderr, "Error decoding sample message %d: "
+			    "%s\n", i, reason);
+			return (1);
+		}
+		CPDLC_VERIFY(msg != NULL);
+		for (unsigned j = 0; j < sizeof (fmts) / sizeof (*fmts); j++) {
+			msg->fmt_plain = fmts[j].fmt_plain;
+			msg->fmt_arinc622 = fmts[j].fmt_arinc622;
+			/* the sample texts end in a newline */
+			printf("%.*s (%s)\n",
+			    (int)strlen(samples[i].text) - 1, samples[i].text,
+			    fmts[j].name);
+			bench_msg(msg, num_iter);
+		}
+		cpdlc_msg_free(msg);
+	}
+
+	return (0);
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * lazy_decode_test: checks that a message decoded with
+ * CPDLC_DECODE_LAZY_ARGS, whose arguments turn out to be malformed, is
+ * never encoded or read as if its arguments were zero. The test message
+ * is an ARINC 622 downlink with a valid CRC, but truncated PER data and
+ * no FROM= header, so the pass-through callsign check fails and any
+ * encoding needs the arguments.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/cpdlc_assert.h"
+#include "../src/cpdlc_crc.h"
+#include "../src/cpdlc_hexcode.h"
+#include "../src/cpdlc_msg.h"
+#include "../src/cpdlc_msg_arinc622.h"
+
+static cpdlc_msg_t *
+decode(const char *text, bool is_dl, unsigned flags)
+{
+	cpdlc_msg_t *msg = NULL;
+	size_t consumed;
+	char error[128] = { 0 };
+
+	CPDLC_VERIFY_MSG(cpdlc_msg_decode_arena(text, strlen(text), is_dl,
+	    NULL, flags, &msg, &consumed, NULL, error, sizeof (error)),
+	    "%s: %s", text, error);
+	CPDLC_VERIFY(msg != NULL);
+	return (msg);
+}
+
+/*
+ * Builds the malformed ARINC 622 message: the PER data of a valid
+ * message, short of its last byte, with the CRC recomputed to match.
+ */
+static void
+make_bad_msg(char *out, unsigned cap)
+{
+	cpdlc_msg_t *msg = decode("PKT=CPDLC/MIN=3/MRN=7/FROM=N650CL/"
+	    "MSG=DM6 FL350\n", true, 0);
+	uint8_t raw[256];
+	char hex[512];
+	const char *hdr;
+	char *enc;
+	unsigned raw_len;
+
+	msg->fmt_plain = false;
+	msg->fmt_arinc622 = true;
+	enc = cpdlc_msg_encode_alloc(msg, NULL);
+	cpdlc_msg_free(msg);
+	hdr = strstr(enc, "/ARINC622=");
+	CPDLC_VERIFY(hdr != NULL);
+	hdr += strlen("/ARINC622=");
+	/* Drop the trailing newline, 16-bit CRC and last data byte */
+	raw_len = strlen(hdr) - 1 - 4 - 2;
+	CPDLC_VERIFY3U(raw_len % 2, ==, 0);
+	memcpy(raw, hdr, CPDLC_DATA_OFF);
+	CPDLC_VERIFY(cpdlc_hex_dec(&hdr[CPDLC_DATA_OFF],
+	    raw_len - CPDLC_DATA_OFF, &raw[CPDLC_DATA_OFF],
+	    (raw_len - CPDLC_DATA_OFF) / 2));
+	raw_len = CPDLC_DATA_OFF + (raw_len - CPDLC_DATA_OFF) / 2;
+	cpdlc_hex_enc(&raw[CPDLC_DATA_OFF], raw_len - CPDLC_DATA_OFF,
+	    hex, sizeof (hex));
+	snprintf(out, cap, "PKT=CPDLC/ARINC622=%.*s%s%04X\n",
+	    CPDLC_DATA_OFF, hdr, hex, cpdlc_crc16(raw, raw_len));
+	free(enc);
+}
+
+static void
+check_unencodable(const cpdlc_msg_t *msg)
+{
+	char buf[1024];
+	char *alloc;
+	unsigned len;
+
+	memset(buf, 'x', sizeof (buf));
+	CPDLC_VERIFY3U(cpdlc_msg_encode(msg, buf, sizeof (buf)), ==, 0);
+	CPDLC_VERIFY3U(buf[0], ==, '\0');
+	alloc = cpdlc_msg_encode_alloc(msg, &len);
+	CPDLC_VERIFY3U(len, ==, 0);
+	CPDLC_VERIFY3U(alloc[0], ==, '\0');
+	free(alloc);
+}
+
+int
+main(void)
+{
+	char text[1024], error[128];
+	cpdlc_msg_t *msg, *copy;
+	size_t consumed;
+	unsigned len;
+	bool fl = false;
+	int alt = -1;
+
+	make_bad_msg(text, sizeof (text));
+	/* The damage is caught right away without LAZY_ARGS */
+	CPDLC_VERIFY(!cpdlc_msg_decode_arena(text, strlen(text), true, NULL,
+	    CPDLC_DECODE_KEEP_RAW, &msg, &consumed, NULL, error,
+	    sizeof (error)));
+
+	msg = decode(text, true, CPDLC_DECODE_LAZY_ARGS);
+	CPDLC_VERIFY3U(cpdlc_msg_get_num_segs(msg), ==, 1);
+	check_unencodable(msg);
+	msg->fmt_plain = true;
+	msg->fmt_arinc622 = false;
+	check_unencodable(msg);
+	CPDLC_VERIFY3U(cpdlc_msg_readable(msg, text, sizeof (text)), ==, 0);
+	CPDLC_VERIFY3U(cpdlc_msg_seg_get_arg(msg, 0, 0, &fl, 0, &alt), ==,
+	    0);
+	CPDLC_VERIFY3S(alt, ==, -1);
+	CPDLC_VERIFY(!cpdlc_msg_validate(msg, error, sizeof (error)));
+
+	/* The failure sticks once the raw text is gone */
+	copy = cpdlc_msg_copy(msg);
+	cpdlc_msg_add_seg(copy, true, CPDLC_DM0_WILCO, 0);
+	CPDLC_VERIFY(!cpdlc_msg_validate(copy, error, sizeof (error)));
+	check_unencodable(copy);
+	cpdlc_msg_free(copy);
+
+	/* Cached encodings of a malformed message aren't cached */
+	cpdlc_msg_freeze(msg);
+	CPDLC_VERIFY(strcmp(cpdlc_msg_encode_cached(msg, true, false, &len),
+	    "") == 0);
+	CPDLC_VERIFY3U(len, ==, 0);
+	CPDLC_VERIFY(strcmp(cpdlc_msg_encode_cached(msg, false, true, &len),
+	    "") == 0);
+	CPDLC_VERIFY3U(len, ==, 0);
+	cpdlc_msg_free(msg);
+
+	printf("lazy_decode_test: OK\n");
+
+	return (0);
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * msg_footprint: measures the memory footprint of decoded messages. It
+ * prints the sizes of the message structures, then decodes many copies
+ * of each sample message and reports the heap memory they take up per
+ * message (including malloc overhead), next to the size of a message
+ * with all CPDLC_MAX_MSG_SEGS segments embedded in the cpdlc_msg_t and
+ * position reports stored inline in the arguments. The latter doesn't
+ * include routes and PDCs, which both layouts store out of line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if	defined(__GLIBC__) && \
+	(__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define	HAVE_MALLINFO2
+#endif
+
+#include "../src/cpdlc_alloc.h"
+#include "../src/cpdlc_assert.h"
+#include "../src/cpdlc_msg.h"
+
+#define	DFL_NUM_COPIES	10000
+#define	MAX(x, y)	((x) > (y) ? (x) : (y))
+
+static const struct {
+	const char	*text;
+	bool		is_dl;
+} samples[] = {
+    { "PKT=CPDLC/MIN=1/FROM=N650CL/TO=KZNY/MSG=DM0\n", true },
+    { "PKT=CPDLC/MIN=2/FROM=N650CL/TO=KZNY/MSG=DM6 FL350/MSG=DM0\n",
+      true },
+    { "PKT=CPDLC/MIN=3/FROM=N650CL/TO=KZNY/MSG=DM67 REQUEST%20WX%20"
+      "DEVIATION/MSG=DM0\n", true },
+    { "PKT=CPDLC/MIN=4/MRN=2/FROM=KZNY/TO=N650CL/MSG=UM20 FL350\n",
+      false },
+    { "PKT=CPDLC/MIN=5/MRN=2/FROM=KZNY/TO=N650CL/MSG=UM20 FL350/"
+      "MSG=UM169 MAINTAIN%20FL350%20UNTIL%20FURTHER%20ADVISED\n", false },
+    { "PKT=CPDLC/MIN=6/FROM=KZNY/TO=N650CL/MSG=UM80 ORIG%3aKJFK%20"
+      "DEST%3aEGLL%20FIX0%20LATLON%3a41.0000,%2d51.0000%20FIX2%20"
+      "LATLON%3a43.0000,%2d53.0000%20FIX4%20\n", false }
+};
+
+static void
+print_usage(const char *progname, FILE *fp)
+{
+	fprintf(fp, "Usage: %s [-h] [-n <copies>]\n"
+	    "  -h : show this help screen\n"
+	    "  -n <copies> : number of copies of each message to decode "
+	    "(default: %d)\n", progname, DFL_NUM_COPIES);
+}
+
+/*
+ * Size of a message with all of its segments embedded, and position
+ * reports inline in the argument union.
+ */
+static size_t
+embedded_msg_size(void)
+{
+	size_t arg_sz = MAX(sizeof (cpdlc_arg_t), sizeof (cpdlc_pos_rep_t));
+	size_t seg_sz = sizeof (cpdlc_msg_seg_t) +
+	    CPDLC_MAX_ARGS * (arg_sz - sizeof (cpdlc_arg_t));
+
+	return (sizeof (cpdlc_msg_t) - sizeof (cpdlc_msg_seg_t *) +
+	    CPDLC_MAX_MSG_SEGS * seg_sz);
+}
+
+#ifdef	HAVE_MALLINFO2
+
+static size_t
+heap_in_use(void)
+{
+	return (mallinfo2().uordblks);
+}
+
+static void
+measure(unsigned sample, unsigned num_copies)
+{
+	cpdlc_msg_t **msgs = safe_calloc(num_copies, sizeof (*msgs));
+	size_t before, after;
+
+	before = heap_in_use();
+	for (unsigned i = 0; i < num_copies; i++) {
+		int consumed;
+		char reason[128];
+
+		if (!cpdlc_msg_decode(samples[sample].text,
+		    samples[sample].is_dl, &msgs[i], &consumed, reason,
+		    sizeof (reason))) {
+			fprintf(stderr, "Error decoding sample message %d: "
+			    "%s\n", sample, reason);
+			exit(EXIT_FAILURE);
+		}
+	}
+	after = heap_in_use();
+	printf("%8zu %8zu  %.*s\n", (after - before) / num_copies,
+	    embedded_msg_size(), (int)strlen(samples[sample].text) - 1,
+	    samples[sample].text);
+	for (unsigned i = 0; i < num_copies; i++)
+		cpdlc_msg_free(msgs[i]);
+	free(msgs);
+}
+
+#endif	/* HAVE_MALLINFO2 */
+
+int
+main(int argc, char *argv[])
+{
+	int opt;
+	unsigned num_copies = DFL_NUM_COPIES;
+
+	while ((opt = getopt(argc, argv, "hn:")) != -1) {
+		switch (opt) {
+		case 'h':
+			print_usage(argv[0], stdout);
+			return (0);
+		case 'n':
+			num_copies = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0], stderr);
+			return (1);
+		}
+	}
+	if (num_copies == 0) {
+		print_usage(argv[0], stderr);
+		return (1);
+	}
+
+	printf("sizeof (cpdlc_msg_t)     %6zu\n", sizeof (cpdlc_msg_t));
+	printf("sizeof (cpdlc_msg_seg_t) %6zu\n", sizeof (cpdlc_msg_seg_t));
+	printf("sizeof (cpdlc_arg_t)     %6zu\n", sizeof (cpdlc_arg_t));
+	printf("sizeof (cpdlc_pos_rep_t) %6zu\n", sizeof (cpdlc_pos_rep_t));
+	printf("all segments embedded    %6zu\n\n", embedded_msg_size());
+
+#ifdef	HAVE_MALLINFO2
+	printf("    heap embedded  message\n");
+	for (unsigned i = 0; i < sizeof (samples) / sizeof (*samples); i++)
+		measure(i, num_copies);
+#else	/* !HAVE_MALLINFO2 */
+	printf("Heap usage can only be measured with glibc 2.33 or newer.\n");
+#endif	/* !HAVE_MALLINFO2 */
+
+	return (0);
+}
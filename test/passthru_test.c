@@ -0,0 +1,204 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * passthru_test: checks the verbatim pass-through of messages decoded
+ * with CPDLC_DECODE_KEEP_RAW. Re-encoding such a message must yield
+ * exactly the received text, while any change to its segments must
+ * drop the raw text, so that the change is actually encoded. Copies of
+ * the message keep the raw text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/cpdlc_assert.h"
+#include "../src/cpdlc_msg.h"
+
+/*
+ * The headers are in the order the encoder emits them. The MSG= headers
+ * of the last two samples are valid, but aren't what the encoder would
+ * produce, so only a verbatim copy reproduces them.
+ */
+static const struct {
+	const char	*text;
+	bool		is_dl;
+	bool		canonical;
+} samples[] = {
+    { "PKT=CPDLC/TO=KZNY/MIN=1/FROM=N650CL/MSG=DM0\n", true, true },
+    { "PKT=CPDLC/TO=KZNY/MIN=2/FROM=N650CL/MSG=DM6 FL350/MSG=DM0\n",
+      true, true },
+    { "PKT=CPDLC/TO=N650CL/MIN=6/FROM=KZNY/MSG=UM80 ORIG%3aKJFK%20"
+      "DEST%3aEGLL%20FIX0%20LATLON%3a41.0000,%2d51.0000%20FIX2%20"
+      "LATLON%3a43.0000,%2d53.0000%20FIX4%20\n", false, true },
+    { "PKT=CPDLC/TO=KZNY/MIN=3/FROM=N650CL/MSG=DM67 REQUEST%20wx%2F"
+      "dev/MSG=DM0\n", true, false },
+    { "PKT=CPDLC/TO=N650CL/MIN=4/MRN=2/FROM=KZNY/MSG=UM20  FL350/"
+      "MSG=UM169 MAINTAIN%20FL350\n", false, false }
+};
+
+#define	MUTABLE_SAMPLE	4
+
+static cpdlc_msg_t *
+decode(const char *text, bool is_dl, unsigned flags)
+{
+	cpdlc_msg_t *msg = NULL;
+	size_t consumed;
+	char error[128] = { 0 };
+
+	CPDLC_VERIFY_MSG(cpdlc_msg_decode_arena(text, strlen(text), is_dl,
+	    NULL, flags, &msg, &consumed, NULL, error, sizeof (error)),
+	    "%s: %s", text, error);
+	CPDLC_VERIFY(msg != NULL);
+	CPDLC_VERIFY3U(consumed, ==, strlen(text));
+	return (msg);
+}
+
+static void
+check_encoding(const cpdlc_msg_t *msg, const char *expected)
+{
+	char *text = cpdlc_msg_encode_alloc(msg, NULL);
+
+	CPDLC_VERIFY_MSG(strcmp(text, expected) == 0, "\n  got: %s"
+	    "  expected: %s", text, expected);
+	free(text);
+}
+
+static void
+test_roundtrip(void)
+{
+	for (unsigned i = 0; i < sizeof (samples) / sizeof (*samples); i++) {
+		cpdlc_msg_t *msg = decode(samples[i].text, samples[i].is_dl,
+		    CPDLC_DECODE_KEEP_RAW);
+		char *text;
+
+		CPDLC_VERIFY(msg->raw_segs != NULL);
+		check_encoding(msg, samples[i].text);
+		cpdlc_msg_free(msg);
+
+		/* Without KEEP_RAW, the segments get re-encoded */
+		msg = decode(samples[i].text, samples[i].is_dl, 0);
+		CPDLC_VERIFY(msg->raw_segs == NULL);
+		text = cpdlc_msg_encode_alloc(msg, NULL);
+		CPDLC_VERIFY3U(strcmp(text, samples[i].text) == 0, ==,
+		    samples[i].canonical);
+		free(text);
+		cpdlc_msg_free(msg);
+	}
+}
+
+static void
+test_roundtrip_arinc622(void)
+{
+	for (unsigned i = 0; i < sizeof (samples) / sizeof (*samples); i++) {
+		cpdlc_msg_t *msg = decode(samples[i].text, samples[i].is_dl,
+		    0);
+		char *text;
+
+		msg->fmt_plain = false;
+		msg->fmt_arinc622 = true;
+		text = cpdlc_msg_encode_alloc(msg, NULL);
+		cpdlc_msg_free(msg);
+
+		msg = decode(text, samples[i].is_dl, CPDLC_DECODE_KEEP_RAW);
+		CPDLC_VERIFY(msg->raw_arinc622 != NULL);
+		/*
+		 * The ARINC622= header carries the aircraft's callsign,
+		 * but the message only passes through once the callsign
+		 * is set, as the server does on receipt.
+		 */
+		if (samples[i].is_dl)
+			cpdlc_msg_set_from(msg, "N650CL");
+		else
+			cpdlc_msg_set_to(msg, "N650CL");
+		check_encoding(msg, text);
+		cpdlc_msg_free(msg);
+		free(text);
+	}
+}
+
+static void
+test_mutation(void)
+{
+	const char *text = samples[MUTABLE_SAMPLE].text;
+	const bool is_dl = samples[MUTABLE_SAMPLE].is_dl;
+	cpdlc_msg_t *msg;
+	bool fl = true;
+	int alt = 24000;
+
+	msg = decode(text, is_dl, CPDLC_DECODE_KEEP_RAW);
+	cpdlc_msg_seg_set_arg(msg, 0, 0, &fl, &alt);
+	CPDLC_VERIFY(msg->raw_segs == NULL);
+	check_encoding(msg, "PKT=CPDLC/TO=N650CL/MIN=4/MRN=2/FROM=KZNY/"
+	    "MSG=UM20 FL240/MSG=UM169 MAINTAIN%20FL350\n");
+	cpdlc_msg_free(msg);
+
+	msg = decode(text, is_dl, CPDLC_DECODE_KEEP_RAW);
+	cpdlc_msg_del_seg(msg, 1);
+	CPDLC_VERIFY(msg->raw_segs == NULL);
+	check_encoding(msg, "PKT=CPDLC/TO=N650CL/MIN=4/MRN=2/FROM=KZNY/"
+	    "MSG=UM20 FL350\n");
+	cpdlc_msg_free(msg);
+
+	msg = decode(text, is_dl, CPDLC_DECODE_KEEP_RAW);
+	CPDLC_VERIFY3S(cpdlc_msg_add_seg(msg, false, CPDLC_UM0_UNABLE, 0),
+	    ==, 2);
+	CPDLC_VERIFY(msg->raw_segs == NULL);
+	check_encoding(msg, "PKT=CPDLC/TO=N650CL/MIN=4/MRN=2/FROM=KZNY/"
+	    "MSG=UM20 FL350/MSG=UM169 MAINTAIN%20FL350/MSG=UM0\n");
+	cpdlc_msg_free(msg);
+}
+
+static void
+test_copy(void)
+{
+	const char *text = samples[MUTABLE_SAMPLE].text;
+	cpdlc_msg_t *msg, *copy;
+
+	msg = decode(text, samples[MUTABLE_SAMPLE].is_dl,
+	    CPDLC_DECODE_KEEP_RAW);
+	copy = cpdlc_msg_copy(msg);
+	CPDLC_VERIFY(copy->raw_segs != NULL);
+	CPDLC_VERIFY(copy->raw_segs != msg->raw_segs);
+	CPDLC_VERIFY(strcmp(copy->raw_segs, msg->raw_segs) == 0);
+	/* The copy mustn't depend on the original */
+	cpdlc_msg_free(msg);
+	check_encoding(copy, text);
+	cpdlc_msg_free(copy);
+}
+
+int
+main(void)
+{
+	test_roundtrip();
+	test_roundtrip_arinc622();
+	test_mutation();
+	test_copy();
+
+	printf("passthru_test: OK\n");
+
+	return (0);
+}
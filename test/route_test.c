@@ -0,0 +1,315 @@
+/*
+ * Copyright 2023 Saso Kiselkov
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * route_test: checks that routes survive the conversion to and from
+ * cpdlc_route_packed_t, both standalone and as stored inside of route
+ * and pre-departure clearance (PDC) message arguments, and that the
+ * packed route accessors return the route's elements.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/cpdlc_arena.h"
+#include "../src/cpdlc_assert.h"
+#include "../src/cpdlc_msg.h"
+#include "../src/cpdlc_route.h"
+
+static const char *route_msg = "PKT=CPDLC/TO=N650CL/MIN=6/FROM=KZNY/"
+    "MSG=UM80 ORIG%3aKJFK%20DEST%3aEGLL%20FIX0%20LATLON%3a41.0000,%2d"
+    "51.0000%20FIX2%20LATLON%3a43.0000,%2d53.0000%20FIX4%20\n";
+
+/*
+ * Fills an array with a pattern unique to `seed', so misplaced elements
+ * are caught by the comparisons.
+ */
+static void
+fill(void *array, size_t size, unsigned seed)
+{
+	unsigned char *p = array;
+
+	for (size_t i = 0; i < size; i++)
+		p[i] = (seed * 31 + i) % 251 + 1;
+}
+
+static cpdlc_route_t *
+make_route(void)
+{
+	cpdlc_route_t *route = calloc(1, sizeof (*route));
+
+	CPDLC_VERIFY(route != NULL);
+	strcpy(route->orig_icao, "KJFK");
+	strcpy(route->dest_icao, "EGLL");
+	strcpy(route->orig_rwy, "31L");
+	strcpy(route->dest_rwy, "27R");
+	route->sid.type = CPDLC_PROC_DEPARTURE;
+	strcpy(route->sid.name, "KENNEDY5");
+	strcpy(route->awy_intc, "N123A");
+	route->num_info = 5;
+	fill(route->info, route->num_info * sizeof (*route->info), 1);
+	route->add_info.num_atk_wpt = 2;
+	fill(route->add_info.atk_wpt, 2 * sizeof (cpdlc_atk_wpt_t), 2);
+	route->add_info.rpt_pts.rpt_lat = true;
+	route->add_info.rpt_pts.degrees = 10;
+	route->add_info.num_intc_from = 1;
+	fill(route->add_info.intc_from, sizeof (cpdlc_intc_from_t), 3);
+	route->add_info.num_hold_at_wpt = 4;
+	fill(route->add_info.hold_at_wpt, 4 * sizeof (cpdlc_hold_at_t), 4);
+	route->add_info.num_wpt_spd_alt = 3;
+	fill(route->add_info.wpt_spd_alt, 3 * sizeof (cpdlc_wpt_spd_alt_t), 5);
+	route->add_info.num_rta = 32;
+	fill(route->add_info.rta, 32 * sizeof (cpdlc_rta_t), 6);
+	strcpy(route->trk_detail.name, "NATA");
+	route->trk_detail.num_lat_lon = 7;
+	fill(route->trk_detail.lat_lon, 7 * sizeof (cpdlc_lat_lon_t), 7);
+
+	return (route);
+}
+
+/*
+ * Checks that the accessors of `packed' return exactly the elements
+ * of `route'.
+ */
+static void
+check_accessors(const cpdlc_route_packed_t *packed, const cpdlc_route_t *route)
+{
+#define	CHECK_ARRAY(name, array, num) \
+	do { \
+		CPDLC_VERIFY3U(cpdlc_route_packed_get_num_ ## name(packed), \
+		    ==, route->num); \
+		for (unsigned i = 0; i < route->num; i++) { \
+			CPDLC_VERIFY0(memcmp(cpdlc_route_packed_get_ ## name( \
+			    packed, i), &route->array[i], \
+			    sizeof (route->array[i]))); \
+		} \
+	} while (0)
+	CHECK_ARRAY(info, info, num_info);
+	CHECK_ARRAY(atk_wpt, add_info.atk_wpt, add_info.num_atk_wpt);
+	CHECK_ARRAY(intc_from, add_info.intc_from, add_info.num_intc_from);
+	CHECK_ARRAY(hold_at_wpt, add_info.hold_at_wpt,
+	    add_info.num_hold_at_wpt);
+	CHECK_ARRAY(wpt_spd_alt, add_info.wpt_spd_alt,
+	    add_info.num_wpt_spd_alt);
+	CHECK_ARRAY(rta, add_info.rta, add_info.num_rta);
+	CHECK_ARRAY(trk_lat_lon, trk_detail.lat_lon, trk_detail.num_lat_lon);
+#undef	CHECK_ARRAY
+	CPDLC_VERIFY(strcmp(packed->orig_icao, route->orig_icao) == 0);
+	CPDLC_VERIFY(strcmp(packed->sid.name, route->sid.name) == 0);
+	CPDLC_VERIFY(strcmp(packed->trk_detail.name,
+	    route->trk_detail.name) == 0);
+}
+
+static void
+check_unpack(const cpdlc_route_packed_t *packed, const cpdlc_route_t *route)
+{
+	cpdlc_route_t *unpacked = malloc(sizeof (*unpacked));
+
+	CPDLC_VERIFY(unpacked != NULL);
+	/* Unpacking must clear whatever was in the output before */
+	memset(unpacked, 0xff, sizeof (*unpacked));
+	cpdlc_route_unpack(packed, unpacked);
+	CPDLC_VERIFY0(memcmp(unpacked, route, sizeof (*route)));
+	free(unpacked);
+}
+
+static void
+test_pack_unpack(void)
+{
+	cpdlc_route_t *route = make_route();
+	cpdlc_route_t *empty = calloc(1, sizeof (*empty));
+	cpdlc_arena_t *arena = cpdlc_arena_alloc();
+	cpdlc_route_packed_t *packed, *copy;
+
+	CPDLC_VERIFY(empty != NULL);
+	packed = cpdlc_route_pack(route);
+	check_accessors(packed, route);
+	check_unpack(packed, route);
+	/* Copies must not point back into the original */
+	copy = cpdlc_route_packed_copy(packed);
+	cpdlc_route_packed_free(packed);
+	check_accessors(copy, route);
+	check_unpack(copy, route);
+
+	packed = cpdlc_route_packed_copy_arena(copy, arena);
+	cpdlc_route_packed_free(copy);
+	check_accessors(packed, route);
+	check_unpack(packed, route);
+	check_unpack(cpdlc_route_pack_arena(route, arena), route);
+
+	packed = cpdlc_route_pack(empty);
+	CPDLC_VERIFY3U(cpdlc_route_packed_get_num_info(packed), ==, 0);
+	CPDLC_VERIFY3U(cpdlc_route_packed_get_num_rta(packed), ==, 0);
+	check_unpack(packed, empty);
+	cpdlc_route_packed_free(packed);
+
+	cpdlc_arena_free(arena);
+	free(empty);
+	free(route);
+}
+
+static cpdlc_msg_t *
+decode(const char *text, bool is_dl)
+{
+	cpdlc_msg_t *msg = NULL;
+	int consumed;
+	char error[128] = { 0 };
+
+	CPDLC_VERIFY_MSG(cpdlc_msg_decode(text, is_dl, &msg, &consumed,
+	    error, sizeof (error)), "%s: %s", text, error);
+	CPDLC_VERIFY(msg != NULL);
+	return (msg);
+}
+
+static void
+test_msg_route(void)
+{
+	cpdlc_msg_t *msg = decode(route_msg, false);
+	const cpdlc_route_packed_t *packed = cpdlc_msg_seg_get_route(msg, 0, 0);
+	cpdlc_route_t *route = malloc(sizeof (*route));
+	const cpdlc_route_info_t *info;
+	char *text;
+
+	CPDLC_VERIFY(packed != NULL);
+	CPDLC_VERIFY(route != NULL);
+	CPDLC_VERIFY(strcmp(packed->orig_icao, "KJFK") == 0);
+	CPDLC_VERIFY(strcmp(packed->dest_icao, "EGLL") == 0);
+	CPDLC_VERIFY3U(cpdlc_route_packed_get_num_info(packed), ==, 5);
+	info = cpdlc_route_packed_get_info(packed, 2);
+	CPDLC_VERIFY3U(info->type, ==, CPDLC_ROUTE_UNKNOWN);
+	CPDLC_VERIFY(strcmp(info->str, "FIX2") == 0);
+	info = cpdlc_route_packed_get_info(packed, 3);
+	CPDLC_VERIFY3U(info->type, ==, CPDLC_ROUTE_LAT_LON);
+	CPDLC_VERIFY3F(info->lat_lon.lat, ==, 43);
+	CPDLC_VERIFY3F(info->lat_lon.lon, ==, -53);
+
+	/* The unpacked form matches what the accessors return */
+	CPDLC_VERIFY3U(cpdlc_msg_seg_get_arg(msg, 0, 0, route, sizeof (*route),
+	    NULL), ==, sizeof (*route));
+	check_accessors(packed, route);
+
+	/* Setting the route back re-packs it without changing it */
+	cpdlc_msg_seg_set_arg(msg, 0, 0, route, NULL);
+	text = cpdlc_msg_encode_alloc(msg, NULL);
+	CPDLC_VERIFY(strcmp(text, route_msg) == 0);
+	free(text);
+
+	free(route);
+	cpdlc_msg_free(msg);
+}
+
+/*
+ * Encodes `msg' in the given format, decodes it again and checks that
+ * the result encodes the same way.
+ */
+static void
+check_msg_roundtrip(cpdlc_msg_t *msg, bool fmt_arinc622)
+{
+	cpdlc_msg_t *msg2;
+	char *text, *text2;
+
+	msg->fmt_plain = !fmt_arinc622;
+	msg->fmt_arinc622 = fmt_arinc622;
+	text = cpdlc_msg_encode_alloc(msg, NULL);
+	msg2 = decode(text, false);
+	/* The ARINC622= header doesn't carry the recipient */
+	cpdlc_msg_set_to(msg2, cpdlc_msg_get_to(msg));
+	text2 = cpdlc_msg_encode_alloc(msg2, NULL);
+	CPDLC_VERIFY_MSG(strcmp(text, text2) == 0, "\n  %s  %s", text, text2);
+	free(text);
+	free(text2);
+	cpdlc_msg_free(msg2);
+}
+
+static void
+test_pdc(void)
+{
+	cpdlc_msg_t *route_src = decode(route_msg, false);
+	cpdlc_msg_t *msg = cpdlc_msg_alloc(CPDLC_PKT_CPDLC), *copy;
+	cpdlc_pdc_t pdc = { 0 }, pdc2;
+	cpdlc_route_t *route = malloc(sizeof (*route));
+	cpdlc_route_t *route2 = malloc(sizeof (*route2));
+	char *text, *text2;
+
+	CPDLC_VERIFY(route != NULL);
+	CPDLC_VERIFY(route2 != NULL);
+	strcpy(pdc.acf_id, "BAW117");
+	strcpy(pdc.acf_type, "B77W");
+	pdc.time_dep.hrs = 14;
+	pdc.time_dep.mins = 35;
+	pdc.route = (cpdlc_route_packed_t *)cpdlc_msg_seg_get_route(
+	    route_src, 0, 0);
+	pdc.alt_restr.alt = 5000;
+	pdc.freq = 135.05;
+	pdc.squawk = 1234;
+	pdc.revision = 1;
+
+	cpdlc_msg_set_to(msg, "BAW117");
+	cpdlc_msg_set_min(msg, 7);
+	CPDLC_VERIFY0(cpdlc_msg_add_seg(msg, false, CPDLC_UM73_PDC_predepclx,
+	    0));
+	cpdlc_msg_seg_set_arg(msg, 0, 0, &pdc, NULL);
+	/* The message keeps its own copy of the route */
+	cpdlc_msg_seg_get_arg(msg, 0, 0, &pdc2, 0, NULL);
+	CPDLC_VERIFY(pdc2.route != NULL);
+	CPDLC_VERIFY(pdc2.route != pdc.route);
+	cpdlc_route_unpack(pdc.route, route);
+	cpdlc_route_unpack(pdc2.route, route2);
+	CPDLC_VERIFY0(memcmp(route, route2, sizeof (*route)));
+	CPDLC_VERIFY(strcmp(pdc2.acf_id, pdc.acf_id) == 0);
+	CPDLC_VERIFY3U(pdc2.squawk, ==, pdc.squawk);
+	cpdlc_msg_free(route_src);
+
+	check_msg_roundtrip(msg, false);
+	check_msg_roundtrip(msg, true);
+
+	/* Copies of the message get their own copy of the route too */
+	msg->fmt_plain = true;
+	msg->fmt_arinc622 = false;
+	text = cpdlc_msg_encode_alloc(msg, NULL);
+	copy = cpdlc_msg_copy(msg);
+	cpdlc_msg_free(msg);
+	text2 = cpdlc_msg_encode_alloc(copy, NULL);
+	CPDLC_VERIFY(strcmp(text, text2) == 0);
+	free(text);
+	free(text2);
+	cpdlc_msg_free(copy);
+
+	free(route);
+	free(route2);
+}
+
+int
+main(void)
+{
+	test_pack_unpack();
+	test_msg_route();
+	test_pdc();
+
+	printf("route_test: OK\n");
+
+	return (0);
+}